@@ -0,0 +1,470 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
+
+#include "client.h"
+#include "job.h"
+#include "serverexception.h"
+#include "mockserver.h"
+
+#include "config.h"
+
+using namespace std;
+using namespace Beanstalkpp;
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct Options {
+  Options():
+    host(BEANSTALK_SERVER), port(BEANSTALK_PORT), mock(false), producers(1), consumers(1),
+    connections(1), minSize(256), maxSize(256), depth(1), seconds(10), tube("beansbench"),
+    sweep(false) {}
+  
+  string host;
+  int port;
+  bool mock;
+  int producers;
+  int consumers;
+  int connections;
+  size_t minSize;
+  size_t maxSize;
+  int depth;
+  int seconds;
+  string tube;
+  ClientOptions socket;
+  bool sweep;
+};
+
+/**
+ * The settings compared by -S, one at a time on top of those given with -o
+ */
+static const char *sweepSettings[] = {
+  "", "nagle", "quickack", "sndbuf=4194304,rcvbuf=4194304", "keepalive=60/10/3", "busypoll=50"
+};
+
+/**
+ * The payload sizes compared by -S
+ */
+static const size_t sweepSizes[] = { 64, 256 * 1024 };
+
+/**
+ * Latencies in nanoseconds, and error counts, collected by one thread
+ */
+struct Stats {
+  Stats(): errors(0) {}
+  
+  void merge(const Stats &other) {
+    this->put.insert(this->put.end(), other.put.begin(), other.put.end());
+    this->reserve.insert(this->reserve.end(), other.reserve.begin(), other.reserve.end());
+    this->del.insert(this->del.end(), other.del.begin(), other.del.end());
+    this->endToEnd.insert(this->endToEnd.end(), other.endToEnd.begin(), other.endToEnd.end());
+    this->errors += other.errors;
+  }
+  
+  vector<uint64_t> put;
+  vector<uint64_t> reserve;
+  vector<uint64_t> del;
+  vector<uint64_t> endToEnd;
+  uint64_t errors;
+};
+
+static std::mutex statsMutex;
+static Stats totals;
+static std::atomic<bool> failed(false);
+
+static uint64_t nanosSince(bench_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+}
+
+/**
+ * Opens @p count connections to the server
+ */
+static vector<Client *> connectAll(const Options &o, int count) {
+  vector<Client *> ret;
+  for(int i = 0; i < count; i++) {
+    ret.push_back(new Client(o.host, o.port));
+    ret.back()->setOptions(o.socket);
+    ret.back()->connect();
+  }
+  
+  return ret;
+}
+
+static void producer(const Options &o, bench_clock::time_point end, unsigned int seed) {
+  Stats stats;
+  vector<Client *> conns;
+  
+  try {
+    conns = connectAll(o, o.connections);
+    for(size_t i = 0; i < conns.size(); i++) {
+      conns[i]->use(o.tube);
+      conns[i]->setEnvelope(true);
+    }
+    
+    // A pool of payloads following the size distribution, so the hot loop doesn't allocate
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<size_t> sizes(o.minSize, o.maxSize);
+    vector<string> payloads;
+    for(int i = 0; i < 64; i++)
+      payloads.push_back(string(sizes(rng), 'x'));
+    
+    vector<bench_clock::time_point> sent(o.depth);
+    for(size_t round = 0; bench_clock::now() < end; round++) {
+      Client &c = *conns[round % conns.size()];
+      
+      // Send up to depth puts before reading any of the replies
+      int inFlight = 0;
+      for(; inFlight < o.depth; inFlight++) {
+        sent[inFlight] = bench_clock::now();
+        if(!c.trySendPut(payloads[(round * o.depth + inFlight) % payloads.size()])) break;
+      }
+      
+      for(int i = 0; i < inFlight; i++) {
+        if(c.tryReadPutReply()) {
+          stats.put.push_back(nanosSince(sent[i]));
+        } else {
+          stats.errors++;
+        }
+      }
+      
+      if(inFlight < o.depth) throw Exception("Lost connection while putting");
+    }
+  } catch(Exception &e) {
+    fprintf(stderr, "Producer failed: %s\n", e.what());
+    failed = true;
+  }
+  
+  for(size_t i = 0; i < conns.size(); i++)
+    delete conns[i];
+  
+  std::lock_guard<std::mutex> lock(statsMutex);
+  totals.merge(stats);
+}
+
+static void consumer(const Options &o, bench_clock::time_point end) {
+  Stats stats;
+  vector<Client *> conns;
+  
+  try {
+    conns = connectAll(o, o.connections);
+    for(size_t i = 0; i < conns.size(); i++) {
+      conns[i]->watch(o.tube);
+      if(o.tube != "default") conns[i]->ignore("default");
+    }
+    
+    // Keep going after the deadline until the tube is drained, so no jobs are left behind
+    for(size_t round = 0; ; round++) {
+      Client &c = *conns[round % conns.size()];
+      bool draining = bench_clock::now() >= end;
+      
+      job_p_t job;
+      bench_clock::time_point start = bench_clock::now();
+      Result<bool> reserved = c.tryReserveWithTimeout(job, draining ? 0 : 1);
+      if(!reserved) {
+        if(
+          reserved.error() == ServerException::NETWORK_ERROR ||
+          reserved.error() == ServerException::CLIENT_TIMEOUT
+        ) {
+          throw Exception("Lost connection while reserving");
+        }
+        
+        stats.errors++;
+        continue;
+      }
+      if(!reserved.value()) {
+        if(draining) break;
+        continue;
+      }
+      stats.reserve.push_back(nanosSince(start));
+      
+      int64_t queued = job->queueLatency();
+      if(queued >= 0) stats.endToEnd.push_back(queued * 1000);
+      
+      start = bench_clock::now();
+      if(c.tryDel(*job)) {
+        stats.del.push_back(nanosSince(start));
+      } else {
+        stats.errors++;
+      }
+    }
+  } catch(Exception &e) {
+    fprintf(stderr, "Consumer failed: %s\n", e.what());
+    failed = true;
+  }
+  
+  for(size_t i = 0; i < conns.size(); i++)
+    delete conns[i];
+  
+  std::lock_guard<std::mutex> lock(statsMutex);
+  totals.merge(stats);
+}
+
+static double percentile(const vector<uint64_t> &sorted, double q) {
+  if(sorted.empty()) return 0;
+  
+  size_t i = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+  return sorted[i] / 1000.0;
+}
+
+static void report(const char *name, vector<uint64_t> &latencies, double seconds) {
+  std::sort(latencies.begin(), latencies.end());
+  
+  printf("%-12s %10zu %12.0f %10.1f %10.1f %10.1f\n", name, latencies.size(),
+    seconds > 0 ? latencies.size() / seconds : 0.0, percentile(latencies, 0.5),
+    percentile(latencies, 0.99), percentile(latencies, 0.999));
+}
+
+/**
+ * Parses a comma separated list of socket options, e.g. "nagle,sndbuf=1048576,keepalive=60/10/3",
+ * into @p o
+ */
+static bool parseSocketOptions(const string &list, ClientOptions &o) {
+  size_t start = 0;
+  
+  while(start <= list.size()) {
+    size_t end = std::min(list.find(',', start), list.size());
+    string option = list.substr(start, end - start);
+    start = end + 1;
+    
+    if(option.empty()) continue;
+    if(option == "nagle") {
+      o.noDelay = false;
+    } else if(option == "quickack") {
+      o.quickAck = true;
+    } else if(
+      sscanf(option.c_str(), "sndbuf=%d", &o.sendBufferSize) != 1 &&
+      sscanf(option.c_str(), "rcvbuf=%d", &o.receiveBufferSize) != 1 &&
+      sscanf(option.c_str(), "busypoll=%d", &o.busyPoll) != 1 &&
+      sscanf(
+        option.c_str(), "keepalive=%d/%d/%d", &o.keepAliveIdle, &o.keepAliveInterval,
+        &o.keepAliveCount
+      ) < 1
+    ) {
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+/**
+ * Connects with the socket options of @p o, and reads them back to find those the kernel refused
+ * or capped, like busypoll without CAP_NET_ADMIN
+ * 
+ * @return The names of the options which didn't take effect, each preceded by a space
+ */
+static string refusedOptions(const Options &o) {
+  ClientOptions actual;
+  
+  try {
+    Client c(o.host, o.port);
+    c.setOptions(o.socket);
+    c.connect();
+    c.getSocketOptions(actual);
+  } catch(Exception &e) {
+    fprintf(stderr, "Unable to check the socket options: %s\n", e.what());
+    failed = true;
+    return "";
+  }
+  
+  const ClientOptions &wanted = o.socket;
+  string ret;
+  
+  if(actual.noDelay != wanted.noDelay) ret += " nagle";
+  
+  // Linux reports twice the size asked for, or twice net.core.wmem_max and rmem_max if capped
+  if(actual.sendBufferSize < wanted.sendBufferSize) ret += " sndbuf";
+  if(actual.receiveBufferSize < wanted.receiveBufferSize) ret += " rcvbuf";
+  
+  if(wanted.keepAliveIdle > 0 && (
+    actual.keepAliveIdle != wanted.keepAliveIdle ||
+    (wanted.keepAliveInterval > 0 && actual.keepAliveInterval != wanted.keepAliveInterval) ||
+    (wanted.keepAliveCount > 0 && actual.keepAliveCount != wanted.keepAliveCount)
+  )) {
+    ret += " keepalive";
+  }
+  
+  if(wanted.busyPoll > 0 && actual.busyPoll != wanted.busyPoll) ret += " busypoll";
+  
+  return ret;
+}
+
+/**
+ * Runs the producers and consumers, adding what they measured to the totals
+ * 
+ * @return The elapsed time in seconds
+ */
+static double run(const Options &o) {
+  bench_clock::time_point start = bench_clock::now();
+  bench_clock::time_point end = start + std::chrono::seconds(o.seconds);
+  
+  vector<std::thread> threads;
+  for(int i = 0; i < o.producers; i++)
+    threads.push_back(std::thread(producer, std::cref(o), end, (unsigned int)i + 1));
+  for(int i = 0; i < o.consumers; i++)
+    threads.push_back(std::thread(consumer, std::cref(o), end));
+  
+  for(size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/**
+ * Runs each of the sweepSettings with each of the sweepSizes, and prints a line of latencies for
+ * every run
+ */
+static void sweep(const Options &o) {
+  printf("%d producers, %d consumers, %d connections each, depth %d, %d s per run\n\n",
+    o.producers, o.consumers, o.connections, o.depth, o.seconds);
+  printf("%-30s %8s %10s %10s %10s %10s %10s\n", "setting", "bytes", "puts/s", "put p50", "put p99",
+    "res p50", "res p99");
+  
+  for(size_t size = 0; size < sizeof(sweepSizes) / sizeof(sweepSizes[0]); size++) {
+    for(size_t i = 0; i < sizeof(sweepSettings) / sizeof(sweepSettings[0]); i++) {
+      Options setting = o;
+      setting.minSize = setting.maxSize = sweepSizes[size];
+      parseSocketOptions(sweepSettings[i], setting.socket);
+      
+      // A setting the kernel refused would only measure the defaults again
+      string refused = refusedOptions(setting);
+      if(!refused.empty()) {
+        printf("%-30s %8zu   not applied:%s\n", sweepSettings[i], sweepSizes[size],
+          refused.c_str());
+        fflush(stdout);
+        continue;
+      }
+      
+      totals = Stats();
+      run(setting);
+      
+      std::sort(totals.put.begin(), totals.put.end());
+      std::sort(totals.reserve.begin(), totals.reserve.end());
+      printf("%-30s %8zu %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+        *sweepSettings[i] ? sweepSettings[i] : "defaults", sweepSizes[size],
+        totals.put.size() / (double)o.seconds, percentile(totals.put, 0.5),
+        percentile(totals.put, 0.99), percentile(totals.reserve, 0.5),
+        percentile(totals.reserve, 0.99));
+      fflush(stdout);
+    }
+  }
+}
+
+int usage(const char **argv) {
+  printf("Generates load against a beanstalk server and reports throughput and latencies.\n\n");
+  printf("Usage:\n");
+  printf("%s [options]\n\n", argv[0]);
+  printf("  -h HOST     Server to connect to (default %s)\n", BEANSTALK_SERVER);
+  printf("  -p PORT     Port to connect to (default %d)\n", BEANSTALK_PORT);
+  printf("  -m          Run against an in-process mock server instead\n");
+  printf("  -P N        Number of producer threads (default 1)\n");
+  printf("  -C N        Number of consumer threads (default 1)\n");
+  printf("  -c N        Number of connections per thread (default 1)\n");
+  printf("  -s SIZE     Payload size in bytes, or MIN-MAX for uniformly distributed sizes (default 256)\n");
+  printf("  -d N        Number of puts in flight per connection (default 1)\n");
+  printf("  -t SECONDS  Duration of the run (default 10)\n");
+  printf("  -T TUBE     Tube to use (default beansbench)\n");
+  printf("  -o OPTIONS  Socket options, comma separated: nagle, quickack, sndbuf=BYTES, rcvbuf=BYTES,\n");
+  printf("              keepalive=IDLE[/INTERVAL/COUNT] and busypoll=MICROSECONDS\n");
+  printf("  -S          Compare the latencies of %zu and %zu byte payloads with each socket option\n",
+    sweepSizes[0], sweepSizes[1]);
+  printf("\n");
+  printf("Latencies are in microseconds. The end-to-end latency is the time from put to reserve, taken\n");
+  printf("from the job envelopes, so producers and consumers on different hosts need synchronized clocks.\n");
+  
+  return 1;
+}
+
+int main(int argc, const char **argv) {
+  Options o;
+  
+  int opt;
+  while((opt = getopt(argc, (char * const *)argv, "h:p:mP:C:c:s:d:t:T:o:S")) != -1) {
+    switch(opt) {
+      case 'h': o.host = optarg; break;
+      case 'p': o.port = atoi(optarg); break;
+      case 'm': o.mock = true; break;
+      case 'P': o.producers = atoi(optarg); break;
+      case 'C': o.consumers = atoi(optarg); break;
+      case 'c': o.connections = atoi(optarg); break;
+      case 's':
+        if(sscanf(optarg, "%zu-%zu", &o.minSize, &o.maxSize) == 1) o.maxSize = o.minSize;
+        break;
+      case 'd': o.depth = atoi(optarg); break;
+      case 't': o.seconds = atoi(optarg); break;
+      case 'T': o.tube = optarg; break;
+      case 'o':
+        if(!parseSocketOptions(optarg, o.socket)) return usage(argv);
+        break;
+      case 'S': o.sweep = true; break;
+      default: return usage(argv);
+    }
+  }
+  
+  if(
+    o.producers < 0 || o.consumers < 0 || o.connections < 1 || o.depth < 1 || o.seconds < 1 ||
+    o.minSize > o.maxSize
+  ) {
+    return usage(argv);
+  }
+  
+  boost::scoped_ptr<MockServer> mock;
+  if(o.mock) {
+    mock.reset(new MockServer());
+    mock->setMaxJobSize(std::max(o.maxSize, o.sweep ? sweepSizes[1] : 0) + Envelope::SIZE);
+    mock->start();
+    o.host = "127.0.0.1";
+    o.port = mock->getPort();
+  }
+  
+  if(o.sweep) {
+    sweep(o);
+    if(mock) mock->stop();
+    return failed ? 1 : 0;
+  }
+  
+  double elapsed = run(o);
+  
+  printf("%d producers, %d consumers, %d connections each, %zu-%zu byte payloads, depth %d, %.1f s\n\n",
+    o.producers, o.consumers, o.connections, o.minSize, o.maxSize, o.depth, elapsed);
+  printf("%-12s %10s %12s %10s %10s %10s\n", "", "ops", "ops/s", "p50 us", "p99 us", "p999 us");
+  report("put", totals.put, o.seconds);
+  report("reserve", totals.reserve, elapsed);
+  report("delete", totals.del, elapsed);
+  report("end-to-end", totals.endToEnd, elapsed);
+  printf("\n%llu errors\n", (unsigned long long)totals.errors);
+  
+  if(mock) mock->stop();
+  
+  return failed ? 1 : 0;
+}
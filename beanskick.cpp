@@ -0,0 +1,122 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "client.h"
+#include "kicker.h"
+#include "serverexception.h"
+
+#include "config.h"
+
+using namespace std;
+using namespace Beanstalkpp;
+
+static Kicker *running = NULL;
+
+static void onSignal(int) {
+  if(running) running->stop();
+}
+
+int usage(const char **argv) {
+  printf("Kicks the buried jobs of a tube back into the ready queue, at a limited rate.\n\n");
+  printf("Usage:\n");
+  printf("%s [options] <tubename>\n\n", argv[0]);
+  printf("  -h HOST  Server to connect to (default %s)\n", BEANSTALK_SERVER);
+  printf("  -p PORT  Port to connect to (default %d)\n", BEANSTALK_PORT);
+  printf("  -r RATE  Jobs kicked per second (default 100)\n");
+  printf("  -n N     Kick at most N jobs (default all)\n");
+  printf("  -j ID    Kick only the buried or delayed job ID\n");
+  
+  return 1;
+}
+
+int main(int argc, const char **argv) {
+  string host = BEANSTALK_SERVER;
+  int port = BEANSTALK_PORT;
+  double rate = 100;
+  uint64_t limit = 0;
+  job_id_t jobId = 0;
+  
+  int opt;
+  while((opt = getopt(argc, (char * const *)argv, "h:p:r:n:j:")) != -1) {
+    switch(opt) {
+      case 'h': host = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'n': limit = strtoull(optarg, NULL, 10); break;
+      case 'j': jobId = strtoull(optarg, NULL, 10); break;
+      default: return usage(argv);
+    }
+  }
+  
+  if(optind >= argc || rate <= 0) return usage(argv);
+  
+  try {
+    Client c(host, port);
+    c.connect();
+    
+    if(jobId != 0) {
+      c.kickJob(jobId);
+      printf("Kicked job %llu\n", (unsigned long long)jobId);
+      return 0;
+    }
+    
+    Kicker kicker(c, argv[optind]);
+    kicker.setRate(rate);
+    kicker.setLimit(limit);
+    
+    running = &kicker;
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    
+    // Progress is reported from another thread, as run() blocks until the kicking is done
+    std::atomic<bool> finished(false);
+    std::thread progress([&kicker, &finished]() {
+      for(int i = 1; !finished; i++) {
+        if(i % 20 == 0) fprintf(stderr, "%llu jobs kicked\n", (unsigned long long)kicker.getKicked());
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+    });
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Result<uint64_t> kicked = kicker.run();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    finished = true;
+    progress.join();
+    running = NULL;
+    
+    printf("Kicked %llu jobs in %.1f s\n", (unsigned long long)kicker.getKicked(), elapsed);
+    kicked.get("kick");
+  } catch(Exception &e) {
+    printf("Caught exception: %s\n", e.what());
+    return 1;
+  }
+  
+  return 0;
+}
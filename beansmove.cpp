@@ -0,0 +1,175 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client.h"
+#include "mover.h"
+#include "serverexception.h"
+
+#include "config.h"
+
+using namespace std;
+using namespace Beanstalkpp;
+
+struct Options {
+  Options():
+    host(BEANSTALK_SERVER), port(BEANSTALK_PORT), destinationPort(BEANSTALK_PORT), connections(1),
+    batch(64), buried(false) {}
+  
+  string host;
+  int port;
+  string tube;
+  string destinationHost;
+  int destinationPort;
+  string destinationTube;
+  int connections;
+  int batch;
+  bool buried;
+};
+
+static std::atomic<bool> interrupted(false);
+static std::atomic<bool> failed(false);
+static std::atomic<uint64_t> jobsMoved(0);
+static std::atomic<uint64_t> jobsRejected(0);
+
+static void onSignal(int) {
+  interrupted = true;
+}
+
+/**
+ * Moves batches over one pair of connections until the source tube is empty
+ */
+static void mover(const Options &o, bool buried) {
+  try {
+    Client source(o.host, o.port);
+    source.connect();
+    Client destination(o.destinationHost, o.destinationPort);
+    destination.connect();
+    
+    Mover m(source, o.tube, destination, o.destinationTube);
+    m.setBatchSize(o.batch);
+    m.setMoveBuried(buried);
+    
+    while(!interrupted && !failed && !m.isDone()) {
+      uint64_t rejected = m.getRejected();
+      
+      jobsMoved += m.moveBatch().get("move");
+      jobsRejected += m.getRejected() - rejected;
+    }
+  } catch(Exception &e) {
+    fprintf(stderr, "Caught exception: %s\n", e.what());
+    failed = true;
+  }
+}
+
+int usage(const char **argv) {
+  printf("Moves the jobs of a tube to another tube or server.\n\n");
+  printf("Usage:\n");
+  printf("%s [options] <tube> <host>[:<port>] [destination tube]\n\n", argv[0]);
+  printf("  -h HOST  Server to move the jobs from (default %s)\n", BEANSTALK_SERVER);
+  printf("  -p PORT  Port of the server to move the jobs from (default %d)\n", BEANSTALK_PORT);
+  printf("  -c N     Number of connection pairs moving jobs in parallel (default 1)\n");
+  printf("  -b N     Number of jobs moved per round trip (default 64)\n");
+  printf("  -B       Also move the buried jobs, which stay buried (needs beanstalkd 1.12)\n");
+  printf("\n");
+  printf("Jobs keep their priority and TTR, and are deleted from the source only once the destination\n");
+  printf("has confirmed them, so an interrupted move can leave a job on both servers. Jobs rejected by\n");
+  printf("the destination are buried on the source. Delayed jobs are not moved.\n");
+  
+  return 1;
+}
+
+int main(int argc, const char **argv) {
+  Options o;
+  
+  int opt;
+  while((opt = getopt(argc, (char * const *)argv, "h:p:c:b:B")) != -1) {
+    switch(opt) {
+      case 'h': o.host = optarg; break;
+      case 'p': o.port = atoi(optarg); break;
+      case 'c': o.connections = atoi(optarg); break;
+      case 'b': o.batch = atoi(optarg); break;
+      case 'B': o.buried = true; break;
+      default: return usage(argv);
+    }
+  }
+  
+  if(argc - optind < 2 || o.connections < 1 || o.batch < 1) return usage(argv);
+  
+  o.tube = argv[optind];
+  o.destinationHost = argv[optind + 1];
+  o.destinationTube = optind + 2 < argc ? argv[optind + 2] : o.tube;
+  
+  size_t colon = o.destinationHost.rfind(':');
+  if(colon != string::npos) {
+    o.destinationPort = atoi(o.destinationHost.c_str() + colon + 1);
+    o.destinationHost.resize(colon);
+  }
+  
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  
+  // Buried jobs are taken from the front of the tube, so only one connection moves them
+  vector<std::thread> threads;
+  for(int i = 0; i < o.connections; i++)
+    threads.push_back(std::thread(mover, std::cref(o), o.buried && i == 0));
+  
+  std::atomic<bool> finished(false);
+  std::thread progress([&]() {
+    uint64_t lastJobs = 0;
+    std::chrono::steady_clock::time_point next = start;
+    
+    for(;;) {
+      next += std::chrono::seconds(1);
+      while(!finished && std::chrono::steady_clock::now() < next)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      if(finished) break;
+      
+      uint64_t jobs = jobsMoved;
+      fprintf(stderr, "%llu jobs moved, %llu jobs/s\n", (unsigned long long)jobs,
+        (unsigned long long)(jobs - lastJobs));
+      lastJobs = jobs;
+    }
+  });
+  
+  for(size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  
+  finished = true;
+  progress.join();
+  
+  fprintf(stderr, "%llu jobs moved in %.1f s (%.0f jobs/s), %llu rejected and buried\n",
+    (unsigned long long)jobsMoved, elapsed, jobsMoved / elapsed, (unsigned long long)jobsRejected);
+  
+  return failed || interrupted ? 1 : 0;
+}
@@ -19,6 +19,8 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <string>
 
 #include "client.h"
@@ -30,37 +32,118 @@
 using namespace std;
 using namespace Beanstalkpp;
 
+// stats-job commands in flight while scanning
+#define SCAN_DEPTH 256
+
 int usage(const char **argv) {
   printf("Peeks at the next ready job in the tube.\n\n");
   printf("Usage:\n");
-  printf("%s <tubename>\n", argv[0]);
+  printf("%s [options] <tubename>\n\n", argv[0]);
+  printf("  -h HOST        Server to connect to (default %s)\n", BEANSTALK_SERVER);
+  printf("  -p PORT        Port to connect to (default %d)\n", BEANSTALK_PORT);
+  printf("  -b             Peek at the next buried job instead\n");
+  printf("  -d             Peek at the next delayed job instead\n");
+  printf("  -j ID          Peek at the job ID, in any tube\n");
+  printf("  -s FIRST-LAST  List the buried jobs of the tube with ids from FIRST to LAST, with their\n");
+  printf("                 priority, age and number of buries\n");
   
   return 1;
 }
 
-void demoClient(const string &tubeName) {
-  Client c(BEANSTALK_SERVER, BEANSTALK_PORT);
+/**
+ * Lists the buried jobs of @p tube among the job ids @p first to @p last, using pipelined
+ * stats-job commands since the protocol has no way to list a queue
+ */
+void scanBuried(Client &c, const string &tube, job_id_t first, job_id_t last) {
+  uint64_t found = 0;
+  
+  for(job_id_t next = first; next <= last; next += SCAN_DEPTH) {
+    // Counted from next, as last + 1 overflows when last is the largest id
+    job_id_t count = last - next < SCAN_DEPTH ? last - next + 1 : SCAN_DEPTH;
+    
+    for(job_id_t i = 0; i < count; i++)
+      c.trySendStatsJob(next + i).get("stats-job");
+    
+    for(job_id_t i = 0; i < count; i++) {
+      Result<JobStats> stats = c.tryReadStatsJob();
+      if(!stats && stats.error() == ServerException::NOT_FOUND) continue;
+      
+      const JobStats &s = stats.get("stats-job");
+      if(s.tube != tube || s.state != "buried") continue;
+      
+      printf("%llu pri %llu age %llu buries %llu\n", (unsigned long long)s.id,
+        (unsigned long long)s.pri, (unsigned long long)s.age, (unsigned long long)s.buries);
+      found++;
+    }
+    
+    // Stopping here keeps next from wrapping around past the largest id
+    if(last - next < SCAN_DEPTH) break;
+  }
+  
+  printf("%llu buried jobs found\n", (unsigned long long)found);
+}
+
+int main(int argc, const char **argv) {
+  string host = BEANSTALK_SERVER;
+  int port = BEANSTALK_PORT;
+  char kind = 'r';
+  job_id_t jobId = 0, first = 0, last = 0;
+  
+  int opt;
+  while((opt = getopt(argc, (char * const *)argv, "h:p:bdj:s:")) != -1) {
+    switch(opt) {
+      case 'h': host = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'b': kind = 'b'; break;
+      case 'd': kind = 'd'; break;
+      case 'j':
+        kind = 'j';
+        jobId = strtoull(optarg, NULL, 10);
+        break;
+      case 's':
+        kind = 's';
+        if(sscanf(optarg, "%llu-%llu", (unsigned long long *)&first, (unsigned long long *)&last) != 2)
+          return usage(argv);
+        break;
+      default: return usage(argv);
+    }
+  }
+  
+  if(optind >= argc && kind != 'j') return usage(argv);
+  
+  Client c(host, port);
   try {
     c.connect();
   } catch(Exception &e) {
     cerr << e.what() << endl;
     exit(1);
   }
-  c.use(tubeName);
-  
-  job_p_t job(new Job);
-  if(c.peekReady(job)) {
-    printf("Next ready job:\n%s\n", job->asString().c_str());
-  } else {
-    printf("No ready job is in the tube.\n");
-  }
-}
-
-int main(int argc, const char **argv) {
-  if(argc < 2) return usage(argv);
   
   try {
-    demoClient(argv[1]);
+    if(kind == 's') {
+      scanBuried(c, argv[optind], first, last);
+      return 0;
+    }
+    
+    if(kind != 'j') c.use(argv[optind]);
+    
+    job_p_t job(new Job);
+    bool found;
+    const char *what;
+    
+    switch(kind) {
+      case 'b': found = c.peekBuried(job); what = "buried job"; break;
+      case 'd': found = c.peekDelayed(job); what = "delayed job"; break;
+      case 'j': found = c.peek(jobId, job); what = "job"; break;
+      default: found = c.peekReady(job); what = "ready job"; break;
+    }
+    
+    if(found) {
+      printf("Next %s (%llu):\n%s\n", what, (unsigned long long)job->getJobId(),
+        job->asString().c_str());
+    } else {
+      printf("No %s is in the tube.\n", what);
+    }
   } catch(ServerException &e) {
     printf("Caught exception: %s\n", e.what());
   }
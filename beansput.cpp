@@ -18,8 +18,21 @@
 // Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 //
 
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "client.h"
 #include "serverexception.h"
@@ -31,18 +44,315 @@
 using namespace std;
 using namespace Beanstalkpp;
 
+// Records handed to a connection at a time, and the byte limit of such a batch
+#define BATCH_RECORDS 1024
+#define BATCH_BYTES (4 * 1024 * 1024)
+
+struct Options {
+  Options():
+    host(BEANSTALK_SERVER), port(BEANSTALK_PORT), lengthPrefixed(false), connections(4),
+    depth(64), offset(0) {}
+  
+  string host;
+  int port;
+  string file;
+  bool lengthPrefixed;
+  int connections;
+  int depth;
+  size_t offset;
+};
+
+/**
+ * A run of whole records of the input, given as byte offsets
+ */
+struct Batch {
+  size_t begin;
+  size_t end;
+};
+
+static std::atomic<bool> interrupted(false);
+static std::atomic<bool> failed(false);
+static std::atomic<uint64_t> jobsPut(0);
+static std::atomic<uint64_t> bytesPut(0);
+static std::atomic<uint64_t> jobsRejected(0);
+
+static void onSignal(int) {
+  interrupted = true;
+}
+
+/**
+ * Finds the record starting at @p pos of the input, which ends at @p size. Lines are records
+ * without their \n, and length prefixed records are a 32 bit big endian length followed by the
+ * payload. Empty lines are skipped.
+ * 
+ * @return false at the end of the input, or at a truncated length prefixed record
+ */
+static bool nextRecord(
+  const char *data, size_t size, bool lengthPrefixed, size_t &pos, const char *&record,
+  size_t &length
+) {
+  if(lengthPrefixed) {
+    if(size - pos < 4) return false;
+    
+    const unsigned char *p = (const unsigned char *)data + pos;
+    length = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+    if(size - pos - 4 < length) return false;
+    
+    record = data + pos + 4;
+    pos += 4 + length;
+    return true;
+  }
+  
+  for(;;) {
+    if(pos >= size) return false;
+    
+    const char *start = data + pos;
+    const char *newline = (const char *)memchr(start, '\n', size - pos);
+    length = newline ? newline - start : size - pos;
+    pos += newline ? length + 1 : length;
+    
+    if(length > 0) {
+      record = start;
+      return true;
+    }
+  }
+}
+
+/**
+ * Hands out batches of records to the connections, and keeps track of the offset up to which all
+ * records have been put
+ */
+class Dispatcher {
+public:
+  Dispatcher(const char *data, size_t size, bool lengthPrefixed, size_t offset):
+    data(data), size(size), lengthPrefixed(lengthPrefixed), cursor(offset), committed(offset) {}
+  
+  /**
+   * Takes the next batch, returning false when the input is exhausted
+   */
+  bool next(Batch &batch) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    
+    batch.begin = batch.end = this->cursor;
+    
+    const char *record;
+    size_t length;
+    size_t pos = this->cursor;
+    for(int i = 0; i < BATCH_RECORDS && batch.end - batch.begin < BATCH_BYTES; i++) {
+      if(!nextRecord(this->data, this->size, this->lengthPrefixed, pos, record, length)) {
+        // Skipped empty lines at the end of the input are consumed too
+        if(!this->lengthPrefixed) batch.end = pos;
+        break;
+      }
+      
+      batch.end = pos;
+    }
+    
+    this->cursor = batch.end;
+    return batch.end > batch.begin;
+  }
+  
+  /**
+   * Marks all records of @p batch as put
+   */
+  void done(const Batch &batch) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    
+    this->finished[batch.begin] = batch.end;
+    while(!this->finished.empty() && this->finished.begin()->first == this->committed) {
+      this->committed = this->finished.begin()->second;
+      this->finished.erase(this->finished.begin());
+    }
+  }
+  
+  /**
+   * Returns the offset to resume from: every record before it has been put
+   */
+  size_t resumeOffset() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->committed;
+  }
+  
+  /**
+   * Returns true if the input ended in the middle of a record
+   */
+  bool truncated() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->cursor < this->size;
+  }
+  
+private:
+  std::mutex mutex;
+  const char *data;
+  size_t size;
+  bool lengthPrefixed;
+  size_t cursor;
+  size_t committed;
+  
+  /**
+   * Batches put out of order, by their start offset
+   */
+  std::map<size_t, size_t> finished;
+};
+
+/**
+ * Puts batches over one connection, with up to depth puts in flight
+ */
+static void loader(const Options &o, const string &tube, const char *data, Dispatcher &dispatcher) {
+  try {
+    Client c(o.host, o.port);
+    c.connect();
+    c.use(tube);
+    
+    Batch batch;
+    while(!interrupted && !failed && dispatcher.next(batch)) {
+      size_t pos = batch.begin;
+      int inFlight = 0;
+      bool more = true;
+      
+      while(more || inFlight > 0) {
+        const char *record;
+        size_t length;
+        
+        if(more && inFlight < o.depth &&
+           (more = nextRecord(data, batch.end, o.lengthPrefixed, pos, record, length))) {
+          c.trySendPut(record, length).get("put");
+          
+          inFlight++;
+          bytesPut += length;
+          continue;
+        }
+        
+        Result<job_id_t> id = c.tryReadPutReply();
+        inFlight--;
+        
+        if(id) {
+          jobsPut++;
+        } else if(id.error() == ServerException::JOB_TOO_BIG) {
+          jobsRejected++;
+        } else {
+          id.get("put");
+        }
+      }
+      
+      dispatcher.done(batch);
+    }
+  } catch(Exception &e) {
+    fprintf(stderr, "Caught exception: %s\n", e.what());
+    failed = true;
+  }
+}
+
+/**
+ * Puts every record of the input file as a job
+ */
+static int bulkPut(const Options &o, const string &tube) {
+  int fd = open(o.file.c_str(), O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    perror(o.file.c_str());
+    return 1;
+  }
+  
+  size_t size = st.st_size;
+  if(o.offset > size) {
+    fprintf(stderr, "Offset %zu is past the end of %s\n", o.offset, o.file.c_str());
+    return 1;
+  }
+  
+  const char *data = "";
+  if(size > 0) {
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(mapped == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+    }
+    
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    data = (const char *)mapped;
+  }
+  close(fd);
+  
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  
+  Dispatcher dispatcher(data, size, o.lengthPrefixed, o.offset);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  
+  vector<std::thread> threads;
+  for(int i = 0; i < o.connections; i++)
+    threads.push_back(std::thread(loader, std::cref(o), std::cref(tube), data, std::ref(dispatcher)));
+  
+  std::atomic<bool> finished(false);
+  std::thread progress([&]() {
+    uint64_t lastJobs = 0;
+    std::chrono::steady_clock::time_point next = start;
+    
+    for(;;) {
+      next += std::chrono::seconds(1);
+      while(!finished && std::chrono::steady_clock::now() < next)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      if(finished) break;
+      
+      uint64_t jobs = jobsPut;
+      size_t offset = dispatcher.resumeOffset();
+      fprintf(stderr, "%llu jobs, %llu jobs/s, %.1f MB, %.1f%% of input, offset %zu\n",
+        (unsigned long long)jobs, (unsigned long long)(jobs - lastJobs), bytesPut / 1e6,
+        size > 0 ? 100.0 * offset / size : 100.0, offset);
+      lastJobs = jobs;
+    }
+  });
+  
+  for(size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  
+  finished = true;
+  progress.join();
+  
+  size_t offset = dispatcher.resumeOffset();
+  
+  fprintf(stderr, "%llu jobs put in %.1f s (%.0f jobs/s, %.1f MB/s), %llu rejected as too big\n",
+    (unsigned long long)jobsPut, elapsed, jobsPut / elapsed, bytesPut / elapsed / 1e6,
+    (unsigned long long)jobsRejected);
+  
+  if(size > 0) munmap((void *)data, size);
+  
+  if(offset < size) {
+    if(!interrupted && !failed && dispatcher.truncated())
+      fprintf(stderr, "The input ends with a truncated record at offset %zu\n", offset);
+    else
+      fprintf(stderr, "Stopped early. To continue, run again with -o %zu\n", offset);
+    return 1;
+  }
+  
+  return 0;
+}
+
 int usage(const char **argv) {
-  printf("Puts a raw job into a beanstalk tube.\n\n");
+  printf("Puts a raw job into a beanstalk tube, or one job per record of a file.\n\n");
   printf("Usage:\n");
-  printf("%s <tubename> [job]\n", argv[0]);
+  printf("%s [options] <tubename> [job]\n", argv[0]);
   printf("\n");
-  printf("If job is not specified, it will be read from stdin.\n");
+  printf("If neither job nor -f is specified, the job will be read from stdin.\n\n");
+  printf("  -h HOST    Server to connect to (default %s)\n", BEANSTALK_SERVER);
+  printf("  -p PORT    Port to connect to (default %d)\n", BEANSTALK_PORT);
+  printf("  -f FILE    Bulk mode: put each line of FILE as a job. Empty lines are skipped.\n");
+  printf("  -L         Records of FILE are a 32 bit big endian length followed by the payload,\n");
+  printf("             as written by beansreserve -x\n");
+  printf("  -c N       Number of connections (default 4)\n");
+  printf("  -d N       Number of puts in flight per connection (default 64)\n");
+  printf("  -o OFFSET  Start at byte OFFSET of FILE, to resume an interrupted load\n");
+  printf("\n");
+  printf("Interrupted bulk loads print the offset to resume from. Every record before it was put, and\n");
+  printf("a few after it may have been, so a resumed load can put these twice.\n");
   
   return 1;
 }
 
-void demoClient(const string &tubeName, const string &job) {
-  Client c(BEANSTALK_SERVER, BEANSTALK_PORT);
+void demoClient(const Options &o, const string &tubeName, const string &job) {
+  Client c(o.host, o.port);
   c.connect();
   
   cout << job << endl;
@@ -52,12 +362,31 @@ void demoClient(const string &tubeName, const string &job) {
 }
 
 int main(int argc, const char **argv) {
-  if(argc < 2) return usage(argv);
+  Options o;
+  
+  int opt;
+  while((opt = getopt(argc, (char * const *)argv, "h:p:f:Lc:d:o:")) != -1) {
+    switch(opt) {
+      case 'h': o.host = optarg; break;
+      case 'p': o.port = atoi(optarg); break;
+      case 'f': o.file = optarg; break;
+      case 'L': o.lengthPrefixed = true; break;
+      case 'c': o.connections = atoi(optarg); break;
+      case 'd': o.depth = atoi(optarg); break;
+      case 'o': o.offset = strtoull(optarg, NULL, 10); break;
+      default: return usage(argv);
+    }
+  }
+  
+  if(optind >= argc || o.connections < 1 || o.depth < 1) return usage(argv);
+  
+  string tube = argv[optind];
+  if(!o.file.empty()) return bulkPut(o, tube);
   
   string jobstr;
   
-  if(argc == 3) {
-    jobstr = argv[2];
+  if(optind + 1 < argc) {
+    jobstr = argv[optind + 1];
   } else {
     // Read the job from stdin
     cout << "Reading from stdin..." << endl;
@@ -71,7 +400,7 @@ int main(int argc, const char **argv) {
   }
   
   try {
-    demoClient(argv[1], jobstr);
+    demoClient(o, tube, jobstr);
   } catch(Exception &e) {
     printf("Caught exception: %s\n", e.what());
   }
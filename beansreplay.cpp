@@ -0,0 +1,329 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "capture.h"
+#include "tokenizedstream.h"
+#include "mockserver.h"
+
+#include "config.h"
+
+using namespace std;
+using namespace Beanstalkpp;
+using boost::asio::ip::tcp;
+
+typedef std::chrono::steady_clock replay_clock;
+
+int usage(const char **argv) {
+  printf("Replays traffic recorded with Client::setCapture.\n\n");
+  printf("Usage:\n");
+  printf("%s [options] <capture>\n\n", argv[0]);
+  printf("  -P          Parse the recorded replies from memory, to benchmark the reply parser\n");
+  printf("  -m          Send the recorded commands to an in-process mock server (the default)\n");
+  printf("  -h HOST     Send the recorded commands to this server instead\n");
+  printf("  -p PORT     Port of the server (default %d)\n", BEANSTALK_PORT);
+  printf("  -s SPEED    Replay SPEED times faster than recorded, e.g. 1 for the original timing.\n");
+  printf("              0, the default, sends as fast as possible.\n");
+  printf("\n");
+  printf("Each recorded connection is replayed on a connection of its own, followed by quit.\n");
+  printf("Replays of reserve commands which find no job block like the original did.\n");
+  
+  return 1;
+}
+
+/**
+ * Returns the ids of the recorded connections, in the order they first appear
+ */
+static vector<uint32_t> connectionsOf(const vector<CaptureReader::Record> &records) {
+  vector<uint32_t> ret;
+  for(size_t i = 0; i < records.size(); i++) {
+    if(std::find(ret.begin(), ret.end(), records[i].connection) == ret.end())
+      ret.push_back(records[i].connection);
+  }
+  
+  return ret;
+}
+
+/**
+ * Splits the bytes sent on @p connection into commands and returns their names, skipping the
+ * payloads of puts
+ */
+static vector<string> commandNames(
+  const vector<CaptureReader::Record> &records, uint32_t connection
+) {
+  string sent;
+  for(size_t i = 0; i < records.size(); i++) {
+    if(records[i].direction == WireCapture::SENT && records[i].connection == connection)
+      sent += records[i].data;
+  }
+  
+  vector<string> ret;
+  size_t pos = 0;
+  while(pos < sent.size()) {
+    size_t eol = sent.find("\r\n", pos);
+    if(eol == string::npos) break;
+    
+    string line = sent.substr(pos, eol - pos);
+    string name = line.substr(0, line.find(' '));
+    pos = eol + 2;
+    
+    if(name == "put") {
+      size_t bytes = strtoul(line.substr(line.rfind(' ') + 1).c_str(), NULL, 10);
+      pos += bytes + 2;
+    }
+    
+    ret.push_back(name);
+  }
+  
+  return ret;
+}
+
+/**
+ * Parses one reply to @p command
+ */
+static Status parseReply(TokenizedStream &s, const string &command, string &payload) {
+  Status st = s.tryNextToken();
+  if(!st) return st;
+  
+  const string &reply = s.lastToken();
+  bool hasJob = reply == "RESERVED" || reply == "FOUND";
+  bool hasData = hasJob || reply == "OK";
+  bool hasArgument = reply == "INSERTED" || reply == "USING" || reply == "WATCHING" ||
+    (reply == "BURIED" && command == "put") || (reply == "KICKED" && command == "kick");
+  
+  if(hasData) {
+    if(hasJob) {
+      Result<uint64_t> id = s.tryExpectULL();
+      if(!id) return id.failure();
+    }
+    
+    Result<unsigned int> size = s.tryExpectInt();
+    if(!size) return size.failure();
+    
+    st = s.tryExpectEol();
+    if(!st) return st;
+    
+    payload.resize(size.value());
+    st = s.tryReadChunk(&payload[0], payload.size());
+    if(!st) return st;
+  } else if(hasArgument) {
+    st = s.tryNextToken();
+    if(!st) return st;
+  }
+  
+  return s.tryExpectEol();
+}
+
+static int replayParser(const vector<CaptureReader::Record> &records) {
+  vector<uint32_t> connections = connectionsOf(records);
+  
+  boost::asio::io_service io_service;
+  size_t bytes = 0, parsed = 0, total = 0;
+  double seconds = 0;
+  
+  // The replies of each connection are parsed by a stream of their own
+  for(size_t c = 0; c < connections.size(); c++) {
+    vector<string> commands = commandNames(records, connections[c]);
+    total += commands.size();
+    
+    tcp::socket socket(io_service);
+    TokenizedStream stream(socket);
+    
+    for(size_t i = 0; i < records.size(); i++) {
+      const CaptureReader::Record &r = records[i];
+      if(r.direction != WireCapture::RECEIVED || r.connection != connections[c]) continue;
+      
+      stream.feed(r.data.data(), r.data.size());
+      bytes += r.data.size();
+    }
+    
+    string payload;
+    size_t i = 0;
+    replay_clock::time_point start = replay_clock::now();
+    
+    for(; i < commands.size(); i++) {
+      Status s = parseReply(stream, commands[i], payload);
+      if(!s) {
+        if(s.error() != ServerException::NETWORK_ERROR)
+          printf("Unexpected reply to %s: %s\n", commands[i].c_str(), stream.lastToken().c_str());
+        break;
+      }
+    }
+    
+    seconds += std::chrono::duration<double>(replay_clock::now() - start).count();
+    parsed += i;
+  }
+  
+  printf("Parsed %zu of %zu replies on %zu connections, %zu bytes, in %.3f ms\n", parsed, total,
+    connections.size(), bytes, seconds * 1000);
+  if(parsed > 0) {
+    printf("%.1f ns per reply, %.1f MB/s\n", seconds * 1e9 / parsed, bytes / seconds / 1e6);
+  }
+  
+  return parsed == total ? 0 : 1;
+}
+
+/**
+ * A connection of the replay, with a thread draining its replies so the server never blocks on a
+ * full socket
+ */
+struct ReplayConnection {
+  ReplayConnection(boost::asio::io_service &io_service): socket(io_service), received(0) {}
+  
+  void startReading() {
+    this->reader = std::thread([this]() {
+      char buf[65536];
+      boost::system::error_code error;
+      while(!error) this->received += this->socket.read_some(boost::asio::buffer(buf), error);
+    });
+  }
+  
+  tcp::socket socket;
+  size_t received;
+  std::thread reader;
+};
+
+static int replayServer(
+  const vector<CaptureReader::Record> &records, const string &host, int port, double speed
+) {
+  boost::asio::io_service io_service;
+  
+  boost::system::error_code error;
+  tcp::resolver resolver(io_service);
+  tcp::resolver::iterator endpoints = resolver.resolve(
+    tcp::resolver::query(host, to_string(port)), error
+  );
+  
+  // Every recorded connection is replayed on a socket of its own, in the recorded order
+  typedef boost::shared_ptr<ReplayConnection> connection_p;
+  map<uint32_t, connection_p> connections;
+  vector<uint32_t> ids = connectionsOf(records);
+  for(size_t i = 0; i < ids.size() && !error; i++) {
+    connection_p c(new ReplayConnection(io_service));
+    boost::asio::connect(c->socket, endpoints, error);
+    connections[ids[i]] = c;
+  }
+  if(error) {
+    printf("Unable to connect to %s:%d\n", host.c_str(), port);
+    return 1;
+  }
+  
+  size_t recordedReplies = 0;
+  for(size_t i = 0; i < records.size(); i++) {
+    if(records[i].direction == WireCapture::RECEIVED) recordedReplies += records[i].data.size();
+  }
+  
+  for(map<uint32_t, connection_p>::iterator i = connections.begin(); i != connections.end(); i++)
+    i->second->startReading();
+  
+  size_t sent = 0;
+  replay_clock::time_point start = replay_clock::now();
+  
+  for(size_t i = 0; i < records.size() && !error; i++) {
+    const CaptureReader::Record &r = records[i];
+    if(r.direction != WireCapture::SENT) continue;
+    
+    if(speed > 0) {
+      std::this_thread::sleep_until(
+        start + std::chrono::nanoseconds((uint64_t)(r.timestamp / speed))
+      );
+    }
+    
+    boost::asio::write(connections[r.connection]->socket, boost::asio::buffer(r.data), error);
+    sent += r.data.size();
+  }
+  
+  size_t received = 0;
+  for(map<uint32_t, connection_p>::iterator i = connections.begin(); i != connections.end(); i++) {
+    boost::system::error_code ignored;
+    boost::asio::write(i->second->socket, boost::asio::buffer("quit\r\n", 6), ignored);
+    
+    i->second->reader.join();
+    received += i->second->received;
+  }
+  
+  double seconds = std::chrono::duration<double>(replay_clock::now() - start).count();
+  
+  printf("Sent %zu bytes on %zu connections and received %zu bytes (%zu recorded) in %.3f s\n",
+    sent, connections.size(), received, recordedReplies, seconds);
+  
+  return 0;
+}
+
+int main(int argc, const char **argv) {
+  bool parser = false;
+  string host;
+  int port = BEANSTALK_PORT;
+  double speed = 0;
+  
+  int opt;
+  while((opt = getopt(argc, (char * const *)argv, "Pmh:p:s:")) != -1) {
+    switch(opt) {
+      case 'P': parser = true; break;
+      case 'm': host.clear(); break;
+      case 'h': host = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 's': speed = atof(optarg); break;
+      default: return usage(argv);
+    }
+  }
+  
+  if(optind != argc - 1 || speed < 0) return usage(argv);
+  
+  CaptureReader reader;
+  if(!reader.open(argv[optind])) {
+    printf("%s is not a capture\n", argv[optind]);
+    return 1;
+  }
+  
+  vector<CaptureReader::Record> records;
+  CaptureReader::Record r;
+  while(reader.next(r))
+    records.push_back(r);
+  
+  if(parser) return replayParser(records);
+  
+  boost::scoped_ptr<MockServer> mock;
+  if(host.empty()) {
+    mock.reset(new MockServer());
+    mock->setMaxJobSize(1 << 30);
+    mock->start();
+    host = "127.0.0.1";
+    port = mock->getPort();
+  }
+  
+  int ret = replayServer(records, host, port, speed);
+  
+  if(mock) mock->stop();
+  
+  return ret;
+}
@@ -18,53 +18,346 @@
 // Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 //
 
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <chrono>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "client.h"
 #include "serverexception.h"
 #include "job.h"
+#include "sink.h"
 
 #include "config.h"
 
 using namespace std;
 using namespace Beanstalkpp;
 
-int usage(const char **argv) {
-  printf("Reserves and deletes all jobs in a beanstalk tube.\n\n");
-  printf("Usage:\n");
-  printf("%s <tubename>\n", argv[0]);
+struct Options {
+  Options():
+    host(BEANSTALK_SERVER), port(BEANSTALK_PORT), connections(1), prefetch(1), batch(64),
+    timeout(-1), exportJobs(false) {}
   
-  return 1;
+  string host;
+  int port;
+  int connections;
+  int prefetch;
+  int batch;
+  int timeout;
+  string output;
+  bool exportJobs;
+};
+
+static std::atomic<bool> interrupted(false);
+static std::atomic<bool> failed(false);
+static std::atomic<uint64_t> jobsDone(0);
+static std::atomic<uint64_t> bytesDone(0);
+static std::atomic<uint64_t> jobsLost(0);
+
+static std::mutex outputMutex;
+static FILE *output = NULL;
+
+static void onSignal(int) {
+  interrupted = true;
+}
+
+/**
+ * Collects the payloads of a batch of jobs in the output format: printed, or as records of a 32
+ * bit big endian length followed by the payload
+ */
+class BatchSink: public PayloadSink {
+public:
+  BatchSink(bool lengthPrefixed): lengthPrefixed(lengthPrefixed), bytes(0) {}
+  
+  virtual void begin(job_id_t, size_t size) {
+    this->bytes += size;
+    
+    if(!this->lengthPrefixed) {
+      this->buffer += "Received job:\n";
+      return;
+    }
+    
+    char length[4] = {
+      (char)(size >> 24), (char)(size >> 16), (char)(size >> 8), (char)size
+    };
+    this->buffer.append(length, 4);
+  }
+  
+  virtual bool write(const char *data, size_t length) {
+    this->buffer.append(data, length);
+    return true;
+  }
+  
+  /**
+   * Ends the job whose payload was just written
+   */
+  void end() {
+    if(!this->lengthPrefixed) this->buffer += "\n";
+  }
+  
+  /**
+   * Writes the batch to the output, returning false on errors
+   */
+  bool flush() {
+    std::lock_guard<std::mutex> lock(outputMutex);
+    
+    bool ok = fwrite(this->buffer.data(), 1, this->buffer.size(), output) == this->buffer.size();
+    ok = fflush(output) == 0 && ok;
+    this->buffer.clear();
+    
+    bytesDone += this->bytes;
+    this->bytes = 0;
+    return ok;
+  }
+  
+private:
+  bool lengthPrefixed;
+  std::string buffer;
+  uint64_t bytes;
+};
+
+/**
+ * Deletes the jobs in @p ids, or buries them with their priority unchanged when exporting, with
+ * all commands pipelined
+ */
+static void finish(const Options &o, Client &c, vector<job_id_t> &ids) {
+  if(o.exportJobs) {
+    vector<unsigned int> priorities(ids.size());
+    
+    for(size_t i = 0; i < ids.size(); i++)
+      c.trySendStatsJob(ids[i]).get("stats-job");
+    for(size_t i = 0; i < ids.size(); i++)
+      priorities[i] = c.tryReadStatsJob().get("stats-job").pri;
+    
+    for(size_t i = 0; i < ids.size(); i++)
+      c.trySendBury(ids[i], priorities[i]).get("bury");
+    for(size_t i = 0; i < ids.size(); i++)
+      c.tryReadBury().get("bury");
+  } else {
+    for(size_t i = 0; i < ids.size(); i++)
+      c.trySendDelete(ids[i]).get("delete");
+    
+    for(size_t i = 0; i < ids.size(); i++) {
+      // A job whose TTR ran out before its batch was deleted went back to the queue
+      Status s = c.tryReadDelete();
+      if(!s && s.error() == ServerException::NOT_FOUND) jobsLost++;
+      else s.get("delete");
+    }
+  }
+  
+  jobsDone += ids.size();
+  ids.clear();
 }
 
-void demoClient(const string &tubeName) {
-  Client c(BEANSTALK_SERVER, BEANSTALK_PORT);
+/**
+ * Reserves jobs over one connection, with up to prefetch reserves in flight, and deletes or
+ * buries them in batches once they are written out
+ */
+static void drainer(const Options &o, const string &tube) {
   try {
+    Client c(o.host, o.port);
     c.connect();
+    c.watch(tube);
+    if(tube != "default") c.ignore("default");
+    
+    // Waiting forever would keep a partial batch reserved, so idle batches are flushed every second
+    int timeout = o.timeout < 0 ? 1 : o.timeout;
+    
+    BatchSink sink(!o.output.empty());
+    vector<job_id_t> ids;
+    
+    while(!interrupted && !failed) {
+      for(int i = 0; i < o.prefetch; i++)
+        c.trySendReserve(timeout).get("reserve");
+      
+      bool idle = true;
+      for(int i = 0; i < o.prefetch; i++) {
+        Result<job_id_t> id = c.tryReadReserve(sink);
+        
+        if(!id && id.error() == ServerException::TIMED_OUT) continue;
+        id.get("reserve");
+        
+        sink.end();
+        ids.push_back(id.value());
+        idle = false;
+      }
+      
+      if(idle || (int)ids.size() >= o.batch) {
+        if(!sink.flush()) {
+          fprintf(stderr, "Unable to write the jobs\n");
+          failed = true;
+          break;
+        }
+        
+        finish(o, c, ids);
+      }
+      
+      // An export buries what it reserves, so once nothing arrives it has gone through the tube
+      if(idle && (o.timeout >= 0 || o.exportJobs)) break;
+    }
+    
+    // Jobs reserved before an interrupt are still written out
+    if(!ids.empty() && sink.flush()) finish(o, c, ids);
   } catch(Exception &e) {
-    cerr << e.what() << endl;
-    exit(1);
+    fprintf(stderr, "Caught exception: %s\n", e.what());
+    failed = true;
   }
-  c.watch(tubeName);
+}
+
+/**
+ * Kicks the jobs buried by an export back into the ready queue
+ */
+static void kickExported(const Options &o, const string &tube) {
+  Client c(o.host, o.port);
+  c.connect();
+  c.use(tube);
   
-  while(true) {
-    Job j = c.reserve();
+  uint64_t remaining = jobsDone;
+  while(remaining > 0) {
+    // Kicking a tube without buried jobs would kick its delayed jobs instead
+    Result<TubeStats> stats = c.tryStatsTube(tube);
+    if(!stats && stats.error() == ServerException::NOT_FOUND) break;
     
-    printf("Received job:\n%s\n", j.asString().c_str());
+    uint64_t count = std::min<uint64_t>(remaining, stats.get("stats-tube").currentJobsBuried);
+    if(count == 0) break;
     
-    c.del(j);
+    size_t kicked = c.kick(count > UINT_MAX ? UINT_MAX : (unsigned int)count);
+    if(kicked == 0) break;
+    
+    remaining -= kicked;
   }
 }
 
+int usage(const char **argv) {
+  printf("Reserves and deletes all jobs in a beanstalk tube.\n\n");
+  printf("Usage:\n");
+  printf("%s [options] <tubename>\n\n", argv[0]);
+  printf("  -h HOST     Server to connect to (default %s)\n", BEANSTALK_SERVER);
+  printf("  -p PORT     Port to connect to (default %d)\n", BEANSTALK_PORT);
+  printf("  -c N        Number of connections (default 1)\n");
+  printf("  -P N        Number of reserves in flight per connection (default 1)\n");
+  printf("  -b N        Delete jobs in batches of N (default 64)\n");
+  printf("  -t SECONDS  Stop once no job arrived for SECONDS (default: never stop, unless exporting)\n");
+  printf("  -x FILE     Write the jobs to FILE, or stdout for -, as a 32 bit big endian length followed\n");
+  printf("              by the payload, instead of printing them. beansput -L reads this format.\n");
+  printf("  -e          Export: bury the jobs instead of deleting them, and kick them back once done\n");
+  printf("\n");
+  printf("Jobs are written out before they are deleted, and stay reserved until then, so -b and -P should\n");
+  printf("be kept well below what can be written within the TTR of the jobs.\n");
+  printf("\n");
+  printf("An export leaves the jobs in place, but hides them from workers while it runs, and refuses to\n");
+  printf("run on a tube with buried jobs, as kicking would release those too.\n");
+  
+  return 1;
+}
+
 int main(int argc, const char **argv) {
-  if(argc < 2) return usage(argv);
+  Options o;
   
-  try {
-    demoClient(argv[1]);
-  } catch(ServerException &e) {
-    printf("Caught exception: %s\n", e.what());
+  int opt;
+  while((opt = getopt(argc, (char * const *)argv, "h:p:c:P:b:t:x:e")) != -1) {
+    switch(opt) {
+      case 'h': o.host = optarg; break;
+      case 'p': o.port = atoi(optarg); break;
+      case 'c': o.connections = atoi(optarg); break;
+      case 'P': o.prefetch = atoi(optarg); break;
+      case 'b': o.batch = atoi(optarg); break;
+      case 't': o.timeout = atoi(optarg); break;
+      case 'x': o.output = optarg; break;
+      case 'e': o.exportJobs = true; break;
+      default: return usage(argv);
+    }
+  }
+  
+  if(optind >= argc || o.connections < 1 || o.prefetch < 1 || o.batch < 1) return usage(argv);
+  string tube = argv[optind];
+  
+  // Progress goes to stderr, so the jobs can be written to stdout
+  output = stdout;
+  if(!o.output.empty() && o.output != "-") {
+    output = fopen(o.output.c_str(), "wb");
+    if(!output) {
+      perror(o.output.c_str());
+      return 1;
+    }
+  }
+  
+  if(o.exportJobs) {
+    try {
+      Client c(o.host, o.port);
+      c.connect();
+      
+      Result<TubeStats> stats = c.tryStatsTube(tube);
+      if(stats && stats.value().currentJobsBuried > 0) {
+        fprintf(stderr, "The tube has buried jobs, which the export would kick\n");
+        return 1;
+      }
+    } catch(Exception &e) {
+      fprintf(stderr, "Caught exception: %s\n", e.what());
+      return 1;
+    }
+  }
+  
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  
+  vector<std::thread> threads;
+  for(int i = 0; i < o.connections; i++)
+    threads.push_back(std::thread(drainer, std::cref(o), std::cref(tube)));
+  
+  std::atomic<bool> finished(false);
+  std::thread progress([&]() {
+    uint64_t lastJobs = 0;
+    std::chrono::steady_clock::time_point next = start;
+    
+    for(;;) {
+      next += std::chrono::seconds(1);
+      while(!finished && std::chrono::steady_clock::now() < next)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      if(finished) break;
+      
+      uint64_t jobs = jobsDone;
+      fprintf(stderr, "%llu jobs, %llu jobs/s, %.1f MB\n", (unsigned long long)jobs,
+        (unsigned long long)(jobs - lastJobs), bytesDone / 1e6);
+      lastJobs = jobs;
+    }
+  });
+  
+  for(size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  
+  finished = true;
+  progress.join();
+  
+  if(output != stdout) fclose(output);
+  
+  fprintf(stderr, "%llu jobs %s in %.1f s (%.0f jobs/s, %.1f MB/s)\n",
+    (unsigned long long)jobsDone, o.exportJobs ? "exported" : "drained", elapsed,
+    jobsDone / elapsed, bytesDone / elapsed / 1e6);
+  if(jobsLost > 0)
+    fprintf(stderr, "%llu jobs timed out before being deleted, and may be written again\n",
+      (unsigned long long)jobsLost);
+  
+  if(o.exportJobs) {
+    try {
+      kickExported(o, tube);
+    } catch(Exception &e) {
+      fprintf(stderr, "Unable to kick the exported jobs back: %s\n", e.what());
+      return 1;
+    }
   }
   
-  return 0;
+  return failed ? 1 : 0;
 }
@@ -21,5 +21,22 @@
 // Includes all files needed for beanstalk.
 #include <beanstalk++/client.h>
 #include <beanstalk++/job.h>
+#include <beanstalk++/typedjob.h>
 #include <beanstalk++/exception.h>
 #include <beanstalk++/serverexception.h>
+#include <beanstalk++/result.h>
+#include <beanstalk++/sink.h>
+#include <beanstalk++/codec.h>
+#include <beanstalk++/envelope.h>
+#include <beanstalk++/crc32c.h>
+#include <beanstalk++/metrics.h>
+#include <beanstalk++/observer.h>
+#include <beanstalk++/capture.h>
+#include <beanstalk++/stats.h>
+#include <beanstalk++/statspoller.h>
+#include <beanstalk++/mover.h>
+#include <beanstalk++/kicker.h>
+#include <beanstalk++/fairscheduler.h>
+#include <beanstalk++/hedgedproducer.h>
+#include <beanstalk++/outbox.h>
+#include <beanstalk++/shardruntime.h>
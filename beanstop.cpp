@@ -0,0 +1,151 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "statspoller.h"
+
+#include "config.h"
+
+using namespace std;
+using namespace Beanstalkpp;
+
+struct Options {
+  Options(): interval(1000), iterations(0), batch(false), rows(0) {}
+  
+  vector<StatsPoller::server_t> servers;
+  int interval;
+  int iterations;
+  bool batch;
+  int rows;
+};
+
+/**
+ * Orders tubes by how fast their backlog grows, then by its size
+ */
+static bool growingFirst(const TubeSample &a, const TubeSample &b) {
+  if(a.backlogRate != b.backlogRate) return a.backlogRate > b.backlogRate;
+  if(a.ready != b.ready) return a.ready > b.ready;
+  return a.name < b.name;
+}
+
+static void printTube(const TubeSample &t, const char *name) {
+  printf("%-24s %8llu %8llu %8llu %8llu %8llu %9.1f %8.1f %8.1f %5llu %5llu %5llu\n",
+    name, (unsigned long long)t.ready, (unsigned long long)t.urgent,
+    (unsigned long long)t.reserved, (unsigned long long)t.delayed, (unsigned long long)t.buried,
+    t.backlogRate, t.putRate, t.deleteRate, (unsigned long long)t.users,
+    (unsigned long long)t.watchers, (unsigned long long)t.waiters);
+}
+
+static void print(const Options &o, const ClusterSample &sample) {
+  // Move to the top left corner and clear the screen, unless the output is a log
+  if(!o.batch) printf("\033[H\033[2J");
+  
+  printf("servers %zu/%zu up, %llu connections, %llu producers, %llu workers\n",
+    o.servers.size() - sample.serversFailed, o.servers.size(),
+    (unsigned long long)sample.connections, (unsigned long long)sample.producers,
+    (unsigned long long)sample.workers);
+  printf("put %.1f/s, reserve %.1f/s, delete %.1f/s, backlog %+.1f/s\n\n",
+    sample.total.putRate, sample.reserveRate, sample.total.deleteRate, sample.total.backlogRate);
+  
+  printf("%-24s %8s %8s %8s %8s %8s %9s %8s %8s %5s %5s %5s\n", "TUBE", "READY", "URGENT",
+    "RESERVED", "DELAYED", "BURIED", "GROWTH/s", "PUT/s", "DEL/s", "USING", "WATCH", "WAIT");
+  
+  vector<TubeSample> tubes = sample.tubes;
+  std::sort(tubes.begin(), tubes.end(), growingFirst);
+  
+  size_t rows = o.rows > 0 ? std::min(tubes.size(), (size_t)o.rows) : tubes.size();
+  for(size_t i = 0; i < rows; i++)
+    printTube(tubes[i], tubes[i].name.c_str());
+  
+  printTube(sample.total, "(total)");
+  
+  if(o.batch) printf("\n");
+  fflush(stdout);
+}
+
+int usage(const char **argv) {
+  printf("Shows the queue depths and rates of all tubes on one or more servers, refreshed regularly.\n\n");
+  printf("Usage:\n");
+  printf("%s [options] [HOST[:PORT] ...]\n\n", argv[0]);
+  printf("  -i MS   Refresh interval in milliseconds (default 1000)\n");
+  printf("  -n N    Stop after N refreshes (default 0, run until interrupted)\n");
+  printf("  -l N    Show at most N tubes (default all)\n");
+  printf("  -b      Batch mode: append each refresh instead of redrawing the screen\n");
+  printf("\n");
+  printf("Without servers, %s:%d is monitored. Tubes are sorted by how fast their ready jobs grow.\n",
+    BEANSTALK_SERVER, BEANSTALK_PORT);
+  printf("Each server is polled over a single connection, with all stats requests pipelined.\n");
+  
+  return 1;
+}
+
+int main(int argc, const char **argv) {
+  Options o;
+  
+  int opt;
+  while((opt = getopt(argc, (char * const *)argv, "i:n:l:b")) != -1) {
+    switch(opt) {
+      case 'i': o.interval = atoi(optarg); break;
+      case 'n': o.iterations = atoi(optarg); break;
+      case 'l': o.rows = atoi(optarg); break;
+      case 'b': o.batch = true; break;
+      default: return usage(argv);
+    }
+  }
+  
+  for(int i = optind; i < argc; i++) {
+    string host = argv[i];
+    int port = BEANSTALK_PORT;
+    
+    size_t colon = host.rfind(':');
+    if(colon != string::npos) {
+      port = atoi(host.c_str() + colon + 1);
+      host.resize(colon);
+    }
+    
+    o.servers.push_back(StatsPoller::server_t(host, port));
+  }
+  
+  if(o.servers.empty())
+    o.servers.push_back(StatsPoller::server_t(BEANSTALK_SERVER, BEANSTALK_PORT));
+  
+  if(o.interval < 1 || o.iterations < 0 || o.rows < 0) return usage(argv);
+  
+  StatsPoller poller(o.servers);
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+  
+  for(int i = 0; o.iterations == 0 || i < o.iterations; i++) {
+    print(o, *poller.poll());
+    
+    next += std::chrono::milliseconds(o.interval);
+    std::this_thread::sleep_until(next);
+  }
+  
+  return 0;
+}
@@ -0,0 +1,381 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "client.h"
+#include "job.h"
+#include "jobtraits.h"
+#include "codec.h"
+#include "envelope.h"
+#include "tokenizedstream.h"
+#include "yaml.h"
+
+using namespace Beanstalkpp;
+using namespace std;
+
+/*
+ * Microbenchmarks of the parser, the put encoding and the Job allocation paths. Each benchmark
+ * reports the time, the number of heap allocations and the number of bytes allocated per
+ * operation. Build with -DCMAKE_BUILD_TYPE=Release for meaningful timings.
+ * 
+ * Usage: bench [--save FILE] [--baseline FILE] [FILTER...]
+ * 
+ *   --save FILE      Writes the results to FILE
+ *   --baseline FILE  Compares the results to those saved in FILE
+ *   FILTER           Only runs benchmarks whose name contains one of the filters
+ */
+
+static std::atomic<uint64_t> allocations(0);
+static std::atomic<uint64_t> allocatedBytes(0);
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  
+  void *p = malloc(size ? size : 1);
+  if(!p) throw std::bad_alloc();
+  
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+// Keeps the compiler from optimizing away the benchmarked work
+static volatile size_t blackhole;
+
+typedef void (*bench_fn_t)(size_t iterations);
+
+struct Measurement {
+  double ns;
+  double allocs;
+  double bytes;
+};
+
+/**
+ * Runs @p fn with a growing number of iterations until a run takes at least 200 ms, and returns
+ * the per-iteration figures of that run
+ */
+static Measurement measure(bench_fn_t fn) {
+  fn(1); // Warm up caches and lazily initialized state
+  
+  for(size_t iterations = 1; ; iterations *= 2) {
+    uint64_t allocsBefore = allocations.load();
+    uint64_t bytesBefore = allocatedBytes.load();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    fn(iterations);
+    
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+    if(elapsed < std::chrono::milliseconds(200) && iterations < ((size_t)1 << 40)) continue;
+    
+    Measurement r;
+    r.ns = (double)elapsed.count() / iterations;
+    r.allocs = (double)(allocations.load() - allocsBefore) / iterations;
+    r.bytes = (double)(allocatedBytes.load() - bytesBefore) / iterations;
+    return r;
+  }
+}
+
+/**
+ * A token stream over an unconnected socket, fed with canned replies
+ */
+struct CannedStream {
+  CannedStream(): socket(io_service), stream(socket) {}
+  
+  /**
+   * Feeds @p count copies of @p reply to the stream
+   */
+  void feed(const std::string &reply, size_t count) {
+    for(size_t i = 0; i < count; i++)
+      this->stream.feed(reply.data(), reply.size());
+  }
+  
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::socket socket;
+  TokenizedStream stream;
+};
+
+// Replies are fed in batches, so the cost of feeding is amortized over many parses
+#define FEED_BATCH 1024
+
+static void benchReservedHeader(size_t iterations) {
+  CannedStream canned;
+  string reply = "RESERVED 1234567 64\r\n" + string(64, 'x') + "\r\n";
+  char payload[64];
+  
+  for(size_t i = 0; i < iterations; i++) {
+    if(i % FEED_BATCH == 0) canned.feed(reply, FEED_BATCH);
+    
+    TokenizedStream &s = canned.stream;
+    s.tryExpectString("RESERVED");
+    Result<uint64_t> id = s.tryExpectULL();
+    Result<unsigned int> size = s.tryExpectInt();
+    s.tryExpectEol();
+    s.tryReadChunk(payload, size.value());
+    s.tryExpectEol();
+    
+    blackhole += id.value();
+  }
+}
+
+static void benchListTubes(size_t iterations) {
+  CannedStream canned;
+  
+  string yaml = "---\n";
+  for(int i = 0; i < 16; i++)
+    yaml += "- tube" + to_string(i) + "\n";
+  string reply = "OK " + to_string(yaml.size()) + "\r\n" + yaml + "\r\n";
+  
+  string payload;
+  for(size_t i = 0; i < iterations; i++) {
+    if(i % FEED_BATCH == 0) canned.feed(reply, FEED_BATCH);
+    
+    TokenizedStream &s = canned.stream;
+    s.tryExpectString("OK");
+    Result<unsigned int> size = s.tryExpectInt();
+    s.tryExpectEol();
+    payload.resize(size.value());
+    s.tryReadChunk(&payload[0], payload.size());
+    s.tryExpectEol();
+    
+    blackhole += parseYamlList(payload.data(), payload.size()).size();
+  }
+}
+
+static void benchPipelinedBurst(size_t iterations) {
+  CannedStream canned;
+  
+  // One operation is a burst of 64 replies, as received when commands are pipelined
+  string burst;
+  for(int i = 0; i < 16; i++)
+    burst += "INSERTED 1234567\r\nDELETED\r\nUSING some-tube\r\nWATCHING 2\r\n";
+  
+  for(size_t i = 0; i < iterations; i++) {
+    if(i % 16 == 0) canned.feed(burst, 16);
+    
+    TokenizedStream &s = canned.stream;
+    for(int j = 0; j < 16; j++) {
+      s.tryExpectString("INSERTED");
+      blackhole += s.tryExpectULL().value();
+      s.tryExpectEol();
+      s.tryExpectString("DELETED");
+      s.tryExpectEol();
+      s.tryExpectString("USING");
+      s.tryNextToken();
+      s.tryExpectEol();
+      s.tryExpectString("WATCHING");
+      blackhole += s.tryExpectInt().value();
+      s.tryExpectEol();
+    }
+  }
+}
+
+static void benchPutHeader(size_t iterations) {
+  char header[Client::PUT_HEADER_SIZE];
+  
+  for(size_t i = 0; i < iterations; i++)
+    blackhole += Client::formatPutHeader(header, 256 + (i & 0xff));
+}
+
+static void benchPutEnvelope(size_t iterations) {
+  string body(1024, 'x');
+  char envelope[Envelope::SIZE];
+  char header[Client::PUT_HEADER_SIZE];
+  
+  for(size_t i = 0; i < iterations; i++) {
+    Envelope::write(envelope, 1, body.data(), body.size());
+    blackhole += Client::formatPutHeader(header, Envelope::SIZE + body.size());
+  }
+}
+
+static void benchPutCompressed(size_t iterations) {
+  string body;
+  for(int i = 0; body.size() < 4096; i++)
+    body += "{\"id\": " + to_string(i) + ", \"state\": \"pending\"} ";
+  
+  ZlibCodec zlib;
+  string compressed;
+  char header[Client::PUT_HEADER_SIZE];
+  
+  for(size_t i = 0; i < iterations; i++) {
+    zlib.encode(body.data(), body.size(), compressed);
+    blackhole += Client::formatPutHeader(header, compressed.size());
+  }
+}
+
+static void benchPutTyped(size_t iterations) {
+  string value(200, 'x');
+  string encoded;
+  char header[Client::PUT_HEADER_SIZE];
+  
+  for(size_t i = 0; i < iterations; i++) {
+    encoded.resize(JobTraits<string>::size(value));
+    JobTraits<string>::encode(value, &encoded[0]);
+    blackhole += Client::formatPutHeader(header, encoded.size());
+  }
+}
+
+static Client benchClient("127.0.0.1", 11300);
+
+static Job makeJob(size_t size) {
+  char *payload = new char[size];
+  memset(payload, 'x', size);
+  
+  return Job(benchClient, 1234567, size, payload);
+}
+
+static void benchJobConstruct(size_t iterations) {
+  for(size_t i = 0; i < iterations; i++) {
+    Job j = makeJob(256);
+    blackhole += j.getJobId();
+  }
+}
+
+static void benchJobCopy(size_t iterations) {
+  Job j = makeJob(256);
+  
+  for(size_t i = 0; i < iterations; i++) {
+    Job copy(j);
+    blackhole += copy.getJobId();
+  }
+}
+
+static void benchJobAsString(size_t iterations) {
+  Job j = makeJob(256);
+  
+  for(size_t i = 0; i < iterations; i++)
+    blackhole += j.asString().size();
+}
+
+static void benchJobData(size_t iterations) {
+  Job j = makeJob(256);
+  
+  for(size_t i = 0; i < iterations; i++)
+    blackhole += j.size() + (size_t)j.data()[0];
+}
+
+struct Benchmark {
+  const char *name;
+  bench_fn_t fn;
+};
+
+static const Benchmark benchmarks[] = {
+  { "parse/reserved-64B", benchReservedHeader },
+  { "parse/list-tubes-16", benchListTubes },
+  { "parse/pipelined-burst-64", benchPipelinedBurst },
+  { "put/header", benchPutHeader },
+  { "put/envelope-1KB", benchPutEnvelope },
+  { "put/zlib-4KB", benchPutCompressed },
+  { "put/typed-string-200B", benchPutTyped },
+  { "job/construct-256B", benchJobConstruct },
+  { "job/copy", benchJobCopy },
+  { "job/asString-256B", benchJobAsString },
+  { "job/data", benchJobData },
+};
+
+/**
+ * Reads results written with --save
+ */
+static map<string, Measurement> loadResults(const char *file) {
+  map<string, Measurement> ret;
+  ifstream in(file);
+  
+  string name;
+  Measurement r;
+  while(in >> name >> r.ns >> r.allocs >> r.bytes)
+    ret[name] = r;
+  
+  return ret;
+}
+
+static bool selected(const char *name, const vector<string> &filters) {
+  if(filters.empty()) return true;
+  
+  for(size_t i = 0; i < filters.size(); i++)
+    if(strstr(name, filters[i].c_str())) return true;
+  
+  return false;
+}
+
+int main(int argc, char **argv) {
+  const char *saveFile = NULL;
+  const char *baselineFile = NULL;
+  vector<string> filters;
+  
+  for(int i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "--save") && i + 1 < argc) {
+      saveFile = argv[++i];
+    } else if(!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+      baselineFile = argv[++i];
+    } else if(argv[i][0] == '-') {
+      printf("Usage: %s [--save FILE] [--baseline FILE] [FILTER...]\n", argv[0]);
+      return 1;
+    } else {
+      filters.push_back(argv[i]);
+    }
+  }
+  
+  map<string, Measurement> baseline;
+  if(baselineFile) baseline = loadResults(baselineFile);
+  
+  FILE *save = NULL;
+  if(saveFile && !(save = fopen(saveFile, "w"))) {
+    printf("Unable to open %s\n", saveFile);
+    return 1;
+  }
+  
+  printf("%-28s %12s %10s %10s%s\n", "benchmark", "ns/op", "allocs/op", "bytes/op",
+    baselineFile ? "   vs baseline" : "");
+  
+  for(size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    const Benchmark &b = benchmarks[i];
+    if(!selected(b.name, filters)) continue;
+    
+    Measurement r = measure(b.fn);
+    printf("%-28s %12.1f %10.2f %10.1f", b.name, r.ns, r.allocs, r.bytes);
+    
+    map<string, Measurement>::const_iterator base = baseline.find(b.name);
+    if(base != baseline.end()) {
+      printf("   %+6.1f%% time, %+.2f allocs", 
+        (r.ns / base->second.ns - 1) * 100, r.allocs - base->second.allocs);
+    }
+    printf("\n");
+    fflush(stdout);
+    
+    if(save) fprintf(save, "%s %f %f %f\n", b.name, r.ns, r.allocs, r.bytes);
+  }
+  
+  if(save) fclose(save);
+  
+  return 0;
+}
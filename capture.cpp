@@ -0,0 +1,134 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "capture.h"
+
+#include <cstring>
+
+static const char magic[Beanstalkpp::WireCapture::HEADER_SIZE] = {
+  'B', 'S', 'W', 'I', 'R', 'E', 0, 2
+};
+
+const size_t Beanstalkpp::WireCapture::HEADER_SIZE;
+const size_t Beanstalkpp::WireCapture::RECORD_HEADER_SIZE;
+
+static inline void writeLittleEndian(char *p, uint64_t v, int bytes) {
+  for(int i = 0; i < bytes; i++)
+    p[i] = (char)((v >> (8 * i)) & 0xff);
+}
+
+static inline uint64_t readLittleEndian(const char *p, int bytes) {
+  uint64_t v = 0;
+  for(int i = 0; i < bytes; i++)
+    v |= (uint64_t)(uint8_t)p[i] << (8 * i);
+  
+  return v;
+}
+
+Beanstalkpp::WireCapture::WireCapture(): file(NULL), connections(0) {
+
+}
+
+Beanstalkpp::WireCapture::~WireCapture() {
+  this->close();
+}
+
+bool Beanstalkpp::WireCapture::open(const std::string& path) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  
+  if(this->file) fclose(this->file);
+  
+  this->file = fopen(path.c_str(), "wb");
+  if(!this->file) return false;
+  
+  this->start = std::chrono::steady_clock::now();
+  return fwrite(magic, 1, sizeof(magic), this->file) == sizeof(magic);
+}
+
+void Beanstalkpp::WireCapture::close() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  
+  if(this->file) fclose(this->file);
+  this->file = NULL;
+}
+
+uint32_t Beanstalkpp::WireCapture::addConnection() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  
+  return this->connections++;
+}
+
+void Beanstalkpp::WireCapture::record(
+  Beanstalkpp::WireCapture::Direction direction, uint32_t connection, const char* data,
+  size_t size
+) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  if(!this->file) return;
+  
+  this->writeHeader(direction, connection, size);
+  fwrite(data, 1, size, this->file);
+}
+
+void Beanstalkpp::WireCapture::writeHeader(
+  Beanstalkpp::WireCapture::Direction direction, uint32_t connection, size_t size
+) {
+  std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - this->start;
+  
+  char header[RECORD_HEADER_SIZE];
+  header[0] = (char)direction;
+  writeLittleEndian(header + 1, connection, 4);
+  writeLittleEndian(header + 5, elapsed.count(), 8);
+  writeLittleEndian(header + 13, size, 4);
+  
+  fwrite(header, 1, sizeof(header), this->file);
+}
+
+Beanstalkpp::CaptureReader::CaptureReader(): file(NULL) {
+
+}
+
+Beanstalkpp::CaptureReader::~CaptureReader() {
+  if(this->file) fclose(this->file);
+}
+
+bool Beanstalkpp::CaptureReader::open(const std::string& path) {
+  if(this->file) fclose(this->file);
+  
+  this->file = fopen(path.c_str(), "rb");
+  if(!this->file) return false;
+  
+  char header[WireCapture::HEADER_SIZE];
+  return fread(header, 1, sizeof(header), this->file) == sizeof(header) &&
+    memcmp(header, magic, sizeof(magic)) == 0;
+}
+
+bool Beanstalkpp::CaptureReader::next(Beanstalkpp::CaptureReader::Record& r) {
+  if(!this->file) return false;
+  
+  char header[WireCapture::RECORD_HEADER_SIZE];
+  if(fread(header, 1, sizeof(header), this->file) != sizeof(header)) return false;
+  
+  r.direction = header[0] ? WireCapture::RECEIVED : WireCapture::SENT;
+  r.connection = readLittleEndian(header + 1, 4);
+  r.timestamp = readLittleEndian(header + 5, 8);
+  r.data.resize(readLittleEndian(header + 13, 4));
+  
+  return r.data.empty() || fread(&r.data[0], 1, r.data.size(), this->file) == r.data.size();
+}
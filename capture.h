@@ -0,0 +1,150 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_CAPTURE_H
+#define _BEANSTALK_CAPTURE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <boost/asio/buffer.hpp>
+
+namespace Beanstalkpp {
+
+/**
+ * Records the bytes a Client sends and receives to a file, for reproducing production traffic
+ * with beansreplay. Attach it with @c Client::setCapture; several clients may share one capture,
+ * each gets a connection id of its own which beansreplay replays on a socket of its own.
+ * 
+ * The file starts with the 8 byte magic "BSWIRE\0\2", followed by one record per socket read or
+ * write. All integers are little endian:
+ * 
+ *   uint8          direction, 0 for bytes sent and 1 for bytes received
+ *   uint32         connection id, see @c addConnection
+ *   uint64         timestamp, in nanoseconds since the capture was opened
+ *   uint32         length
+ *   length bytes   the data
+ */
+class WireCapture {
+public:
+  enum Direction { SENT = 0, RECEIVED = 1 };
+  
+  static const size_t HEADER_SIZE = 8;
+  static const size_t RECORD_HEADER_SIZE = 17;
+  
+  WireCapture();
+  
+  /**
+   * Closes the file
+   */
+  ~WireCapture();
+  
+  /**
+   * Creates the file at @p path, replacing any existing file, and starts the clock
+   * 
+   * @return False if the file couldn't be created
+   */
+  bool open(const std::string &path);
+  
+  /**
+   * Flushes and closes the file. Nothing more is recorded.
+   */
+  void close();
+  
+  /**
+   * Returns a new connection id, to tell the records of the clients sharing the capture apart
+   */
+  uint32_t addConnection();
+  
+  /**
+   * Records @p size bytes from @p data
+   */
+  void record(Direction direction, uint32_t connection, const char *data, size_t size);
+  
+  /**
+   * Records the contents of @p buffers, as a single record
+   */
+  template<class ConstBufferSequence>
+  void record(Direction direction, uint32_t connection, const ConstBufferSequence &buffers) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if(!this->file) return;
+    
+    this->writeHeader(direction, connection, boost::asio::buffer_size(buffers));
+    for(
+      auto i = boost::asio::buffer_sequence_begin(buffers);
+      i != boost::asio::buffer_sequence_end(buffers); ++i
+    ) {
+      boost::asio::const_buffer b(*i);
+      fwrite(b.data(), 1, b.size(), this->file);
+    }
+  }
+private:
+  /**
+   * Writes the header of a record of @p size bytes. The mutex must be held.
+   */
+  void writeHeader(Direction direction, uint32_t connection, size_t size);
+  
+  FILE *file;
+  uint32_t connections;
+  std::chrono::steady_clock::time_point start;
+  std::mutex mutex;
+};
+
+/**
+ * Reads files written by @c WireCapture
+ */
+class CaptureReader {
+public:
+  struct Record {
+    WireCapture::Direction direction;
+    uint32_t connection;
+    
+    /**
+     * Nanoseconds since the capture was opened
+     */
+    uint64_t timestamp;
+    std::string data;
+  };
+  
+  CaptureReader();
+  ~CaptureReader();
+  
+  /**
+   * Opens the capture at @p path
+   * 
+   * @return False if the file couldn't be opened or isn't a capture
+   */
+  bool open(const std::string &path);
+  
+  /**
+   * Reads the next record into @p r
+   * 
+   * @return False at the end of the file, or if the last record is truncated
+   */
+  bool next(Record &r);
+private:
+  FILE *file;
+};
+
+}
+
+#endif
@@ -24,9 +24,24 @@
 #include <sstream>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <climits>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <poll.h>
+#include <thread>
+#include <unistd.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
 
 #include "serverexception.h"
 #include "job.h"
+#include "yaml.h"
+#include "metrics.h"
+#include "capture.h"
 
 using namespace std;
 using namespace boost::asio::ip;
@@ -37,195 +52,1531 @@ using namespace boost::asio::ip;
 #define DEFAULT_DELAY 0 
 // 1 minute
 #define DEFAULT_TTR 60 
+// Chunk size when streaming payloads which can't be sent with sendfile
+#define STREAM_CHUNK_SIZE 65536
+// puts in flight during putBatch
+#define PUT_BATCH_DEPTH 64
+
+/**
+ * Sends @p length bytes from @p fd over the socket of @p stream. Uses sendfile() if @p fd is a
+ * file and splice() if it is a pipe, and falls back to copying through userspace for everything
+ * else.
+ * 
+ * @return SOURCE_ERROR if @p fd ran out of data or couldn't be read, NETWORK_ERROR on other errors
+ *         and CLIENT_TIMEOUT if the socket wasn't writable in time
+ */
+static Beanstalkpp::Status sendFromFd(
+  Beanstalkpp::TokenizedStream &stream, int sock, int fd, size_t length
+) {
+  const Beanstalkpp::Failure failed(Beanstalkpp::ServerException::NETWORK_ERROR);
+  const Beanstalkpp::Failure exhausted(Beanstalkpp::ServerException::SOURCE_ERROR);
+  
+#ifdef __linux__
+  while(length > 0) {
+    ssize_t sent = sendfile(sock, fd, NULL, length);
+    if(sent > 0) {
+      length -= sent;
+      continue;
+    }
+    if(sent == 0) return exhausted;
+    if(errno == EINTR) continue;
+    if(errno == EAGAIN) {
+      Beanstalkpp::Status s = stream.wait(POLLOUT);
+      if(!s) return s;
+      continue;
+    }
+    if(errno == EINVAL || errno == ENOSYS) break;
+    return failed;
+  }
+  
+  while(length > 0) {
+    ssize_t sent = splice(fd, NULL, sock, NULL, length, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if(sent > 0) {
+      length -= sent;
+      continue;
+    }
+    if(sent == 0) return exhausted;
+    if(errno == EINTR) continue;
+    if(errno == EAGAIN) {
+      Beanstalkpp::Status s = stream.wait(POLLOUT);
+      if(!s) return s;
+      continue;
+    }
+    if(errno == EINVAL || errno == ENOSYS) break;
+    return failed;
+  }
+#endif
+  
+  vector<char> buf(std::min(length, (size_t)STREAM_CHUNK_SIZE));
+  while(length > 0) {
+    ssize_t read = ::read(fd, &buf[0], std::min(length, buf.size()));
+    if(read < 0 && errno == EINTR) continue;
+    if(read <= 0) return exhausted;
+    
+    for(ssize_t written = 0; written < read; ) {
+      ssize_t w = ::write(sock, &buf[written], read - written);
+      if(w < 0 && errno == EINTR) continue;
+      if(w < 0 && errno == EAGAIN) {
+        Beanstalkpp::Status s = stream.wait(POLLOUT);
+        if(!s) return s;
+        continue;
+      }
+      if(w <= 0) return failed;
+      written += w;
+    }
+    
+    length -= read;
+  }
+  
+  return Beanstalkpp::Status();
+}
+
+const size_t Beanstalkpp::Client::PUT_HEADER_SIZE;
+
+size_t Beanstalkpp::Client::formatPutHeader(char *header, size_t length) {
+  return formatPutHeader(header, length, DEFAULT_PRIORITY, DEFAULT_DELAY, DEFAULT_TTR);
+}
+
+size_t Beanstalkpp::Client::formatPutHeader(
+  char* header, size_t length, unsigned int priority, unsigned int delay, unsigned int ttr
+) {
+  return snprintf(header, PUT_HEADER_SIZE, "put %u %u %u %zu\r\n", priority, delay, ttr, length);
+}
 
 Beanstalkpp::Client::Client(const std::string& server, int port): 
   socket(io_service), tokenStream(socket) {
+  this->codec = NULL;
+  this->compressionThreshold = 0;
+  this->envelope = false;
+  this->contentType = 0;
   this->hostname = server;
   this->port = port;
+  this->resetTubes();
+  
+  this->reconnectAttempts = 0;
+  this->reconnectMinDelayMs = 10;
+  this->reconnectMaxDelayMs = 1000;
+  this->reconnects = 0;
+  this->reconnecting = false;
+  this->random.seed(std::chrono::steady_clock::now().time_since_epoch().count() ^ (uintptr_t)this);
+  
+  this->timeoutMs = 0;
+  this->deadline = std::chrono::steady_clock::time_point::max();
+  this->reserveWaitMs = 0;
+  
+#ifndef BEANSTALKPP_NO_METRICS
+  this->metrics.reset(new Metrics());
+  this->tokenStream.setMetrics(this->metrics.get());
+#endif
+  
+  this->observer = NULL;
+  this->event = NULL;
+  this->capture = NULL;
+  this->captureConnection = 0;
+}
+
+const Beanstalkpp::Metrics* Beanstalkpp::Client::getMetrics() const {
+  return this->metrics.get();
+}
+
+void Beanstalkpp::Client::setObserver(Beanstalkpp::CommandObserver* o) {
+  this->observer = o;
+}
+
+void Beanstalkpp::Client::setCapture(Beanstalkpp::WireCapture* c) {
+  this->capture = c;
+  this->captureConnection = c ? c->addConnection() : 0;
+  this->tokenStream.setCapture(c, this->captureConnection);
 }
 
 void Beanstalkpp::Client::connect() {
-  stringstream portStr;
-  portStr << this->port;
+  Status s = this->tryConnect();
+  if(s.error() == ServerException::CLIENT_TIMEOUT) s.get("connect");
+  if(!s) throw Exception(string("Unable to connect to beanstalk server ") + this->hostname);
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::tryConnect() {
+  Status s = this->connectEndpoints(false);
+  if(!s) return s;
   
-  tcp::resolver resolver(this->io_service);
-  tcp::resolver::query query(this->hostname, portStr.str());
-  tcp::resolver::iterator endpoint_iterator;
+  this->resetTubes();
+  
+  return Status();
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::connectEndpoints(bool resolve) {
+  boost::system::error_code error;
   
-  try {
-    endpoint_iterator = resolver.resolve(query);
-    socket.connect(*endpoint_iterator);
-  } catch(boost::system::system_error &e) {
-    throw Exception(string("Unable to connect to beanstalk server: ") + e.what());
+  if(resolve || this->endpoints.empty()) {
+    char portStr[16];
+    snprintf(portStr, sizeof(portStr), "%d", this->port);
+    
+    tcp::resolver resolver(this->io_service);
+    tcp::resolver::query query(this->hostname, portStr);
+    
+    // A failed lookup keeps the endpoints we had
+    tcp::resolver::iterator i = resolver.resolve(query, error);
+    if(!error) this->endpoints.assign(i, tcp::resolver::iterator());
+    if(this->endpoints.empty()) return Failure(ServerException::NETWORK_ERROR);
+  }
+  
+  Status s = Failure(ServerException::NETWORK_ERROR);
+  for(size_t i = 0; i < this->endpoints.size(); i++) {
+    s = this->connectEndpoint(this->endpoints[i]);
+    if(s) break;
   }
+  
+  return s;
 }
 
-int Beanstalkpp::Client::put(const std::string& data) {
-  stringstream str;
-  string reply;
+Beanstalkpp::Status Beanstalkpp::Client::connectEndpoint(const tcp::endpoint& endpoint) {
+  boost::system::error_code error;
+  this->socket.close(error);
   
-  str << "put " << DEFAULT_PRIORITY << " 0 " << DEFAULT_TTR << " " << data.length() << "\r\n";
-  str << data << "\r\n";
+  this->socket.open(endpoint.protocol(), error);
+  if(error) return Failure(ServerException::NETWORK_ERROR);
   
-  this->sendCommand(str);
-  reply = this->tokenStream.nextString();
+  // The buffer sizes limit the window scale, which is agreed on in the handshake
+  this->applyOptions();
   
-  // "INSERTED <id>\r\n" and "BURIED <id>\r\n" are accepted commands
-  if(reply.compare("INSERTED") == 0 || reply.compare("BURIED") == 0) {
-    uint64_t id = this->tokenStream.expectULL();
-    this->tokenStream.expectEol();
+  if(this->timeoutMs == 0 && this->deadline == std::chrono::steady_clock::time_point::max()) {
+    this->socket.connect(endpoint, error);
+    if(error) {
+      this->socket.close(error);
+      return Failure(ServerException::NETWORK_ERROR);
+    }
     
-    return id;
+    return Status();
+  }
+  
+  // asio's connect() blocks until the kernel gives up, so connect by hand, and wait for the socket
+  // to become writable
+  this->socket.non_blocking(true, error);
+  if(error) {
+    this->socket.close(error);
+    return Failure(ServerException::NETWORK_ERROR);
   }
   
-  if(reply.compare("JOB_TOO_BIG") == 0) {
-    this->tokenStream.expectEol();
+  int fd = this->socket.native_handle();
+  if(::connect(fd, endpoint.data(), endpoint.size()) < 0) {
+    if(errno != EINPROGRESS) {
+      this->socket.close(error);
+      return Failure(ServerException::NETWORK_ERROR);
+    }
+    
+    Status s = this->tokenStream.wait(POLLOUT);
+    if(!s) return s;
+    
+    int result = 0;
+    socklen_t size = sizeof(result);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &result, &size) < 0 || result != 0) {
+      this->socket.close(error);
+      return Failure(ServerException::NETWORK_ERROR);
+    }
+  }
+  
+  return Status();
+}
+
+void Beanstalkpp::Client::setOptions(const Beanstalkpp::ClientOptions& options) {
+  this->options = options;
+  this->tokenStream.setQuickAck(options.quickAck);
+  
+  if(this->socket.is_open()) this->applyOptions();
+}
+
+const Beanstalkpp::ClientOptions& Beanstalkpp::Client::getOptions() const {
+  return this->options;
+}
+
+bool Beanstalkpp::Client::getSocketOptions(Beanstalkpp::ClientOptions& options) {
+  if(!this->socket.is_open()) return false;
+  
+  int fd = this->socket.native_handle();
+  int value = 0;
+  socklen_t size = sizeof(value);
+  
+  // quickAck isn't a socket option, but is set after every read
+  options = ClientOptions();
+  options.quickAck = this->options.quickAck;
+  
+  if(getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, &size) == 0) options.noDelay = value != 0;
+  getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.sendBufferSize, &size);
+  getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options.receiveBufferSize, &size);
+  
+  value = 0;
+  getsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &value, &size);
+#ifdef TCP_KEEPIDLE
+  if(value) {
+    getsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &options.keepAliveIdle, &size);
+    getsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &options.keepAliveInterval, &size);
+    getsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &options.keepAliveCount, &size);
+  }
+#endif
+  
+#ifdef SO_BUSY_POLL
+  getsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &options.busyPoll, &size);
+#endif
+  
+  return true;
+}
+
+void Beanstalkpp::Client::applyOptions() {
+  const ClientOptions &o = this->options;
+  int fd = this->socket.native_handle();
+  int value;
+  
+  // Failures are ignored: a socket without the tuning still works
+  value = o.noDelay;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+  
+  if(o.sendBufferSize > 0)
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &o.sendBufferSize, sizeof(o.sendBufferSize));
+  if(o.receiveBufferSize > 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &o.receiveBufferSize, sizeof(o.receiveBufferSize));
+  
+  value = o.keepAliveIdle > 0;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &value, sizeof(value));
+#ifdef TCP_KEEPIDLE
+  if(o.keepAliveIdle > 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &o.keepAliveIdle, sizeof(o.keepAliveIdle));
+  if(o.keepAliveIdle > 0 && o.keepAliveInterval > 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &o.keepAliveInterval, sizeof(o.keepAliveInterval));
+  if(o.keepAliveIdle > 0 && o.keepAliveCount > 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &o.keepAliveCount, sizeof(o.keepAliveCount));
+#endif
+  
+#ifdef SO_BUSY_POLL
+  if(o.busyPoll > 0) setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &o.busyPoll, sizeof(o.busyPoll));
+#endif
+}
+
+void Beanstalkpp::Client::setTimeout(unsigned int ms) {
+  this->timeoutMs = ms;
+  this->applyDeadline();
+}
+
+void Beanstalkpp::Client::applyDeadline() {
+  this->tokenStream.setDeadline(this->timeoutMs, this->deadline);
+  
+  // Once non-blocking, the socket stays so until the next connect, which saves toggling it for
+  // every Deadline
+  if(
+    this->socket.is_open() &&
+    (this->timeoutMs > 0 || this->deadline != std::chrono::steady_clock::time_point::max())
+  ) {
+    boost::system::error_code ignored;
+    this->socket.non_blocking(true, ignored);
+  }
+}
+
+void Beanstalkpp::Client::setReconnect(
+  unsigned int attempts, unsigned int minDelayMs, unsigned int maxDelayMs
+) {
+  this->reconnectAttempts = attempts;
+  this->reconnectMinDelayMs = minDelayMs;
+  this->reconnectMaxDelayMs = maxDelayMs;
+}
+
+void Beanstalkpp::Client::reconnect() {
+  if(!this->tryReconnect())
+    throw Exception(string("Unable to reconnect to beanstalk server ") + this->hostname);
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::tryReconnect() {
+  // What to restore. The tube and watch list are what the last commands asked for, even if they
+  // failed.
+  string tube = this->tubeName;
+  set<string> watched = this->watched;
+  
+  boost::system::error_code error;
+  this->socket.close(error);
+  this->tokenStream.reset();
+  this->reconnecting = true;
+  
+  Status s = Failure(ServerException::NETWORK_ERROR);
+  unsigned int delay = this->reconnectMinDelayMs;
+  
+  for(unsigned int attempt = 0; attempt < std::max(1u, this->reconnectAttempts); attempt++) {
+    // The first attempt is immediate, the others sleep a random share of a growing delay
+    if(attempt > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(
+        std::uniform_int_distribution<unsigned int>(0, delay)(this->random)
+      ));
+      delay = std::min(this->reconnectMaxDelayMs, delay * 2);
+    }
+    
+    // Once the cached endpoints have failed, look up the server again in case it moved
+    s = this->connectEndpoints(attempt == 1);
+    if(s) {
+      this->resetTubes();
+      s = this->tryUse(tube);
+    }
+    if(s && !watched.empty()) {
+      Result<size_t> w = this->trySetWatchList(watched);
+      if(!w) s = w.failure();
+    }
+    
+    if(s) break;
+  }
+  
+  this->reconnecting = false;
+  if(s) this->reconnects++;
+  
+  return s;
+}
+
+uint64_t Beanstalkpp::Client::getReconnects() const {
+  return this->reconnects;
+}
+
+void Beanstalkpp::Client::resetTubes() {
+  this->tubeName = "default";
+  this->watched.clear();
+  this->watched.insert("default");
+  this->tubeKnown = true;
+  this->watchedKnown = true;
+  this->watchReplies = 0;
+}
+
+const std::string& Beanstalkpp::Client::getUsedTube() const {
+  return this->tubeName;
+}
+
+const std::set<std::string>& Beanstalkpp::Client::getWatchedTubes() const {
+  return this->watched;
+}
+
+Beanstalkpp::ClientOptions::ClientOptions():
+  noDelay(true), sendBufferSize(0), receiveBufferSize(0), keepAliveIdle(0), keepAliveInterval(0),
+  keepAliveCount(0), busyPoll(0), quickAck(false) {}
+
+Beanstalkpp::BatchPut::BatchPut(const std::string& tube, const std::string& data):
+  tube(tube), data(data), priority(DEFAULT_PRIORITY), delay(DEFAULT_DELAY), ttr(DEFAULT_TTR),
+  jobId(0) {}
+
+Beanstalkpp::BatchPut::BatchPut(
+  const std::string& tube, const std::string& data, unsigned int priority, unsigned int delay,
+  unsigned int ttr
+): tube(tube), data(data), priority(priority), delay(delay), ttr(ttr), jobId(0) {}
+
+int Beanstalkpp::Client::put(const std::string& data) {
+  Result<job_id_t> r = this->tryPut(data);
+  
+  if(!r && r.error() == ServerException::JOB_TOO_BIG) {
     stringstream err;
     err << "Job too big (" << data.length() << "b)";
     throw ServerException(ServerException::JOB_TOO_BIG, err.str());
   }
   
-  // We got some other unknown command
-  throw ServerException(ServerException::BAD_FORMAT, "Received bad reply to put: " + reply);
+  return r.get("put");
+}
+
+void Beanstalkpp::Client::setCompression(const Beanstalkpp::Codec* codec, size_t threshold) {
+  this->codec = codec;
+  this->compressionThreshold = threshold;
+}
+
+void Beanstalkpp::Client::setEnvelope(bool enabled, uint16_t contentType) {
+  this->envelope = enabled;
+  this->contentType = contentType;
+}
+
+const Beanstalkpp::Codec* Beanstalkpp::Client::getCompression() const {
+  return this->codec;
+}
+
+bool Beanstalkpp::Client::getEnvelope() const {
+  return this->envelope;
+}
+
+Beanstalkpp::Result<Beanstalkpp::job_id_t> Beanstalkpp::Client::tryPut(const std::string& data) {
+  return this->tryPut(data.data(), data.length());
+}
+
+Beanstalkpp::Result<Beanstalkpp::job_id_t> Beanstalkpp::Client::tryPut(const char* data, size_t size) {
+  return this->tryPut(data, size, DEFAULT_PRIORITY, DEFAULT_DELAY, DEFAULT_TTR);
+}
+
+Beanstalkpp::job_id_t Beanstalkpp::Client::put(
+  const std::string& data, unsigned int priority, unsigned int delay, unsigned int ttr
+) {
+  return this->tryPut(data, priority, delay, ttr).get("put");
+}
+
+Beanstalkpp::Result<Beanstalkpp::job_id_t> Beanstalkpp::Client::tryPut(
+  const std::string& data, unsigned int priority, unsigned int delay, unsigned int ttr
+) {
+  return this->tryPut(data.data(), data.length(), priority, delay, ttr);
+}
+
+Beanstalkpp::Result<Beanstalkpp::job_id_t> Beanstalkpp::Client::tryPut(
+  const char* data, size_t size, unsigned int priority, unsigned int delay, unsigned int ttr
+) {
+  return this->withReconnect([&]() -> Result<job_id_t> {
+    CommandScope scope(*this, Metrics::PUT, 0, this->tubeName.c_str());
+    
+    Status s = this->sendPut(data, size, priority, delay, ttr);
+    if(!s) return s.failure();
+    
+    return this->tryReadPutReply();
+  }, false);
+}
+
+size_t Beanstalkpp::Client::putBatch(std::vector<BatchPut>& jobs) {
+  return this->tryPutBatch(jobs).get("put");
+}
+
+Beanstalkpp::Result<size_t> Beanstalkpp::Client::tryPutBatch(std::vector<BatchPut>& jobs) {
+  // Group the jobs by tube, keeping their order within a tube, with the tube in use first
+  vector<BatchPut*> order;
+  order.reserve(jobs.size());
+  for(size_t i = 0; i < jobs.size(); i++)
+    order.push_back(&jobs[i]);
+  
+  const string current = this->tubeKnown ? this->tubeName : string();
+  std::stable_sort(order.begin(), order.end(), [&current](const BatchPut *a, const BatchPut *b) {
+    if((a->tube == current) != (b->tube == current)) return a->tube == current;
+    return a->tube < b->tube;
+  });
+  
+  size_t put = 0;
+  for(size_t i = 0; i < jobs.size(); i++)
+    jobs[i].jobId = 0;
+  
+  Status failed;
+  for(size_t first = 0; failed && first < order.size();) {
+    size_t last = first;
+    while(last < order.size() && order[last]->tube == order[first]->tube) last++;
+    
+    Status s = this->tryUse(order[first]->tube);
+    if(!s) return s.failure();
+    
+    // After a failure nothing more is sent, but every reply in flight is still read to keep the
+    // connection in sync
+    for(size_t sent = first, read = first; read < sent || (failed && read < last); read++) {
+      for(; failed && sent < last && sent - read < PUT_BATCH_DEPTH; sent++) {
+        const BatchPut &j = *order[sent];
+        s = this->sendPut(j.data.data(), j.data.size(), j.priority, j.delay, j.ttr);
+        if(!s) return s.failure();
+      }
+      
+      Result<job_id_t> id = this->tryReadPutReply();
+      if(id) {
+        order[read]->jobId = id.value();
+        put++;
+      } else if(
+        id.error() == ServerException::NETWORK_ERROR ||
+        id.error() == ServerException::CLIENT_TIMEOUT
+      ) {
+        return id.failure();
+      } else if(id.error() != ServerException::JOB_TOO_BIG && failed) {
+        failed = id.failure();
+      }
+    }
+    
+    first = last;
+  }
+  
+  if(!failed) return failed.failure();
+  return put;
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::trySendPut(const std::string& data) {
+  return this->sendPut(data.data(), data.length(), DEFAULT_PRIORITY, DEFAULT_DELAY, DEFAULT_TTR);
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::trySendPut(const char* data, size_t size) {
+  return this->sendPut(data, size, DEFAULT_PRIORITY, DEFAULT_DELAY, DEFAULT_TTR);
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::trySendPut(
+  const char* data, size_t size, unsigned int priority, unsigned int delay, unsigned int ttr
+) {
+  return this->sendPut(data, size, priority, delay, ttr);
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::sendPut(
+  const char* data, size_t size, unsigned int priority, unsigned int delay, unsigned int ttr
+) {
+  // Payloads which aren't compressed still get a header, so that consumers with compression
+  // enabled never take their first bytes for one
+  if(
+    this->codec && (
+      (size >= this->compressionThreshold && this->codec->encode(data, size, this->compressed)) ||
+      Codec::store(data, size, this->compressed)
+    )
+  ) {
+    data = this->compressed.data();
+    size = this->compressed.size();
+  }
+  
+  char envelope[Envelope::SIZE];
+  size_t envelopeLength = 0;
+  if(this->envelope) {
+    Envelope::write(envelope, this->contentType, data, size);
+    envelopeLength = Envelope::SIZE;
+  }
+  
+  char header[PUT_HEADER_SIZE];
+  size_t headerLength = formatPutHeader(header, envelopeLength + size, priority, delay, ttr);
+  
+  // Send the header, the payload and the trailing \r\n without copying the payload
+  boost::array<boost::asio::const_buffer, 4> buffers = {{
+    boost::asio::buffer(header, headerLength),
+    boost::asio::buffer(envelope, envelopeLength),
+    boost::asio::buffer(data, size),
+    boost::asio::buffer("\r\n", 2)
+  }};
+  
+  return this->send(buffers);
+}
+
+Beanstalkpp::job_id_t Beanstalkpp::Client::put(int fd, size_t length) {
+  return this->tryPut(fd, length).get("put");
+}
+
+Beanstalkpp::Result<Beanstalkpp::job_id_t> Beanstalkpp::Client::tryPut(int fd, size_t length) {
+  // Envelopes can't be written, as their checksum covers a payload which is only read once
+  if(this->envelope) return Failure(ServerException::BAD_FORMAT);
+  
+  return this->withReconnect([&]() -> Result<job_id_t> {
+    CommandScope scope(*this, Metrics::PUT, 0, this->tubeName.c_str());
+    
+    Status s = this->sendPutHeader(length);
+    if(!s) return s.failure();
+    
+    if(this->capture) {
+      // sendfile() and splice() bypass userspace, so captured payloads are copied through send()
+      vector<char> buf(std::min(length, (size_t)STREAM_CHUNK_SIZE));
+      while(length > 0) {
+        ssize_t read = ::read(fd, &buf[0], std::min(length, buf.size()));
+        if(read < 0 && errno == EINTR) continue;
+        if(read <= 0) return this->failSource();
+    
+        s = this->send(boost::asio::buffer(&buf[0], read));
+        if(!s) {
+          boost::system::error_code ignored;
+          this->socket.close(ignored);
+          return s.failure();
+        }
+    
+        length -= read;
+      }
+    
+      return this->finishPut();
+    }
+    
+    s = sendFromFd(this->tokenStream, this->socket.native_handle(), fd, length);
+    if(!s) {
+      // Timeouts were recorded, and closed the socket, when they happened
+      if(s.error() == ServerException::CLIENT_TIMEOUT) return s.failure();
+      if(s.error() == ServerException::SOURCE_ERROR) return this->failSource();
+      
+      boost::system::error_code ignored;
+      this->socket.close(ignored);
+      return this->fail(ServerException::NETWORK_ERROR);
+    }
+    
+#ifndef BEANSTALKPP_NO_METRICS
+    if(this->metrics) this->metrics->recordSent(length);
+#endif
+    
+    if(this->event) {
+      this->event->time = CommandEvent::now();
+      this->observer->bytesWritten(*this->event, length);
+    }
+    
+    return this->finishPut();
+  }, false);
+}
+
+Beanstalkpp::job_id_t Beanstalkpp::Client::put(std::istream& in, size_t length) {
+  return this->tryPut(in, length).get("put");
+}
+
+Beanstalkpp::Result<Beanstalkpp::job_id_t> Beanstalkpp::Client::tryPut(
+  std::istream& in, size_t length
+) {
+  if(this->envelope) return Failure(ServerException::BAD_FORMAT);
+  
+  return this->withReconnect([&]() -> Result<job_id_t> {
+    CommandScope scope(*this, Metrics::PUT, 0, this->tubeName.c_str());
+    
+    Status s = this->sendPutHeader(length);
+    if(!s) return s.failure();
+    
+    vector<char> buf(std::min(length, (size_t)STREAM_CHUNK_SIZE));
+    while(length > 0) {
+      in.read(&buf[0], std::min(length, buf.size()));
+      size_t read = in.gcount();
+    
+      if(read == 0) return this->failSource();
+    
+      s = this->send(boost::asio::buffer(&buf[0], read));
+      if(!s) {
+        boost::system::error_code ignored;
+        this->socket.close(ignored);
+        return s.failure();
+      }
+    
+      length -= read;
+    }
+    
+    return this->finishPut();
+  }, false);
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::sendPutHeader(size_t length) {
+  char header[PUT_HEADER_SIZE];
+  
+  char stored[Codec::HEADER_SIZE];
+  if(!this->codec || !Codec::storedHeader(length, stored))
+    return this->sendCommand(header, formatPutHeader(header, length));
+  
+  // Streamed payloads aren't compressed, but are stored behind a header like small ones in put
+  boost::array<boost::asio::const_buffer, 2> buffers = {{
+    boost::asio::buffer(header, formatPutHeader(header, Codec::HEADER_SIZE + length)),
+    boost::asio::buffer(stored, Codec::HEADER_SIZE)
+  }};
+  
+  return this->send(buffers);
+}
+
+Beanstalkpp::Result<Beanstalkpp::job_id_t> Beanstalkpp::Client::finishPut() {
+  Status s = this->sendCommand("\r\n");
+  if(!s) return s.failure();
+  
+  return this->tryReadPutReply();
+}
+
+Beanstalkpp::Result<Beanstalkpp::job_id_t> Beanstalkpp::Client::tryReadPutReply() {
+  Status s = this->tokenStream.tryNextToken();
+  if(!s) return s.failure();
+  
+  // "INSERTED <id>\r\n" and "BURIED <id>\r\n" are accepted replies
+  const string &reply = this->tokenStream.lastToken();
+  if(reply.compare("INSERTED") != 0 && reply.compare("BURIED") != 0)
+    return this->replyError();
+  
+  Result<uint64_t> id = this->tokenStream.tryExpectULL();
+  if(!id) return id.failure();
+  
+  s = this->tokenStream.tryExpectEol();
+  if(!s) return s.failure();
+  
+  if(this->event) this->event->jobId = id.value();
+  
+  return id.value();
 }
 
 void Beanstalkpp::Client::use(const std::string& tubeName) {
-  stringstream str;
-  string reply;
-  string expectedReply = "USING " + tubeName + "\r\n";
+  this->tryUse(tubeName).get("use");
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::tryUse(const std::string& tubeName) {
+  if(this->tubeKnown && tubeName == this->tubeName) return Status();
+  
+  return this->withReconnect([&]() { return this->useCommand(tubeName); });
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::useCommand(const std::string& tubeName) {
+  CommandScope scope(*this, Metrics::USE, 0, tubeName.c_str());
   
+  // Known again once the server has confirmed the new tube
   this->tubeName = tubeName;
+  this->tubeKnown = false;
+  
+  boost::array<boost::asio::const_buffer, 3> buffers = {{
+    boost::asio::buffer("use ", 4),
+    boost::asio::buffer(tubeName),
+    boost::asio::buffer("\r\n", 2)
+  }};
+  
+  Status s = this->send(buffers);
+  if(!s) return s;
+  
+  s = this->expectReply("USING");
+  if(!s) return s;
   
-  str << "use " << this->tubeName << "\r\n";
+  s = this->tokenStream.tryExpectString(tubeName.c_str());
+  if(!s) return s;
   
-  this->sendCommand(str);
+  s = this->tokenStream.tryExpectEol();
+  if(!s) return s;
   
-  this->tokenStream.expectString("USING");
-  this->tokenStream.expectString(tubeName);
-  this->tokenStream.expectEol();
+  this->tubeKnown = true;
+  return Status();
 }
 
-void Beanstalkpp::Client::sendCommand(const std::stringstream& str) {
+Beanstalkpp::Status Beanstalkpp::Client::sendCommand(const char *cmd, size_t length) {
+  return this->send(boost::asio::buffer(cmd, length));
+}
+
+template<class ConstBufferSequence>
+Beanstalkpp::Status Beanstalkpp::Client::send(const ConstBufferSequence& buffers) {
   boost::system::error_code error;
   
-  boost::asio::write(socket, boost::asio::buffer(str.str()), boost::asio::transfer_all(), error);
+  size_t sent = boost::asio::write(this->socket, buffers, boost::asio::transfer_all(), error);
+  
+  if(error == boost::asio::error::would_block) {
+    // Only sockets with a timeout or deadline are non-blocking. Wait, then send what's left.
+    vector<boost::asio::const_buffer> rest(
+      boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers)
+    );
+    size_t skip = sent;
+    
+    while(error == boost::asio::error::would_block) {
+      while(skip > 0 && skip >= rest.front().size()) {
+        skip -= rest.front().size();
+        rest.erase(rest.begin());
+      }
+      rest.front() += skip;
+      
+      Status s = this->tokenStream.wait(POLLOUT);
+      if(!s) return s;
+      
+      skip = boost::asio::write(this->socket, rest, boost::asio::transfer_all(), error);
+      sent += skip;
+    }
+  }
+  
   if(error) 
-    throw Exception("Unable to write to socket");
+    return this->fail(ServerException::NETWORK_ERROR);
+  
+  if(this->capture)
+    this->capture->record(WireCapture::SENT, this->captureConnection, buffers);
+  
+#ifndef BEANSTALKPP_NO_METRICS
+  if(this->metrics) this->metrics->recordSent(sent);
+#endif
+  
+  if(this->event) {
+    this->event->time = CommandEvent::now();
+    this->observer->bytesWritten(*this->event, sent);
+  }
+  
+  return Status();
+}
+
+Beanstalkpp::Failure Beanstalkpp::Client::fail(Beanstalkpp::ServerException::Reason r) {
+#ifndef BEANSTALKPP_NO_METRICS
+  if(this->metrics) this->metrics->recordError(r);
+#endif
+  
+  // A reserve which timed out ended normally, without a job, so its scope reports it as parsed
+  if(this->event && r != ServerException::TIMED_OUT) {
+    this->event->failed = true;
+    this->event->time = CommandEvent::now();
+    this->observer->commandFailed(*this->event, r);
+  }
+  
+  return Failure(r);
+}
+
+Beanstalkpp::Failure Beanstalkpp::Client::failSource() {
+  boost::system::error_code ignored;
+  this->socket.close(ignored);
+  
+  return this->fail(ServerException::SOURCE_ERROR);
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::readJob(
+  const char* reply, Beanstalkpp::job_id_t& jobId, size_t& payloadSize, char*& payload
+) {
+  Status s = this->expectReply(reply);
+  if(!s) return s;
+  
+  Result<uint64_t> id = this->tokenStream.tryExpectULL();
+  if(!id) return id.failure();
+  
+  Result<unsigned int> size = this->tokenStream.tryExpectInt();
+  if(!size) return size.failure();
+  
+  s = this->tokenStream.tryExpectEol();
+  if(!s) return s;
+  
+  jobId = id.value();
+  payloadSize = size.value();
+  if(this->event) this->event->jobId = jobId;
+  payload = new char[payloadSize];
+  
+  s = this->tokenStream.tryReadChunk(payload, payloadSize);
+  if(s) s = this->tokenStream.tryExpectEol();
+  if(!s) {
+    delete[] payload;
+    return s;
+  }
+  
+  return Status();
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::expectReply(const char* reply) {
+  Status s = this->tokenStream.tryExpectString(reply);
+  if(
+    !s && s.error() != ServerException::NETWORK_ERROR &&
+    s.error() != ServerException::CLIENT_TIMEOUT
+  )
+    return this->replyError();
+  
+  return s;
+}
+
+Beanstalkpp::Failure Beanstalkpp::Client::replyError() {
+  const string &reply = this->tokenStream.lastToken();
+  ServerException::Reason reason = ServerException::fromReply(reply);
+  
+  // Error replies are a single token. Anything else leaves the stream in an unknown state.
+  if(reason != ServerException::BAD_FORMAT || reply.compare("BAD_FORMAT") == 0)
+    this->tokenStream.tryExpectEol();
+  
+  return this->fail(reason);
 }
 
 Beanstalkpp::Job Beanstalkpp::Client::reserve() {
   return this->reserve<Job>();
 }
 
+Beanstalkpp::Result<Beanstalkpp::Job> Beanstalkpp::Client::tryReserve() {
+  return this->tryReserve<Job>();
+}
+
+Beanstalkpp::job_id_t Beanstalkpp::Client::reserveInto(Beanstalkpp::PayloadSink& sink) {
+  return this->tryReserveInto(sink).get("reserve");
+}
+
+Beanstalkpp::Result<Beanstalkpp::job_id_t> Beanstalkpp::Client::tryReserveInto(
+  Beanstalkpp::PayloadSink& sink
+) {
+  return this->withReconnect([&]() -> Result<job_id_t> {
+    CommandScope scope(*this, Metrics::RESERVE);
+    
+    Status s = this->trySendReserve(-1);
+    if(!s) return s.failure();
+    
+    return this->tryReadReserve(sink);
+  }, false);
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::trySendReserve(int timeout) {
+  this->reserveWaitMs = timeout < 0 || timeout > INT_MAX / 1000 ? -1 : timeout * 1000;
+  if(timeout < 0) return this->sendCommand("reserve\r\n");
+  
+  char cmd[64];
+  
+  return this->sendCommand(cmd, snprintf(cmd, sizeof(cmd), "reserve-with-timeout %d\r\n", timeout));
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::trySendReserveJob(Beanstalkpp::job_id_t jobId) {
+  this->reserveWaitMs = 0;
+  
+  char cmd[64];
+  
+  return this->sendCommand(
+    cmd, snprintf(cmd, sizeof(cmd), "reserve-job %llu\r\n", (unsigned long long)jobId)
+  );
+}
+
+Beanstalkpp::Result<Beanstalkpp::job_id_t> Beanstalkpp::Client::tryReadReserve(
+  Beanstalkpp::PayloadSink& sink
+) {
+  this->tokenStream.setServerWait(this->reserveWaitMs);
+  Status s = this->expectReply("RESERVED");
+  this->tokenStream.setServerWait(0);
+  if(!s) return s.failure();
+  
+  Result<uint64_t> id = this->tokenStream.tryExpectULL();
+  if(!id) return id.failure();
+  
+  Result<unsigned int> size = this->tokenStream.tryExpectInt();
+  if(!size) return size.failure();
+  
+  s = this->tokenStream.tryExpectEol();
+  if(!s) return s.failure();
+  
+  if(this->event) this->event->jobId = id.value();
+  sink.begin(id.value(), size.value());
+  
+  s = this->tokenStream.tryReadChunk(sink, size.value());
+  if(s) s = this->tokenStream.tryExpectEol();
+  if(!s) return s.failure();
+  
+  return id.value();
+}
+
+Beanstalkpp::Result<bool> Beanstalkpp::Client::tryReadReserve(Beanstalkpp::job_p_t& jobPtr) {
+  job_id_t jobId;
+  size_t payloadSize;
+  char *payload;
+  
+  Status s = this->readReserved(jobId, payloadSize, payload);
+  if(!s) {
+    if(s.error() == ServerException::TIMED_OUT) return false;
+    return s.failure();
+  }
+  
+  jobPtr.reset(new Job(*this, jobId, payloadSize, payload));
+  return true;
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::readReserved(
+  Beanstalkpp::job_id_t& jobId, size_t& payloadSize, char*& payload
+) {
+  this->tokenStream.setServerWait(this->reserveWaitMs);
+  Status s = this->readJob("RESERVED", jobId, payloadSize, payload);
+  this->tokenStream.setServerWait(0);
+  
+#ifndef BEANSTALKPP_NO_METRICS
+  Envelope envelope;
+  if(s && this->envelope && this->metrics && envelope.parse(payload, payloadSize)) {
+    // The producer's clock may be ahead of ours
+    uint64_t now = Envelope::now();
+    uint64_t queued = now > envelope.timestamp ? now - envelope.timestamp : 0;
+    this->metrics->recordQueueLatency(queued * 1000);
+  }
+#endif
+  
+  return s;
+}
 
 bool Beanstalkpp::Client::reserveWithTimeout(Beanstalkpp::job_p_t& jobPtr, int timeout) {
   return this->reserveWithTimeout<Job>(jobPtr, timeout);
 }
 
+Beanstalkpp::Result<bool> Beanstalkpp::Client::tryReserveWithTimeout(
+  Beanstalkpp::job_p_t& jobPtr, int timeout
+) {
+  return this->tryReserveWithTimeout<Job>(jobPtr, timeout);
+}
+
 bool Beanstalkpp::Client::peekReady(Beanstalkpp::job_p_t& jobPtr) {
+  return this->tryPeekReady(jobPtr).get("peek-ready");
+}
+
+Beanstalkpp::Result<bool> Beanstalkpp::Client::tryPeekReady(Beanstalkpp::job_p_t& jobPtr) {
+  return this->withReconnect([&]() {
+    CommandScope scope(*this, Metrics::PEEK);
+    return this->peekCommand("peek-ready\r\n", 12, jobPtr);
+  });
+}
+
+bool Beanstalkpp::Client::peekBuried(Beanstalkpp::job_p_t& jobPtr) {
+  return this->tryPeekBuried(jobPtr).get("peek-buried");
+}
+
+Beanstalkpp::Result<bool> Beanstalkpp::Client::tryPeekBuried(Beanstalkpp::job_p_t& jobPtr) {
+  return this->withReconnect([&]() {
+    CommandScope scope(*this, Metrics::PEEK);
+    return this->peekCommand("peek-buried\r\n", 13, jobPtr);
+  });
+}
+
+bool Beanstalkpp::Client::peekDelayed(Beanstalkpp::job_p_t& jobPtr) {
+  return this->tryPeekDelayed(jobPtr).get("peek-delayed");
+}
+
+Beanstalkpp::Result<bool> Beanstalkpp::Client::tryPeekDelayed(Beanstalkpp::job_p_t& jobPtr) {
+  return this->withReconnect([&]() {
+    CommandScope scope(*this, Metrics::PEEK);
+    return this->peekCommand("peek-delayed\r\n", 14, jobPtr);
+  });
+}
+
+bool Beanstalkpp::Client::peek(Beanstalkpp::job_id_t jobId, Beanstalkpp::job_p_t& jobPtr) {
+  return this->tryPeek(jobId, jobPtr).get("peek");
+}
+
+Beanstalkpp::Result<bool> Beanstalkpp::Client::tryPeek(
+  Beanstalkpp::job_id_t jobId, Beanstalkpp::job_p_t& jobPtr
+) {
+  return this->withReconnect([&]() {
+    CommandScope scope(*this, Metrics::PEEK, jobId);
+    char cmd[64];
+    
+    return this->peekCommand(
+      cmd, snprintf(cmd, sizeof(cmd), "peek %llu\r\n", (unsigned long long)jobId), jobPtr
+    );
+  });
+}
+
+Beanstalkpp::Result<bool> Beanstalkpp::Client::peekCommand(
+  const char* cmd, size_t length, Beanstalkpp::job_p_t& jobPtr
+) {
   job_id_t jobId;
   size_t payloadSize;
   char *payload;
-  std::stringstream s("peek-ready\r\n");
   
-  this->sendCommand(s);
+  Status s = this->sendCommand(cmd, length);
+  if(!s) return s.failure();
   
-  std::string response = this->tokenStream.nextString();
-  if(response.compare("NOT_FOUND") == 0) {
-    this->tokenStream.expectEol();
-    return false; 
+  s = this->readJob("FOUND", jobId, payloadSize, payload);
+  if(!s) {
+    if(s.error() == ServerException::NOT_FOUND) return false;
+    return s.failure();
   }
   
-  if(response.compare("FOUND") == 0) {
-    jobId = this->tokenStream.expectULL();
-    payloadSize = this->tokenStream.expectInt();
-    this->tokenStream.expectEol();
+  jobPtr.reset(new Job(*this, jobId, payloadSize, payload));
+  return true;
+}
+
+void Beanstalkpp::Client::del(const Beanstalkpp::Job& j) {
+  this->tryDel(j).get("delete");
+}
+
+void Beanstalkpp::Client::del(const Beanstalkpp::job_p_t& j) {
+  del(*j);
+}
+
+void Beanstalkpp::Client::del(Beanstalkpp::job_id_t jobId) {
+  this->tryDel(jobId).get("delete");
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::tryDel(const Beanstalkpp::Job& j) {
+  return this->tryDel(j.getJobId());
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::tryDel(Beanstalkpp::job_id_t jobId) {
+  return this->withReconnect([&]() -> Status {
+    CommandScope scope(*this, Metrics::DELETE, jobId);
     
-    payload = this->tokenStream.readChunk(payloadSize);
-    this->tokenStream.expectEol();
+    Status s = this->trySendDelete(jobId);
+    if(!s) return s;
     
-    boost::shared_ptr<Job> newJob(new Job(*this, jobId, payloadSize, payload));
-    jobPtr = newJob;
-    return true;
-  }
+    return this->tryReadDelete();
+  }, false);
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::trySendDelete(Beanstalkpp::job_id_t jobId) {
+  char cmd[64];
   
-  throw ServerException(
-    ServerException::BAD_FORMAT, 
-    "Didn't get FOUND or NOT_FOUND reply to peek-ready command"
+  return this->sendCommand(
+    cmd, snprintf(cmd, sizeof(cmd), "delete %llu\r\n", (unsigned long long)jobId)
   );
 }
 
-void Beanstalkpp::Client::del(const Beanstalkpp::Job& j) {
-  stringstream s;
-  s << "delete " << j.getJobId() << "\r\n";
-  this->sendCommand(s);
+Beanstalkpp::Status Beanstalkpp::Client::tryReadDelete() {
+  Status s = this->expectReply("DELETED");
+  if(!s) return s;
   
-  this->tokenStream.expectString("DELETED");
-  this->tokenStream.expectEol();
+  return this->tokenStream.tryExpectEol();
 }
 
-void Beanstalkpp::Client::del(const Beanstalkpp::job_p_t& j) {
-  del(*j);
+void Beanstalkpp::Client::bury(const Beanstalkpp::Job& j, int priority) {
+  this->tryBury(j, priority).get("bury");
 }
 
+Beanstalkpp::Status Beanstalkpp::Client::tryBury(const Beanstalkpp::Job& j, int priority) {
+  return this->withReconnect([&]() -> Status {
+    CommandScope scope(*this, Metrics::BURY, j.getJobId());
+    
+    Status s = this->trySendBury(j.getJobId(), priority);
+    if(!s) return s;
+    
+    return this->tryReadBury();
+  }, false);
+}
 
-void Beanstalkpp::Client::bury(const Beanstalkpp::Job& j, int priority) {
-  stringstream s;
-  s << "bury " << j.getJobId() << " " << priority << "\r\n";
-  this->sendCommand(s);
-  
-  string response = this->tokenStream.nextString();
-  this->tokenStream.expectEol();
+Beanstalkpp::Status Beanstalkpp::Client::trySendBury(
+  Beanstalkpp::job_id_t jobId, unsigned int priority
+) {
+  char cmd[64];
   
-  if(response.compare("NOT_FOUND") == 0)
-    throw ServerException(ServerException::NOT_FOUND, "Got not found in reply to bury");
+  return this->sendCommand(
+    cmd, snprintf(cmd, sizeof(cmd), "bury %llu %u\r\n", (unsigned long long)jobId, priority)
+  );
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::tryReadBury() {
+  Status s = this->expectReply("BURIED");
+  if(!s) return s;
   
-  if(response.compare("BURIED") != 0)
-    throw ServerException(ServerException::BAD_FORMAT, "Didn't get BURIED reply to bury command");
+  return this->tokenStream.tryExpectEol();
+}
+
+void Beanstalkpp::Client::kickJob(Beanstalkpp::job_id_t jobId) {
+  this->tryKickJob(jobId).get("kick-job");
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::tryKickJob(Beanstalkpp::job_id_t jobId) {
+  return this->withReconnect([&]() -> Status {
+    CommandScope scope(*this, Metrics::KICK, jobId);
+    
+    char cmd[64];
+    
+    Status s = this->sendCommand(
+      cmd, snprintf(cmd, sizeof(cmd), "kick-job %llu\r\n", (unsigned long long)jobId)
+    );
+    if(!s) return s;
+    
+    s = this->expectReply("KICKED");
+    if(!s) return s;
+    
+    return this->tokenStream.tryExpectEol();
+  }, false);
+}
+
+size_t Beanstalkpp::Client::kick(unsigned int bound) {
+  return this->tryKick(bound).get("kick");
+}
+
+Beanstalkpp::Result<size_t> Beanstalkpp::Client::tryKick(unsigned int bound) {
+  return this->withReconnect([&]() -> Result<size_t> {
+    CommandScope scope(*this, Metrics::KICK, 0, this->tubeName.c_str());
+    
+    char cmd[64];
+    
+    Status s = this->sendCommand(cmd, snprintf(cmd, sizeof(cmd), "kick %u\r\n", bound));
+    if(!s) return s.failure();
+    
+    s = this->expectReply("KICKED");
+    if(!s) return s.failure();
+    
+    Result<unsigned int> ret = this->tokenStream.tryExpectInt();
+    if(!ret) return ret.failure();
+    
+    s = this->tokenStream.tryExpectEol();
+    if(!s) return s.failure();
+    
+    return (size_t)ret.value();
+  }, false);
 }
 
 size_t Beanstalkpp::Client::watch(const std::string& tube) {
-  stringstream s("watch " + tube + "\r\n");
-  int ret;
+  return this->tryWatch(tube).get("watch");
+}
+
+Beanstalkpp::Result<size_t> Beanstalkpp::Client::tryWatch(const std::string& tube) {
+  if(this->watchedKnown && this->watched.count(tube)) return this->watched.size();
   
-  this->sendCommand(s);
-  this->tokenStream.expectString("WATCHING");
-  ret = this->tokenStream.expectInt();
-  this->tokenStream.expectEol();
+  Result<size_t> ret = this->withReconnect([&]() {
+    CommandScope scope(*this, Metrics::WATCH, 0, tube.c_str());
+    return this->watchCommand("watch ", 6, tube);
+  });
+  if(ret) this->watched.insert(tube);
   
   return ret;
 }
 
-vector< string > Beanstalkpp::Client::listTubes() {
-  vector<string> ret;
-  stringstream s("list-tubes\r\n");
-  
-  this->sendCommand(s);
-  
-  this->tokenStream.expectString("OK");
-  size_t payloadSize = this->tokenStream.expectInt();
-  this->tokenStream.expectEol();
-  
-  char* payload = this->tokenStream.readChunk(payloadSize);
-  
-  try {
-    string p;
-    p.assign(payload, payloadSize);
-    size_t lastHit = 4; // We ignore the first four characters, which are "---\n"
-    for(size_t i = lastHit; i < p.size(); i++) {
-      if(payload[i] == '\n') {
-        string str = p.substr(lastHit + 2, i - lastHit - 2);
-        
-        ret.push_back(str);
-        lastHit = i+1;
+size_t Beanstalkpp::Client::ignore(const std::string& tube) {
+  return this->tryIgnore(tube).get("ignore");
+}
+
+Beanstalkpp::Result<size_t> Beanstalkpp::Client::tryIgnore(const std::string& tube) {
+  if(this->watchedKnown && !this->watched.count(tube)) return this->watched.size();
+  
+  Result<size_t> ret = this->withReconnect([&]() {
+    CommandScope scope(*this, Metrics::IGNORE, 0, tube.c_str());
+    return this->watchCommand("ignore ", 7, tube);
+  });
+  if(ret) this->watched.erase(tube);
+  
+  return ret;
+}
+
+Beanstalkpp::Result<size_t> Beanstalkpp::Client::watchCommand(
+  const char *cmd, size_t length, const std::string& tube
+) {
+  // NOT_IGNORED leaves the watch list as it was, other failures leave it unknown
+  bool known = this->watchedKnown;
+  this->watchedKnown = false;
+  
+  boost::array<boost::asio::const_buffer, 3> buffers = {{
+    boost::asio::buffer(cmd, length),
+    boost::asio::buffer(tube),
+    boost::asio::buffer("\r\n", 2)
+  }};
+  
+  Status s = this->send(buffers);
+  if(!s) return s.failure();
+  
+  s = this->expectReply("WATCHING");
+  if(!s) {
+    this->watchedKnown = known && s.error() == ServerException::NOT_IGNORED;
+    return s.failure();
+  }
+  
+  Result<unsigned int> ret = this->tokenStream.tryExpectInt();
+  if(!ret) return ret.failure();
+  
+  s = this->tokenStream.tryExpectEol();
+  if(!s) return s.failure();
+  
+  this->watchedKnown = known;
+  return (size_t)ret.value();
+}
+
+size_t Beanstalkpp::Client::setWatchList(const std::set<std::string>& tubes) {
+  return this->trySetWatchList(tubes).get("watch");
+}
+
+Beanstalkpp::Result<size_t> Beanstalkpp::Client::trySetWatchList(
+  const std::set<std::string>& tubes
+) {
+  return this->withReconnect([&]() -> Result<size_t> {
+    CommandScope scope(*this, Metrics::WATCH);
+    
+    Status s = this->trySendWatchList(tubes);
+    if(!s) return s.failure();
+    
+    return this->tryReadWatchList();
+  });
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::trySendWatchList(const std::set<std::string>& tubes) {
+  if(tubes.empty()) return Failure(ServerException::NOT_IGNORED);
+  
+  if(!this->watchedKnown) {
+    Result<vector<string> > current = this->listCommand("list-tubes-watched\r\n", 20);
+    if(!current) return current.failure();
+    
+    this->watched = set<string>(current.value().begin(), current.value().end());
+    this->watchedKnown = true;
+  }
+  
+  // Watch the new tubes before ignoring the old ones, so the list never runs empty
+  string commands;
+  for(set<string>::const_iterator i = tubes.begin(); i != tubes.end(); i++) {
+    if(this->watched.count(*i)) continue;
+    
+    commands += "watch " + *i + "\r\n";
+    this->watchReplies++;
+  }
+  
+  for(set<string>::const_iterator i = this->watched.begin(); i != this->watched.end(); i++) {
+    if(tubes.count(*i)) continue;
+    
+    commands += "ignore " + *i + "\r\n";
+    this->watchReplies++;
+  }
+  
+  // Assume success, tryReadWatchList marks the list unknown otherwise
+  this->watched = tubes;
+  if(commands.empty()) return Status();
+  
+  this->watchedKnown = false;
+  return this->sendCommand(commands.data(), commands.size());
+}
+
+Beanstalkpp::Result<size_t> Beanstalkpp::Client::tryReadWatchList() {
+  Status failed;
+  size_t count = this->watched.size();
+  
+  // Read every reply, even after an error, to keep the connection in sync
+  for(; this->watchReplies > 0; this->watchReplies--) {
+    Status s = this->expectReply("WATCHING");
+    
+    if(s) {
+      Result<unsigned int> ret = this->tokenStream.tryExpectInt();
+      if(ret) {
+        count = ret.value();
+        s = this->tokenStream.tryExpectEol();
+      } else {
+        s = ret.failure();
       }
     }
-    delete[] payload;
-  } catch(...) {
-    delete[] payload;
-    throw;
+    
+    if(!s) {
+      if(
+        s.error() == ServerException::NETWORK_ERROR ||
+        s.error() == ServerException::CLIENT_TIMEOUT
+      ) {
+        this->watchReplies = 0;
+        return s.failure();
+      }
+      
+      if(failed) failed = s;
+    }
+  }
+  
+  if(!failed) return failed.failure();
+  
+  this->watchedKnown = true;
+  return count;
+}
+
+vector< string > Beanstalkpp::Client::listTubes() {
+  return this->tryListTubes().get("list-tubes");
+}
+
+Beanstalkpp::Result<vector< string > > Beanstalkpp::Client::tryListTubes() {
+  return this->withReconnect([&]() {
+    CommandScope scope(*this, Metrics::LIST_TUBES);
+    return this->listCommand("list-tubes\r\n", 12);
+  });
+}
+
+vector< string > Beanstalkpp::Client::listTubesWatched() {
+  return this->tryListTubesWatched().get("list-tubes-watched");
+}
+
+Beanstalkpp::Result<vector< string > > Beanstalkpp::Client::tryListTubesWatched() {
+  return this->withReconnect([&]() {
+    CommandScope scope(*this, Metrics::LIST_TUBES);
+    return this->listCommand("list-tubes-watched\r\n", 20);
+  });
+}
+
+Beanstalkpp::Result<vector< string > > Beanstalkpp::Client::listCommand(
+  const char *cmd, size_t length
+) {
+  Status s = this->sendCommand(cmd, length);
+  if(!s) return s.failure();
+  
+  s = this->readYaml();
+  if(!s) return s.failure();
+  
+  return parseYamlList(this->yaml.data(), this->yaml.size());
+}
+
+Beanstalkpp::ServerStats Beanstalkpp::Client::stats() {
+  return this->tryStats().get("stats");
+}
+
+Beanstalkpp::Result<Beanstalkpp::ServerStats> Beanstalkpp::Client::tryStats() {
+  return this->withReconnect([&]() -> Result<ServerStats> {
+    CommandScope scope(*this, Metrics::STATS);
+    
+    Status s = this->trySendStats();
+    if(!s) return s.failure();
+    
+    return this->tryReadStats();
+  });
+}
+
+Beanstalkpp::Result<bool> Beanstalkpp::Client::tryWaitReply(int timeoutMs) {
+  vector<Client*> clients(1, this);
+  
+  Result<int> ready = tryWaitReply(clients, timeoutMs);
+  if(!ready) return ready.failure();
+  
+  return ready.value() == 0;
+}
+
+Beanstalkpp::Result<int> Beanstalkpp::Client::tryWaitReply(
+  const std::vector<Client*>& clients, int timeoutMs
+) {
+  vector<pollfd> fds(clients.size());
+  
+  for(size_t i = 0; i < clients.size(); i++) {
+    if(clients[i]->tokenStream.buffered() > 0) return (int)i;
+    
+    fds[i].fd = clients[i]->socket.native_handle();
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
   }
   
+  int ret;
+  do {
+    ret = poll(fds.data(), fds.size(), timeoutMs);
+  } while(ret < 0 && errno == EINTR);
+  
+  if(ret < 0) return Failure(ServerException::NETWORK_ERROR);
+  
+  // Errors and hangups count as replies, and are reported by the read
+  for(size_t i = 0; i < fds.size(); i++)
+    if(fds[i].revents) return (int)i;
+  
+  return -1;
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::trySendStats() {
+  return this->sendCommand("stats\r\n");
+}
+
+Beanstalkpp::Result<Beanstalkpp::ServerStats> Beanstalkpp::Client::tryReadStats() {
+  Status s = this->readYaml();
+  if(!s) return s.failure();
+  
+  ServerStats ret;
+  ret.parse(this->yaml.data(), this->yaml.size());
   return ret;
 }
 
+Beanstalkpp::TubeStats Beanstalkpp::Client::statsTube(const std::string& tube) {
+  return this->tryStatsTube(tube).get("stats-tube");
+}
+
+Beanstalkpp::Result<Beanstalkpp::TubeStats> Beanstalkpp::Client::tryStatsTube(
+  const std::string& tube
+) {
+  return this->withReconnect([&]() -> Result<TubeStats> {
+    CommandScope scope(*this, Metrics::STATS, 0, tube.c_str());
+    
+    Status s = this->trySendStatsTube(tube);
+    if(!s) return s.failure();
+    
+    return this->tryReadStatsTube();
+  });
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::trySendStatsTube(const std::string& tube) {
+  boost::array<boost::asio::const_buffer, 3> buffers = {{
+    boost::asio::buffer("stats-tube ", 11),
+    boost::asio::buffer(tube),
+    boost::asio::buffer("\r\n", 2)
+  }};
+  
+  return this->send(buffers);
+}
+
+Beanstalkpp::Result<Beanstalkpp::TubeStats> Beanstalkpp::Client::tryReadStatsTube() {
+  Status s = this->readYaml();
+  if(!s) return s.failure();
+  
+  TubeStats ret;
+  ret.parse(this->yaml.data(), this->yaml.size());
+  return ret;
+}
+
+Beanstalkpp::JobStats Beanstalkpp::Client::statsJob(Beanstalkpp::job_id_t jobId) {
+  return this->tryStatsJob(jobId).get("stats-job");
+}
+
+Beanstalkpp::Result<Beanstalkpp::JobStats> Beanstalkpp::Client::tryStatsJob(
+  Beanstalkpp::job_id_t jobId
+) {
+  return this->withReconnect([&]() -> Result<JobStats> {
+    CommandScope scope(*this, Metrics::STATS, jobId);
+    
+    Status s = this->trySendStatsJob(jobId);
+    if(!s) return s.failure();
+    
+    return this->tryReadStatsJob();
+  });
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::trySendStatsJob(Beanstalkpp::job_id_t jobId) {
+  char cmd[64];
+  
+  return this->sendCommand(
+    cmd, snprintf(cmd, sizeof(cmd), "stats-job %llu\r\n", (unsigned long long)jobId)
+  );
+}
+
+Beanstalkpp::Result<Beanstalkpp::JobStats> Beanstalkpp::Client::tryReadStatsJob() {
+  Status s = this->readYaml();
+  if(!s) return s.failure();
+  
+  JobStats ret;
+  ret.parse(this->yaml.data(), this->yaml.size());
+  return ret;
+}
+
+Beanstalkpp::Status Beanstalkpp::Client::readYaml() {
+  Status s = this->expectReply("OK");
+  if(!s) return s;
+  
+  Result<unsigned int> payloadSize = this->tokenStream.tryExpectInt();
+  if(!payloadSize) return payloadSize.failure();
+  
+  s = this->tokenStream.tryExpectEol();
+  if(!s) return s;
+  
+  this->yaml.resize(payloadSize.value());
+  if(this->yaml.empty()) return this->tokenStream.tryExpectEol();
+  
+  s = this->tokenStream.tryReadChunk(&this->yaml[0], this->yaml.size());
+  if(!s) return s;
+  
+  return this->tokenStream.tryExpectEol();
+}
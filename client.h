@@ -21,21 +21,110 @@
 #ifndef _BEANSTALK_POOL_H
 #define _BEANSTALK_POOL_H
 
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <set>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <sstream>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/io_service.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "tokenizedstream.h"
 #include "job.h"
 #include "serverexception.h"
+#include "result.h"
+#include "sink.h"
+#include "codec.h"
+#include "jobtraits.h"
+#include "metrics.h"
+#include "observer.h"
+#include "capture.h"
+#include "stats.h"
 
 namespace Beanstalkpp {
 
 class Job;
 
+/**
+ * A job for @c Client::putBatch
+ */
+struct BatchPut {
+  /**
+   * A job with the default priority, delay and ttr of @c Client::put
+   */
+  BatchPut(const std::string &tube, const std::string &data);
+  
+  BatchPut(
+    const std::string &tube, const std::string &data, unsigned int priority, unsigned int delay,
+    unsigned int ttr
+  );
+  
+  std::string tube;
+  std::string data;
+  unsigned int priority;
+  unsigned int delay;
+  unsigned int ttr;
+  
+  /**
+   * Set by putBatch to the id the job got on the server, or 0 if it wasn't put
+   */
+  job_id_t jobId;
+};
+
+/**
+ * Socket options for @c Client::setOptions, applied whenever the client connects, before the
+ * handshake. Options the kernel refuses, like busy polling without CAP_NET_ADMIN, are skipped;
+ * @c Client::getSocketOptions shows the ones in effect.
+ */
+struct ClientOptions {
+  /**
+   * Nagle's algorithm disabled, and the system defaults for the rest
+   */
+  ClientOptions();
+  
+  /**
+   * Sets TCP_NODELAY, so small writes like pipelined commands aren't held back waiting for the
+   * server to acknowledge the previous ones
+   */
+  bool noDelay;
+  
+  /**
+   * SO_SNDBUF and SO_RCVBUF in bytes, or 0 for the system defaults. Large jobs need buffers of
+   * about the bandwidth-delay product to keep the link busy.
+   */
+  int sendBufferSize;
+  int receiveBufferSize;
+  
+  /**
+   * Seconds of idleness before the first TCP keepalive probe, or 0 for no keepalive
+   */
+  int keepAliveIdle;
+  
+  /**
+   * Seconds between keepalive probes, and the unanswered probes after which the connection is
+   * dropped, or 0 for the system defaults
+   */
+  int keepAliveInterval;
+  int keepAliveCount;
+  
+  /**
+   * SO_BUSY_POLL: microseconds to spin on the device queue when a read would block, or 0 to sleep
+   * right away
+   */
+  int busyPoll;
+  
+  /**
+   * Sets TCP_QUICKACK after every read, so the server's replies are acknowledged at once instead
+   * of after the delayed ACK timeout. Costs a system call per read.
+   */
+  bool quickAck;
+};
+
 /**
  * The beanstalk client. Used for sending and receiving jobs over beanstalk.
  */
@@ -56,9 +145,69 @@ public:
    */
   void connect();
   
+  /**
+   * Sets the socket options, applied right away if connected, and on every connect
+   */
+  void setOptions(const ClientOptions &options);
+  
+  const ClientOptions &getOptions() const;
+  
+  /**
+   * Reads the socket options in effect back with getsockopt, to tell which of those set with
+   * @c setOptions the kernel refused or capped. Buffer sizes are as the kernel reports them, which
+   * on Linux is twice what was asked for.
+   * 
+   * @return False if the client isn't connected
+   */
+  bool getSocketOptions(ClientOptions &options);
+  
+  /**
+   * Makes the client reconnect when a command fails with a network error, and retry the command
+   * if it is idempotent: use, watch, ignore, reserve, peek and the list and stats commands. Other
+   * commands still fail, as they may have taken effect, but leave the client connected for the next
+   * one. Reserve is safe to retry, since the server releases the jobs of a closed connection.
+   * 
+   * Reconnecting reuses the endpoints resolved by @c connect, and restores the tube in use and the
+   * watch list. Failed attempts are retried after a random delay of up to @p minDelayMs, doubled
+   * for every attempt up to @p maxDelayMs.
+   * 
+   * @param attempts The connection attempts per reconnect, or 0 to never reconnect, the default
+   */
+  void setReconnect(
+    unsigned int attempts, unsigned int minDelayMs = 10, unsigned int maxDelayMs = 1000
+  );
+  
+  /**
+   * Bounds how long the client waits on the server: any one connect, write or read fails with a
+   * TimeoutException, reason CLIENT_TIMEOUT, if it takes longer than @p ms. The connection is then
+   * closed, as the reply it was waiting for can't be resumed. The wait for a job is left to the
+   * server: reserve is never timed out, and reserve-with-timeout only once the server's timeout
+   * has passed too.
+   * 
+   * See @c Deadline for bounding a series of commands, reserve included.
+   * 
+   * @param ms The timeout in milliseconds, or 0 to wait as long as it takes, the default
+   */
+  void setTimeout(unsigned int ms);
+  
+  class Deadline;
+  
+  /**
+   * Closes the connection and reconnects, as configured with @c setReconnect, restoring the tube
+   * in use and the watch list
+   * 
+   * @throws Exception If no attempt succeeded
+   */
+  void reconnect();
+  
+  /**
+   * Returns the number of successful reconnects
+   */
+  uint64_t getReconnects() const;
+  
   /**
    * Selects the tube to send jobs through. If no tube has been selected, the tube "default" is
-   * used.
+   * used. Nothing is sent if the tube is already in use.
    * 
    * @param tubeName The name of the tube
    * 
@@ -66,6 +215,46 @@ public:
    */
   void use(const std::string &tubeName);
   
+  /**
+   * Enables compression of the payloads sent with @c put(const std::string&). Payloads smaller
+   * than @p threshold, or which don't get smaller when compressed, are stored uncompressed behind
+   * the same header. Payloads sent from streams and file descriptors are never compressed.
+   * 
+   * Enabling compression also makes the jobs reserved by this client decompressed transparently
+   * by @c Job::asString, whatever codec they were compressed with. Consumers without compression
+   * enabled get payloads exactly as they were put, so producers and consumers must agree.
+   * 
+   * @param codec     The codec to use, or NULL to disable compression. The codec must outlive 
+   *                  the client, and be registered (see @c Codec::registerCodec) with consumers.
+   * @param threshold The smallest payload to compress, in bytes
+   */
+  void setCompression(const Codec *codec, size_t threshold = 1024);
+  
+  /**
+   * Enables writing an @c Envelope in front of the payloads sent with 
+   * @c put(const std::string&). The envelope carries the time of the put and a CRC32C checksum, 
+   * which consumers get through @c Job::queueLatency and @c Job::verify. The queue latencies of
+   * the jobs reserved by this client are also recorded in its metrics.
+   * 
+   * Enabling envelopes also makes @c Job::asString remove and check the envelopes of the jobs
+   * reserved by this client, so producers and consumers must agree. Streamed puts are refused
+   * while envelopes are enabled, as the checksum would need the payload before it is sent.
+   * 
+   * @param enabled     Whether to write envelopes
+   * @param contentType Application defined tag describing the payload
+   */
+  void setEnvelope(bool enabled, uint16_t contentType = 0);
+  
+  /**
+   * @return The codec set with @c setCompression, NULL if compression is disabled
+   */
+  const Codec *getCompression() const;
+  
+  /**
+   * @return Whether envelopes are enabled, see @c setEnvelope
+   */
+  bool getEnvelope() const;
+  
   /**
    * Adds a job consisting of a string to the server
    * 
@@ -78,6 +267,99 @@ public:
    */
   int put(const std::string &data);
   
+  /**
+   * Adds a job consisting of a string to the server, with the given attributes instead of the
+   * defaults
+   * 
+   * @param data     The data to send
+   * @param priority The priority of the job, where lower values are more urgent
+   * @param delay    Seconds to wait before the job becomes ready
+   * @param ttr      Seconds a worker may hold the job reserved
+   * 
+   * @return The id the job got on the server
+   * 
+   * @throws ServerException With reason JOB_TOO_BIG on jobs the server deems too big
+   */
+  job_id_t put(const std::string &data, unsigned int priority, unsigned int delay, unsigned int ttr);
+  
+  /**
+   * Adds a job whose payload is read from a file descriptor. The payload is streamed to the server
+   * without being held in memory, using sendfile() for files and splice() for pipes where
+   * available.
+   * 
+   * If the descriptor runs out of data before @p length bytes have been sent, the connection is 
+   * closed, since the server would otherwise wait for the rest of the job, and the put fails with
+   * reason SOURCE_ERROR.
+   * 
+   * @param fd     The file descriptor to read from, starting at its current position
+   * @param length The size of the payload
+   * 
+   * @return The id the job got on the server
+   * 
+   * @throws ServerException With reason NETWORK_ERROR if the payload couldn't be sent
+   * @throws ServerException With reason SOURCE_ERROR if the payload couldn't be read from @p fd
+   * @throws ServerException With reason BAD_FORMAT, before anything is sent, if envelopes are
+   *                         enabled, see @c setEnvelope
+   * @throws ServerException With reason JOB_TOO_BIG on jobs the server deems too big
+   */
+  job_id_t put(int fd, size_t length);
+  
+  /**
+   * Adds a job carrying @p value, serialized with @c JobTraits<T>. Consumers receive it with 
+   * reserve<TypedJob<T> >().
+   * 
+   * This is only available for types with a JobTraits specialization. Note that put(std::string)
+   * still sends the raw string; use put<std::string> for a length prefixed string.
+   * 
+   * @return The id the job got on the server
+   * 
+   * @throws ServerException With reason BAD_FORMAT on unexpected server response
+   * @throws ServerException With reason JOB_TOO_BIG on jobs the server deems too big
+   */
+  template<class T>
+  typename std::enable_if<JobTraits<T>::serializable, job_id_t>::type put(const T &value) {
+    return this->tryPut<T>(value).get("put");
+  }
+  
+  /**
+   * Adds a job whose payload is read from a stream, one chunk at a time. 
+   * 
+   * If the stream runs out of data before @p length bytes have been sent, the connection is 
+   * closed, since the server would otherwise wait for the rest of the job, and the put fails with
+   * reason SOURCE_ERROR.
+   * 
+   * @param in     The stream to read from
+   * @param length The size of the payload
+   * 
+   * @return The id the job got on the server
+   * 
+   * @throws ServerException With reason NETWORK_ERROR if the payload couldn't be sent
+   * @throws ServerException With reason SOURCE_ERROR if the payload couldn't be read from @p in
+   * @throws ServerException With reason BAD_FORMAT, before anything is sent, if envelopes are
+   *                         enabled, see @c setEnvelope
+   * @throws ServerException With reason JOB_TOO_BIG on jobs the server deems too big
+   */
+  job_id_t put(std::istream &in, size_t length);
+  
+  /**
+   * Adds jobs to several tubes. The jobs are grouped by tube, starting with the tube in use, so
+   * each tube is selected once, and the puts of a tube are pipelined. The jobs of a tube are put
+   * in the order they have in @p jobs, but the tubes may be visited in any order.
+   * 
+   * The tube in use afterwards is the last tube visited.
+   * 
+   * @param jobs The jobs to put. Their jobId is set as they are put.
+   * 
+   * @return The number of jobs put, which is less than the number of jobs if the server deemed
+   *         some of them too big
+   * 
+   * @throws ServerException With reason BAD_FORMAT on unexpected server response
+   * @throws ServerException With the reason of the first other error the server replied with,
+   *                         e.g. DRAINING. No more jobs are sent after it, but the puts already
+   *                         sent are completed, and the jobs that weren't put have jobId 0.
+   */
+  size_t putBatch(std::vector<BatchPut> &jobs);
+  
   /**
    * Reserves the next job in the queue. This function is blocking until a job becomes available in
    * the queue.
@@ -88,22 +370,7 @@ public:
    */
   template<class TJob>
   TJob reserve() {
-    job_id_t jobId;
-    size_t payloadSize;
-    char *payload;
-    std::stringstream s("reserve\r\n");
-
-    this->sendCommand(s);
-    
-    this->tokenStream.expectString("RESERVED");
-    jobId = this->tokenStream.expectULL();
-    payloadSize = this->tokenStream.expectInt();
-    this->tokenStream.expectEol();
-    
-    payload = this->tokenStream.readChunk(payloadSize);
-    this->tokenStream.expectEol();
-    
-    return TJob(*this, jobId, payloadSize, payload);
+    return this->tryReserve<TJob>().get("reserve");
   }
   
   /**
@@ -113,6 +380,18 @@ public:
    */
   Job reserve();
   
+  /**
+   * Reserves the next job in the queue, and hands its payload to @p sink in chunks as it arrives
+   * instead of reading it into memory. This function is blocking until a job becomes available.
+   * 
+   * @param sink Receives the payload
+   * 
+   * @return The id of the reserved job
+   * 
+   * @throws ServerException With reason BAD_FORMAT on unexpected server response
+   */
+  job_id_t reserveInto(PayloadSink &sink);
+  
   /**
    * Tries to reserve a job from the queue. If a job is available within @p timeout, it will be 
    * placed in @p jobPtr, and true will be returned. Otherwise @p jobPtr will be left unchanged, 
@@ -127,38 +406,7 @@ public:
    */
   template<class TJob>
   bool reserveWithTimeout(boost::shared_ptr<TJob> &jobPtr, int timeout) {
-    job_id_t jobId;
-    size_t payloadSize;
-    char *payload;
-    std::stringstream s;
-    
-    s << "reserve-with-timeout " << timeout << "\r\n";
-    this->sendCommand(s);
-    
-    std::string response = this->tokenStream.nextString();
-    
-    if(response.compare("RESERVED") == 0) {
-      jobId = this->tokenStream.expectULL();
-      payloadSize = this->tokenStream.expectInt();
-      this->tokenStream.expectEol();
-      
-      payload = this->tokenStream.readChunk(payloadSize);
-      this->tokenStream.expectEol();
-      
-      boost::shared_ptr<TJob> newJob(new TJob(*this, jobId, payloadSize, payload));
-      jobPtr = newJob;
-      return true;
-    }
-    
-    if(response.compare("TIMED_OUT") == 0) {
-      this->tokenStream.expectEol();
-      return false;
-    }
-    
-    throw ServerException(
-      ServerException::BAD_FORMAT, 
-      "Didn't get RESERVED or TIMED_OUT reply to reserve-with-timeout command"
-    );    
+    return this->tryReserveWithTimeout<TJob>(jobPtr, timeout).get("reserve-with-timeout");
   }
   
   /**
@@ -182,6 +430,27 @@ public:
    */
   bool peekReady(job_p_t &jobPtr);
   
+  /**
+   * Peeks at the buried job that would be kicked next, in the used tube
+   * 
+   * @return True if a job was found, otherwise false
+   */
+  bool peekBuried(job_p_t &jobPtr);
+  
+  /**
+   * Peeks at the delayed job with the shortest delay left, in the used tube
+   * 
+   * @return True if a job was found, otherwise false
+   */
+  bool peekDelayed(job_p_t &jobPtr);
+  
+  /**
+   * Peeks at the job @p jobId, in any tube and state
+   * 
+   * @return True if the job was found, otherwise false
+   */
+  bool peek(job_id_t jobId, job_p_t &jobPtr);
+  
   /**
    * The delete command removes a job from the server entirely. It is normally used by the client 
    * when the job has successfully run to completion. A client can only delete jobs that it has 
@@ -204,6 +473,13 @@ public:
    */
   void del(const job_p_t &j);
   
+  /**
+   * Deletes the job with id @p jobId. See @c del(const Job&).
+   * 
+   * @throws ServerException With reason BAD_FORMAT on unexpected server response
+   */
+  void del(job_id_t jobId);
+  
   /**
    * The bury command puts a job into the "buried" state. Buried jobs are put into a FIFO linked 
    * list and will not be touched by the server again until a client kicks them with the "kick"
@@ -217,11 +493,31 @@ public:
    */
   void bury(const Job &j, int priority = 10);
   
+  /**
+   * The "kick" command moves up to @p bound jobs of the used tube to the ready queue. If the tube
+   * has buried jobs, only buried jobs are kicked, otherwise delayed jobs are.
+   * 
+   * @return The number of jobs kicked
+   * 
+   * @throws ServerException With reason BAD_FORMAT on unexpected server response
+   */
+  size_t kick(unsigned int bound);
+  
+  /**
+   * Moves the buried or delayed job @p jobId to the ready queue
+   * 
+   * @throws ServerException With reason NOT_FOUND if the job doesn't exist, or is neither buried
+   *                         nor delayed
+   */
+  void kickJob(job_id_t jobId);
+  
   /**
    * The "watch" command adds the named tube to the watch list for the current connection. A reserve
    * command will take a job from any of the tubes in the watch list. For each new connection, the
    * watch list initially consists of one tube, named "default".
    * 
+   * Nothing is sent if the tube is already watched.
+   * 
    * @param tube The new tube to watch
    * 
    * @throws ServerException With reason BAD_FORMAT on unexpected server response
@@ -230,31 +526,836 @@ public:
    */
   size_t watch(const std::string &tube);
   
+  /**
+   * The "ignore" command removes the named tube from the watch list for the current connection.
+   * Nothing is sent if the tube isn't watched.
+   * 
+   * @param tube The tube to stop watching
+   * 
+   * @throws ServerException With reason NOT_IGNORED if @p tube is the last watched tube
+   * 
+   * @return The number of tubes currently watched
+   */
+  size_t ignore(const std::string &tube);
+  
+  /**
+   * Replaces the watch list with @p tubes. The watch and ignore commands needed are pipelined, so
+   * this costs one round trip however many tubes change, and nothing is sent if @p tubes already
+   * is the watch list.
+   * 
+   * @throws ServerException With reason NOT_IGNORED if @p tubes is empty
+   * 
+   * @return The number of tubes currently watched
+   */
+  size_t setWatchList(const std::set<std::string> &tubes);
+  
+  /**
+   * Returns the watch list of the connection, as reported by the server
+   * 
+   * @throws ServerException With reason BAD_FORMAT on unexpected server response
+   */
+  std::vector<std::string> listTubesWatched();
+  
   /**
    * Returns a list of all tubes available at the beanstalk server
    * 
    * @throws ServerException With reason BAD_FORMAT on unexpected server response
    */
   std::vector<std::string> listTubes();
-private:
-  std::string tubeName;
   
   /**
-   * Sends a command over the TCP wire
+   * Returns the server wide statistics
+   * 
+   * @throws ServerException With reason BAD_FORMAT on unexpected server response
+   */
+  ServerStats stats();
+  
+  /**
+   * Returns the statistics of @p tube
    * 
-   * @param cmd The command to send
+   * @throws ServerException With reason NOT_FOUND if the tube doesn't exist
+   */
+  TubeStats statsTube(const std::string &tube);
+  
+  /**
+   * Returns the statistics of the job @p jobId
    * 
-   * @throws Exception On network errors
+   * @throws ServerException With reason NOT_FOUND if the job doesn't exist
    */
-  void sendCommand(const std::stringstream &cmd);
+  JobStats statsJob(job_id_t jobId);
   
-  boost::asio::io_service io_service;
-  boost::asio::ip::tcp::socket socket;
+  /**
+   * Returns the tube selected with @c use, "default" on a new connection
+   */
+  const std::string &getUsedTube() const;
   
-  std::string hostname;
-  int port;
+  /**
+   * Returns the tubes in the watch list, as changed by @c watch and @c ignore
+   */
+  const std::set<std::string> &getWatchedTubes() const;
   
-  TokenizedStream tokenStream;
+  /*
+   * Non-throwing versions of the commands above. They report errors through their return value
+   * instead of exceptions, and their error paths never allocate memory. Server errors are reported
+   * with the matching ServerException::Reason, network errors as NETWORK_ERROR.
+   */
+  
+  /**
+   * Non-throwing version of @c connect
+   */
+  Status tryConnect();
+  
+  /**
+   * Non-throwing version of @c reconnect
+   */
+  Status tryReconnect();
+  
+  /**
+   * Non-throwing version of @c use
+   */
+  Status tryUse(const std::string &tubeName);
+  
+  /**
+   * Non-throwing version of @c put
+   * 
+   * @return The id the job got on the server, or JOB_TOO_BIG if the server deems the job too big
+   */
+  Result<job_id_t> tryPut(const std::string &data);
+  
+  /**
+   * Non-throwing version of @c put(const std::string&, unsigned int, unsigned int, unsigned int)
+   */
+  Result<job_id_t> tryPut(
+    const std::string &data, unsigned int priority, unsigned int delay, unsigned int ttr
+  );
+  
+  /**
+   * Non-throwing version of @c put(int, size_t)
+   */
+  Result<job_id_t> tryPut(int fd, size_t length);
+  
+  /**
+   * Non-throwing version of @c put(std::istream&, size_t)
+   */
+  Result<job_id_t> tryPut(std::istream &in, size_t length);
+  
+  /**
+   * Non-throwing version of @c putBatch
+   */
+  Result<size_t> tryPutBatch(std::vector<BatchPut> &jobs);
+  
+  /**
+   * Non-throwing version of @c put<T>
+   */
+  template<class T>
+  typename std::enable_if<JobTraits<T>::serializable, Result<job_id_t> >::type tryPut(
+    const T &value
+  ) {
+    size_t size = JobTraits<T>::size(value);
+    
+    // The buffer is kept between puts, so encoding doesn't allocate once it has grown
+    this->encoded.resize(size);
+    JobTraits<T>::encode(value, &this->encoded[0]);
+    
+    return this->tryPut(this->encoded.data(), size);
+  }
+  
+  /**
+   * Non-throwing version of @c reserve
+   */
+  template<class TJob>
+  Result<TJob> tryReserve() {
+    return this->withReconnect([this]() -> Result<TJob> {
+      CommandScope scope(*this, Metrics::RESERVE);
+      job_id_t jobId;
+      size_t payloadSize;
+      char *payload;
+      
+      Status s = this->trySendReserve(-1);
+      if(!s) return s.failure();
+      
+      s = this->readReserved(jobId, payloadSize, payload);
+      if(!s) return s.failure();
+      
+      return TJob(*this, jobId, payloadSize, payload);
+    });
+  }
+  
+  /**
+   * Alias for tryReserve<Job>
+   */
+  Result<Job> tryReserve();
+  
+  /**
+   * Non-throwing version of @c reserveInto
+   */
+  Result<job_id_t> tryReserveInto(PayloadSink &sink);
+  
+  /**
+   * Non-throwing version of @c reserveWithTimeout
+   * 
+   * @return Whether a job was found and put into @p jobPtr
+   */
+  template<class TJob>
+  Result<bool> tryReserveWithTimeout(boost::shared_ptr<TJob> &jobPtr, int timeout) {
+    return this->withReconnect([&]() -> Result<bool> {
+      CommandScope scope(*this, Metrics::RESERVE);
+      job_id_t jobId;
+      size_t payloadSize;
+      char *payload;
+      
+      Status s = this->trySendReserve(timeout);
+      if(!s) return s.failure();
+      
+      s = this->readReserved(jobId, payloadSize, payload);
+      if(!s) {
+        if(s.error() == ServerException::TIMED_OUT) return false;
+        return s.failure();
+      }
+      
+      jobPtr.reset(new TJob(*this, jobId, payloadSize, payload));
+      return true;
+    });
+  }
+  
+  /**
+   * Alias for tryReserveWithTimeout<Job>
+   */
+  Result<bool> tryReserveWithTimeout(job_p_t &jobPtr, int timeout);
+  
+  /**
+   * Non-throwing version of @c peekReady
+   * 
+   * @return True if a job was found, otherwise false
+   */
+  Result<bool> tryPeekReady(job_p_t &jobPtr);
+  
+  /**
+   * Non-throwing version of @c peekBuried
+   */
+  Result<bool> tryPeekBuried(job_p_t &jobPtr);
+  
+  /**
+   * Non-throwing version of @c peekDelayed
+   */
+  Result<bool> tryPeekDelayed(job_p_t &jobPtr);
+  
+  /**
+   * Non-throwing version of @c peek
+   */
+  Result<bool> tryPeek(job_id_t jobId, job_p_t &jobPtr);
+  
+  /**
+   * Non-throwing version of @c del
+   */
+  Status tryDel(const Job &j);
+  
+  /**
+   * Non-throwing version of @c del(job_id_t)
+   */
+  Status tryDel(job_id_t jobId);
+  
+  /**
+   * Non-throwing version of @c bury
+   * 
+   * @return NOT_FOUND if the job was not found on the server
+   */
+  Status tryBury(const Job &j, int priority = 10);
+  
+  /**
+   * Non-throwing version of @c kick
+   */
+  Result<size_t> tryKick(unsigned int bound);
+  
+  /**
+   * Non-throwing version of @c kickJob
+   */
+  Status tryKickJob(job_id_t jobId);
+  
+  /**
+   * Non-throwing version of @c watch
+   */
+  Result<size_t> tryWatch(const std::string &tube);
+  
+  /**
+   * Non-throwing version of @c ignore
+   */
+  Result<size_t> tryIgnore(const std::string &tube);
+  
+  /**
+   * Non-throwing version of @c listTubes
+   */
+  Result<std::vector<std::string> > tryListTubes();
+  
+  /**
+   * Non-throwing version of @c setWatchList
+   */
+  Result<size_t> trySetWatchList(const std::set<std::string> &tubes);
+  
+  /**
+   * Non-throwing version of @c listTubesWatched
+   */
+  Result<std::vector<std::string> > tryListTubesWatched();
+  
+  /**
+   * Non-throwing version of @c stats
+   */
+  Result<ServerStats> tryStats();
+  
+  /**
+   * Non-throwing version of @c statsTube
+   */
+  Result<TubeStats> tryStatsTube(const std::string &tube);
+  
+  /**
+   * Non-throwing version of @c statsJob
+   */
+  Result<JobStats> tryStatsJob(job_id_t jobId);
+  
+  /*
+   * Pipelined puts. trySendPut writes a put command without waiting for the reply, so several puts
+   * can be in flight on one connection. Every trySendPut must be matched by a tryReadPutReply, and
+   * the replies arrive in the order the puts were sent. Don't mix in other commands while puts are
+   * in flight.
+   */
+  
+  /**
+   * Sends a put command, applying compression and envelopes like @c put, without waiting for the
+   * reply
+   * 
+   * @return NETWORK_ERROR on network errors
+   */
+  Status trySendPut(const std::string &data);
+  
+  /**
+   * Sends a put of the @p size bytes at @p data, see @c trySendPut(const std::string&)
+   */
+  Status trySendPut(const char *data, size_t size);
+  
+  /**
+   * Sends a put with the given attributes instead of the defaults
+   */
+  Status trySendPut(
+    const char *data, size_t size, unsigned int priority, unsigned int delay, unsigned int ttr
+  );
+  
+  /**
+   * Reads the reply to the oldest put sent with @c trySendPut
+   * 
+   * @return The id of the new job, or JOB_TOO_BIG if the server deems the job too big
+   */
+  Result<job_id_t> tryReadPutReply();
+  
+  /**
+   * Waits up to @p timeoutMs milliseconds for the reply to the oldest command in flight to start
+   * arriving, so a tryRead* can read it without blocking for long
+   * 
+   * @return Whether a reply has started arriving, or NETWORK_ERROR
+   */
+  Result<bool> tryWaitReply(int timeoutMs);
+  
+  /**
+   * Waits up to @p timeoutMs milliseconds for a reply to start arriving on any of @p clients
+   * 
+   * @return The index of a client with a reply, or -1 if the time ran out
+   */
+  static Result<int> tryWaitReply(const std::vector<Client*> &clients, int timeoutMs);
+  
+  /**
+   * Sends a stats command without waiting for the reply, to be matched by a @c tryReadStats
+   */
+  Status trySendStats();
+  
+  /**
+   * Reads the reply to a stats command sent with @c trySendStats
+   */
+  Result<ServerStats> tryReadStats();
+  
+  /**
+   * Sends a stats-tube command without waiting for the reply. Like puts, several can be in flight,
+   * and each must be matched by a @c tryReadStatsTube.
+   */
+  Status trySendStatsTube(const std::string &tube);
+  
+  /**
+   * Reads the reply to the oldest stats-tube sent with @c trySendStatsTube
+   * 
+   * @return NOT_FOUND if the tube doesn't exist
+   */
+  Result<TubeStats> tryReadStatsTube();
+  
+  /*
+   * The same for the commands used to drain a tube: each trySend* below is matched by the
+   * tryRead* of the same command, in the order they were sent.
+   */
+  
+  /**
+   * Sends a reserve-with-timeout command, or a reserve command if @p timeout is negative
+   */
+  Status trySendReserve(int timeout);
+  
+  /**
+   * Sends a reserve-job command for @p jobId, whose reply is read with @c tryReadReserve. The job
+   * may be ready, delayed or buried. Needs beanstalkd 1.12 or later; older servers reply
+   * UNKNOWN_COMMAND.
+   */
+  Status trySendReserveJob(job_id_t jobId);
+  
+  /**
+   * Reads the reply to a reserve sent with @c trySendReserve or @c trySendReserveJob, handing the
+   * payload to @p sink like @c reserveInto
+   * 
+   * @return The id of the job, TIMED_OUT if no job arrived within the timeout, or NOT_FOUND if the
+   *         job asked for by reserve-job doesn't exist or is reserved
+   */
+  Result<job_id_t> tryReadReserve(PayloadSink &sink);
+  
+  /**
+   * Reads the reply to a reserve sent with @c trySendReserve into @p jobPtr
+   * 
+   * @return Whether a job arrived within the timeout
+   */
+  Result<bool> tryReadReserve(job_p_t &jobPtr);
+  
+  /**
+   * Sends the watch and ignore commands which replace the watch list with @p tubes, see
+   * @c setWatchList. If an earlier failure left the watch list unknown, it is first read with
+   * list-tubes-watched, so no other replies may be pending then.
+   * 
+   * @return NOT_IGNORED if @p tubes is empty
+   */
+  Status trySendWatchList(const std::set<std::string> &tubes);
+  
+  /**
+   * Reads the replies to the commands sent by @c trySendWatchList
+   * 
+   * @return The number of tubes currently watched, or the first error replied
+   */
+  Result<size_t> tryReadWatchList();
+  
+  /**
+   * Sends a delete command for @p jobId
+   */
+  Status trySendDelete(job_id_t jobId);
+  
+  /**
+   * Reads the reply to a delete sent with @c trySendDelete
+   * 
+   * @return NOT_FOUND if the job was not found on the server
+   */
+  Status tryReadDelete();
+  
+  /**
+   * Sends a bury command for @p jobId
+   */
+  Status trySendBury(job_id_t jobId, unsigned int priority);
+  
+  /**
+   * Reads the reply to a bury sent with @c trySendBury
+   * 
+   * @return NOT_FOUND if the job was not found on the server
+   */
+  Status tryReadBury();
+  
+  /**
+   * Sends a stats-job command for @p jobId
+   */
+  Status trySendStatsJob(job_id_t jobId);
+  
+  /**
+   * Reads the reply to a stats-job sent with @c trySendStatsJob
+   * 
+   * @return NOT_FOUND if the job doesn't exist
+   */
+  Result<JobStats> tryReadStatsJob();
+  
+  /**
+   * Room needed for the command line of a put, see @c formatPutHeader
+   */
+  static const size_t PUT_HEADER_SIZE = 96;
+  
+  /**
+   * Returns the metrics recorded by this client, or NULL if the library was built without them.
+   * The returned object lives as long as the client, and may be read from any thread.
+   */
+  const Metrics *getMetrics() const;
+  
+  /**
+   * Reports the lifecycle of every command to @p o, or to nobody if NULL. The client doesn't take
+   * ownership of the observer.
+   */
+  void setObserver(CommandObserver *o);
+  
+  /**
+   * Records all bytes sent and received to @p c, or stops recording if NULL. The client doesn't
+   * take ownership of the capture. The client gets a new connection id in the capture on every
+   * call.
+   */
+  void setCapture(WireCapture *c);
+  
+  /**
+   * Writes the command line of a put command with a payload of @p length bytes into @p header,
+   * which must have room for PUT_HEADER_SIZE bytes
+   * 
+   * @return The length of the command line
+   */
+  static size_t formatPutHeader(char *header, size_t length);
+  
+  /**
+   * Writes the command line of a put command with the given attributes, see
+   * @c formatPutHeader(char*, size_t)
+   */
+  static size_t formatPutHeader(
+    char *header, size_t length, unsigned int priority, unsigned int delay, unsigned int ttr
+  );
+private:
+  std::string tubeName;
+  
+  /**
+   * The watch list of the connection
+   */
+  std::set<std::string> watched;
+  
+  /**
+   * False when a use, watch or ignore failed, so that the server's state is unknown. Commands are
+   * then always sent, until the next connect.
+   */
+  bool tubeKnown;
+  bool watchedKnown;
+  
+  /**
+   * The number of replies tryReadWatchList has to read
+   */
+  size_t watchReplies;
+  
+  /**
+   * The endpoints of the server, resolved by the first connect
+   */
+  std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+  
+  unsigned int reconnectAttempts;
+  unsigned int reconnectMinDelayMs;
+  unsigned int reconnectMaxDelayMs;
+  uint64_t reconnects;
+  
+  /**
+   * Set while reconnecting, so the commands restoring the tubes aren't retried
+   */
+  bool reconnecting;
+  
+  std::minstd_rand random;
+  
+  ClientOptions options;
+  
+  unsigned int timeoutMs;
+  
+  /**
+   * The deadline of the innermost @c Deadline in scope, or time_point::max()
+   */
+  std::chrono::steady_clock::time_point deadline;
+  
+  /**
+   * How long the reserve sent last lets the server wait for a job, -1 for as long as it likes
+   */
+  int reserveWaitMs;
+  
+  const Codec *codec;
+  size_t compressionThreshold;
+  
+  bool envelope;
+  uint16_t contentType;
+  
+  /**
+   * Holds the compressed payload during put, reused between puts
+   */
+  std::string compressed;
+  
+  /**
+   * Holds values serialized by put<T>, reused between puts
+   */
+  std::string encoded;
+  
+  /**
+   * Holds the YAML payload of the last list or stats reply, reused between commands
+   */
+  std::string yaml;
+  
+  boost::scoped_ptr<Metrics> metrics;
+  
+  CommandObserver *observer;
+  
+  /**
+   * The traced command in flight, if there is an observer
+   */
+  CommandEvent *event;
+  
+  WireCapture *capture;
+  
+  /**
+   * The connection id of this client in the capture
+   */
+  uint32_t captureConnection;
+  
+  class CommandScope;
+  
+  /**
+   * Writes @p buffers to the socket, counting the bytes sent
+   * 
+   * @return NETWORK_ERROR on network errors
+   */
+  template<class ConstBufferSequence>
+  Status send(const ConstBufferSequence &buffers);
+  
+  /**
+   * Records an error with reason @p r in the metrics, reports it to the observer unless it is a
+   * TIMED_OUT, and returns it
+   */
+  Failure fail(ServerException::Reason r);
+  
+  /**
+   * Fails a streamed put whose payload ran out before its length. The server is still waiting for
+   * the rest of the job, so the connection is closed, but as the connection isn't to blame it
+   * isn't reconnected until the next command.
+   */
+  Failure failSource();
+  
+  /**
+   * Sends a command over the TCP wire
+   * 
+   * @param cmd    The command to send
+   * @param length The length of @p cmd
+   * 
+   * @return NETWORK_ERROR on network errors
+   */
+  Status sendCommand(const char *cmd, size_t length);
+  
+  /**
+   * Sends one of the peek commands, and reads the job it finds into @p jobPtr
+   * 
+   * @return False if no job was found
+   */
+  Result<bool> peekCommand(const char *cmd, size_t length, job_p_t &jobPtr);
+  
+  /**
+   * Sends a watch or ignore command, and reads the number of watched tubes
+   */
+  Result<size_t> watchCommand(const char *cmd, size_t length, const std::string &tube);
+  
+  /**
+   * Sends one of the list commands, and parses the list of tubes it replies
+   */
+  Result<std::vector<std::string> > listCommand(const char *cmd, size_t length);
+  
+  /**
+   * Resets the tube in use and the watch list to those of a new connection
+   */
+  void resetTubes();
+  
+  /**
+   * Connects to the first of the cached endpoints that accepts. They are resolved first if there
+   * are none, or if @p resolve is set.
+   */
+  Status connectEndpoints(bool resolve);
+  
+  /**
+   * Runs @p command. If it fails with a network error and reconnecting is enabled, reconnects, and
+   * runs it once more if it is @p idempotent. Otherwise its failure is returned, but the next
+   * command finds the client connected.
+   */
+  template<class F>
+  auto withReconnect(F command, bool idempotent = true) -> decltype(command()) {
+    decltype(command()) r = command();
+    
+    if(
+      !r && r.error() == ServerException::NETWORK_ERROR && this->reconnectAttempts > 0 &&
+      !this->reconnecting && this->tryReconnect() && idempotent
+    ) {
+      r = command();
+    }
+    
+    return r;
+  }
+  
+  /**
+   * The body of @c tryUse
+   */
+  Status useCommand(const std::string &tubeName);
+  
+  /**
+   * Connects to @p endpoint, within the timeout and the deadline
+   */
+  Status connectEndpoint(const boost::asio::ip::tcp::endpoint &endpoint);
+  
+  /**
+   * Sets the socket options on an open socket, which is either connected or about to be
+   */
+  void applyOptions();
+  
+  /**
+   * Passes the timeout and deadline on to the socket, which is non-blocking while either is set
+   */
+  void applyDeadline();
+  
+  /**
+   * Reads the reply to a reserve, giving the server the time the reserve asked for
+   */
+  Status readReserved(job_id_t &jobId, size_t &payloadSize, char *&payload);
+  
+  /**
+   * Sends a command over the TCP wire
+   * 
+   * @param cmd The command to send, which must be a string literal
+   */
+  template<size_t N>
+  Status sendCommand(const char (&cmd)[N]) {
+    return this->sendCommand(cmd, N - 1);
+  }
+  
+  /**
+   * Adds a job with @p size bytes from @p data, applying compression and envelopes
+   */
+  Result<job_id_t> tryPut(const char *data, size_t size);
+  Result<job_id_t> tryPut(
+    const char *data, size_t size, unsigned int priority, unsigned int delay, unsigned int ttr
+  );
+  
+  /**
+   * Sends a put of @p size bytes from @p data, applying compression and envelopes, without
+   * reading the reply
+   */
+  Status sendPut(
+    const char *data, size_t size, unsigned int priority, unsigned int delay, unsigned int ttr
+  );
+  
+  /**
+   * Sends the "put" command line announcing a payload of @p length bytes
+   */
+  Status sendPutHeader(size_t length);
+  
+  /**
+   * Sends the \r\n terminating a payload, and reads the reply to a put command
+   * 
+   * @return The id of the new job
+   */
+  Result<job_id_t> finishPut();
+  
+  /**
+   * Reads a reply carrying a job, i.e. "<reply> <id> <bytes>\r\n<data>\r\n". The caller takes
+   * ownership of @p payload.
+   * 
+   * @param reply The expected reply, such as "RESERVED" or "FOUND"
+   * 
+   * @return The reason the server replied with instead of @p reply, NETWORK_ERROR or CLIENT_TIMEOUT
+   */
+  Status readJob(const char *reply, job_id_t &jobId, size_t &payloadSize, char *&payload);
+  
+  /**
+   * Reads a reply carrying YAML, i.e. "OK <bytes>\r\n<data>\r\n", into @c yaml
+   */
+  Status readYaml();
+  
+  /**
+   * Makes sure the next token of the reply is @p reply
+   * 
+   * @return The reason the server replied with instead of @p reply, NETWORK_ERROR or CLIENT_TIMEOUT
+   */
+  Status expectReply(const char *reply);
+  
+  /**
+   * Turns an unexpected reply token into a failure, consuming the rest of the reply if it is a 
+   * known error
+   */
+  Failure replyError();
+  
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::socket socket;
+  
+  std::string hostname;
+  int port;
+  
+  TokenizedStream tokenStream;
+};
+
+/**
+ * Bounds every wait of a client on its server while in scope, e.g. to give a request one budget
+ * for all its commands. Unlike the timeout of @c Client::setTimeout, it applies to reserve too.
+ * Deadlines nest, and the earliest one applies.
+ * 
+ * Passing the deadline fails the command with a TimeoutException, reason CLIENT_TIMEOUT, and
+ * closes the connection.
+ */
+class Client::Deadline {
+public:
+  Deadline(Client &c, unsigned int ms): client(c), previous(c.deadline) {
+    c.deadline = std::min(
+      c.deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(ms)
+    );
+    c.applyDeadline();
+  }
+  
+  ~Deadline() {
+    this->client.deadline = this->previous;
+    this->client.applyDeadline();
+  }
+private:
+  Client &client;
+  std::chrono::steady_clock::time_point previous;
+};
+
+/**
+ * Instruments the command running while it is in scope: times it for the metrics, and reports its
+ * lifecycle to the observer. The command counts as failed if any error was recorded meanwhile.
+ */
+class Client::CommandScope {
+public:
+  CommandScope(Client &c, Metrics::Command command, job_id_t jobId = 0, const char *tube = ""):
+    client(c), command(command) {
+#ifndef BEANSTALKPP_NO_METRICS
+    if(c.metrics) {
+      this->errorsBefore = c.metrics->errorCount();
+      this->start = std::chrono::steady_clock::now();
+    }
+#endif
+    
+    if(c.observer) {
+      this->event.command = command;
+      this->event.jobId = jobId;
+      this->event.tube = tube;
+      this->event.startTime = this->event.time = CommandEvent::now();
+      this->event.failed = false;
+      
+      c.event = &this->event;
+      c.tokenStream.setTrace(c.observer, &this->event);
+      c.observer->commandStarted(this->event);
+    }
+  }
+  
+  ~CommandScope() {
+#ifndef BEANSTALKPP_NO_METRICS
+    if(this->client.metrics) {
+      std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - this->start;
+      this->client.metrics->recordCommand(
+        this->command, elapsed.count(), this->client.metrics->errorCount() != this->errorsBefore
+      );
+    }
+#endif
+    
+    if(this->client.event == &this->event) {
+      if(!this->event.failed) {
+        this->event.time = CommandEvent::now();
+        this->client.observer->replyParsed(this->event);
+      }
+      
+      this->client.event = NULL;
+      this->client.tokenStream.setTrace(NULL, NULL);
+    }
+  }
+private:
+  Client &client;
+  Metrics::Command command;
+  uint64_t errorsBefore;
+  std::chrono::steady_clock::time_point start;
+  CommandEvent event;
 };
 
 }
@@ -0,0 +1,193 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "codec.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#include <boost/iostreams/filtering_streambuf.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/copy.hpp>
+
+using namespace std;
+namespace io = boost::iostreams;
+
+#define ZLIB_CODEC_ID 1
+
+// How much larger than the compressed data the output buffer is reserved up front, at most. The
+// rest of the size claimed by the header is only allocated as the output actually grows.
+#define RESERVE_RATIO 8
+
+static const char magic[] = { 0x00, 'B', 'Z' };
+
+namespace {
+
+/**
+ * Appends to a string like io::back_inserter, but throws std::length_error once more than a
+ * limit would be appended
+ */
+class LimitedSink {
+public:
+  typedef char char_type;
+  typedef io::sink_tag category;
+  
+  LimitedSink(std::string &out, size_t limit): out(&out), left(limit) {}
+  
+  std::streamsize write(const char *s, std::streamsize n) {
+    if((size_t)n > this->left) throw std::length_error("Payload larger than its header claims");
+    
+    this->out->append(s, n);
+    this->left -= n;
+    return n;
+  }
+private:
+  std::string *out;
+  size_t left;
+};
+
+}
+
+static Beanstalkpp::ZlibCodec zlibCodec;
+
+static const Beanstalkpp::Codec *codecs[256] = { NULL, &zlibCodec };
+
+const size_t Beanstalkpp::Codec::HEADER_SIZE;
+const uint8_t Beanstalkpp::Codec::STORED;
+
+/**
+ * Replaces the contents of @p out with a header for @p size bytes encoded with codec @p id
+ */
+static void writeHeader(std::string &out, uint8_t id, size_t size) {
+  out.clear();
+  out.append(magic, sizeof(magic));
+  out.push_back((char)id);
+  for(int i = 0; i < 4; i++)
+    out.push_back((char)((size >> (8 * i)) & 0xff));
+}
+
+bool Beanstalkpp::Codec::encode(const char* data, size_t size, std::string& out) const {
+  // The header only has room for 32 bit sizes
+  if(size > UINT32_MAX) return false;
+  
+  out.reserve(HEADER_SIZE + size / 2);
+  writeHeader(out, this->id(), size);
+  
+  this->compress(data, size, out);
+  
+  return out.size() < size;
+}
+
+bool Beanstalkpp::Codec::store(const char* data, size_t size, std::string& out) {
+  if(size > UINT32_MAX) return false;
+  
+  out.reserve(HEADER_SIZE + size);
+  writeHeader(out, STORED, size);
+  out.append(data, size);
+  
+  return true;
+}
+
+bool Beanstalkpp::Codec::storedHeader(size_t size, char* out) {
+  if(size > UINT32_MAX) return false;
+  
+  string header;
+  writeHeader(header, STORED, size);
+  memcpy(out, header.data(), HEADER_SIZE);
+  
+  return true;
+}
+
+bool Beanstalkpp::Codec::isCompressed(const char* data, size_t size) {
+  return size >= HEADER_SIZE && memcmp(data, magic, sizeof(magic)) == 0;
+}
+
+bool Beanstalkpp::Codec::decode(const char* data, size_t size, std::string& out) {
+  if(!isCompressed(data, size)) return false;
+  
+  size_t originalSize = 0;
+  for(int i = 0; i < 4; i++)
+    originalSize |= (size_t)(uint8_t)data[4 + i] << (8 * i);
+  
+  if((uint8_t)data[3] == STORED) {
+    if(size - HEADER_SIZE != originalSize) return false;
+    
+    out.assign(data + HEADER_SIZE, originalSize);
+    return true;
+  }
+  
+  const Codec *codec = byId((uint8_t)data[3]);
+  if(!codec) return false;
+  
+  out.clear();
+  out.reserve(std::min(originalSize, (size - HEADER_SIZE) * RESERVE_RATIO));
+  if(!codec->decompress(data + HEADER_SIZE, size - HEADER_SIZE, originalSize, out))
+    return false;
+  
+  return out.size() == originalSize;
+}
+
+void Beanstalkpp::Codec::registerCodec(const Beanstalkpp::Codec* codec) {
+  codecs[codec->id()] = codec;
+}
+
+const Beanstalkpp::Codec* Beanstalkpp::Codec::byId(uint8_t id) {
+  return codecs[id];
+}
+
+Beanstalkpp::ZlibCodec::ZlibCodec(int level): level(level) {
+
+}
+
+uint8_t Beanstalkpp::ZlibCodec::id() const {
+  return ZLIB_CODEC_ID;
+}
+
+void Beanstalkpp::ZlibCodec::compress(const char* data, size_t size, std::string& out) const {
+  io::filtering_streambuf<io::output> compressor;
+  compressor.push(io::zlib_compressor(io::zlib_params(this->level)));
+  compressor.push(io::back_inserter(out));
+  
+  io::copy(io::array_source(data, size), compressor);
+}
+
+bool Beanstalkpp::ZlibCodec::decompress(
+  const char* data, size_t size, size_t limit, std::string& out
+) const {
+  try {
+    io::filtering_streambuf<io::output> decompressor;
+    decompressor.push(io::zlib_decompressor());
+    decompressor.push(LimitedSink(out, limit));
+    
+    io::copy(io::array_source(data, size), decompressor);
+  } catch(io::zlib_error &e) {
+    return false;
+  } catch(std::length_error &e) {
+    return false;
+  } catch(std::bad_alloc &e) {
+    return false;
+  }
+  
+  return true;
+}
@@ -0,0 +1,142 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_CODEC_H
+#define _BEANSTALK_CODEC_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace Beanstalkpp {
+
+/**
+ * A compression codec for job payloads.
+ * 
+ * Compressed payloads start with a small header: the bytes 0x00 'B' 'Z', the id of the codec, and
+ * the uncompressed size as a little endian 32 bit integer. Payloads which weren't worth compressing
+ * get the same header with the id STORED, so every payload of a compressing producer has one, and
+ * a payload that happens to start with the magic is never mistaken for a compressed one.
+ * 
+ * Consumers only look for the header if they enable compression too, see
+ * @c Client::setCompression.
+ * 
+ * To add a codec, subclass Codec with an unused id and pass an instance to @c registerCodec.
+ */
+class Codec {
+public:
+  /**
+   * The size of the header in front of compressed payloads
+   */
+  static const size_t HEADER_SIZE = 8;
+  
+  /**
+   * The codec id of payloads stored as they are, behind the header
+   */
+  static const uint8_t STORED = 0;
+  
+  virtual ~Codec() {}
+  
+  /**
+   * The id written into the header of payloads compressed by this codec
+   */
+  virtual uint8_t id() const = 0;
+  
+  /**
+   * Compresses @p size bytes from @p data, appending the result to @p out
+   */
+  virtual void compress(const char *data, size_t size, std::string &out) const = 0;
+  
+  /**
+   * Decompresses @p size bytes from @p data, appending the result to @p out. Stops as soon as
+   * more than @p limit bytes would be appended, as the header of an untrusted payload may claim
+   * any size.
+   * 
+   * @return False if @p data isn't valid output of this codec, or decompresses to more than 
+   *         @p limit bytes
+   */
+  virtual bool decompress(const char *data, size_t size, size_t limit, std::string &out) const = 0;
+  
+  /**
+   * Compresses a payload, and puts the header and compressed data in @p out.
+   * 
+   * @return False if compression didn't make the payload smaller, in which case the payload should
+   *         be sent as it is
+   */
+  bool encode(const char *data, size_t size, std::string &out) const;
+  
+  /**
+   * Puts the header with the id STORED, followed by @p data as it is, in @p out
+   * 
+   * @return False if @p size doesn't fit the header
+   */
+  static bool store(const char *data, size_t size, std::string &out);
+  
+  /**
+   * Writes the HEADER_SIZE bytes of the header with the id STORED for a payload of @p size bytes
+   * to @p out, for payloads which are sent separately from their header
+   * 
+   * @return False if @p size doesn't fit the header
+   */
+  static bool storedHeader(size_t size, char *out);
+  
+  /**
+   * Returns true if @p data starts with a compression header
+   */
+  static bool isCompressed(const char *data, size_t size);
+  
+  /**
+   * Decompresses a payload with the codec named by its header.
+   * 
+   * @return False if the payload is corrupt, or compressed with a codec which isn't registered
+   */
+  static bool decode(const char *data, size_t size, std::string &out);
+  
+  /**
+   * Makes a codec available for decoding. The codec must outlive all calls to @c decode.
+   */
+  static void registerCodec(const Codec *codec);
+  
+  /**
+   * Returns the codec registered with @p id, or NULL if there is none
+   */
+  static const Codec *byId(uint8_t id);
+};
+
+/**
+ * zlib (deflate) compression, through Boost.Iostreams. Registered by default, with id 1.
+ */
+class ZlibCodec: public Codec {
+public:
+  /**
+   * @param level The zlib compression level, from 1 (fastest) to 9 (smallest)
+   */
+  ZlibCodec(int level = 1);
+  
+  virtual uint8_t id() const;
+  virtual void compress(const char *data, size_t size, std::string &out) const;
+  virtual bool decompress(const char *data, size_t size, size_t limit, std::string &out) const;
+private:
+  int level;
+};
+
+}
+
+#endif
@@ -0,0 +1,100 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+// The reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+namespace {
+
+class Crc32cTable {
+public:
+  Crc32cTable() {
+    for(uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for(int bit = 0; bit < 8; bit++)
+        crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+      this->table[i] = crc;
+    }
+  }
+  
+  uint32_t table[256];
+};
+
+const Crc32cTable crcTable;
+
+uint32_t crc32cSoftware(const char *data, size_t size, uint32_t crc) {
+  const uint8_t *p = (const uint8_t *)data;
+  
+  while(size--)
+    crc = crcTable.table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  
+  return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(const char *data, size_t size, uint32_t crc) {
+  uint64_t crc64 = crc;
+  
+  while(size >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    size -= 8;
+  }
+  
+  crc = (uint32_t)crc64;
+  while(size--)
+    crc = _mm_crc32_u8(crc, (uint8_t)*data++);
+  
+  return crc;
+}
+
+bool detectHardwareCrc() {
+  // Needed since we may run before the constructors of libgcc
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+}
+
+const bool hasHardwareCrc = detectHardwareCrc();
+#endif
+
+}
+
+uint32_t Beanstalkpp::crc32c(const char* data, size_t size, uint32_t crc) {
+  crc = ~crc;
+
+#ifdef HAVE_SSE42_CRC
+  if(hasHardwareCrc)
+    return ~crc32cHardware(data, size, crc);
+#endif
+
+  return ~crc32cSoftware(data, size, crc);
+}
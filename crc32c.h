@@ -0,0 +1,43 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_CRC32C_H
+#define _BEANSTALK_CRC32C_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace Beanstalkpp {
+
+/**
+ * Computes the CRC32C (Castagnoli) checksum of @p size bytes from @p data.
+ * 
+ * Uses the SSE 4.2 crc32 instruction when the CPU supports it, and a table driven implementation
+ * otherwise.
+ * 
+ * @param data The data to checksum
+ * @param size The number of bytes in @p data
+ * @param crc  The checksum of preceding data, to checksum data in several parts
+ */
+uint32_t crc32c(const char *data, size_t size, uint32_t crc = 0);
+
+}
+
+#endif
@@ -0,0 +1,81 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "envelope.h"
+
+#include <chrono>
+#include <cstring>
+
+#include "crc32c.h"
+
+static const char magic[] = { 0x00, 'B', 'E' };
+
+const size_t Beanstalkpp::Envelope::SIZE;
+const uint8_t Beanstalkpp::Envelope::VERSION;
+
+static inline uint64_t readLittleEndian(const char *p, int bytes) {
+  uint64_t v = 0;
+  for(int i = 0; i < bytes; i++)
+    v |= (uint64_t)(uint8_t)p[i] << (8 * i);
+  
+  return v;
+}
+
+static inline void writeLittleEndian(char *p, uint64_t v, int bytes) {
+  for(int i = 0; i < bytes; i++)
+    p[i] = (char)((v >> (8 * i)) & 0xff);
+}
+
+Beanstalkpp::Envelope::Envelope(): version(0), contentType(0), timestamp(0), crc(0) {
+
+}
+
+bool Beanstalkpp::Envelope::isEnveloped(const char* data, size_t size) {
+  return size >= SIZE && memcmp(data, magic, sizeof(magic)) == 0;
+}
+
+bool Beanstalkpp::Envelope::parse(const char* data, size_t size) {
+  if(!isEnveloped(data, size) || (uint8_t)data[3] != VERSION) return false;
+  
+  this->version = (uint8_t)data[3];
+  this->contentType = readLittleEndian(data + 4, 2);
+  this->timestamp = readLittleEndian(data + 6, 8);
+  this->crc = readLittleEndian(data + 14, 4);
+  
+  return true;
+}
+
+void Beanstalkpp::Envelope::write(char* out, uint16_t contentType, const char* body, size_t size) {
+  memcpy(out, magic, sizeof(magic));
+  out[3] = (char)VERSION;
+  writeLittleEndian(out + 4, contentType, 2);
+  writeLittleEndian(out + 6, now(), 8);
+  writeLittleEndian(out + 14, crc32c(body, size), 4);
+}
+
+bool Beanstalkpp::Envelope::verify(const char* body, size_t size) const {
+  return crc32c(body, size) == this->crc;
+}
+
+uint64_t Beanstalkpp::Envelope::now() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()
+  ).count();
+}
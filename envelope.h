@@ -0,0 +1,84 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_ENVELOPE_H
+#define _BEANSTALK_ENVELOPE_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace Beanstalkpp {
+
+/**
+ * Metadata written in front of a payload by @c Client::setEnvelope.
+ * 
+ * The envelope is 18 bytes, all integers little endian:
+ * 
+ *   0x00 'B' 'E'   magic
+ *   uint8          version
+ *   uint16         content type, chosen by the application
+ *   uint64         producer timestamp, in microseconds since the epoch
+ *   uint32         CRC32C of the body following the envelope
+ * 
+ * The body may in turn be compressed (see @c Codec).
+ */
+struct Envelope {
+  static const size_t SIZE = 18;
+  static const uint8_t VERSION = 1;
+  
+  Envelope();
+  
+  uint8_t version;
+  uint16_t contentType;
+  uint64_t timestamp;
+  uint32_t crc;
+  
+  /**
+   * Returns true if @p data starts with an envelope
+   */
+  static bool isEnveloped(const char *data, size_t size);
+  
+  /**
+   * Parses the envelope at the start of @p data
+   * 
+   * @return False if @p data doesn't start with an envelope, or with one of another version
+   */
+  bool parse(const char *data, size_t size);
+  
+  /**
+   * Writes an envelope for @p body into @p out, which must have room for SIZE bytes. The timestamp
+   * is set to the current time.
+   */
+  static void write(char *out, uint16_t contentType, const char *body, size_t size);
+  
+  /**
+   * Returns true if @p body matches the checksum of the envelope
+   */
+  bool verify(const char *body, size_t size) const;
+  
+  /**
+   * Returns the current time in microseconds since the epoch, as used for the timestamp
+   */
+  static uint64_t now();
+};
+
+}
+
+#endif
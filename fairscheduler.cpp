@@ -0,0 +1,188 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "fairscheduler.h"
+
+#include "client.h"
+#include "statspoller.h"
+
+using namespace std;
+
+Beanstalkpp::FairScheduler::FairScheduler(Beanstalkpp::Client& client):
+  client(client), quantum(1), current(0), inTurn(false), poller(NULL), misses(0), switches(0) {
+}
+
+void Beanstalkpp::FairScheduler::setTube(const std::string& tube, unsigned int weight) {
+  map<string, size_t>::const_iterator i = this->index.find(tube);
+  if(i != this->index.end()) {
+    this->tubes[i->second].weight = weight;
+    return;
+  }
+  
+  Tube t;
+  t.name = tube;
+  t.weight = weight;
+  t.deficit = 0;
+  t.empty = false;
+  
+  this->index[tube] = this->tubes.size();
+  this->tubes.push_back(t);
+}
+
+void Beanstalkpp::FairScheduler::removeTube(const std::string& tube) {
+  map<string, size_t>::iterator i = this->index.find(tube);
+  if(i == this->index.end()) return;
+  
+  size_t removed = i->second;
+  this->index.erase(i);
+  this->tubes.erase(this->tubes.begin() + removed);
+  
+  for(map<string, size_t>::iterator j = this->index.begin(); j != this->index.end(); j++)
+    if(j->second > removed) j->second--;
+  
+  // The next tube takes the removed one's place
+  if(this->current == removed) this->inTurn = false;
+  if(this->current > removed) this->current--;
+  if(this->current >= this->tubes.size()) this->current = 0;
+}
+
+void Beanstalkpp::FairScheduler::setQuantum(unsigned int jobs) {
+  this->quantum = jobs;
+}
+
+void Beanstalkpp::FairScheduler::setPoller(const Beanstalkpp::StatsPoller* poller) {
+  this->poller = poller;
+  this->sample.reset();
+}
+
+void Beanstalkpp::FairScheduler::update(const Beanstalkpp::ClusterSample& sample) {
+  for(size_t i = 0; i < this->tubes.size(); i++)
+    this->tubes[i].empty = true;
+  
+  for(size_t i = 0; i < sample.tubes.size(); i++) {
+    map<string, size_t>::const_iterator t = this->index.find(sample.tubes[i].name);
+    if(t != this->index.end() && sample.tubes[i].ready > 0) this->tubes[t->second].empty = false;
+  }
+}
+
+void Beanstalkpp::FairScheduler::advance() {
+  this->current = (this->current + 1) % this->tubes.size();
+  this->inTurn = false;
+}
+
+bool Beanstalkpp::FairScheduler::reserve(Beanstalkpp::job_p_t& jobPtr) {
+  return this->tryReserve(jobPtr).get("reserve");
+}
+
+Beanstalkpp::Result<bool> Beanstalkpp::FairScheduler::tryReserve(Beanstalkpp::job_p_t& jobPtr) {
+  if(this->poller) {
+    boost::shared_ptr<const ClusterSample> newest = this->poller->latest();
+    if(newest && newest != this->sample) {
+      this->sample = newest;
+      this->update(*newest);
+    }
+  }
+  
+  if(this->tubes.empty()) return false;
+  
+  // Every tube gets at most one turn, plus the rest of the current one
+  for(size_t turns = 0; turns <= this->tubes.size();) {
+    Tube &t = this->tubes[this->current];
+    
+    if(!this->inTurn) {
+      if(t.empty) {
+        // An idle tube doesn't save up its turns
+        t.deficit = 0;
+        this->advance();
+        turns++;
+        continue;
+      }
+      
+      t.deficit += (uint64_t)t.weight * this->quantum;
+      this->inTurn = true;
+    }
+    
+    if(t.deficit == 0) {
+      this->advance();
+      turns++;
+      continue;
+    }
+    
+    Result<bool> found = this->reserveFrom(t.name, jobPtr);
+    if(!found) return found;
+    
+    if(found.value()) {
+      t.deficit--;
+      this->lastTube = t.name;
+      return true;
+    }
+    
+    this->misses++;
+    t.empty = true;
+    t.deficit = 0;
+    this->advance();
+    turns++;
+  }
+  
+  // Without a poller nothing would tell us when the tubes get jobs again
+  if(!this->poller) {
+    for(size_t i = 0; i < this->tubes.size(); i++)
+      this->tubes[i].empty = false;
+  }
+  
+  return false;
+}
+
+Beanstalkpp::Result<bool> Beanstalkpp::FairScheduler::reserveFrom(
+  const std::string& tube, Beanstalkpp::job_p_t& jobPtr
+) {
+  const set<string> &watched = this->client.getWatchedTubes();
+  if(watched.size() == 1 && *watched.begin() == tube)
+    return this->client.tryReserveWithTimeout(jobPtr, 0);
+  
+  set<string> tubes;
+  tubes.insert(tube);
+  
+  Status s = this->client.trySendWatchList(tubes);
+  if(!s) return s.failure();
+  
+  s = this->client.trySendReserve(0);
+  if(!s) return s.failure();
+  
+  this->switches++;
+  
+  Result<size_t> switched = this->client.tryReadWatchList();
+  Result<bool> found = this->client.tryReadReserve(jobPtr);
+  if(!switched) return switched.failure();
+  
+  return found;
+}
+
+const std::string& Beanstalkpp::FairScheduler::getLastTube() const {
+  return this->lastTube;
+}
+
+uint64_t Beanstalkpp::FairScheduler::getMisses() const {
+  return this->misses;
+}
+
+uint64_t Beanstalkpp::FairScheduler::getSwitches() const {
+  return this->switches;
+}
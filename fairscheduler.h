@@ -0,0 +1,166 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_FAIRSCHEDULER_H
+#define _BEANSTALK_FAIRSCHEDULER_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include "job.h"
+#include "result.h"
+
+namespace Beanstalkpp {
+
+class Client;
+class StatsPoller;
+struct ClusterSample;
+
+/**
+ * Reserves jobs from a set of tubes, e.g. one per tenant, sharing the reserves between the tubes
+ * by weight with deficit round-robin, so a tube with a large backlog can't starve the others.
+ * 
+ * The tubes take turns. Each turn adds the tube's weight times the quantum to its deficit, and
+ * the tube is reserved from until the deficit is spent or the tube runs empty. Beanstalkd reserves
+ * from the whole watch list, so the watch list is switched to the tube at the start of its turn:
+ * the watch and ignore commands are pipelined with the first reserve, in one round trip.
+ * 
+ * Tubes the stats poller reports as having no ready jobs are skipped without a round trip. The
+ * poller sums all servers, so a tube is probed whenever any server has jobs for it. A tube found
+ * empty by a reserve is skipped until the next sample. Without a poller, each tube is probed once
+ * per idle round.
+ */
+class FairScheduler {
+public:
+  /**
+   * @param client A connected client. The scheduler replaces its watch list.
+   */
+  FairScheduler(Client &client);
+  
+  /**
+   * Adds @p tube, or changes its weight if it was already added. Tubes take turns in the order
+   * they were added.
+   * 
+   * @param weight The share of the reserves given to the tube, relative to the other weights
+   */
+  void setTube(const std::string &tube, unsigned int weight = 1);
+  
+  /**
+   * Stops reserving from @p tube
+   */
+  void removeTube(const std::string &tube);
+  
+  /**
+   * Sets the number of jobs reserved in a turn per unit of weight. Defaults to 1; larger quanta
+   * take fewer watch list switches, at the cost of coarser fairness.
+   */
+  void setQuantum(unsigned int jobs);
+  
+  /**
+   * Takes the ready counts from the newest sample of @p poller before each reserve, or stops
+   * doing so if NULL. The scheduler doesn't take ownership of the poller.
+   */
+  void setPoller(const StatsPoller *poller);
+  
+  /**
+   * Skips the tubes without ready jobs in @p sample, and probes the others again
+   */
+  void update(const ClusterSample &sample);
+  
+  /**
+   * Reserves a job from the tube whose turn it is, without waiting for jobs to arrive
+   * 
+   * @return Whether a job was found and put into @p jobPtr. False means a whole round found no
+   *         jobs, and the caller should wait, e.g. for the next poll.
+   */
+  Result<bool> tryReserve(job_p_t &jobPtr);
+  
+  /**
+   * Throwing version of @c tryReserve
+   */
+  bool reserve(job_p_t &jobPtr);
+  
+  /**
+   * Returns the tube of the job reserved last
+   */
+  const std::string &getLastTube() const;
+  
+  /**
+   * Returns the number of reserves which found their tube empty
+   */
+  uint64_t getMisses() const;
+  
+  /**
+   * Returns the number of times the watch list was switched to another tube
+   */
+  uint64_t getSwitches() const;
+private:
+  struct Tube {
+    std::string name;
+    unsigned int weight;
+    uint64_t deficit;
+    
+    /**
+     * Known to have no ready jobs, from the poller or a reserve
+     */
+    bool empty;
+  };
+  
+  /**
+   * Ends the turn of the current tube
+   */
+  void advance();
+  
+  /**
+   * Reserves a job from @p tube, switching the watch list first if needed
+   */
+  Result<bool> reserveFrom(const std::string &tube, job_p_t &jobPtr);
+  
+  Client &client;
+  
+  std::vector<Tube> tubes;
+  
+  /**
+   * Index of each tube in tubes
+   */
+  std::map<std::string, size_t> index;
+  
+  unsigned int quantum;
+  
+  /**
+   * The tube whose turn it is, and whether its turn has started
+   */
+  size_t current;
+  bool inTurn;
+  
+  const StatsPoller *poller;
+  boost::shared_ptr<const ClusterSample> sample;
+  
+  std::string lastTube;
+  uint64_t misses;
+  uint64_t switches;
+};
+
+}
+
+#endif
@@ -0,0 +1,351 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "hedgedproducer.h"
+
+#include <algorithm>
+
+#include "client.h"
+
+using namespace std;
+
+// Put latencies kept per server
+#define LATENCY_SAMPLES 128
+
+// Put latencies needed before the percentile is trusted as hedge delay
+#define MIN_SAMPLES 20
+
+// The backoff of a failed server, doubling from the first to the longest
+#define RETRY_MIN_MS 100
+#define RETRY_MAX_MS 10000
+
+Beanstalkpp::HedgedProducer::HedgedProducer(const std::vector<Client*>& clients):
+  tube("default"), minDelayUs(1000), maxDelayUs(1000000), hedged(0), hedgeWins(0), duplicates(0) {
+  for(size_t i = 0; i < clients.size(); i++) {
+    Server s;
+    s.client = clients[i];
+    s.nextLatency = 0;
+    s.info.primaries = 0;
+    s.info.hedges = 0;
+    s.info.wins = 0;
+    s.info.meanUs = 0;
+    s.info.p95Us = 0;
+    s.info.failed = false;
+    s.info.failures = 0;
+    
+    this->servers.push_back(s);
+  }
+}
+
+void Beanstalkpp::HedgedProducer::use(const std::string& tube) {
+  this->tube = tube;
+}
+
+void Beanstalkpp::HedgedProducer::setHedgeDelay(unsigned int minUs, unsigned int maxUs) {
+  this->minDelayUs = minUs;
+  this->maxDelayUs = maxUs;
+}
+
+Beanstalkpp::HedgedPut Beanstalkpp::HedgedProducer::put(const std::string& data) {
+  return this->tryPut(data).get("put");
+}
+
+Beanstalkpp::Result<Beanstalkpp::HedgedPut> Beanstalkpp::HedgedProducer::tryPut(
+  const std::string& data
+) {
+  this->readmit();
+  
+  // Collect the replies to losing copies which have arrived meanwhile
+  for(size_t i = 0; i < this->servers.size(); i++) {
+    Server &s = this->servers[i];
+    if(s.info.failed) continue;
+    
+    Status st = this->settle(s, false);
+    if(!st) this->fail(s, st.failure());
+  }
+  
+  Failure last(ServerException::NETWORK_ERROR);
+  
+  int primary = this->pick(-1);
+  for(; primary >= 0; primary = this->pick(-1)) {
+    Status st = this->send(this->servers[primary], data);
+    if(st) break;
+    
+    last = this->fail(this->servers[primary], st.failure());
+  }
+  if(primary < 0) return last;
+  
+  this->servers[primary].info.primaries++;
+  clock::time_point primarySent = clock::now();
+  
+  int hedge = -1;
+  clock::time_point hedgeSent;
+  
+  Result<bool> replied = this->servers[primary].client->tryWaitReply(
+    this->hedgeDelay(this->servers[primary])
+  );
+  
+  if(replied && !replied.value()) {
+    for(hedge = this->pick(primary); hedge >= 0; hedge = this->pick(primary)) {
+      if(this->send(this->servers[hedge], data)) break;
+      this->fail(this->servers[hedge], Failure(ServerException::NETWORK_ERROR));
+    }
+    
+    if(hedge >= 0) {
+      hedgeSent = clock::now();
+      this->servers[hedge].info.hedges++;
+      this->hedged++;
+    }
+  }
+  
+  for(;;) {
+    int winner = primary;
+    
+    if(hedge >= 0) {
+      vector<Client*> clients;
+      clients.push_back(this->servers[primary].client);
+      clients.push_back(this->servers[hedge].client);
+      
+      Result<int> ready = Client::tryWaitReply(clients, -1);
+      if(!ready) return ready.failure();
+      if(ready.value() == 1) winner = hedge;
+    }
+    
+    int loser = hedge < 0 ? -1 : (winner == primary ? hedge : primary);
+    clock::time_point sent = winner == primary ? primarySent : hedgeSent;
+    Server &w = this->servers[winner];
+    
+    Result<job_id_t> id = w.client->tryReadPutReply();
+    this->recordLatency(
+      w, chrono::duration_cast<chrono::microseconds>(clock::now() - sent).count()
+    );
+    
+    if(id || id.error() == ServerException::JOB_TOO_BIG) {
+      if(loser >= 0) {
+        Pending p;
+        p.isDelete = false;
+        p.sent = loser == primary ? primarySent : hedgeSent;
+        this->servers[loser].pending.push_back(p);
+      }
+      
+      if(!id) return id.failure();
+      
+      w.info.wins++;
+      w.info.failures = 0;
+      if(winner == hedge) this->hedgeWins++;
+      
+      HedgedPut ret;
+      ret.jobId = id.value();
+      ret.server = winner;
+      ret.hedged = hedge >= 0;
+      return ret;
+    }
+    
+    last = this->fail(w, id.failure());
+    if(loser < 0) return last;
+    
+    // The other copy may still make it
+    primary = loser;
+    primarySent = loser == hedge ? hedgeSent : primarySent;
+    hedge = -1;
+  }
+}
+
+Beanstalkpp::Status Beanstalkpp::HedgedProducer::tryFlush() {
+  Failure last(ServerException::NETWORK_ERROR);
+  bool failed = false;
+  
+  for(size_t i = 0; i < this->servers.size(); i++) {
+    Server &s = this->servers[i];
+    if(s.info.failed) continue;
+    
+    Status st = this->settle(s, true);
+    if(!st) {
+      last = this->fail(s, st.failure());
+      failed = true;
+    }
+  }
+  
+  if(failed) return last;
+  return Status();
+}
+
+Beanstalkpp::HedgedProducer::ServerInfo Beanstalkpp::HedgedProducer::getServerInfo(
+  size_t index
+) const {
+  return this->servers[index].info;
+}
+
+uint64_t Beanstalkpp::HedgedProducer::getHedged() const {
+  return this->hedged;
+}
+
+uint64_t Beanstalkpp::HedgedProducer::getHedgeWins() const {
+  return this->hedgeWins;
+}
+
+uint64_t Beanstalkpp::HedgedProducer::getDuplicates() const {
+  return this->duplicates;
+}
+
+void Beanstalkpp::HedgedProducer::recordLatency(Server& s, uint64_t us) {
+  if(s.latencies.size() < LATENCY_SAMPLES) {
+    s.latencies.push_back(us);
+  } else {
+    s.latencies[s.nextLatency] = us;
+    s.nextLatency = (s.nextLatency + 1) % LATENCY_SAMPLES;
+  }
+  
+  uint64_t sum = 0;
+  for(size_t i = 0; i < s.latencies.size(); i++)
+    sum += s.latencies[i];
+  s.info.meanUs = (double)sum / s.latencies.size();
+  
+  vector<uint64_t> sorted(s.latencies);
+  vector<uint64_t>::iterator p95 = sorted.begin() + sorted.size() * 95 / 100;
+  nth_element(sorted.begin(), p95, sorted.end());
+  s.info.p95Us = *p95;
+}
+
+int Beanstalkpp::HedgedProducer::hedgeDelay(const Server& s) const {
+  uint64_t us = this->maxDelayUs;
+  if(s.latencies.size() >= MIN_SAMPLES)
+    us = std::max<uint64_t>(this->minDelayUs, std::min<uint64_t>(this->maxDelayUs, s.info.p95Us));
+  
+  // Poll works in milliseconds
+  return (int)((us + 999) / 1000);
+}
+
+int Beanstalkpp::HedgedProducer::pick(int exclude) {
+  bool idleOnly = false;
+  for(size_t i = 0; i < this->servers.size(); i++) {
+    const Server &s = this->servers[i];
+    if((int)i != exclude && !s.info.failed && s.pending.empty()) idleOnly = true;
+  }
+  
+  vector<double> weights(this->servers.size(), 0.0);
+  double total = 0;
+  
+  for(size_t i = 0; i < this->servers.size(); i++) {
+    const Server &s = this->servers[i];
+    if((int)i == exclude || s.info.failed || (idleOnly && !s.pending.empty())) continue;
+    
+    // Servers without samples yet count as fast, so they get tried
+    weights[i] = 1.0 / std::max(1.0, s.info.meanUs);
+    total += weights[i];
+  }
+  
+  if(total == 0) return -1;
+  
+  double r = uniform_real_distribution<double>(0, total)(this->random);
+  for(size_t i = 0; i < weights.size(); i++) {
+    if(weights[i] == 0) continue;
+    
+    if(r < weights[i]) return (int)i;
+    r -= weights[i];
+  }
+  
+  // Rounding left r at the total
+  for(size_t i = weights.size(); i > 0; i--)
+    if(weights[i - 1] > 0) return (int)(i - 1);
+  
+  return -1;
+}
+
+Beanstalkpp::Status Beanstalkpp::HedgedProducer::settle(Server& s, bool block) {
+  while(!s.pending.empty()) {
+    if(!block) {
+      Result<bool> replied = s.client->tryWaitReply(0);
+      if(!replied) return replied.failure();
+      if(!replied.value()) break;
+    }
+    
+    Pending p = s.pending.front();
+    s.pending.pop_front();
+    
+    if(p.isDelete) {
+      Status st = s.client->tryReadDelete();
+      if(st) continue;
+      
+      // Reserved by a consumer before we could delete it
+      if(st.error() == ServerException::NOT_FOUND) {
+        this->duplicates++;
+        continue;
+      }
+      
+      return st;
+    }
+    
+    Result<job_id_t> id = s.client->tryReadPutReply();
+    this->recordLatency(
+      s, chrono::duration_cast<chrono::microseconds>(clock::now() - p.sent).count()
+    );
+    
+    if(!id) {
+      if(id.error() == ServerException::JOB_TOO_BIG) continue;
+      return id.failure();
+    }
+    
+    Status st = s.client->trySendDelete(id.value());
+    if(!st) return st;
+    
+    p.isDelete = true;
+    p.sent = clock::now();
+    s.pending.push_back(p);
+  }
+  
+  return Status();
+}
+
+Beanstalkpp::Status Beanstalkpp::HedgedProducer::send(Server& s, const std::string& data) {
+  // Otherwise the reply to the put would be mistaken for an older one
+  Status st = this->settle(s, true);
+  if(!st) return st;
+  
+  st = s.client->tryUse(this->tube);
+  if(!st) return st;
+  
+  return s.client->trySendPut(data);
+}
+
+void Beanstalkpp::HedgedProducer::readmit() {
+  clock::time_point now = clock::now();
+  
+  for(size_t i = 0; i < this->servers.size(); i++) {
+    Server &s = this->servers[i];
+    if(!s.info.failed || s.retryAt > now) continue;
+    
+    // The connection may still carry replies that were owed, so it's never used again as is
+    if(s.client->tryReconnect()) s.info.failed = false;
+    else this->fail(s, Failure(ServerException::NETWORK_ERROR));
+  }
+}
+
+Beanstalkpp::Failure Beanstalkpp::HedgedProducer::fail(Server& s, const Failure& f) {
+  s.info.failed = true;
+  s.pending.clear();
+  
+  unsigned int backoffMs = RETRY_MAX_MS;
+  if(s.info.failures < 16) backoffMs = std::min(RETRY_MAX_MS, RETRY_MIN_MS << s.info.failures);
+  s.info.failures++;
+  s.retryAt = clock::now() + chrono::milliseconds(backoffMs);
+  
+  return f;
+}
@@ -0,0 +1,241 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_HEDGEDPRODUCER_H
+#define _BEANSTALK_HEDGEDPRODUCER_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "job.h"
+#include "result.h"
+
+namespace Beanstalkpp {
+
+class Client;
+
+/**
+ * The outcome of a put through @c HedgedProducer
+ */
+struct HedgedPut {
+  /**
+   * The id of the job on the server which inserted it first
+   */
+  job_id_t jobId;
+  
+  /**
+   * The index of that server, in the clients given to the producer
+   */
+  size_t server;
+  
+  /**
+   * Whether the put was sent to a second server, because the first was slow to reply
+   */
+  bool hedged;
+};
+
+/**
+ * Puts jobs to one of several servers which can all take them, cutting the tail latency caused by
+ * an occasionally slow server, e.g. one stalled on a binlog fsync.
+ * 
+ * Each put is sent to a primary server. If it isn't inserted within the hedge delay, the put is
+ * sent to a second server as well, and the first copy inserted wins. The hedge delay is the 95th
+ * percentile of the primary's recent put latencies, so about one put in twenty is hedged.
+ * 
+ * The losing copy can't be cancelled. Its reply is read during a later put, without waiting for
+ * it, and the copy is then deleted. A consumer may reserve it before that, so hedged jobs may be
+ * processed twice; see @c getDuplicates.
+ * 
+ * The primary is picked at random, weighted by the inverse of each server's mean put latency, so
+ * slow servers get fewer puts. Servers still owing replies are avoided. A server that fails is left
+ * out for a backoff which doubles with every failure in a row, and is then reconnected and tried
+ * again.
+ */
+class HedgedProducer {
+public:
+  /**
+   * The put latencies and counters of one server
+   */
+  struct ServerInfo {
+    /**
+     * Puts sent to the server as primary, and as hedge
+     */
+    uint64_t primaries;
+    uint64_t hedges;
+    
+    /**
+     * Puts the server won
+     */
+    uint64_t wins;
+    
+    /**
+     * Mean and 95th percentile of the recent put latencies, in microseconds
+     */
+    double meanUs;
+    uint64_t p95Us;
+    
+    /**
+     * Whether the server is left out after a failure, and how often it failed in a row
+     */
+    bool failed;
+    unsigned int failures;
+  };
+  
+  /**
+   * @param clients Connected clients, one per server. The producer doesn't take ownership of them,
+   *                and they shouldn't be used by others meanwhile.
+   */
+  HedgedProducer(const std::vector<Client*> &clients);
+  
+  /**
+   * Selects the tube to put jobs into on all servers. Defaults to "default".
+   */
+  void use(const std::string &tube);
+  
+  /**
+   * Sets the shortest and longest hedge delay, in microseconds. Defaults to 1000 and 1000000. The
+   * longest delay is also used until a server has replied to a few puts.
+   */
+  void setHedgeDelay(unsigned int minUs, unsigned int maxUs);
+  
+  /**
+   * Puts a job with the default priority, delay and ttr of @c Client::put
+   * 
+   * @return The first copy inserted, or the failure of the last server tried. JOB_TOO_BIG is
+   *         returned at once, as the other servers would reject the job too.
+   */
+  Result<HedgedPut> tryPut(const std::string &data);
+  
+  /**
+   * Throwing version of @c tryPut
+   */
+  HedgedPut put(const std::string &data);
+  
+  /**
+   * Waits for the replies still owed for losing copies, and deletes those copies
+   */
+  Status tryFlush();
+  
+  /**
+   * Returns the latencies and counters of the server @p index
+   */
+  ServerInfo getServerInfo(size_t index) const;
+  
+  /**
+   * Returns the number of puts sent to two servers, and how many of those the second one won
+   */
+  uint64_t getHedged() const;
+  uint64_t getHedgeWins() const;
+  
+  /**
+   * Returns the number of losing copies reserved before they could be deleted
+   */
+  uint64_t getDuplicates() const;
+private:
+  typedef std::chrono::steady_clock clock;
+  
+  /**
+   * A reply the server owes
+   */
+  struct Pending {
+    bool isDelete;
+    clock::time_point sent;
+  };
+  
+  struct Server {
+    Client *client;
+    
+    /**
+     * Recent put latencies in microseconds, a ring of LATENCY_SAMPLES
+     */
+    std::vector<uint64_t> latencies;
+    size_t nextLatency;
+    
+    /**
+     * Replies to losing copies and their deletes, oldest first
+     */
+    std::deque<Pending> pending;
+    
+    /**
+     * When a failed server is reconnected and tried again
+     */
+    clock::time_point retryAt;
+    
+    ServerInfo info;
+  };
+  
+  /**
+   * Records a put latency of @p us microseconds for @p s
+   */
+  void recordLatency(Server &s, uint64_t us);
+  
+  /**
+   * Returns the hedge delay of @p s in milliseconds
+   */
+  int hedgeDelay(const Server &s) const;
+  
+  /**
+   * Picks a server, other than @p exclude, by weighted random choice among the servers owing no
+   * replies, or among all servers that haven't failed if every one owes replies
+   * 
+   * @return The index of the server, or -1 if there is none
+   */
+  int pick(int exclude);
+  
+  /**
+   * Reads the replies @p s owes, deleting losing copies as they are found. Without @p block only
+   * the replies that have arrived are read.
+   */
+  Status settle(Server &s, bool block);
+  
+  /**
+   * Reconnects the failed servers whose backoff has run out, and takes them back in
+   */
+  void readmit();
+  
+  /**
+   * Sends @p data to @p s, after reading the replies it owes
+   */
+  Status send(Server &s, const std::string &data);
+  
+  /**
+   * Marks @p s failed until its backoff runs out, and returns @p f
+   */
+  Failure fail(Server &s, const Failure &f);
+  
+  std::vector<Server> servers;
+  std::string tube;
+  unsigned int minDelayUs;
+  unsigned int maxDelayUs;
+  
+  std::minstd_rand random;
+  
+  uint64_t hedged;
+  uint64_t hedgeWins;
+  uint64_t duplicates;
+};
+
+}
+
+#endif
@@ -23,25 +23,51 @@
 #include <sstream>
 
 #include "exception.h"
+#include "codec.h"
+#include "client.h"
+
+#include <boost/checked_delete.hpp>
 
 using namespace std;
 
+/**
+ * The body of a payload, once the envelope and compression have been removed
+ */
+struct Beanstalkpp::Job::Decoded {
+  Decoded(): data(NULL), size(0) {}
+  
+  /**
+   * Holds the body if the payload was compressed
+   */
+  std::string decompressed;
+  
+  const char *data;
+  size_t size;
+};
+
 Beanstalkpp::Job::Job() {
   client = NULL;
   this->payloadSize = 0;
   this->jobId = 0;
+  this->envelopes = false;
+  this->compression = false;
 }
 
 
 Beanstalkpp::Job::Job(Beanstalkpp::Client& c, job_id_t jobId, size_t payloadSize, char* payload):
-  client(&c), payload(payload) {
+  client(&c), payload(payload, boost::checked_array_deleter<char>()) {
   this->payloadSize = payloadSize;
   this->jobId = jobId;
+  this->envelopes = c.getEnvelope();
+  this->compression = c.getCompression() != NULL;
 }
 
-Beanstalkpp::Job::Job(const Beanstalkpp::Job& job): client(job.client), payload(job.payload) {
+Beanstalkpp::Job::Job(const Beanstalkpp::Job& job): client(job.client), payload(job.payload),
+  decoded(job.decoded) {
   this->payloadSize = job.payloadSize;
   this->jobId = job.jobId;
+  this->envelopes = job.envelopes;
+  this->compression = job.compression;
 }
 
 
@@ -51,7 +77,7 @@ Beanstalkpp::Job::~Job() {
 
 std::string Beanstalkpp::Job::asString() const {
   std::string s;
-  s.assign((const char*)this->payload.get(), this->payloadSize);
+  s.assign(this->data(), this->size());
   
   return s;
 }
@@ -61,6 +87,9 @@ Beanstalkpp::Job Beanstalkpp::Job::operator=(const Beanstalkpp::Job& job) {
   this->client = job.client;
   this->payload = job.payload;
   this->jobId = job.jobId;
+  this->envelopes = job.envelopes;
+  this->compression = job.compression;
+  this->decoded = job.decoded;
   
   return *this;
 }
@@ -77,3 +106,70 @@ int Beanstalkpp::Job::asAsciiInt() const {
   
   return ret;
 }
+
+const char* Beanstalkpp::Job::data() const {
+  if(!this->isEncoded()) return this->payload.get();
+  
+  return this->decode().data;
+}
+
+size_t Beanstalkpp::Job::size() const {
+  if(!this->isEncoded()) return this->payloadSize;
+  
+  return this->decode().size;
+}
+
+bool Beanstalkpp::Job::getEnvelope(Beanstalkpp::Envelope& envelope) const {
+  return envelope.parse(this->payload.get(), this->payloadSize);
+}
+
+int64_t Beanstalkpp::Job::queueLatency() const {
+  Envelope envelope;
+  if(!this->getEnvelope(envelope)) return -1;
+  
+  return (int64_t)(Envelope::now() - envelope.timestamp);
+}
+
+bool Beanstalkpp::Job::verify() const {
+  Envelope envelope;
+  if(!this->getEnvelope(envelope)) return true;
+  
+  return envelope.verify(this->payload.get() + Envelope::SIZE, this->payloadSize - Envelope::SIZE);
+}
+
+bool Beanstalkpp::Job::isEncoded() const {
+  // Payloads are only looked into when the client expects them to be encoded, a typed or raw 
+  // payload may start with the same bytes
+  return (this->envelopes || this->compression) &&
+    this->payloadSize > 0 && this->payload.get()[0] == 0;
+}
+
+const Beanstalkpp::Job::Decoded& Beanstalkpp::Job::decode() const {
+  if(this->decoded) return *this->decoded;
+  
+  boost::shared_ptr<Decoded> d(new Decoded);
+  d->data = this->payload.get();
+  d->size = this->payloadSize;
+  
+  Envelope envelope;
+  if(this->envelopes && Envelope::isEnveloped(d->data, d->size)) {
+    if(!envelope.parse(d->data, d->size)) throw Exception("Unsupported envelope version");
+    
+    d->data += Envelope::SIZE;
+    d->size -= Envelope::SIZE;
+    
+    if(!envelope.verify(d->data, d->size))
+      throw Exception("Payload doesn't match the checksum in its envelope");
+  }
+  
+  if(this->compression && Codec::isCompressed(d->data, d->size)) {
+    if(!Codec::decode(d->data, d->size, d->decompressed))
+      throw Exception("Unable to decompress payload");
+    
+    d->data = d->decompressed.data();
+    d->size = d->decompressed.size();
+  }
+  
+  this->decoded = d;
+  return *d;
+}
@@ -25,6 +25,8 @@
 #include <string>
 #include <cstdint>
 
+#include "envelope.h"
+
 namespace Beanstalkpp {
   
 class Client;
@@ -63,9 +65,37 @@ public:
   
   /**
    * Treats the job as a string message and returns it.
+   * 
+   * If the client the job arrived from has envelopes enabled (see @c Client::setEnvelope), the
+   * envelope is removed and its checksum verified. If it has compression enabled (see 
+   * @c Client::setCompression), the payload is decompressed. Otherwise the payload is returned
+   * exactly as it was put.
+   * 
+   * @throws Exception If the payload is compressed, but can't be decompressed
+   * @throws Exception If the payload doesn't match the checksum in its envelope
+   * @throws Exception If the payload has an envelope of an unsupported version
    */
   std::string asString() const;
   
+  /**
+   * Returns the payload, with any envelope and compression removed. Unlike asString, this doesn't
+   * copy the payload unless it has to be decompressed. Valid as long as a copy of the job exists.
+   * 
+   * @throws Exception If the payload is compressed, but can't be decompressed
+   * @throws Exception If the payload doesn't match the checksum in its envelope
+   * @throws Exception If the payload has an envelope of an unsupported version
+   */
+  const char *data() const;
+  
+  /**
+   * Returns the size of the payload returned by @c data
+   * 
+   * @throws Exception If the payload is compressed, but can't be decompressed
+   * @throws Exception If the payload doesn't match the checksum in its envelope
+   * @throws Exception If the payload has an envelope of an unsupported version
+   */
+  size_t size() const;
+  
   /**
    * Treats the job as a number written in ascii, converts it to an int, and returns it.
    * 
@@ -80,12 +110,58 @@ public:
    */
   job_id_t getJobId() const;
   
+  /**
+   * Parses the envelope the producer wrote in front of the payload, if any.
+   * 
+   * @param envelope Receives the envelope
+   * 
+   * @return False if the job has no envelope
+   */
+  bool getEnvelope(Envelope &envelope) const;
+  
+  /**
+   * Returns the time since the job was put, in microseconds, based on the timestamp in its 
+   * envelope. Returns -1 for jobs without an envelope.
+   */
+  int64_t queueLatency() const;
+  
+  /**
+   * Checks the payload against the checksum in its envelope. Jobs without an envelope always pass.
+   */
+  bool verify() const;
+  
   Job operator =(const Job &job);
 private:
+  struct Decoded;
+  
+  /**
+   * Returns true if the payload may carry an envelope or compression the client expects. Both 
+   * start with a null byte.
+   */
+  bool isEncoded() const;
+  
+  /**
+   * Removes the envelope and compression from the payload on first use, and returns the result
+   * 
+   * @throws Exception If the payload can't be decompressed, or doesn't match its checksum
+   */
+  const Decoded &decode() const;
+  
   Client *client;
   boost::shared_ptr<char> payload;
   size_t payloadSize;
   job_id_t jobId;
+  
+  /**
+   * Whether the client the job arrived from had envelopes and compression enabled
+   */
+  bool envelopes;
+  bool compression;
+  
+  /**
+   * Cache of the decoded payload, shared between copies of the job
+   */
+  mutable boost::shared_ptr<Decoded> decoded;
 };
 
 }
@@ -0,0 +1,140 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_JOBTRAITS_H
+#define _BEANSTALK_JOBTRAITS_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace Beanstalkpp {
+
+/**
+ * Describes how values of type T are serialized into job payloads, for @c Client::put<T> and
+ * @c TypedJob<T>.
+ * 
+ * A specialization must define:
+ * 
+ *   static const bool serializable = true;
+ *   static size_t size(const T &value);                            // Bytes needed for value
+ *   static void encode(const T &value, char *out);                 // Writes size(value) bytes
+ *   static bool decode(const char *data, size_t size, T &value);  // False on malformed data
+ * 
+ * Specializations are provided for integers (fixed width, little endian), trivially copyable types
+ * (their object representation) and std::string (32 bit little endian length, then the bytes).
+ * Specialize JobTraits for your own types to put and reserve them directly.
+ */
+template<class T, class Enable = void>
+struct JobTraits {
+  static const bool serializable = false;
+};
+
+/**
+ * Integers are written as fixed width little endian numbers
+ */
+template<class T>
+struct JobTraits<T, typename std::enable_if<
+  std::is_integral<T>::value && !std::is_same<T, bool>::value
+>::type> {
+  static const bool serializable = true;
+  
+  static size_t size(const T &) {
+    return sizeof(T);
+  }
+  
+  static void encode(const T &value, char *out) {
+    typename std::make_unsigned<T>::type v = value;
+    for(size_t i = 0; i < sizeof(T); i++) {
+      out[i] = (char)(v & 0xff);
+      v >>= 8;
+    }
+  }
+  
+  static bool decode(const char *data, size_t size, T &value) {
+    if(size != sizeof(T)) return false;
+    
+    typename std::make_unsigned<T>::type v = 0;
+    for(size_t i = sizeof(T); i > 0; i--)
+      v = (v << 8) | (uint8_t)data[i - 1];
+    
+    value = (T)v;
+    return true;
+  }
+};
+
+/**
+ * Other trivially copyable types (structs, enums, bools, floating point numbers) are written as
+ * their object representation, so producers and consumers must share the type's layout.
+ */
+template<class T>
+struct JobTraits<T, typename std::enable_if<
+  std::is_trivially_copyable<T>::value &&
+  (!std::is_integral<T>::value || std::is_same<T, bool>::value) &&
+  !std::is_pointer<T>::value && !std::is_array<T>::value
+>::type> {
+  static const bool serializable = true;
+  
+  static size_t size(const T &) {
+    return sizeof(T);
+  }
+  
+  static void encode(const T &value, char *out) {
+    memcpy(out, &value, sizeof(T));
+  }
+  
+  static bool decode(const char *data, size_t size, T &value) {
+    if(size != sizeof(T)) return false;
+    
+    memcpy(&value, data, sizeof(T));
+    return true;
+  }
+};
+
+/**
+ * Strings are written as a 32 bit little endian length, followed by the bytes of the string
+ */
+template<>
+struct JobTraits<std::string> {
+  static const bool serializable = true;
+  
+  static size_t size(const std::string &value) {
+    return 4 + value.size();
+  }
+  
+  static void encode(const std::string &value, char *out) {
+    JobTraits<uint32_t>::encode((uint32_t)value.size(), out);
+    memcpy(out + 4, value.data(), value.size());
+  }
+  
+  static bool decode(const char *data, size_t size, std::string &value) {
+    uint32_t length;
+    if(size < 4 || !JobTraits<uint32_t>::decode(data, 4, length) || length != size - 4)
+      return false;
+    
+    value.assign(data + 4, length);
+    return true;
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,111 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "kicker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <thread>
+
+#include "client.h"
+
+// Steps per second. Smaller steps give a smoother rate, at the cost of more round trips.
+#define STEPS_PER_SECOND 20
+
+// The longest sleep, so stop() takes effect quickly even at low rates
+#define MAX_SLEEP_MS 50
+
+// The range rates are clamped to, so the arithmetic of run() stays finite
+#define MIN_RATE 0.001
+#define MAX_RATE 1e9
+
+Beanstalkpp::Kicker::Kicker(Beanstalkpp::Client& client, const std::string& tube):
+  client(client), tube(tube), rate(100), limit(0), stopped(false), kicked(0) {
+}
+
+void Beanstalkpp::Kicker::setRate(double jobsPerSecond) {
+  // Written so NaN ends up at the minimum too
+  if(!(jobsPerSecond >= MIN_RATE)) jobsPerSecond = MIN_RATE;
+  this->rate = std::min(jobsPerSecond, MAX_RATE);
+}
+
+void Beanstalkpp::Kicker::setLimit(uint64_t jobs) {
+  this->limit = jobs;
+}
+
+void Beanstalkpp::Kicker::stop() {
+  this->stopped = true;
+}
+
+uint64_t Beanstalkpp::Kicker::getKicked() const {
+  return this->kicked;
+}
+
+Beanstalkpp::Result<uint64_t> Beanstalkpp::Kicker::run() {
+  typedef std::chrono::steady_clock clock;
+  
+  Status s = this->client.tryUse(this->tube);
+  if(!s) return s.failure();
+  
+  this->stopped = false;
+  uint64_t ret = 0;
+  double step = std::max(1.0, this->rate / STEPS_PER_SECOND);
+  
+  // Jobs we may kick by now. Starts at one step, so the first step isn't delayed.
+  double credit = step;
+  clock::time_point last = clock::now();
+  
+  while(!this->stopped) {
+    uint64_t wanted = this->limit > 0 ? this->limit - ret : UINT64_MAX;
+    if(wanted == 0) break;
+    
+    clock::time_point now = clock::now();
+    credit = std::min(step, credit + std::chrono::duration<double>(now - last).count() * this->rate);
+    last = now;
+    
+    if(credit < std::min(step, (double)wanted)) {
+      double wait = (std::min(step, (double)wanted) - credit) / this->rate;
+      std::this_thread::sleep_for(std::chrono::microseconds(
+        (uint64_t)std::min(wait * 1e6, MAX_SLEEP_MS * 1000.0)
+      ));
+      continue;
+    }
+    
+    Result<TubeStats> stats = this->client.tryStatsTube(this->tube);
+    if(!stats && stats.error() == ServerException::NOT_FOUND) break;
+    if(!stats) return stats.failure();
+    
+    uint64_t count = std::min<uint64_t>(
+      std::min<uint64_t>((uint64_t)credit, wanted), stats.value().currentJobsBuried
+    );
+    if(count == 0) break;
+    
+    Result<size_t> k = this->client.tryKick(count > UINT_MAX ? UINT_MAX : (unsigned int)count);
+    if(!k) return k.failure();
+    if(k.value() == 0) break;
+    
+    credit -= k.value();
+    ret += k.value();
+    this->kicked += k.value();
+  }
+  
+  return ret;
+}
@@ -0,0 +1,88 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_KICKER_H
+#define _BEANSTALK_KICKER_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "result.h"
+
+namespace Beanstalkpp {
+
+class Client;
+
+/**
+ * Kicks the buried jobs of a tube back into the ready queue at a limited rate, so replaying a
+ * backlog of failed jobs doesn't flood the consumers, or whatever they write to.
+ * 
+ * Jobs are kicked with the kick command, in steps of a twentieth of a second's worth. Before
+ * each step the number of buried jobs is read with stats-tube, since kick moves delayed jobs
+ * instead once a tube has no buried jobs left.
+ */
+class Kicker {
+public:
+  /**
+   * @param client A connected client. The kicker selects @p tube with use.
+   * @param tube   The tube whose buried jobs to kick
+   */
+  Kicker(Client &client, const std::string &tube);
+  
+  /**
+   * Sets the number of jobs kicked per second. Defaults to 100. Rates that aren't positive are
+   * raised to 0.001, and rates above 1e9 lowered to it.
+   */
+  void setRate(double jobsPerSecond);
+  
+  /**
+   * Stops after kicking @p jobs jobs. Defaults to 0, for no limit.
+   */
+  void setLimit(uint64_t jobs);
+  
+  /**
+   * Kicks buried jobs until there are none left, the limit is reached or @c stop is called
+   * 
+   * @return The number of jobs kicked by this call
+   */
+  Result<uint64_t> run();
+  
+  /**
+   * Makes @c run return after its current step. May be called from any thread.
+   */
+  void stop();
+  
+  /**
+   * Returns the number of jobs kicked so far. May be called from any thread.
+   */
+  uint64_t getKicked() const;
+private:
+  Client &client;
+  std::string tube;
+  double rate;
+  uint64_t limit;
+  std::atomic<bool> stopped;
+  std::atomic<uint64_t> kicked;
+};
+
+}
+
+#endif
@@ -0,0 +1,113 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "metrics.h"
+
+static const char *commandNames[] = {
+  "put", "use", "reserve", "delete", "bury", "watch", "ignore", "peek", "list-tubes", "stats", "kick"
+};
+
+int Beanstalkpp::HistogramSnapshot::bucketOf(uint64_t value) {
+  if(value < (uint64_t)SUB_BUCKETS) return (int)value;
+  
+  int magnitude = 63 - __builtin_clzll(value);
+  if(magnitude >= MAGNITUDES) return BUCKETS - 1;
+  
+  // SUB_BUCKETS is 2^3, so the three bits below the leading one pick the sub bucket
+  int sub = (int)(value >> (magnitude - 3)) & (SUB_BUCKETS - 1);
+  return (magnitude - 2) * SUB_BUCKETS + sub;
+}
+
+uint64_t Beanstalkpp::HistogramSnapshot::bucketStart(int bucket) {
+  if(bucket < SUB_BUCKETS) return bucket;
+  
+  int magnitude = bucket / SUB_BUCKETS + 2;
+  uint64_t sub = bucket % SUB_BUCKETS;
+  return (SUB_BUCKETS + sub) << (magnitude - 3);
+}
+
+uint64_t Beanstalkpp::HistogramSnapshot::percentile(double q) const {
+  if(this->count == 0) return 0;
+  
+  uint64_t rank = (uint64_t)(q * this->count);
+  if(rank >= this->count) rank = this->count - 1;
+  
+  uint64_t seen = 0;
+  for(int i = 0; i < BUCKETS; i++) {
+    seen += this->counts[i];
+    if(seen > rank) {
+      // Report the middle of the bucket, but never more than the largest value seen
+      uint64_t start = bucketStart(i);
+      uint64_t end = i + 1 < BUCKETS ? bucketStart(i + 1) : start;
+      uint64_t value = start + (end - start) / 2;
+      return value < this->max ? value : this->max;
+    }
+  }
+  
+  return this->max;
+}
+
+double Beanstalkpp::HistogramSnapshot::mean() const {
+  return this->count ? (double)this->sum / this->count : 0.0;
+}
+
+Beanstalkpp::LatencyHistogram::LatencyHistogram(): count(0), sum(0), max(0) {
+  for(int i = 0; i < HistogramSnapshot::BUCKETS; i++)
+    this->counts[i].store(0, std::memory_order_relaxed);
+}
+
+void Beanstalkpp::LatencyHistogram::snapshot(HistogramSnapshot& s) const {
+  for(int i = 0; i < HistogramSnapshot::BUCKETS; i++)
+    s.counts[i] = this->counts[i].load(std::memory_order_relaxed);
+  
+  s.sum = this->sum.load(std::memory_order_relaxed);
+  s.max = this->max.load(std::memory_order_relaxed);
+  
+  // The counters may be updated while we copy them, so the total is summed from the buckets
+  // to keep the snapshot consistent with itself
+  s.count = 0;
+  for(int i = 0; i < HistogramSnapshot::BUCKETS; i++)
+    s.count += s.counts[i];
+}
+
+Beanstalkpp::Metrics::Metrics(): totalErrors(0), bytesSent(0), bytesReceived(0) {
+  for(int i = 0; i < ServerException::REASON_COUNT; i++)
+    this->errors[i].store(0, std::memory_order_relaxed);
+}
+
+const char* Beanstalkpp::Metrics::commandName(Beanstalkpp::Metrics::Command command) {
+  if(command < 0 || command >= COMMAND_COUNT) return "unknown";
+  
+  return commandNames[command];
+}
+
+void Beanstalkpp::Metrics::snapshot(Beanstalkpp::MetricsSnapshot& s) const {
+  for(int i = 0; i < COMMAND_COUNT; i++) {
+    this->commands[i].latency.snapshot(s.commands[i].latency);
+    s.commands[i].errors = this->commands[i].errors.load(std::memory_order_relaxed);
+  }
+  
+  for(int i = 0; i < ServerException::REASON_COUNT; i++)
+    s.errors[i] = this->errors[i].load(std::memory_order_relaxed);
+  
+  s.bytesSent = this->bytesSent.load(std::memory_order_relaxed);
+  s.bytesReceived = this->bytesReceived.load(std::memory_order_relaxed);
+  this->queueLatency.snapshot(s.queueLatency);
+}
@@ -0,0 +1,221 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_METRICS_H
+#define _BEANSTALK_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include "serverexception.h"
+
+namespace Beanstalkpp {
+
+/**
+ * A point-in-time copy of a @c LatencyHistogram
+ */
+struct HistogramSnapshot {
+  /**
+   * Values below SUB_BUCKETS get a bucket each. Above that, every power of two is split into
+   * SUB_BUCKETS linear buckets, so a value is off by at most 1/SUB_BUCKETS (12.5%).
+   */
+  static const int SUB_BUCKETS = 8;
+  
+  /**
+   * Values up to 2^MAGNITUDES nanoseconds (about 18 minutes) are told apart, larger ones end up in
+   * the last bucket
+   */
+  static const int MAGNITUDES = 40;
+  
+  static const int BUCKETS = SUB_BUCKETS * (MAGNITUDES - 2);
+  
+  uint64_t counts[BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  
+  /**
+   * Returns the value below which a fraction @p q of the recorded values lie, e.g. 0.99 for the
+   * 99th percentile
+   */
+  uint64_t percentile(double q) const;
+  
+  /**
+   * Returns the mean of the recorded values
+   */
+  double mean() const;
+  
+  /**
+   * Returns the bucket @p value falls into
+   */
+  static int bucketOf(uint64_t value);
+  
+  /**
+   * Returns the smallest value falling into @p bucket
+   */
+  static uint64_t bucketStart(int bucket);
+};
+
+/**
+ * A log-linear (HDR style) histogram of latencies in nanoseconds.
+ * 
+ * Values are recorded by a single thread without locks or atomic read-modify-write instructions.
+ * Snapshots can be taken from any thread at any time.
+ */
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+  
+  void record(uint64_t nanoseconds) {
+    bump(this->counts[HistogramSnapshot::bucketOf(nanoseconds)], 1);
+    bump(this->count, 1);
+    bump(this->sum, nanoseconds);
+    if(nanoseconds > this->max.load(std::memory_order_relaxed))
+      this->max.store(nanoseconds, std::memory_order_relaxed);
+  }
+  
+  void snapshot(HistogramSnapshot &s) const;
+  
+  /**
+   * Adds @p n to a counter only written by the recording thread
+   */
+  static void bump(std::atomic<uint64_t> &counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+private:
+  std::atomic<uint64_t> counts[HistogramSnapshot::BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+};
+
+/**
+ * A point-in-time copy of a client's @c Metrics
+ */
+struct MetricsSnapshot;
+
+/**
+ * Counters and latency histograms recorded by a Client: the number of commands of each type, how
+ * long they took from sending the command to parsing the reply, how many failed, errors by reason
+ * and the number of bytes sent and received. Clients with envelopes enabled also record how long
+ * the jobs they reserve were queued.
+ * 
+ * The owning client records metrics from its own thread. Any thread may call @c snapshot at any
+ * time, without disturbing the client.
+ * 
+ * Metrics are compiled out of the library when it is built with BEANSTALKPP_NO_METRICS (the CMake
+ * option BEANSTALKPP_METRICS=OFF), in which case Client::getMetrics returns NULL.
+ */
+class Metrics {
+public:
+  enum Command {
+    PUT, USE, RESERVE, DELETE, BURY, WATCH, IGNORE, PEEK, LIST_TUBES, STATS, KICK, COMMAND_COUNT
+  };
+  
+  Metrics();
+  
+  /**
+   * Returns the protocol name of @p command, e.g. "put"
+   */
+  static const char *commandName(Command command);
+  
+  void recordCommand(Command command, uint64_t nanoseconds, bool failed) {
+    CommandMetrics &m = this->commands[command];
+    m.latency.record(nanoseconds);
+    if(failed) LatencyHistogram::bump(m.errors, 1);
+  }
+  
+  /**
+   * Counts an error. TIMED_OUT, the normal outcome of a reserve-with-timeout which found no job,
+   * is counted by reason but doesn't make the command count as failed.
+   */
+  void recordError(ServerException::Reason reason) {
+    if(reason >= 0 && reason < ServerException::REASON_COUNT)
+      LatencyHistogram::bump(this->errors[reason], 1);
+    if(reason != ServerException::TIMED_OUT)
+      LatencyHistogram::bump(this->totalErrors, 1);
+  }
+  
+  void recordSent(size_t bytes) {
+    LatencyHistogram::bump(this->bytesSent, bytes);
+  }
+  
+  void recordReceived(size_t bytes) {
+    LatencyHistogram::bump(this->bytesReceived, bytes);
+  }
+  
+  void recordQueueLatency(uint64_t nanoseconds) {
+    this->queueLatency.record(nanoseconds);
+  }
+  
+  /**
+   * Returns the number of errors recorded so far
+   */
+  uint64_t errorCount() const {
+    return this->totalErrors.load(std::memory_order_relaxed);
+  }
+  
+  /**
+   * Copies the current values into @p s. Safe to call from any thread.
+   */
+  void snapshot(MetricsSnapshot &s) const;
+private:
+  struct CommandMetrics {
+    CommandMetrics(): errors(0) {}
+    
+    LatencyHistogram latency;
+    std::atomic<uint64_t> errors;
+  };
+  
+  CommandMetrics commands[COMMAND_COUNT];
+  std::atomic<uint64_t> errors[ServerException::REASON_COUNT];
+  std::atomic<uint64_t> totalErrors;
+  std::atomic<uint64_t> bytesSent;
+  std::atomic<uint64_t> bytesReceived;
+  LatencyHistogram queueLatency;
+};
+
+struct MetricsSnapshot {
+  struct Command {
+    /**
+     * Latencies from sending the command until its reply was parsed. The count is the number of
+     * commands.
+     */
+    HistogramSnapshot latency;
+    uint64_t errors;
+  };
+  
+  Command commands[Metrics::COMMAND_COUNT];
+  uint64_t errors[ServerException::REASON_COUNT];
+  uint64_t bytesSent;
+  uint64_t bytesReceived;
+  
+  /**
+   * Times from put to reserve of the reserved jobs carrying an envelope, taken from the producer's
+   * timestamp, so producers on other hosts need synchronized clocks. Only recorded by clients with
+   * envelopes enabled, see @c Client::setEnvelope.
+   */
+  HistogramSnapshot queueLatency;
+};
+
+}
+
+#endif
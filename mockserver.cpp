@@ -0,0 +1,990 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "mockserver.h"
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+class Session;
+typedef boost::shared_ptr<Session> session_p_t;
+typedef boost::weak_ptr<Session> session_wp_t;
+
+enum JobState { READY, RESERVED, BURIED, DELAYED };
+
+struct MockJob {
+  uint64_t id;
+  std::string tube;
+  unsigned int priority;
+  unsigned int ttr;
+  std::string data;
+  JobState state;
+  Clock::time_point readyAt;
+  Clock::time_point created;
+  Session *owner;
+  unsigned int reserves;
+  unsigned int releases;
+  unsigned int buries;
+};
+
+struct Tube {
+  /**
+   * Ready jobs, ordered by priority and then id
+   */
+  std::set<std::pair<unsigned int, uint64_t> > ready;
+  std::multimap<Clock::time_point, uint64_t> delayed;
+  std::list<uint64_t> buried;
+  
+  uint64_t totalJobs;
+  uint64_t cmdDelete;
+  
+  Tube(): totalJobs(0), cmdDelete(0) {}
+};
+
+/**
+ * Parses a non-negative decimal number from a command argument
+ */
+bool parseNumber(const std::string &s, uint64_t &value) {
+  if(s.empty() || s.size() > 20) return false;
+  
+  char *end;
+  value = strtoull(s.c_str(), &end, 10);
+  return *end == 0 && s[0] != '-';
+}
+
+/**
+ * Checks a tube name like beanstalkd does
+ */
+bool isValidTube(const std::string &s) {
+  return !s.empty() && s.size() <= 200 && s[0] != '-' &&
+    s.find_first_not_of(
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-+/;.$_()"
+    ) == std::string::npos;
+}
+
+}
+
+/**
+ * The state of the server. All of it is protected by mutex, and only touched from the io_service
+ * thread, except for the accessors of MockServer.
+ */
+class Beanstalkpp::MockServer::Impl {
+public:
+  Impl(unsigned short port);
+  
+  void accept();
+  
+  /**
+   * Returns the tube named @p name, creating it if needed
+   */
+  Tube &tube(const std::string &name);
+  
+  /**
+   * Puts @p job into the ready or delayed queue of its tube, as given by its state
+   */
+  void enqueue(MockJob &job);
+  
+  /**
+   * Removes @p job from whichever queue it is in
+   */
+  void dequeue(MockJob &job);
+  
+  /**
+   * Moves delayed jobs whose delay has passed to the ready queues
+   */
+  void promoteDelayed();
+  
+  /**
+   * Returns the next ready job in any of @p tubes, or NULL
+   */
+  MockJob *nextReady(const std::vector<std::string> &tubes);
+  
+  /**
+   * Hands ready jobs to sessions blocked in reserve
+   */
+  void dispatchWaiting();
+  
+  /**
+   * Arms the timer waking reservations up when the next delayed job becomes ready
+   */
+  void scheduleDelayed();
+  
+  boost::asio::io_service io_service;
+  tcp::acceptor acceptor;
+  boost::asio::steady_timer delayTimer;
+  std::thread thread;
+  mutable std::mutex mutex;
+  
+  unsigned int latency;
+  size_t maxJobSize;
+  uint64_t nextId;
+  uint64_t cmdPut;
+  uint64_t cmdReserve;
+  
+  std::map<uint64_t, MockJob> jobs;
+  std::map<std::string, Tube> tubes;
+  std::map<std::string, std::deque<std::string> > injected;
+  
+  std::list<session_wp_t> sessions;
+  
+  /**
+   * Sessions blocked in reserve, in the order they started waiting. Held strongly, as a waiting
+   * session has no outstanding asynchronous operation keeping it alive.
+   */
+  std::list<session_p_t> waiting;
+};
+
+namespace {
+
+/**
+ * A client connection
+ */
+class Session: public boost::enable_shared_from_this<Session> {
+public:
+  Session(Beanstalkpp::MockServer::Impl &server):
+    socket(server.io_service), server(server), replyTimer(server.io_service),
+    reserveTimer(server.io_service), used("default"), waiting(false), bodySize(0) {
+    this->watched.push_back("default");
+  }
+  
+  void start() {
+    this->readCommand();
+  }
+  
+  bool isWaiting() const {
+    return this->waiting;
+  }
+  
+  const std::vector<std::string> &watchList() const {
+    return this->watched;
+  }
+  
+  /**
+   * Completes a blocked reserve with @p job. Called with the server mutex held.
+   */
+  void deliver(MockJob &job) {
+    this->waiting = false;
+    this->reserveTimer.cancel();
+    this->reply(this->reserve(job, "RESERVED"));
+  }
+  
+  tcp::socket socket;
+private:
+  void readCommand() {
+    session_p_t self = shared_from_this();
+    boost::asio::async_read_until(
+      this->socket, this->input, "\r\n",
+      [self](const boost::system::error_code &e, size_t length) { self->onLine(e, length); }
+    );
+  }
+  
+  void onLine(const boost::system::error_code &error, size_t length) {
+    if(error) return this->disconnect();
+    
+    std::string line(
+      boost::asio::buffer_cast<const char *>(this->input.data()), length - 2
+    );
+    this->input.consume(length);
+    
+    this->args.clear();
+    std::istringstream s(line);
+    std::string arg;
+    while(s >> arg)
+      this->args.push_back(arg);
+    
+    if(this->args.size() == 5 && this->args[0] == "put") {
+      uint64_t bytes;
+      if(!parseNumber(this->args[4], bytes)) {
+        std::lock_guard<std::mutex> lock(this->server.mutex);
+        return this->reply("BAD_FORMAT\r\n");
+      }
+      
+      this->bodySize = bytes + 2;
+      if(this->input.size() >= this->bodySize)
+        return this->onBody(boost::system::error_code());
+      
+      this->readBody();
+      return;
+    }
+    
+    this->bodySize = 0;
+    this->handle();
+  }
+  
+  void onBody(const boost::system::error_code &error) {
+    if(error) return this->disconnect();
+    
+    // A job which is shorter than its announced size may still arrive through a later read
+    if(this->input.size() < this->bodySize) return this->readBody();
+    
+    const char *data = boost::asio::buffer_cast<const char *>(this->input.data());
+    bool terminated = data[this->bodySize - 2] == '\r' && data[this->bodySize - 1] == '\n';
+    this->body.assign(data, this->bodySize - 2);
+    this->input.consume(this->bodySize);
+    
+    if(!terminated) {
+      std::lock_guard<std::mutex> lock(this->server.mutex);
+      return this->reply("EXPECTED_CRLF\r\n");
+    }
+    
+    this->handle();
+  }
+  
+  void readBody() {
+    session_p_t self = shared_from_this();
+    boost::asio::async_read(
+      this->socket, this->input, boost::asio::transfer_at_least(this->bodySize - this->input.size()),
+      [self](const boost::system::error_code &e, size_t) { self->onBody(e); }
+    );
+  }
+  
+  void handle() {
+    std::lock_guard<std::mutex> lock(this->server.mutex);
+    
+    if(this->args.empty()) return this->reply("UNKNOWN_COMMAND\r\n");
+    
+    std::map<std::string, std::deque<std::string> >::iterator injected =
+      this->server.injected.find(this->args[0]);
+    if(injected != this->server.injected.end() && !injected->second.empty()) {
+      std::string r = injected->second.front() + "\r\n";
+      injected->second.pop_front();
+      return this->reply(r);
+    }
+    
+    this->execute();
+  }
+  
+  /**
+   * Executes the command in args. Called with the server mutex held.
+   */
+  void execute() {
+    const std::string &cmd = this->args[0];
+    size_t argc = this->args.size();
+    uint64_t a, b, c;
+    
+    if(cmd == "put" && argc == 5) {
+      this->server.cmdPut++;
+      if(!parseNumber(this->args[1], a) || !parseNumber(this->args[2], b) ||
+         !parseNumber(this->args[3], c))
+        return this->reply("BAD_FORMAT\r\n");
+      
+      if(this->body.size() > this->server.maxJobSize) return this->reply("JOB_TOO_BIG\r\n");
+      
+      MockJob &job = this->server.jobs[this->server.nextId];
+      job.id = this->server.nextId++;
+      job.tube = this->used;
+      job.priority = a;
+      job.ttr = c;
+      job.data.swap(this->body);
+      job.owner = NULL;
+      job.state = b > 0 ? DELAYED : READY;
+      job.readyAt = Clock::now() + std::chrono::seconds(b);
+      job.created = Clock::now();
+      job.reserves = job.releases = job.buries = 0;
+      this->server.enqueue(job);
+      this->server.tube(job.tube).totalJobs++;
+      
+      this->reply("INSERTED " + toString(job.id) + "\r\n");
+      this->server.dispatchWaiting();
+      return;
+    }
+    
+    bool tubeCommand = cmd == "use" || cmd == "watch" || cmd == "ignore";
+    if(tubeCommand && argc == 2 && !isValidTube(this->args[1]))
+      return this->reply("BAD_FORMAT\r\n");
+    
+    if(cmd == "use" && argc == 2) {
+      this->used = this->args[1];
+      this->server.tube(this->used);
+      return this->reply("USING " + this->used + "\r\n");
+    }
+    
+    if((cmd == "reserve" && argc == 1) || (cmd == "reserve-with-timeout" && argc == 2)) {
+      this->server.cmdReserve++;
+      this->server.promoteDelayed();
+      
+      MockJob *job = this->server.nextReady(this->watched);
+      if(job) return this->reply(this->reserve(*job, "RESERVED"));
+      
+      if(argc == 2) {
+        if(!parseNumber(this->args[1], a)) return this->reply("BAD_FORMAT\r\n");
+        if(a == 0) return this->reply("TIMED_OUT\r\n");
+        
+        this->reserveTimer.expires_from_now(std::chrono::seconds(a));
+        session_p_t self = shared_from_this();
+        this->reserveTimer.async_wait(
+          [self](const boost::system::error_code &e) { self->onReserveTimeout(e); }
+        );
+      }
+      
+      this->waiting = true;
+      this->server.waiting.push_back(shared_from_this());
+      return;
+    }
+    
+    if(cmd == "reserve-job" && argc == 2) {
+      MockJob *job = this->find(this->args[1]);
+      if(!job || job->state == RESERVED) return this->reply("NOT_FOUND\r\n");
+      
+      return this->reply(this->reserve(*job, "RESERVED"));
+    }
+    
+    if(cmd == "delete" && argc == 2) {
+      MockJob *job = this->find(this->args[1]);
+      if(!job || (job->state == RESERVED && job->owner != this)) return this->reply("NOT_FOUND\r\n");
+      
+      if(job->state == RESERVED) this->reserved.erase(job->id);
+      this->server.tube(job->tube).cmdDelete++;
+      this->server.dequeue(*job);
+      this->server.jobs.erase(job->id);
+      return this->reply("DELETED\r\n");
+    }
+    
+    if(cmd == "release" && argc == 4) {
+      MockJob *job = this->find(this->args[1]);
+      if(!job || job->state != RESERVED || job->owner != this) return this->reply("NOT_FOUND\r\n");
+      if(!parseNumber(this->args[2], a) || !parseNumber(this->args[3], b))
+        return this->reply("BAD_FORMAT\r\n");
+      
+      this->reserved.erase(job->id);
+      job->owner = NULL;
+      job->priority = a;
+      job->releases++;
+      job->state = b > 0 ? DELAYED : READY;
+      job->readyAt = Clock::now() + std::chrono::seconds(b);
+      this->server.enqueue(*job);
+      
+      this->reply("RELEASED\r\n");
+      this->server.dispatchWaiting();
+      return;
+    }
+    
+    if(cmd == "bury" && argc == 3) {
+      MockJob *job = this->find(this->args[1]);
+      if(!job || job->state != RESERVED || job->owner != this) return this->reply("NOT_FOUND\r\n");
+      if(!parseNumber(this->args[2], a)) return this->reply("BAD_FORMAT\r\n");
+      
+      this->reserved.erase(job->id);
+      job->owner = NULL;
+      job->priority = a;
+      job->buries++;
+      job->state = BURIED;
+      this->server.enqueue(*job);
+      return this->reply("BURIED\r\n");
+    }
+    
+    if(cmd == "kick" && argc == 2) {
+      if(!parseNumber(this->args[1], a)) return this->reply("BAD_FORMAT\r\n");
+      
+      this->server.promoteDelayed();
+      
+      Tube &t = this->server.tube(this->used);
+      
+      // Delayed jobs are only kicked when the tube has no buried jobs
+      bool buried = !t.buried.empty();
+      uint64_t kicked = 0;
+      
+      for(; kicked < a; kicked++) {
+        uint64_t id;
+        if(buried && !t.buried.empty()) {
+          id = t.buried.front();
+          t.buried.pop_front();
+        } else if(!buried && !t.delayed.empty()) {
+          id = t.delayed.begin()->second;
+          t.delayed.erase(t.delayed.begin());
+        } else {
+          break;
+        }
+        
+        MockJob &job = this->server.jobs[id];
+        job.state = READY;
+        this->server.enqueue(job);
+      }
+      
+      this->reply("KICKED " + toString(kicked) + "\r\n");
+      this->server.dispatchWaiting();
+      return;
+    }
+    
+    if(cmd == "touch" && argc == 2) {
+      MockJob *job = this->find(this->args[1]);
+      if(!job || job->state != RESERVED || job->owner != this) return this->reply("NOT_FOUND\r\n");
+      
+      return this->reply("TOUCHED\r\n");
+    }
+    
+    if(cmd == "watch" && argc == 2) {
+      if(std::find(this->watched.begin(), this->watched.end(), this->args[1]) == this->watched.end())
+        this->watched.push_back(this->args[1]);
+      this->server.tube(this->args[1]);
+      
+      return this->reply("WATCHING " + toString(this->watched.size()) + "\r\n");
+    }
+    
+    if(cmd == "ignore" && argc == 2) {
+      std::vector<std::string>::iterator i =
+        std::find(this->watched.begin(), this->watched.end(), this->args[1]);
+      if(i != this->watched.end()) {
+        if(this->watched.size() == 1) return this->reply("NOT_IGNORED\r\n");
+        this->watched.erase(i);
+      }
+      
+      return this->reply("WATCHING " + toString(this->watched.size()) + "\r\n");
+    }
+    
+    if(cmd == "peek-ready" && argc == 1) {
+      this->server.promoteDelayed();
+      
+      MockJob *job = this->server.nextReady(std::vector<std::string>(1, this->used));
+      if(!job) return this->reply("NOT_FOUND\r\n");
+      
+      return this->reply(formatJob("FOUND", *job));
+    }
+    
+    if(cmd == "peek-buried" && argc == 1) {
+      Tube &t = this->server.tube(this->used);
+      if(t.buried.empty()) return this->reply("NOT_FOUND\r\n");
+      
+      return this->reply(formatJob("FOUND", this->server.jobs[t.buried.front()]));
+    }
+    
+    if(cmd == "peek-delayed" && argc == 1) {
+      this->server.promoteDelayed();
+      
+      Tube &t = this->server.tube(this->used);
+      if(t.delayed.empty()) return this->reply("NOT_FOUND\r\n");
+      
+      return this->reply(formatJob("FOUND", this->server.jobs[t.delayed.begin()->second]));
+    }
+    
+    if(cmd == "peek" && argc == 2) {
+      MockJob *job = this->find(this->args[1]);
+      if(!job) return this->reply("NOT_FOUND\r\n");
+      
+      return this->reply(formatJob("FOUND", *job));
+    }
+    
+    if(cmd == "kick-job" && argc == 2) {
+      MockJob *job = this->find(this->args[1]);
+      if(!job || (job->state != BURIED && job->state != DELAYED))
+        return this->reply("NOT_FOUND\r\n");
+      
+      this->server.dequeue(*job);
+      job->state = READY;
+      this->server.enqueue(*job);
+      
+      this->reply("KICKED\r\n");
+      this->server.dispatchWaiting();
+      return;
+    }
+    
+    if(cmd == "list-tubes" && argc == 1) {
+      std::string yaml = "---\n";
+      for(std::map<std::string, Tube>::iterator i = this->server.tubes.begin();
+          i != this->server.tubes.end(); i++)
+        yaml += "- " + i->first + "\n";
+      
+      return this->reply("OK " + toString(yaml.size()) + "\r\n" + yaml + "\r\n");
+    }
+    
+    if(cmd == "stats" && argc == 1) {
+      this->server.promoteDelayed();
+      
+      std::string yaml = "---\n";
+      yaml += formatCounts(this->server.jobs, NULL);
+      yaml += "cmd-put: " + toString(this->server.cmdPut) + "\n";
+      yaml += "cmd-reserve: " + toString(this->server.cmdReserve) + "\n";
+      yaml += "total-jobs: " + toString(this->server.nextId - 1) + "\n";
+      yaml += "max-job-size: " + toString(this->server.maxJobSize) + "\n";
+      yaml += "current-tubes: " + toString(this->server.tubes.size()) + "\n";
+      yaml += "current-connections: " + toString(this->connections()) + "\n";
+      yaml += "current-waiting: " + toString(this->server.waiting.size()) + "\n";
+      yaml += "version: \"mock\"\n";
+      
+      return this->reply("OK " + toString(yaml.size()) + "\r\n" + yaml + "\r\n");
+    }
+    
+    if(cmd == "stats-tube" && argc == 2) {
+      std::map<std::string, Tube>::iterator t = this->server.tubes.find(this->args[1]);
+      if(t == this->server.tubes.end()) return this->reply("NOT_FOUND\r\n");
+      
+      this->server.promoteDelayed();
+      
+      std::string yaml = "---\nname: \"" + t->first + "\"\n";
+      yaml += formatCounts(this->server.jobs, &t->first);
+      yaml += "total-jobs: " + toString(t->second.totalJobs) + "\n";
+      yaml += this->formatUsers(t->first);
+      yaml += "cmd-delete: " + toString(t->second.cmdDelete) + "\n";
+      
+      return this->reply("OK " + toString(yaml.size()) + "\r\n" + yaml + "\r\n");
+    }
+    
+    if(cmd == "stats-job" && argc == 2) {
+      MockJob *job = this->find(this->args[1]);
+      if(!job) return this->reply("NOT_FOUND\r\n");
+      
+      static const char *states[] = { "ready", "reserved", "buried", "delayed" };
+      uint64_t age = std::chrono::duration_cast<std::chrono::seconds>(
+        Clock::now() - job->created
+      ).count();
+      
+      std::string yaml = "---\n";
+      yaml += "id: " + toString(job->id) + "\n";
+      yaml += "tube: \"" + job->tube + "\"\n";
+      yaml += std::string("state: ") + states[job->state] + "\n";
+      yaml += "pri: " + toString(job->priority) + "\n";
+      yaml += "age: " + toString(age) + "\n";
+      yaml += "ttr: " + toString(job->ttr) + "\n";
+      yaml += "reserves: " + toString(job->reserves) + "\n";
+      yaml += "releases: " + toString(job->releases) + "\n";
+      yaml += "buries: " + toString(job->buries) + "\n";
+      
+      return this->reply("OK " + toString(yaml.size()) + "\r\n" + yaml + "\r\n");
+    }
+    
+    if(cmd == "list-tube-used" && argc == 1)
+      return this->reply("USING " + this->used + "\r\n");
+    
+    if(cmd == "list-tubes-watched" && argc == 1) {
+      std::string yaml = "---\n";
+      for(size_t i = 0; i < this->watched.size(); i++)
+        yaml += "- " + this->watched[i] + "\n";
+      
+      return this->reply("OK " + toString(yaml.size()) + "\r\n" + yaml + "\r\n");
+    }
+    
+    if(cmd == "quit" && argc == 1) {
+      this->socket.close();
+      return;
+    }
+    
+    this->reply("UNKNOWN_COMMAND\r\n");
+  }
+  
+  MockJob *find(const std::string &id) {
+    uint64_t jobId;
+    if(!parseNumber(id, jobId)) return NULL;
+    
+    std::map<uint64_t, MockJob>::iterator i = this->server.jobs.find(jobId);
+    return i == this->server.jobs.end() ? NULL : &i->second;
+  }
+  
+  /**
+   * Reserves @p job, which may be in any state but reserved, for this session, and returns the
+   * reply carrying it
+   */
+  std::string reserve(MockJob &job, const char *reply) {
+    this->server.dequeue(job);
+    job.state = RESERVED;
+    job.owner = this;
+    job.reserves++;
+    this->reserved.insert(job.id);
+    
+    return formatJob(reply, job);
+  }
+  
+  /**
+   * Formats the current-jobs-* lines of a stats reply, counting the jobs in @p tube, or in all
+   * tubes if it is NULL
+   */
+  static std::string formatCounts(const std::map<uint64_t, MockJob> &jobs, const std::string *tube) {
+    uint64_t counts[4] = { 0, 0, 0, 0 };
+    uint64_t urgent = 0;
+    
+    for(std::map<uint64_t, MockJob>::const_iterator i = jobs.begin(); i != jobs.end(); i++) {
+      if(tube && i->second.tube != *tube) continue;
+      
+      counts[i->second.state]++;
+      if(i->second.state == READY && i->second.priority < 1024) urgent++;
+    }
+    
+    return "current-jobs-urgent: " + toString(urgent) + "\n" +
+      "current-jobs-ready: " + toString(counts[READY]) + "\n" +
+      "current-jobs-reserved: " + toString(counts[RESERVED]) + "\n" +
+      "current-jobs-delayed: " + toString(counts[DELAYED]) + "\n" +
+      "current-jobs-buried: " + toString(counts[BURIED]) + "\n";
+  }
+  
+  /**
+   * Returns the number of open connections
+   */
+  size_t connections() {
+    size_t ret = 0;
+    for(std::list<session_wp_t>::iterator i = this->server.sessions.begin();
+        i != this->server.sessions.end(); i++) {
+      session_p_t session = i->lock();
+      if(session && session->socket.is_open()) ret++;
+    }
+    
+    return ret;
+  }
+  
+  /**
+   * Formats the current-using, current-watching and current-waiting lines of stats-tube
+   */
+  std::string formatUsers(const std::string &tube) {
+    uint64_t users = 0, watchers = 0, waiters = 0;
+    
+    for(std::list<session_wp_t>::iterator i = this->server.sessions.begin();
+        i != this->server.sessions.end(); i++) {
+      session_p_t session = i->lock();
+      if(!session) continue;
+      
+      bool watching = std::find(session->watched.begin(), session->watched.end(), tube) !=
+        session->watched.end();
+      
+      if(session->used == tube) users++;
+      if(watching) watchers++;
+      if(watching && session->waiting) waiters++;
+    }
+    
+    return "current-using: " + toString(users) + "\n" + "current-watching: " +
+      toString(watchers) + "\n" + "current-waiting: " + toString(waiters) + "\n";
+  }
+  
+  static std::string formatJob(const char *reply, const MockJob &job) {
+    return std::string(reply) + " " + toString(job.id) + " " + toString(job.data.size()) + "\r\n" +
+      job.data + "\r\n";
+  }
+  
+  template<class T>
+  static std::string toString(T value) {
+    std::ostringstream s;
+    s << value;
+    return s.str();
+  }
+  
+  void onReserveTimeout(const boost::system::error_code &error) {
+    if(error) return;
+    
+    std::lock_guard<std::mutex> lock(this->server.mutex);
+    if(!this->waiting) return;
+    
+    this->waiting = false;
+    this->reply("TIMED_OUT\r\n");
+  }
+  
+  /**
+   * Sends @p r, after the configured latency. Reading the next command starts once it is sent.
+   */
+  void reply(const std::string &r) {
+    this->outgoing = r;
+    
+    if(this->server.latency == 0) return this->write(boost::system::error_code());
+    
+    this->replyTimer.expires_from_now(std::chrono::microseconds(this->server.latency));
+    session_p_t self = shared_from_this();
+    this->replyTimer.async_wait([self](const boost::system::error_code &e) { self->write(e); });
+  }
+  
+  void write(const boost::system::error_code &error) {
+    if(error) return;
+    
+    session_p_t self = shared_from_this();
+    boost::asio::async_write(
+      this->socket, boost::asio::buffer(this->outgoing),
+      [self](const boost::system::error_code &e, size_t) { self->onWritten(e); }
+    );
+  }
+  
+  void onWritten(const boost::system::error_code &error) {
+    if(error) return this->disconnect();
+    
+    this->readCommand();
+  }
+  
+  /**
+   * Releases the jobs reserved by this session, like beanstalkd does when a client goes away
+   */
+  void disconnect() {
+    std::lock_guard<std::mutex> lock(this->server.mutex);
+    
+    this->waiting = false;
+    this->reserveTimer.cancel();
+    this->replyTimer.cancel();
+    
+    for(std::set<uint64_t>::iterator i = this->reserved.begin(); i != this->reserved.end(); i++) {
+      MockJob &job = this->server.jobs[*i];
+      job.owner = NULL;
+      job.state = READY;
+      this->server.enqueue(job);
+    }
+    this->reserved.clear();
+    
+    this->server.dispatchWaiting();
+  }
+  
+  Beanstalkpp::MockServer::Impl &server;
+  boost::asio::steady_timer replyTimer;
+  boost::asio::steady_timer reserveTimer;
+  
+  boost::asio::streambuf input;
+  std::vector<std::string> args;
+  std::string body;
+  std::string outgoing;
+  
+  std::string used;
+  std::vector<std::string> watched;
+  std::set<uint64_t> reserved;
+  bool waiting;
+  size_t bodySize;
+};
+
+}
+
+Beanstalkpp::MockServer::Impl::Impl(unsigned short port):
+  acceptor(io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)),
+  delayTimer(io_service) {
+  this->latency = 0;
+  this->maxJobSize = 65535;
+  this->nextId = 1;
+  this->cmdPut = 0;
+  this->cmdReserve = 0;
+  this->tube("default");
+}
+
+void Beanstalkpp::MockServer::Impl::accept() {
+  session_p_t session(new Session(*this));
+  
+  this->acceptor.async_accept(session->socket, [this, session](const boost::system::error_code &e) {
+    if(e) return;
+    
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->sessions.push_back(session);
+    }
+    
+    session->socket.set_option(tcp::no_delay(true));
+    session->start();
+    this->accept();
+  });
+}
+
+Tube& Beanstalkpp::MockServer::Impl::tube(const std::string& name) {
+  return this->tubes[name];
+}
+
+void Beanstalkpp::MockServer::Impl::enqueue(MockJob& job) {
+  Tube &t = this->tube(job.tube);
+  
+  switch(job.state) {
+    case READY:
+      t.ready.insert(std::make_pair(job.priority, job.id));
+      break;
+    case DELAYED:
+      t.delayed.insert(std::make_pair(job.readyAt, job.id));
+      this->scheduleDelayed();
+      break;
+    case BURIED:
+      t.buried.push_back(job.id);
+      break;
+    case RESERVED:
+      break;
+  }
+}
+
+void Beanstalkpp::MockServer::Impl::dequeue(MockJob& job) {
+  Tube &t = this->tube(job.tube);
+  
+  switch(job.state) {
+    case READY:
+      t.ready.erase(std::make_pair(job.priority, job.id));
+      break;
+    case DELAYED:
+      for(std::multimap<Clock::time_point, uint64_t>::iterator i = t.delayed.begin();
+          i != t.delayed.end(); i++) {
+        if(i->second == job.id) {
+          t.delayed.erase(i);
+          break;
+        }
+      }
+      break;
+    case BURIED:
+      t.buried.remove(job.id);
+      break;
+    case RESERVED:
+      break;
+  }
+}
+
+void Beanstalkpp::MockServer::Impl::promoteDelayed() {
+  Clock::time_point now = Clock::now();
+  
+  for(std::map<std::string, Tube>::iterator t = this->tubes.begin(); t != this->tubes.end(); t++) {
+    std::multimap<Clock::time_point, uint64_t> &delayed = t->second.delayed;
+    
+    while(!delayed.empty() && delayed.begin()->first <= now) {
+      MockJob &job = this->jobs[delayed.begin()->second];
+      delayed.erase(delayed.begin());
+      job.state = READY;
+      this->enqueue(job);
+    }
+  }
+}
+
+MockJob* Beanstalkpp::MockServer::Impl::nextReady(const std::vector<std::string>& tubes) {
+  const std::pair<unsigned int, uint64_t> *best = NULL;
+  
+  for(size_t i = 0; i < tubes.size(); i++) {
+    std::map<std::string, Tube>::iterator t = this->tubes.find(tubes[i]);
+    if(t == this->tubes.end() || t->second.ready.empty()) continue;
+    
+    const std::pair<unsigned int, uint64_t> &first = *t->second.ready.begin();
+    if(!best || first < *best) best = &first;
+  }
+  
+  return best ? &this->jobs[best->second] : NULL;
+}
+
+void Beanstalkpp::MockServer::Impl::dispatchWaiting() {
+  this->promoteDelayed();
+  
+  std::list<session_p_t>::iterator i = this->waiting.begin();
+  while(i != this->waiting.end()) {
+    session_p_t session = *i;
+    if(!session->isWaiting()) {
+      i = this->waiting.erase(i);
+      continue;
+    }
+    
+    MockJob *job = this->nextReady(session->watchList());
+    if(!job) {
+      i++;
+      continue;
+    }
+    
+    session->deliver(*job);
+    i = this->waiting.erase(i);
+  }
+}
+
+void Beanstalkpp::MockServer::Impl::scheduleDelayed() {
+  Clock::time_point next = Clock::time_point::max();
+  
+  for(std::map<std::string, Tube>::iterator t = this->tubes.begin(); t != this->tubes.end(); t++) {
+    if(!t->second.delayed.empty() && t->second.delayed.begin()->first < next)
+      next = t->second.delayed.begin()->first;
+  }
+  
+  if(next == Clock::time_point::max()) return;
+  
+  this->delayTimer.expires_at(next);
+  this->delayTimer.async_wait([this](const boost::system::error_code &e) {
+    if(e) return;
+    
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->dispatchWaiting();
+    this->scheduleDelayed();
+  });
+}
+
+Beanstalkpp::MockServer::MockServer(unsigned short port): impl(new Impl(port)) {
+
+}
+
+Beanstalkpp::MockServer::~MockServer() {
+  this->stop();
+}
+
+void Beanstalkpp::MockServer::start() {
+  if(this->impl->thread.joinable()) return;
+  
+  this->impl->accept();
+  this->impl->thread = std::thread([this]() { this->impl->io_service.run(); });
+}
+
+void Beanstalkpp::MockServer::stop() {
+  if(!this->impl->thread.joinable()) return;
+  
+  Impl *impl = this->impl.get();
+  this->impl->io_service.post([impl]() {
+    boost::system::error_code ignored;
+    impl->acceptor.close(ignored);
+    impl->delayTimer.cancel();
+    
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    for(std::list<session_wp_t>::iterator i = impl->sessions.begin(); i != impl->sessions.end(); i++) {
+      session_p_t session = i->lock();
+      if(session) session->socket.close(ignored);
+    }
+    
+    impl->waiting.clear();
+    impl->io_service.stop();
+  });
+  
+  this->impl->thread.join();
+}
+
+unsigned short Beanstalkpp::MockServer::getPort() const {
+  return this->impl->acceptor.local_endpoint().port();
+}
+
+void Beanstalkpp::MockServer::setLatency(unsigned int microseconds) {
+  std::lock_guard<std::mutex> lock(this->impl->mutex);
+  this->impl->latency = microseconds;
+}
+
+void Beanstalkpp::MockServer::setMaxJobSize(size_t bytes) {
+  std::lock_guard<std::mutex> lock(this->impl->mutex);
+  this->impl->maxJobSize = bytes;
+}
+
+void Beanstalkpp::MockServer::injectError(
+  const std::string& command, const std::string& reply, size_t count
+) {
+  std::lock_guard<std::mutex> lock(this->impl->mutex);
+  
+  for(size_t i = 0; i < count; i++)
+    this->impl->injected[command].push_back(reply);
+}
+
+size_t Beanstalkpp::MockServer::jobCount() const {
+  std::lock_guard<std::mutex> lock(this->impl->mutex);
+  return this->impl->jobs.size();
+}
+
+size_t Beanstalkpp::MockServer::readyCount(const std::string& tube) const {
+  std::lock_guard<std::mutex> lock(this->impl->mutex);
+  
+  std::map<std::string, Tube>::const_iterator t = this->impl->tubes.find(tube);
+  return t == this->impl->tubes.end() ? 0 : t->second.ready.size();
+}
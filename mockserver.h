@@ -0,0 +1,110 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_MOCKSERVER_H
+#define _BEANSTALK_MOCKSERVER_H
+
+#include <string>
+#include <boost/scoped_ptr.hpp>
+
+namespace Beanstalkpp {
+
+/**
+ * An in-process stand-in for beanstalkd, for tests and benchmarks.
+ * 
+ * The server listens on the loopback interface and runs its own thread. It speaks the subset of
+ * the protocol used by the client: put, use, reserve, reserve-with-timeout, delete, release, bury,
+ * kick, kick-job, touch, watch, ignore, peek, peek-ready, peek-buried, peek-delayed, list-tubes,
+ * list-tube-used, list-tubes-watched, stats, stats-tube, stats-job and quit.
+ * Jobs never time out, and nothing is persisted.
+ * 
+ * Replies can be delayed with @c setLatency, and replaced by errors with @c injectError.
+ */
+class MockServer {
+public:
+  /**
+   * Creates a server. It doesn't accept connections until @c start is called.
+   * 
+   * @param port The TCP port to listen on, or 0 to pick a free port (see @c getPort)
+   */
+  MockServer(unsigned short port = 0);
+  
+  /**
+   * Stops the server, closing all connections
+   */
+  ~MockServer();
+  
+  /**
+   * Starts accepting connections, in a background thread
+   */
+  void start();
+  
+  /**
+   * Stops the server, closing all connections
+   */
+  void stop();
+  
+  /**
+   * Returns the port the server listens on
+   */
+  unsigned short getPort() const;
+  
+  /**
+   * Delays every reply by @p microseconds, to simulate a remote or slow server
+   */
+  void setLatency(unsigned int microseconds);
+  
+  /**
+   * Sets the largest payload accepted by put. Larger jobs get JOB_TOO_BIG. Defaults to 65535, like
+   * beanstalkd.
+   */
+  void setMaxJobSize(size_t bytes);
+  
+  /**
+   * Makes the next @p count occurrences of @p command fail with @p reply instead of being executed,
+   * e.g. injectError("put", "OUT_OF_MEMORY").
+   * 
+   * @param command The command name, e.g. "put" or "reserve"
+   * @param reply   The reply to send, without the trailing \r\n
+   * @param count   How many commands to fail
+   */
+  void injectError(const std::string &command, const std::string &reply, size_t count = 1);
+  
+  /**
+   * Returns the number of jobs on the server, in any state
+   */
+  size_t jobCount() const;
+  
+  /**
+   * Returns the number of ready jobs in @p tube
+   */
+  size_t readyCount(const std::string &tube) const;
+  
+  /**
+   * The state of the server, defined in mockserver.cpp
+   */
+  class Impl;
+private:
+  boost::scoped_ptr<Impl> impl;
+};
+
+}
+
+#endif
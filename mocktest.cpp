@@ -0,0 +1,1522 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <boost/scoped_ptr.hpp>
+
+#include "client.h"
+#include "job.h"
+#include "typedjob.h"
+#include "serverexception.h"
+#include "mockserver.h"
+#include "metrics.h"
+#include "observer.h"
+#include "capture.h"
+#include "stats.h"
+#include "statspoller.h"
+#include "mover.h"
+#include "kicker.h"
+#include "fairscheduler.h"
+#include "hedgedproducer.h"
+#include "outbox.h"
+#include "crc32c.h"
+#include "shardruntime.h"
+
+using namespace Beanstalkpp;
+using namespace std;
+
+/*
+ * Tests of the client against the in-process mock server. Unlike test.cpp, these need no
+ * beanstalkd and run unattended, so they are run by ctest.
+ */
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+  if(!(cond)) { \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    failures++; \
+  } \
+} while(0)
+
+class StringSink: public PayloadSink {
+public:
+  virtual bool write(const char *data, size_t length) {
+    this->data.append(data, length);
+    return true;
+  }
+  
+  std::string data;
+};
+
+struct Point {
+  int x;
+  double y;
+};
+
+void testPutReserve(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  c.use("roundtrip");
+  c.watch("roundtrip");
+  
+  c.put("first");
+  c.put("second");
+  CHECK(server.readyCount("roundtrip") == 2);
+  
+  Job j = c.reserve();
+  CHECK(j.asString() == "first");
+  c.del(j);
+  
+  j = c.reserve();
+  CHECK(j.asString() == "second");
+  c.del(j);
+  
+  CHECK(server.jobCount() == 0);
+  
+  job_p_t job;
+  CHECK(!c.reserveWithTimeout(job, 0));
+  
+  vector<string> tubes = c.listTubes();
+  CHECK(find(tubes.begin(), tubes.end(), "roundtrip") != tubes.end());
+}
+
+void testErrors(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  CHECK(c.tryConnect());
+  
+  Result<job_id_t> id = c.tryPut("job");
+  CHECK(id.ok());
+  
+  Result<Job> j = c.tryReserve();
+  CHECK(j.ok() && j.value().asString() == "job");
+  CHECK(c.tryDel(j.value()).ok());
+  
+  Status s = c.tryBury(j.value());
+  CHECK(!s && s.error() == ServerException::NOT_FOUND);
+  
+  server.injectError("put", "JOB_TOO_BIG");
+  id = c.tryPut("job");
+  CHECK(!id && id.error() == ServerException::JOB_TOO_BIG);
+  
+  server.injectError("put", "OUT_OF_MEMORY");
+  try {
+    c.put("job");
+    CHECK(false);
+  } catch(ServerException &e) {
+    CHECK(e.getReason() == ServerException::OUT_OF_MEMORY);
+  }
+  
+  // The connection is still usable after errors
+  job_p_t job;
+  CHECK(c.tryPeekReady(job).ok());
+  
+  Client unconnected("127.0.0.1", 1);
+  CHECK(!unconnected.tryConnect());
+}
+
+void testStreaming(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  c.use("streaming");
+  c.watch("streaming");
+  
+  server.setMaxJobSize(1 << 20);
+  
+  string payload;
+  for(int i = 0; payload.size() < 500000; i++)
+    payload += "streamed payload " + to_string(i) + "\n";
+  
+  istringstream in(payload);
+  c.put(in, payload.size());
+  
+  StringSink sink;
+  job_id_t id = c.reserveInto(sink);
+  CHECK(sink.data == payload);
+  c.del(id);
+  
+  // A stream which runs short fails on its own reason, and doesn't count as a network error
+  istringstream shortIn(payload.substr(0, 1000));
+  Result<job_id_t> shortPut = c.tryPut(shortIn, 2000);
+  CHECK(!shortPut && shortPut.error() == ServerException::SOURCE_ERROR);
+  
+  if(c.getMetrics()) {
+    MetricsSnapshot m;
+    c.getMetrics()->snapshot(m);
+    CHECK(m.errors[ServerException::SOURCE_ERROR] == 1);
+    CHECK(m.errors[ServerException::NETWORK_ERROR] == 0);
+  }
+  
+  c.connect();
+  c.use("streaming");
+  c.watch("streaming");
+  CHECK(c.tryPut("after short stream").ok());
+  c.del(c.reserve());
+  
+  // Envelopes would need the payload's checksum up front, so streamed puts are refused
+  c.setEnvelope(true);
+  istringstream refused(payload);
+  Result<job_id_t> refusedPut = c.tryPut(refused, payload.size());
+  CHECK(!refusedPut && refusedPut.error() == ServerException::BAD_FORMAT);
+  CHECK(refused.tellg() == 0);
+  CHECK(c.tryListTubes().ok());
+  c.setEnvelope(false);
+  
+  server.setMaxJobSize(65535);
+}
+
+void testEncodings(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  c.use("encodings");
+  c.watch("encodings");
+  
+  ZlibCodec zlib;
+  c.setCompression(&zlib, 64);
+  c.setEnvelope(true, 42);
+  
+  string text;
+  for(int i = 0; i < 200; i++)
+    text += "{\"compressible\": true} ";
+  c.put(text);
+  
+  Job j = c.reserve();
+  Envelope envelope;
+  CHECK(j.getEnvelope(envelope) && envelope.contentType == 42);
+  CHECK(j.verify());
+  CHECK(j.queueLatency() >= 0);
+  CHECK(j.asString() == text);
+  c.del(j);
+  
+  // Headers claiming less, or much more, than the payload decompresses to are refused
+  string encoded, decoded;
+  CHECK(zlib.encode(text.data(), text.size(), encoded));
+  encoded[4] = 100;
+  encoded[5] = 0;
+  CHECK(!Codec::decode(encoded.data(), encoded.size(), decoded));
+  encoded[4] = encoded[5] = encoded[6] = encoded[7] = (char)0xff;
+  CHECK(!Codec::decode(encoded.data(), encoded.size(), decoded));
+  CHECK(decoded.capacity() < text.size() * 16);
+  
+  // Envelopes of other versions are refused
+  char header[Envelope::SIZE];
+  Envelope::write(header, 42, text.data(), text.size());
+  CHECK(envelope.parse(header, sizeof(header)));
+  header[3] = Envelope::VERSION + 1;
+  CHECK(!envelope.parse(header, sizeof(header)));
+  
+  Point p = { 7, 2.5 };
+  c.put(p);
+  c.put<std::string>(std::string("typed"));
+  c.put<int64_t>(-5);
+  
+  TypedJob<Point> tp = c.reserve<TypedJob<Point> >();
+  CHECK(tp.value().x == 7 && tp.value().y == 2.5);
+  c.del(tp);
+  
+  TypedJob<std::string> ts = c.reserve<TypedJob<std::string> >();
+  CHECK(ts.value() == "typed");
+  c.del(ts);
+  
+  TypedJob<int64_t> ti = c.reserve<TypedJob<int64_t> >();
+  CHECK(ti.value() == -5);
+  c.del(ti);
+  
+  // 5915136 is serialized as 00 42 5A 00 .., which starts like a compressed payload
+  const uint64_t magic = 5915136;
+  c.put<uint64_t>(magic);
+  TypedJob<uint64_t> tm = c.reserve<TypedJob<uint64_t> >();
+  CHECK(tm.value() == magic);
+  c.del(tm);
+  
+  // Clients without compression and envelopes never look into payloads
+  Client plain("127.0.0.1", server.getPort());
+  plain.connect();
+  plain.use("encodings");
+  plain.watch("encodings");
+  
+  plain.put<uint64_t>(magic);
+  tm = plain.reserve<TypedJob<uint64_t> >();
+  CHECK(tm.value() == magic);
+  plain.del(tm);
+  
+  const std::string lookalike("\0BZ\1\4\0\0\0data", 12);
+  plain.put(lookalike);
+  j = plain.reserve();
+  CHECK(j.asString() == lookalike);
+  plain.del(j);
+  
+  // Jobs from a compressing producer are stored behind a header, even when not compressed
+  c.setEnvelope(false);
+  c.put(lookalike);
+  j = c.reserve();
+  CHECK(j.asString() == lookalike);
+  c.del(j);
+  
+  std::istringstream in(lookalike);
+  c.put(in, lookalike.size());
+  j = c.reserve();
+  CHECK(j.asString() == lookalike);
+  c.del(j);
+}
+
+void testPipelining(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  c.use("pipelined");
+  CHECK(c.watch("pipelined") == 2);
+  CHECK(c.ignore("default") == 1);
+  
+  Result<size_t> watched = c.tryIgnore("pipelined");
+  CHECK(!watched && watched.error() == ServerException::NOT_IGNORED);
+  
+  for(int i = 0; i < 10; i++)
+    CHECK(c.trySendPut("job " + to_string(i)).ok());
+  
+  job_id_t last = 0;
+  for(int i = 0; i < 10; i++) {
+    Result<job_id_t> id = c.tryReadPutReply();
+    CHECK(id.ok() && id.value() > last);
+    last = id.value();
+  }
+  
+  for(int i = 0; i < 10; i++) {
+    Job j = c.reserve();
+    CHECK(j.asString() == "job " + to_string(i));
+    c.del(j);
+  }
+  
+  const char *raw = "raw job, not all of it";
+  CHECK(c.trySendPut(raw, 7).ok());
+  CHECK(c.tryReadPutReply().ok());
+  Job j = c.reserve();
+  CHECK(j.asString() == "raw job");
+  c.del(j);
+}
+
+void testMetrics(MockServer &server) {
+  for(uint64_t v = 1; v < ((uint64_t)1 << 40); v = v * 3 + 1) {
+    int bucket = HistogramSnapshot::bucketOf(v);
+    CHECK(HistogramSnapshot::bucketStart(bucket) <= v);
+    CHECK(HistogramSnapshot::bucketStart(bucket + 1) > v);
+  }
+  
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  
+  // Metrics can be compiled out of the library
+  if(!c.getMetrics()) return;
+  
+  c.use("metrics");
+  c.watch("metrics");
+  
+  for(int i = 0; i < 5; i++)
+    c.put("measured");
+  
+  server.injectError("put", "JOB_TOO_BIG");
+  CHECK(!c.tryPut("too big"));
+  
+  for(int i = 0; i < 5; i++)
+    c.del(c.reserve());
+  
+  job_p_t job;
+  CHECK(!c.reserveWithTimeout(job, 0));
+  
+  MetricsSnapshot m;
+  c.getMetrics()->snapshot(m);
+  
+  CHECK(m.commands[Metrics::PUT].latency.count == 6);
+  CHECK(m.commands[Metrics::PUT].errors == 1);
+  CHECK(m.commands[Metrics::RESERVE].latency.count == 6);
+  CHECK(m.commands[Metrics::RESERVE].errors == 0);
+  CHECK(m.commands[Metrics::DELETE].latency.count == 5);
+  CHECK(m.errors[ServerException::JOB_TOO_BIG] == 1);
+  CHECK(m.errors[ServerException::TIMED_OUT] == 1);
+  
+  const HistogramSnapshot &put = m.commands[Metrics::PUT].latency;
+  CHECK(put.percentile(0.5) > 0 && put.percentile(0.5) <= put.percentile(0.99));
+  CHECK(put.percentile(1.0) <= put.max);
+  
+  // At least the payloads, the command lines and the replies crossed the wire
+  CHECK(m.bytesSent > 6 * strlen("measured"));
+  CHECK(m.bytesReceived > 5 * strlen("RESERVED 1 8\r\nmeasured\r\n"));
+  CHECK(m.queueLatency.count == 0);
+  
+  // With envelopes, reserves record how long the jobs were queued
+  c.setEnvelope(true);
+  c.put("enveloped", 1024, 0, 60);
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  c.del(c.reserve());
+  c.setEnvelope(false);
+  
+  c.getMetrics()->snapshot(m);
+  CHECK(m.queueLatency.count == 1);
+  CHECK(m.queueLatency.max >= 5000000 && m.queueLatency.max < 10000000000ULL);
+}
+
+class RecordingObserver: public CommandObserver {
+public:
+  virtual void commandStarted(const CommandEvent &e) {
+    this->log += string("start ") + Metrics::commandName(e.command) + " " + e.tube + ";";
+  }
+  
+  virtual void bytesWritten(const CommandEvent &, size_t) {
+    this->written = true;
+  }
+  
+  virtual void firstReplyByte(const CommandEvent &e) {
+    this->ordered = this->ordered && e.time >= e.startTime;
+  }
+  
+  virtual void replyParsed(const CommandEvent &e) {
+    this->log += "done " + to_string(e.jobId) + ";";
+  }
+  
+  virtual void commandFailed(const CommandEvent &, ServerException::Reason reason) {
+    this->log += string("failed ") + ServerException::reasonName(reason) + ";";
+  }
+  
+  RecordingObserver(): written(false), ordered(true) {}
+  
+  string log;
+  bool written;
+  bool ordered;
+};
+
+void testObserver(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  
+  RecordingObserver observer;
+  c.setObserver(&observer);
+  
+  c.use("traced");
+  job_id_t id = c.put("job");
+  
+  server.injectError("put", "DRAINING");
+  CHECK(!c.tryPut("job"));
+  
+  // A reserve which finds no job doesn't fail
+  c.watch("traced-empty");
+  c.ignore("default");
+  job_p_t none;
+  CHECK(!c.reserveWithTimeout(none, 0));
+  
+  c.setObserver(NULL);
+  c.del(id);
+  
+  CHECK(observer.log ==
+    "start use traced;done 0;"
+    "start put traced;done " + to_string(id) + ";"
+    "start put traced;failed DRAINING;"
+    "start watch traced-empty;done 0;"
+    "start ignore default;done 0;"
+    "start reserve ;done 0;"
+  );
+  CHECK(observer.written);
+  CHECK(observer.ordered);
+}
+
+void testCapture(MockServer &server) {
+  char path[] = "/tmp/beanstalkpp-capture-XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  
+  WireCapture capture;
+  CHECK(capture.open(path));
+  
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  c.setCapture(&capture);
+  c.use("captured");
+  c.watch("captured");
+  c.put("recorded");
+  
+  // A second client sharing the capture is recorded as a connection of its own
+  Client other("127.0.0.1", server.getPort());
+  other.connect();
+  other.setCapture(&capture);
+  other.use("shared");
+  
+  c.del(c.reserve());
+  capture.close();
+  
+  CaptureReader reader;
+  CHECK(reader.open(path));
+  
+  string sent, received, otherSent;
+  uint64_t lastTimestamp = 0;
+  CaptureReader::Record r;
+  while(reader.next(r)) {
+    CHECK(r.timestamp >= lastTimestamp);
+    lastTimestamp = r.timestamp;
+    
+    CHECK(r.connection <= 1);
+    if(r.connection == 1) {
+      if(r.direction == WireCapture::SENT) otherSent += r.data;
+      continue;
+    }
+    (r.direction == WireCapture::SENT ? sent : received) += r.data;
+  }
+  CHECK(otherSent == "use shared\r\n");
+  
+  CHECK(sent.find(
+    "use captured\r\nwatch captured\r\nput 1024 0 60 8\r\nrecorded\r\nreserve\r\ndelete "
+  ) == 0);
+  CHECK(received.find("USING captured\r\nWATCHING 2\r\nINSERTED ") == 0);
+  CHECK(received.find("\r\nrecorded\r\nDELETED\r\n") != string::npos);
+  
+  unlink(path);
+}
+
+void testStats(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  c.use("stats");
+  c.watch("stats");
+  c.ignore("default");
+  
+  for(int i = 0; i < 3; i++)
+    c.put("stats " + to_string(i));
+  Job j = c.reserve();
+  
+  TubeStats tube = c.statsTube("stats");
+  CHECK(tube.name == "stats");
+  CHECK(tube.currentJobsReady == 2);
+  CHECK(tube.currentJobsReserved == 1);
+  CHECK(tube.totalJobs == 3);
+  
+  JobStats job = c.statsJob(j.getJobId());
+  CHECK(job.id == j.getJobId());
+  CHECK(job.tube == "stats");
+  CHECK(job.state == "reserved");
+  CHECK(job.reserves == 1);
+  
+  ServerStats stats = c.stats();
+  CHECK(stats.currentJobsReserved >= 1);
+  CHECK(stats.version == "mock");
+  
+  Result<TubeStats> missing = c.tryStatsTube("no-such-tube");
+  CHECK(!missing && missing.error() == ServerException::NOT_FOUND);
+  
+  // The second server doesn't exist, and must only be counted as failed
+  std::vector<StatsPoller::server_t> servers;
+  servers.push_back(StatsPoller::server_t("127.0.0.1", server.getPort()));
+  servers.push_back(StatsPoller::server_t("127.0.0.1", 1));
+  StatsPoller poller(servers);
+  CHECK(!poller.latest());
+  
+  boost::shared_ptr<const ClusterSample> sample = poller.poll();
+  CHECK(sample->serversFailed == 1);
+  CHECK(poller.latest() == sample);
+  
+  const TubeSample *t = NULL;
+  for(size_t i = 0; i < sample->tubes.size(); i++)
+    if(sample->tubes[i].name == "stats") t = &sample->tubes[i];
+  CHECK(t && t->ready == 2 && t->reserved == 1 && t->totalJobs == 3);
+  CHECK(t && t->users == 1 && t->watchers == 1);
+  CHECK(sample->total.reserved >= 1);
+  CHECK(sample->connections >= 2 && sample->reserves >= 1);
+  
+  c.del(j);
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  sample = poller.poll();
+  
+  t = NULL;
+  for(size_t i = 0; i < sample->tubes.size(); i++)
+    if(sample->tubes[i].name == "stats") t = &sample->tubes[i];
+  CHECK(t && t->reserved == 0 && t->deletes == 1 && t->deleteRate > 0 && t->putRate == 0);
+  CHECK(t && t->backlogRate == 0);
+  
+  poller.start(5);
+  std::this_thread::sleep_for(std::chrono::milliseconds(30));
+  poller.stop();
+  CHECK(poller.latest() != sample);
+  
+  job_p_t rest;
+  while(c.reserveWithTimeout(rest, 0))
+    c.del(*rest);
+  
+  // A server coming back after a failure doesn't show what it did meanwhile as a burst of puts
+  boost::scoped_ptr<MockServer> flaky(new MockServer());
+  flaky->start();
+  unsigned short flakyPort = flaky->getPort();
+  
+  servers.clear();
+  servers.push_back(StatsPoller::server_t("127.0.0.1", server.getPort()));
+  servers.push_back(StatsPoller::server_t("127.0.0.1", flakyPort));
+  StatsPoller rates(servers);
+  
+  c.use("rates");
+  c.put("rates");
+  rates.poll();
+  
+  flaky->stop();
+  CHECK(rates.poll()->serversFailed == 1);
+  
+  flaky.reset(new MockServer(flakyPort));
+  flaky->start();
+  Client back("127.0.0.1", flakyPort);
+  back.connect();
+  back.use("rates");
+  for(int i = 0; i < 50; i++)
+    back.put("rates");
+  
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  sample = rates.poll();
+  t = NULL;
+  for(size_t i = 0; i < sample->tubes.size(); i++)
+    if(sample->tubes[i].name == "rates") t = &sample->tubes[i];
+  CHECK(sample->serversFailed == 0);
+  CHECK(t && t->totalJobs == 51 && t->putRate == 0 && t->backlogRate == 0);
+  
+  Client cleanup("127.0.0.1", server.getPort());
+  cleanup.connect();
+  cleanup.watch("rates");
+  cleanup.ignore("default");
+  cleanup.del(cleanup.reserve());
+}
+
+void testDrain(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  c.use("drain");
+  c.watch("drain");
+  c.ignore("default");
+  
+  for(int i = 0; i < 3; i++)
+    c.put("drain " + to_string(i));
+  
+  // Pipelined reserves, the last of which finds the tube empty
+  for(int i = 0; i < 4; i++)
+    CHECK(c.trySendReserve(0).ok());
+  
+  StringSink sink;
+  job_id_t ids[3];
+  for(int i = 0; i < 3; i++) {
+    Result<job_id_t> id = c.tryReadReserve(sink);
+    CHECK(id.ok());
+    ids[i] = id.value();
+  }
+  CHECK(sink.data == "drain 0drain 1drain 2");
+  
+  Result<job_id_t> empty = c.tryReadReserve(sink);
+  CHECK(!empty && empty.error() == ServerException::TIMED_OUT);
+  
+  CHECK(c.trySendStatsJob(ids[0]).ok());
+  CHECK(c.trySendBury(ids[0], 7).ok());
+  CHECK(c.trySendDelete(ids[1]).ok());
+  CHECK(c.trySendDelete(ids[2]).ok());
+  CHECK(c.trySendDelete(ids[2]).ok());
+  CHECK(c.tryReadStatsJob().value().state == "reserved");
+  CHECK(c.tryReadBury().ok());
+  CHECK(c.tryReadDelete().ok());
+  CHECK(c.tryReadDelete().ok());
+  
+  Status missing = c.tryReadDelete();
+  CHECK(!missing && missing.error() == ServerException::NOT_FOUND);
+  
+  CHECK(c.kick(10) == 1);
+  CHECK(c.kick(10) == 0);
+  
+  Job j = c.reserve();
+  CHECK(j.getJobId() == ids[0]);
+  CHECK(c.statsJob(j.getJobId()).pri == 7);
+  c.del(j);
+}
+
+void testMove(MockServer &server) {
+  MockServer other;
+  other.setMaxJobSize(16);
+  other.start();
+  
+  Client source("127.0.0.1", server.getPort());
+  source.connect();
+  source.use("move");
+  source.watch("move");
+  
+  for(int i = 0; i < 100; i++)
+    source.put("move " + to_string(i), 100 + i, 0, 30);
+  source.put("too big for the destination", 5, 0, 30);
+  
+  // Buried jobs, which are only moved with setMoveBuried
+  source.ignore("default");
+  Job buried = source.reserve();
+  CHECK(buried.asString() == "too big for the destination");
+  source.bury(buried, 7);
+  source.put("was buried", 3, 0, 30);
+  source.bury(source.reserve(), 3);
+  
+  Client destination("127.0.0.1", other.getPort());
+  destination.connect();
+  
+  Mover m(source, "move", destination, "moved");
+  m.setBatchSize(16);
+  m.setMoveBuried(true);
+  
+  Result<uint64_t> moved = m.moveAll();
+  CHECK(moved.ok() && moved.value() == 101);
+  CHECK(m.getMoved() == 101 && m.getRejected() == 1);
+  
+  CHECK(m.isDone());
+  
+  TubeStats left = source.statsTube("move");
+  CHECK(left.currentJobsReady == 0 && left.currentJobsReserved == 0 && left.currentJobsBuried == 1);
+  
+  // The buried job stays buried on the destination
+  TubeStats arrived = destination.statsTube("moved");
+  CHECK(arrived.currentJobsReady == 100 && arrived.currentJobsBuried == 1);
+  CHECK(arrived.currentJobsDelayed == 0 && arrived.currentJobsReserved == 0);
+  
+  destination.use("moved");
+  job_p_t wasBuried;
+  CHECK(destination.peekBuried(wasBuried) && wasBuried->asString() == "was buried");
+  
+  JobStats stats = destination.statsJob(wasBuried->getJobId());
+  CHECK(stats.pri == 3 && stats.ttr == 30);
+  destination.del(wasBuried);
+  
+  destination.watch("moved");
+  for(int i = 0; i < 100; i++) {
+    Job j = destination.reserve();
+    CHECK(j.asString() == "move " + to_string(i));
+    destination.del(j);
+  }
+  
+  job_p_t j;
+  CHECK(source.reserveWithTimeout(j, 0) == false);
+  source.kick(1);
+  CHECK(source.reserveWithTimeout(j, 0) && j->asString() == "too big for the destination");
+  source.del(j);
+  
+  other.stop();
+}
+
+void testKick(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  c.use("kick");
+  c.watch("kick");
+  c.ignore("default");
+  
+  job_p_t j(new Job);
+  CHECK(c.peekBuried(j) == false);
+  CHECK(c.peekDelayed(j) == false);
+  
+  c.put("delayed", 10, 3600, 30);
+  for(int i = 0; i < 40; i++) {
+    c.put("buried " + to_string(i));
+    c.bury(c.reserve(), 10);
+  }
+  
+  CHECK(c.peekBuried(j) && j->asString() == "buried 0");
+  job_id_t firstBuried = j->getJobId();
+  CHECK(c.peekDelayed(j) && j->asString() == "delayed");
+  job_id_t delayed = j->getJobId();
+  
+  CHECK(c.peek(firstBuried, j) && j->asString() == "buried 0");
+  CHECK(c.peek(delayed + 1000, j) == false);
+  
+  c.kickJob(firstBuried);
+  CHECK(c.reserveWithTimeout(j, 0) && j->getJobId() == firstBuried);
+  c.del(j);
+  CHECK(c.tryKickJob(firstBuried).error() == ServerException::NOT_FOUND);
+  
+  // 39 buried jobs at 400 jobs a second, without touching the delayed one
+  Kicker k(c, "kick");
+  k.setRate(400);
+  Result<uint64_t> kicked = k.run();
+  CHECK(kicked.ok() && kicked.value() == 39 && k.getKicked() == 39);
+  
+  TubeStats stats = c.statsTube("kick");
+  CHECK(stats.currentJobsReady == 39 && stats.currentJobsBuried == 0 && stats.currentJobsDelayed == 1);
+  
+  for(int i = 1; i < 40; i++) {
+    CHECK(c.reserveWithTimeout(j, 0) && j->asString() == "buried " + to_string(i));
+    c.del(j);
+  }
+  
+  c.kickJob(delayed);
+  CHECK(c.reserveWithTimeout(j, 0) && j->getJobId() == delayed);
+  c.del(j);
+  
+  // Rates that aren't positive are clamped, so the first step is kicked and the next one waited for
+  for(int i = 0; i < 2; i++) {
+    c.put("buried again");
+    c.bury(c.reserve(), 10);
+  }
+  
+  Kicker slow(c, "kick");
+  slow.setRate(-5);
+  slow.setRate(0);
+  std::thread stopper([&slow]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    slow.stop();
+  });
+  kicked = slow.run();
+  stopper.join();
+  CHECK(kicked.ok() && kicked.value() == 1);
+  
+  c.kick(1);
+  for(int i = 0; i < 2; i++) {
+    CHECK(c.reserveWithTimeout(j, 0));
+    c.del(j);
+  }
+}
+
+void testElision(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  
+  RecordingObserver observer;
+  c.setObserver(&observer);
+  
+  // A new connection already uses and watches "default"
+  c.use("default");
+  CHECK(c.watch("default") == 1);
+  CHECK(c.ignore("elided") == 1);
+  CHECK(observer.log.empty());
+  
+  c.use("elided");
+  c.use("elided");
+  CHECK(c.watch("elided") == 2);
+  CHECK(c.watch("elided") == 2);
+  CHECK(observer.log == "start use elided;done 0;start watch elided;done 0;");
+  CHECK(c.getUsedTube() == "elided" && c.getWatchedTubes().size() == 2);
+  
+  // The last watched tube can't be ignored
+  CHECK(c.ignore("default") == 1);
+  CHECK(c.tryIgnore("elided").error() == ServerException::NOT_IGNORED);
+  CHECK(c.getWatchedTubes().count("elided") == 1);
+  
+  // After a failure the tube in use is unknown, so the next use is sent
+  server.injectError("use", "INTERNAL_ERROR");
+  CHECK(!c.tryUse("elided-b"));
+  observer.log.clear();
+  c.use("elided-b");
+  CHECK(observer.log == "start use elided-b;done 0;");
+  
+  c.use("elided");
+  observer.log.clear();
+  
+  vector<BatchPut> jobs;
+  for(int i = 0; i < 300; i++)
+    jobs.push_back(BatchPut(i % 3 ? "elided-b" : "elided", to_string(i), 100, 0, 30));
+  
+  server.injectError("put", "JOB_TOO_BIG");
+  CHECK(c.putBatch(jobs) == 299);
+  
+  // One use per tube, starting with the tube in use
+  CHECK(observer.log == "start use elided-b;done 0;");
+  CHECK(c.getUsedTube() == "elided-b");
+  CHECK(jobs[0].jobId == 0 && jobs[3].jobId < jobs[6].jobId && jobs[297].jobId < jobs[1].jobId);
+  CHECK(jobs[1].jobId < jobs[2].jobId && jobs[2].jobId < jobs[4].jobId);
+  
+  c.setObserver(NULL);
+  CHECK(c.statsTube("elided").currentJobsReady == 99);
+  CHECK(c.statsTube("elided-b").currentJobsReady == 200);
+  
+  c.watch("elided-b");
+  for(int i = 0; i < 299; i++)
+    c.del(c.reserve());
+  
+  // Any other error fails the batch, but only after the replies in flight have been read
+  jobs.clear();
+  for(int i = 0; i < 3; i++)
+    jobs.push_back(BatchPut("elided", to_string(i)));
+  
+  server.injectError("put", "DRAINING");
+  Result<size_t> batch = c.tryPutBatch(jobs);
+  CHECK(!batch && batch.error() == ServerException::DRAINING);
+  CHECK(jobs[0].jobId == 0 && jobs[1].jobId > 0 && jobs[2].jobId > 0);
+  
+  CHECK(c.tryListTubes().ok());
+  CHECK(c.tryPut("after the batch").ok());
+  
+  c.watch("elided");
+  c.ignore("elided-b");
+  for(int i = 0; i < 3; i++)
+    c.del(c.reserve());
+}
+
+void testFairScheduler(MockServer &server) {
+  Client producer("127.0.0.1", server.getPort());
+  producer.connect();
+  
+  vector<BatchPut> jobs;
+  for(int i = 0; i < 100; i++) {
+    jobs.push_back(BatchPut("fair-big", "big"));
+    jobs.push_back(BatchPut("fair-heavy", "heavy"));
+  }
+  for(int i = 0; i < 5; i++)
+    jobs.push_back(BatchPut("fair-small", "small"));
+  producer.putBatch(jobs);
+  
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  
+  FairScheduler scheduler(c);
+  scheduler.setTube("fair-big");
+  scheduler.setTube("fair-small");
+  scheduler.setTube("fair-heavy", 3);
+  scheduler.setTube("fair-idle");
+  
+  // Four rounds, each probing the idle tube until a probe finds it empty
+  map<string, int> reserved;
+  job_p_t j;
+  for(int i = 0; i < 20; i++) {
+    CHECK(scheduler.reserve(j));
+    CHECK(j->asString() == scheduler.getLastTube().substr(5));
+    reserved[scheduler.getLastTube()]++;
+    c.del(j);
+  }
+  
+  CHECK(reserved["fair-big"] == 4 && reserved["fair-small"] == 4 && reserved["fair-heavy"] == 12);
+  CHECK(scheduler.getMisses() == 1);
+  CHECK(scheduler.getSwitches() == 13);
+  CHECK(c.getWatchedTubes().size() == 1);
+  
+  // With a poller, tubes without ready jobs are never probed
+  vector<StatsPoller::server_t> servers;
+  servers.push_back(StatsPoller::server_t("127.0.0.1", server.getPort()));
+  StatsPoller poller(servers);
+  poller.poll();
+  scheduler.setPoller(&poller);
+  
+  int left = 0;
+  while(scheduler.reserve(j)) {
+    left++;
+    c.del(j);
+  }
+  CHECK(left == 185);
+  
+  uint64_t misses = scheduler.getMisses();
+  poller.poll();
+  CHECK(!scheduler.reserve(j));
+  CHECK(scheduler.getMisses() == misses);
+}
+
+void testHedgedProducer(MockServer &server) {
+  MockServer stalling;
+  stalling.start();
+  
+  Client fast("127.0.0.1", server.getPort()), slow("127.0.0.1", stalling.getPort());
+  fast.connect();
+  slow.connect();
+  
+  vector<Client*> clients;
+  clients.push_back(&fast);
+  clients.push_back(&slow);
+  
+  HedgedProducer producer(clients);
+  producer.use("hedged");
+  producer.setHedgeDelay(1000, 5000);
+  
+  for(int i = 0; i < 100; i++)
+    producer.put("hedged");
+  
+  HedgedProducer::ServerInfo before = producer.getServerInfo(1);
+  
+  // The second server stalls, so puts sent to it are hedged, and the first server wins them
+  stalling.setLatency(30000);
+  
+  int64_t slowest = 0;
+  for(int i = 0; i < 60; i++) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    producer.put("hedged");
+    slowest = std::max<int64_t>(slowest, chrono::duration_cast<chrono::milliseconds>(
+      chrono::steady_clock::now() - start
+    ).count());
+  }
+  
+  CHECK(slowest < 25);
+  CHECK(producer.getHedged() > 0 && producer.getHedgeWins() > 0);
+  CHECK(producer.getServerInfo(1).primaries - before.primaries < 30);
+  
+  // The losing copies are deleted, leaving one copy of each job
+  stalling.setLatency(0);
+  CHECK(producer.tryFlush());
+  CHECK(producer.getDuplicates() == 0);
+  CHECK(producer.getServerInfo(1).meanUs > before.meanUs);
+  CHECK(fast.statsTube("hedged").currentJobsReady + slow.statsTube("hedged").currentJobsReady == 160);
+  
+  fast.watch("hedged");
+  for(int i = 0; i < (int)fast.statsTube("hedged").currentJobsReady; i++)
+    fast.del(fast.reserve());
+  
+  // A failed server is left out, and taken back in once it's up again and its backoff ran out
+  unsigned short stallingPort = stalling.getPort();
+  stalling.stop();
+  for(int i = 0; i < 100 && !producer.getServerInfo(1).failed; i++)
+    producer.tryPut("hedged");
+  CHECK(producer.getServerInfo(1).failed);
+  
+  MockServer back(stallingPort);
+  back.start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(150));
+  
+  // Its stalled samples make it a rare pick, so keep putting for a while rather than a fixed count
+  before = producer.getServerInfo(1);
+  chrono::steady_clock::time_point giveUp = chrono::steady_clock::now() + chrono::seconds(5);
+  while(producer.getServerInfo(1).primaries == before.primaries &&
+        chrono::steady_clock::now() < giveUp)
+    producer.put("hedged");
+  CHECK(!producer.getServerInfo(1).failed);
+  CHECK(producer.getServerInfo(1).primaries > before.primaries);
+  
+  CHECK(producer.tryFlush());
+  for(int i = 0; i < (int)fast.statsTube("hedged").currentJobsReady; i++)
+    fast.del(fast.reserve());
+  
+  back.stop();
+}
+
+/**
+ * Removes the directory @p path and the files in it
+ */
+static void removeDirectory(const string &path) {
+  DIR *dir = opendir(path.c_str());
+  for(struct dirent *e = dir ? readdir(dir) : NULL; e; e = readdir(dir))
+    if(e->d_name[0] != '.') unlink((path + "/" + e->d_name).c_str());
+  
+  if(dir) closedir(dir);
+  rmdir(path.c_str());
+}
+
+/**
+ * Returns the segment files of the outbox in @p path, sorted
+ */
+static vector<string> outboxSegments(const string &path) {
+  vector<string> ret;
+  
+  DIR *dir = opendir(path.c_str());
+  for(struct dirent *e = readdir(dir); e; e = readdir(dir))
+    if(strstr(e->d_name, ".seg")) ret.push_back(path + "/" + e->d_name);
+  closedir(dir);
+  
+  sort(ret.begin(), ret.end());
+  return ret;
+}
+
+void testOutbox(MockServer &server) {
+  char path[] = "/tmp/beanstalkpp-outbox-XXXXXX";
+  CHECK(mkdtemp(path));
+  
+  // Puts succeed while the server is down
+  MockServer down;
+  down.start();
+  int downPort = down.getPort();
+  down.stop();
+  
+  {
+    Outbox o("127.0.0.1", downPort);
+    o.setSegmentSize(4096);
+    CHECK(o.open(path));
+    
+    for(int i = 0; i < 100; i++)
+      o.put(i % 2 ? "outbox-b" : "outbox-a", "job " + to_string(i) + string(100, '.'));
+    o.put("outbox-a", "torn record");
+    
+    CHECK(o.tryPut("outbox-a", string(5000, 'x')).error() == ServerException::JOB_TOO_BIG);
+    CHECK(o.tryPut("outbox a", "x").error() == ServerException::BAD_FORMAT);
+    CHECK(o.tryPut("-outbox", "x").error() == ServerException::BAD_FORMAT);
+    CHECK(o.tryPut(string(201, 't'), "x").error() == ServerException::BAD_FORMAT);
+    CHECK(o.getPending() == 101);
+    CHECK(o.tryDrain().error() == ServerException::NETWORK_ERROR);
+    CHECK(o.getPending() == 101);
+  }
+  
+  vector<string> segments = outboxSegments(path);
+  CHECK(segments.size() == 4);
+  
+  // Tear the last record, as a crash in the middle of the put would
+  int fd = open(segments.back().c_str(), O_RDWR);
+  char segment[4096];
+  CHECK(pread(fd, segment, sizeof(segment), 0) == sizeof(segment));
+  char *torn = (char *)memmem(segment, sizeof(segment), "torn record", 11);
+  CHECK(torn && pwrite(fd, "T", 1, torn - segment) == 1);
+  close(fd);
+  
+  {
+    Outbox o("127.0.0.1", server.getPort());
+    CHECK(o.open(path));
+    CHECK(o.getPending() == 100);
+    
+    Result<uint64_t> drained = o.tryDrain();
+    CHECK(drained.ok() && drained.value() == 100);
+    CHECK(o.getPending() == 0 && o.getDrained() == 100);
+  }
+  
+  // Drained segments are deleted, and the checkpoint keeps the jobs from being put again
+  CHECK(outboxSegments(path).size() == 1);
+  
+  {
+    Outbox o("127.0.0.1", server.getPort());
+    CHECK(o.open(path));
+    CHECK(o.getPending() == 0);
+    
+    o.start();
+    for(int i = 100; i < 110; i++)
+      o.put(i % 2 ? "outbox-b" : "outbox-a", "job " + to_string(i) + string(100, '.'));
+    
+    for(int i = 0; i < 200 && o.getDrained() < 10; i++)
+      this_thread::sleep_for(chrono::milliseconds(10));
+    o.stop();
+    
+    CHECK(o.getDrained() == 10 && o.getPending() == 0);
+    
+    o.put("outbox-c", "refused");
+    o.put("outbox-c", "accepted");
+  }
+  
+  // Give the first record a tube name the server refuses, as an older log might have
+  fd = open(outboxSegments(path).back().c_str(), O_RDWR);
+  CHECK(pread(fd, segment, sizeof(segment), 0) == sizeof(segment));
+  char *refused = (char *)memmem(segment, sizeof(segment), "outbox-crefused", 15);
+  CHECK(refused);
+  refused[0] = '-';
+  char *record = refused - Outbox::RECORD_HEADER_SIZE;
+  uint32_t crc = crc32c(record + 4, Outbox::RECORD_HEADER_SIZE - 4 + 15);
+  for(int i = 0; i < 4; i++)
+    record[i] = (char)((crc >> (8 * i)) & 0xff);
+  CHECK(pwrite(fd, segment, sizeof(segment), 0) == sizeof(segment));
+  close(fd);
+  
+  // The refused record is skipped, instead of failing the batch and everything behind it
+  {
+    Outbox o("127.0.0.1", server.getPort());
+    CHECK(o.open(path));
+    CHECK(o.getPending() == 2);
+    
+    Result<uint64_t> drained = o.tryDrain();
+    CHECK(drained.ok() && drained.value() == 2);
+    CHECK(o.getPending() == 0 && o.getRejected() == 1);
+  }
+  
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  c.watch("outbox-a");
+  c.watch("outbox-b");
+  c.ignore("default");
+  CHECK(c.statsTube("outbox-a").currentJobsReady == 55);
+  CHECK(c.statsTube("outbox-b").currentJobsReady == 55);
+  CHECK(c.statsTube("outbox-c").currentJobsReady == 1);
+  
+  // The jobs of a tube keep their order
+  c.ignore("outbox-b");
+  for(int i = 0; i < 110; i += 2) {
+    Job j = c.reserve();
+    CHECK(j.asString() == "job " + to_string(i) + string(100, '.'));
+    c.del(j);
+  }
+  
+  c.watch("outbox-b");
+  c.ignore("outbox-a");
+  for(int i = 1; i < 110; i += 2) {
+    Job j = c.reserve();
+    CHECK(j.asString() == "job " + to_string(i) + string(100, '.'));
+    c.del(j);
+  }
+  
+  removeDirectory(path);
+}
+
+void testReconnect() {
+  MockServer first;
+  first.start();
+  unsigned short port = first.getPort();
+  
+  Client c("127.0.0.1", port);
+  c.setReconnect(5, 1, 20);
+  c.connect();
+  c.use("reconnect");
+  c.watch("reconnect");
+  c.ignore("default");
+  c.put("before");
+  
+  // The restarted server has lost the connection and its tubes
+  first.stop();
+  MockServer second(port);
+  second.start();
+  
+  // Idempotent commands are retried on the new connection
+  vector<string> watched = c.listTubesWatched();
+  CHECK(watched.size() == 1 && watched[0] == "reconnect");
+  CHECK(c.getReconnects() == 1);
+  
+  c.put("after");
+  Job j = c.reserve();
+  CHECK(j.asString() == "after");
+  CHECK(c.statsJob(j.getJobId()).tube == "reconnect");
+  c.del(j);
+  
+  // A put may have taken effect, so it fails, but the next one finds the client connected
+  second.stop();
+  MockServer third(port);
+  third.start();
+  
+  CHECK(c.tryPut("lost").error() == ServerException::NETWORK_ERROR);
+  CHECK(c.getReconnects() == 2);
+  CHECK(c.tryPut("kept").ok());
+  CHECK(c.statsTube("reconnect").currentJobsReady == 1);
+  
+  // Without a server to reconnect to, the command's failure is returned
+  third.stop();
+  c.setReconnect(2, 1, 2);
+  CHECK(c.tryStats().error() == ServerException::NETWORK_ERROR);
+  CHECK(c.getReconnects() == 2);
+}
+
+void testTimeouts() {
+  MockServer server;
+  server.setMaxJobSize(8 << 20);
+  server.start();
+  
+  Client c("127.0.0.1", server.getPort());
+  c.setTimeout(1000);
+  c.connect();
+  c.use("timeouts");
+  c.watch("timeouts");
+  c.ignore("default");
+  
+  // A job larger than the socket buffers is written in several waits
+  string big(4 << 20, 'x');
+  c.put(big);
+  Job j = c.reserve();
+  CHECK(j.asString() == big);
+  c.del(j);
+  
+  // A stalled reply fails the command, and closes the connection
+  c.setTimeout(50);
+  server.setLatency(300000);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  CHECK(c.tryStats().error() == ServerException::CLIENT_TIMEOUT);
+  CHECK(chrono::steady_clock::now() - start < chrono::milliseconds(250));
+  server.setLatency(0);
+  CHECK(c.tryStats().error() == ServerException::NETWORK_ERROR);
+  
+  c.connect();
+  server.setLatency(300000);
+  bool thrown = false;
+  try {
+    c.stats();
+  } catch(TimeoutException &e) {
+    thrown = e.getReason() == ServerException::CLIENT_TIMEOUT;
+  }
+  CHECK(thrown);
+  server.setLatency(0);
+  
+  // The wait for a job is the server's, unless a deadline bounds it
+  c.connect();
+  job_p_t job;
+  CHECK(c.tryReserveWithTimeout(job, 1).value() == false);
+  {
+    Client::Deadline d(c, 100);
+    CHECK(c.tryReserveWithTimeout(job, 1).error() == ServerException::CLIENT_TIMEOUT);
+  }
+  
+  // Deadlines span commands
+  c.setTimeout(0);
+  c.connect();
+  server.setLatency(80000);
+  {
+    Client::Deadline d(c, 120);
+    CHECK(c.tryStats().ok());
+    CHECK(c.tryStats().error() == ServerException::CLIENT_TIMEOUT);
+  }
+  server.setLatency(0);
+  
+  c.connect();
+  CHECK(c.tryStats().ok());
+  
+  if(c.getMetrics()) {
+    MetricsSnapshot m;
+    c.getMetrics()->snapshot(m);
+    CHECK(m.errors[ServerException::CLIENT_TIMEOUT] == 4);
+  }
+}
+
+/**
+ * Returns the socket of this process connected to @p port, or -1 if there isn't exactly one
+ */
+static int socketConnectedTo(unsigned short port) {
+  int ret = -1;
+  
+  for(int fd = 0; fd < 1024; fd++) {
+    struct sockaddr_in peer;
+    socklen_t length = sizeof(peer);
+    if(getpeername(fd, (struct sockaddr *)&peer, &length) != 0 || peer.sin_family != AF_INET)
+      continue;
+    if(ntohs(peer.sin_port) != port) continue;
+    
+    if(ret >= 0) return -1;
+    ret = fd;
+  }
+  
+  return ret;
+}
+
+static int getIntOption(int fd, int level, int option) {
+  int value = -1;
+  socklen_t length = sizeof(value);
+  getsockopt(fd, level, option, &value, &length);
+  
+  return value;
+}
+
+void testSocketOptions() {
+  // A server of its own, so the socket of the client is the only one connected to it
+  MockServer server;
+  server.start();
+  
+  ClientOptions o;
+  CHECK(o.noDelay && !o.quickAck && o.sendBufferSize == 0 && o.keepAliveIdle == 0);
+  
+  // Below the usual net.core.wmem_max, which the kernel caps buffer sizes at
+  o.sendBufferSize = o.receiveBufferSize = 65536;
+  o.keepAliveIdle = 60;
+  o.keepAliveInterval = 10;
+  o.keepAliveCount = 3;
+  o.busyPoll = 50;
+  o.quickAck = true;
+  
+  Client c("127.0.0.1", server.getPort());
+  c.setOptions(o);
+  c.connect();
+  CHECK(c.getOptions().keepAliveCount == 3);
+  
+  int fd = socketConnectedTo(server.getPort());
+  CHECK(fd >= 0);
+  CHECK(getIntOption(fd, IPPROTO_TCP, TCP_NODELAY) == 1);
+  CHECK(getIntOption(fd, SOL_SOCKET, SO_KEEPALIVE) == 1);
+  CHECK(getIntOption(fd, IPPROTO_TCP, TCP_KEEPIDLE) == 60);
+  CHECK(getIntOption(fd, IPPROTO_TCP, TCP_KEEPCNT) == 3);
+  CHECK(getIntOption(fd, SOL_SOCKET, SO_SNDBUF) >= 65536);
+  
+  ClientOptions actual;
+  CHECK(c.getSocketOptions(actual));
+  CHECK(actual.noDelay && actual.quickAck && actual.keepAliveIdle == 60);
+  CHECK(actual.keepAliveInterval == 10 && actual.keepAliveCount == 3);
+  CHECK(actual.sendBufferSize >= 65536 && actual.receiveBufferSize >= 65536);
+  
+  Client unconnected("127.0.0.1", server.getPort());
+  CHECK(!unconnected.getSocketOptions(actual));
+  
+  c.use("options");
+  c.watch("options");
+  for(int i = 0; i < 10; i++)
+    c.put("job " + to_string(i));
+  for(int i = 0; i < 10; i++) {
+    Job j = c.reserve();
+    CHECK(j.asString() == "job " + to_string(i));
+    c.del(j);
+  }
+  
+  // Changing the options of a connected client applies them right away
+  o.noDelay = false;
+  o.quickAck = false;
+  o.sendBufferSize = 200000;
+  c.setOptions(o);
+  CHECK(getIntOption(fd, IPPROTO_TCP, TCP_NODELAY) == 0);
+  CHECK(getIntOption(fd, SOL_SOCKET, SO_SNDBUF) >= 200000);
+  c.put("after");
+  Job j = c.reserve();
+  CHECK(j.asString() == "after");
+  c.del(j);
+}
+
+class CountingHandler: public ShardHandler {
+public:
+  CountingHandler(std::atomic<int> &handled):
+    handled(handled), thread(std::this_thread::get_id()) {}
+  
+  virtual bool handle(job_id_t, const char *data, size_t size) {
+    this->sameThread = this->sameThread && std::this_thread::get_id() == this->thread;
+    this->handled++;
+    
+    return string(data, size).compare(0, 3, "bad") != 0;
+  }
+  
+  static bool sameThread;
+private:
+  std::atomic<int> &handled;
+  std::thread::id thread;
+};
+
+bool CountingHandler::sameThread = true;
+
+void testShardRuntime(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  c.use("shards");
+  for(int i = 0; i < 200; i++)
+    c.put((i % 20 == 0 ? "bad " : "job ") + to_string(i), i % 20 == 0 ? 7 : 1024, 0, 60);
+  
+  std::atomic<int> handled(0);
+  std::thread::id mainThread = std::this_thread::get_id();
+  bool ownThreads = true;
+  
+  ShardRuntime runtime("127.0.0.1", server.getPort(), "shards", [&](size_t) {
+    ownThreads = ownThreads && std::this_thread::get_id() != mainThread;
+    return new CountingHandler(handled);
+  });
+  runtime.setShards(2);
+  runtime.setConnections(2);
+  runtime.setNuma(true);
+  runtime.start();
+  CHECK(runtime.getShards() == 2);
+  
+  for(int i = 0; i < 500 && runtime.getHandled() < 200; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  runtime.stop();
+  
+  CHECK(handled == 200);
+  CHECK(runtime.getHandled() == 200);
+  CHECK(ownThreads && CountingHandler::sameThread);
+  
+  uint64_t reserved = 0, deleted = 0, buried = 0;
+  for(size_t i = 0; i < runtime.getShards(); i++) {
+    ShardSnapshot s;
+    runtime.snapshot(i, s);
+    CHECK(s.errors == 0);
+    CHECK(s.handler.count == s.reserved);
+    reserved += s.reserved;
+    deleted += s.deleted;
+    buried += s.buried;
+  }
+  CHECK(reserved == 200 && deleted == 190 && buried == 10);
+  
+  TubeStats t = c.statsTube("shards");
+  CHECK(t.currentJobsReady == 0 && t.currentJobsReserved == 0 && t.currentJobsBuried == 10);
+  
+  // Rejected jobs keep their priority
+  job_p_t rejected;
+  CHECK(c.peekBuried(rejected) && c.statsJob(rejected->getJobId()).pri == 7);
+  
+  // A shard that can't connect fails the start
+  MockServer down;
+  down.start();
+  int downPort = down.getPort();
+  down.stop();
+  
+  ShardRuntime unreachable("127.0.0.1", downPort, "shards", [&](size_t) {
+    return new CountingHandler(handled);
+  });
+  unreachable.setShards(2);
+  CHECK(unreachable.tryStart().error() == ServerException::NETWORK_ERROR);
+}
+
+void testBlockingReserve(MockServer &server) {
+  Client consumer("127.0.0.1", server.getPort());
+  consumer.connect();
+  consumer.watch("blocking");
+  
+  std::thread producer([&server]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    
+    Client c("127.0.0.1", server.getPort());
+    c.connect();
+    c.use("blocking");
+    c.put("late");
+  });
+  
+  try {
+    Job j = consumer.reserve();
+    CHECK(j.asString() == "late");
+    consumer.del(j);
+  } catch(...) {
+    producer.join();
+    throw;
+  }
+  
+  producer.join();
+}
+
+void testLatency(MockServer &server) {
+  Client c("127.0.0.1", server.getPort());
+  c.connect();
+  
+  server.setLatency(5000);
+  
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  c.use("latency");
+  CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(5));
+  
+  server.setLatency(0);
+}
+
+int main() {
+  MockServer server;
+  server.start();
+  
+  try {
+    testPutReserve(server);
+    testErrors(server);
+    testStreaming(server);
+    testEncodings(server);
+    testPipelining(server);
+    testMetrics(server);
+    testObserver(server);
+    testCapture(server);
+    testStats(server);
+    testDrain(server);
+    testMove(server);
+    testKick(server);
+    testElision(server);
+    testFairScheduler(server);
+    testHedgedProducer(server);
+    testOutbox(server);
+    testReconnect();
+    testTimeouts();
+    testSocketOptions();
+    testShardRuntime(server);
+    testBlockingReserve(server);
+    testLatency(server);
+  } catch(Exception &e) {
+    printf("Caught exception: %s\n", e.what());
+    failures++;
+  }
+  
+  server.stop();
+  
+  if(failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  
+  printf("All checks passed\n");
+  return 0;
+}
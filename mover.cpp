@@ -0,0 +1,327 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "mover.h"
+
+#include "client.h"
+#include "sink.h"
+
+using namespace std;
+
+namespace {
+
+/**
+ * Collects each payload of a batch into its own string
+ */
+class BatchSink: public Beanstalkpp::PayloadSink {
+public:
+  BatchSink(vector<string> &payloads): payloads(payloads), count(0) {}
+  
+  virtual void begin(Beanstalkpp::job_id_t, size_t size) {
+    if(this->payloads.size() <= this->count) this->payloads.resize(this->count + 1);
+    
+    this->payloads[this->count].clear();
+    this->payloads[this->count].reserve(size);
+    this->count++;
+  }
+  
+  virtual bool write(const char *data, size_t length) {
+    this->payloads[this->count - 1].append(data, length);
+    return true;
+  }
+private:
+  vector<string> &payloads;
+  size_t count;
+};
+
+/**
+ * Skips the payloads of the copies reserved on the destination, which are only reserved to be
+ * buried
+ */
+class DiscardSink: public Beanstalkpp::PayloadSink {
+public:
+  virtual bool write(const char *, size_t) {
+    return false;
+  }
+};
+
+/**
+ * The priority and TTR given to jobs whose stats couldn't be read, the defaults of put
+ */
+const unsigned int DEFAULT_PRIORITY = 1024;
+const unsigned int DEFAULT_TTR = 60;
+
+/**
+ * The delay the copies of buried jobs are put with, which keeps the consumers of the destination
+ * off them until they are buried there
+ */
+const unsigned int BURIED_PUT_DELAY = 60;
+
+/**
+ * Returns true for the errors after which the connection is closed, and no more replies come
+ */
+bool isConnectionLost(Beanstalkpp::ServerException::Reason reason) {
+  return reason == Beanstalkpp::ServerException::NETWORK_ERROR ||
+    reason == Beanstalkpp::ServerException::CLIENT_TIMEOUT;
+}
+
+}
+
+Beanstalkpp::Mover::Mover(
+  Beanstalkpp::Client& source, const std::string& sourceTube, Beanstalkpp::Client& destination,
+  const std::string& destinationTube
+): source(source), sourceTube(sourceTube), destination(destination),
+  destinationTube(destinationTube), batchSize(64), buried(false), prepared(false), drained(false),
+  buriedLeft(0), moved(0), rejected(0) {
+}
+
+void Beanstalkpp::Mover::setBatchSize(size_t jobs) {
+  this->batchSize = jobs > 0 ? jobs : 1;
+}
+
+void Beanstalkpp::Mover::setMoveBuried(bool enabled) {
+  this->buried = enabled;
+}
+
+Beanstalkpp::Status Beanstalkpp::Mover::prepare() {
+  Result<size_t> watched = this->source.tryWatch(this->sourceTube);
+  if(!watched) return watched.failure();
+  
+  if(this->sourceTube != "default") {
+    watched = this->source.tryIgnore("default");
+    if(!watched) return watched.failure();
+  }
+  
+  // peek-buried works on the used tube
+  Status s = this->source.tryUse(this->sourceTube);
+  if(!s) return s;
+  
+  s = this->destination.tryUse(this->destinationTube);
+  if(!s) return s;
+  
+  if(this->buried) {
+    Result<TubeStats> stats = this->source.tryStatsTube(this->sourceTube);
+    if(!stats && stats.error() != ServerException::NOT_FOUND) return stats.failure();
+    
+    this->buriedLeft = stats ? stats.value().currentJobsBuried : 0;
+  }
+  
+  this->prepared = true;
+  return Status();
+}
+
+Beanstalkpp::Result<size_t> Beanstalkpp::Mover::moveBatch() {
+  if(!this->prepared) {
+    Status s = this->prepare();
+    if(!s) return s.failure();
+  }
+  
+  if(this->buriedLeft > 0) return this->moveBuried();
+  
+  // Reserve the batch. Once the tube is empty the remaining reserves time out at once.
+  for(size_t i = 0; i < this->batchSize; i++) {
+    Status s = this->source.trySendReserve(0);
+    if(!s) return s.failure();
+  }
+  
+  // Read every reply, even after an error, to keep the connection in sync. Jobs reserved by a
+  // failed batch go back to the source tube once their TTR runs out.
+  BatchSink sink(this->payloads);
+  Status failed;
+  this->ids.clear();
+  for(size_t i = 0; i < this->batchSize; i++) {
+    Result<job_id_t> id = this->source.tryReadReserve(sink);
+    if(id) {
+      this->ids.push_back(id.value());
+    } else if(
+      id.error() != ServerException::TIMED_OUT && id.error() != ServerException::DEADLINE_SOON
+    ) {
+      if(isConnectionLost(id.error())) return id.failure();
+      if(failed) failed = id.failure();
+    }
+  }
+  if(!failed) return failed.failure();
+  
+  size_t count = this->ids.size();
+  this->drained = count == 0;
+  if(count == 0) return (size_t)0;
+  
+  for(size_t i = 0; i < count; i++) {
+    Status s = this->source.trySendStatsJob(this->ids[i]);
+    if(!s) return s.failure();
+  }
+  
+  this->priorities.resize(count);
+  this->ttrs.resize(count);
+  for(size_t i = 0; i < count; i++) {
+    Result<JobStats> stats = this->source.tryReadStatsJob();
+    if(!stats && stats.error() != ServerException::NOT_FOUND) {
+      if(isConnectionLost(stats.error())) return stats.failure();
+      if(failed) failed = stats.failure();
+    }
+    
+    this->priorities[i] = stats ? stats.value().pri : DEFAULT_PRIORITY;
+    this->ttrs[i] = stats ? stats.value().ttr : DEFAULT_TTR;
+  }
+  if(!failed) return failed.failure();
+  
+  // A failure from here on leaves the batch reserved on the source, which releases it once the
+  // connection is closed
+  for(size_t i = 0; i < count; i++) {
+    Status s = this->destination.trySendPut(
+      this->payloads[i].data(), this->payloads[i].size(), this->priorities[i], 0, this->ttrs[i]
+    );
+    if(!s) return s.failure();
+  }
+  
+  this->inserted.assign(count, false);
+  for(size_t i = 0; i < count; i++) {
+    Result<job_id_t> id = this->destination.tryReadPutReply();
+    if(id) this->inserted[i] = true;
+    else if(isConnectionLost(id.error())) return id.failure();
+  }
+  
+  for(size_t i = 0; i < count; i++) {
+    Status s = this->inserted[i] ?
+      this->source.trySendDelete(this->ids[i]) :
+      this->source.trySendBury(this->ids[i], this->priorities[i]);
+    if(!s) return s.failure();
+  }
+  
+  size_t ret = 0;
+  for(size_t i = 0; i < count; i++) {
+    Status s = this->inserted[i] ? this->source.tryReadDelete() : this->source.tryReadBury();
+    
+    // A job whose TTR ran out went back to the source tube, and will be moved again
+    if(!s && s.error() != ServerException::NOT_FOUND) return s.failure();
+    
+    if(this->inserted[i]) ret++;
+    else this->rejected++;
+  }
+  
+  this->moved += ret;
+  return ret;
+}
+
+Beanstalkpp::Result<size_t> Beanstalkpp::Mover::moveBuried() {
+  DiscardSink discard;
+  size_t ret = 0;
+  
+  for(size_t i = 0; i < this->batchSize && this->buriedLeft > 0; i++) {
+    this->buriedLeft--;
+    
+    job_p_t peeked;
+    Result<bool> found = this->source.tryPeekBuried(peeked);
+    if(!found) return found.failure();
+    
+    // No buried jobs left means another client got there first
+    if(!found.value()) {
+      this->buriedLeft = 0;
+      break;
+    }
+    
+    // Reserving the job keeps other clients off it while it is moved
+    job_id_t id = peeked->getJobId();
+    Status s = this->source.trySendReserveJob(id);
+    if(!s) return s.failure();
+    s = this->source.trySendStatsJob(id);
+    if(!s) return s.failure();
+    
+    BatchSink sink(this->payloads);
+    Result<job_id_t> reserved = this->source.tryReadReserve(sink);
+    if(!reserved && isConnectionLost(reserved.error())) return reserved.failure();
+    Result<JobStats> stats = this->source.tryReadStatsJob();
+    if(!stats && isConnectionLost(stats.error())) return stats.failure();
+    
+    // A job which is gone, or was reserved by another client, isn't buried any more
+    if(!reserved) {
+      if(reserved.error() == ServerException::NOT_FOUND) continue;
+      return reserved.failure();
+    }
+    
+    unsigned int priority = stats ? stats.value().pri : DEFAULT_PRIORITY;
+    s = this->destination.trySendPut(
+      this->payloads[0].data(), this->payloads[0].size(), priority, BURIED_PUT_DELAY,
+      stats ? stats.value().ttr : DEFAULT_TTR
+    );
+    Result<job_id_t> copy = s ? this->destination.tryReadPutReply() : s.failure();
+    if(!copy) {
+      // Burying the job again, rather than leaving it reserved, keeps it from becoming ready. A
+      // rejected job ends up behind the buried jobs left to move.
+      s = this->source.trySendBury(id, priority);
+      if(s) s = this->source.tryReadBury();
+      if(!s && s.error() != ServerException::NOT_FOUND) return s.failure();
+      
+      if(isConnectionLost(copy.error())) return copy.failure();
+      
+      this->rejected++;
+      continue;
+    }
+    
+    // The destination has the job, so it is deleted from the source while the copy is buried
+    s = this->destination.trySendReserveJob(copy.value());
+    if(s) s = this->destination.trySendBury(copy.value(), priority);
+    if(!s) return s.failure();
+    s = this->source.trySendDelete(id);
+    if(!s) return s.failure();
+    
+    // Both connections are read before any error is returned, to keep them in sync
+    s = this->source.tryReadDelete();
+    Result<job_id_t> copyReserved = this->destination.tryReadReserve(discard);
+    Status copyBuried = copyReserved || !isConnectionLost(copyReserved.error()) ?
+      this->destination.tryReadBury() : copyReserved.failure();
+    
+    if(!s && s.error() != ServerException::NOT_FOUND) return s.failure();
+    
+    ret++;
+    this->moved++;
+    
+    // Without reserve-job the copy becomes ready once its delay has passed
+    if(!copyReserved) return copyReserved.failure();
+    if(!copyBuried) return copyBuried.failure();
+  }
+  
+  return ret;
+}
+
+Beanstalkpp::Result<uint64_t> Beanstalkpp::Mover::moveAll() {
+  uint64_t total = 0;
+  
+  while(!this->isDone()) {
+    Result<size_t> batch = this->moveBatch();
+    if(!batch) return batch.failure();
+    
+    total += batch.value();
+  }
+  
+  return total;
+}
+
+bool Beanstalkpp::Mover::isDone() const {
+  return this->drained && this->buriedLeft == 0;
+}
+
+uint64_t Beanstalkpp::Mover::getMoved() const {
+  return this->moved;
+}
+
+uint64_t Beanstalkpp::Mover::getRejected() const {
+  return this->rejected;
+}
@@ -0,0 +1,144 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_MOVER_H
+#define _BEANSTALK_MOVER_H
+
+#include <string>
+#include <vector>
+
+#include "job.h"
+#include "result.h"
+
+namespace Beanstalkpp {
+
+class Client;
+
+/**
+ * Moves the jobs of a tube to another tube, usually on another server.
+ * 
+ * Jobs are moved in batches, each taking a round trip to either server: the batch is reserved
+ * from the source with pipelined reserves, its priorities and TTRs are read with pipelined
+ * stats-job commands, it is put to the destination with pipelined puts, and then deleted from the
+ * source. A job is only deleted once the destination has confirmed its put, so a failure midway
+ * leaves it on the source, and it may end up on both servers. Jobs the destination rejects, e.g.
+ * as too big, are buried on the source.
+ * 
+ * Only ready jobs can be reserved in batches. With @c setMoveBuried, the jobs buried in the source
+ * tube when the move starts are moved first, one at a time, and stay buried on the destination.
+ * Delayed jobs are left in place.
+ */
+class Mover {
+public:
+  /**
+   * @param source           Connected client to take the jobs from
+   * @param sourceTube       The tube to empty
+   * @param destination      Connected client to put the jobs to
+   * @param destinationTube  The tube to put the jobs into
+   */
+  Mover(
+    Client &source, const std::string &sourceTube, Client &destination,
+    const std::string &destinationTube
+  );
+  
+  /**
+   * Sets the number of jobs moved per round trip. Defaults to 64. All jobs of a batch stay
+   * reserved until it is done, so batches must be moved well within the TTR of the jobs.
+   */
+  void setBatchSize(size_t jobs);
+  
+  /**
+   * Moves the buried jobs too. Each is reserved with reserve-job on the source, put to the
+   * destination with a delay which keeps consumers off it, and then reserved with reserve-job and
+   * buried there with its priority, so both servers must be beanstalkd 1.12 or later. Only one
+   * mover should move the buried jobs of a tube, as they are taken from the front of its buried
+   * jobs.
+   */
+  void setMoveBuried(bool enabled);
+  
+  /**
+   * Moves one batch of jobs, buried ones first
+   * 
+   * @return The number of jobs moved, which may be 0 when all of them were rejected, see @c isDone
+   */
+  Result<size_t> moveBatch();
+  
+  /**
+   * Moves batches until @c isDone
+   * 
+   * @return The number of jobs moved
+   */
+  Result<uint64_t> moveAll();
+  
+  /**
+   * Returns true once no buried jobs are left to move, and a batch found no ready jobs
+   */
+  bool isDone() const;
+  
+  /**
+   * Returns the number of jobs moved so far
+   */
+  uint64_t getMoved() const;
+  
+  /**
+   * Returns the number of jobs the destination rejected, which were buried on the source
+   */
+  uint64_t getRejected() const;
+private:
+  /**
+   * Selects the tubes on both connections
+   */
+  Status prepare();
+  
+  /**
+   * Moves a batch of buried jobs, one at a time
+   */
+  Result<size_t> moveBuried();
+  
+  Client &source;
+  std::string sourceTube;
+  Client &destination;
+  std::string destinationTube;
+  size_t batchSize;
+  bool buried;
+  bool prepared;
+  bool drained;
+  
+  /**
+   * Buried jobs left to move. Jobs buried after the move started, like the rejected ones, are
+   * not moved.
+   */
+  uint64_t buriedLeft;
+  uint64_t moved;
+  uint64_t rejected;
+  
+  /**
+   * The jobs of the current batch, reused between batches
+   */
+  std::vector<job_id_t> ids;
+  std::vector<std::string> payloads;
+  std::vector<unsigned int> priorities;
+  std::vector<unsigned int> ttrs;
+  std::vector<bool> inserted;
+};
+
+}
+
+#endif
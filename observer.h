@@ -0,0 +1,116 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_OBSERVER_H
+#define _BEANSTALK_OBSERVER_H
+
+#include <chrono>
+#include <cstdint>
+
+#include "job.h"
+#include "metrics.h"
+#include "serverexception.h"
+
+namespace Beanstalkpp {
+
+/**
+ * Describes a command in flight, as passed to a @c CommandObserver
+ */
+struct CommandEvent {
+  Metrics::Command command;
+  
+  /**
+   * The job the command operates on. 0 until known, e.g. for put until the reply is parsed.
+   */
+  job_id_t jobId;
+  
+  /**
+   * The tube the command operates on: the used tube for put and use, the named tube for watch
+   * and ignore. Empty where the tube isn't known, such as for reserve and delete.
+   */
+  const char *tube;
+  
+  /**
+   * When the command started, in nanoseconds on the steady clock (see @c now)
+   */
+  uint64_t startTime;
+  
+  /**
+   * When the reported event happened, in nanoseconds on the steady clock
+   */
+  uint64_t time;
+  
+  /**
+   * Set once the command has failed
+   */
+  bool failed;
+  
+  /**
+   * The current time in nanoseconds on the steady clock
+   */
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+  }
+};
+
+/**
+ * Receives the lifecycle events of the commands a Client runs, e.g. to tie them into
+ * distributed traces. Attach an observer with @c Client::setObserver.
+ * 
+ * The callbacks run synchronously on the client's thread, in the middle of the command, so they
+ * should be quick. A client without an observer only pays for a pointer check per event.
+ * 
+ * Pipelined puts (Client::trySendPut) aren't reported.
+ */
+class CommandObserver {
+public:
+  virtual ~CommandObserver() {}
+  
+  /**
+   * The command is about to be sent
+   */
+  virtual void commandStarted(const CommandEvent &) {}
+  
+  /**
+   * @p bytes of the command were written to the socket
+   */
+  virtual void bytesWritten(const CommandEvent &, size_t bytes) { (void)bytes; }
+  
+  /**
+   * The first bytes of the reply were read from the socket
+   */
+  virtual void firstReplyByte(const CommandEvent &) {}
+  
+  /**
+   * The reply was parsed and the command succeeded. This is the last event of the command.
+   */
+  virtual void replyParsed(const CommandEvent &) {}
+  
+  /**
+   * The command failed with @p reason. This is the last event of the command.
+   */
+  virtual void commandFailed(const CommandEvent &, ServerException::Reason reason) { (void)reason; }
+};
+
+}
+
+#endif
@@ -0,0 +1,502 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "outbox.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "client.h"
+#include "crc32c.h"
+
+using namespace std;
+
+// 64 MiB
+#define DEFAULT_SEGMENT_SIZE (64 << 20)
+
+// The defaults of Client::put
+#define DEFAULT_PRIORITY 1024
+#define DEFAULT_DELAY 0
+#define DEFAULT_TTR 60
+
+// Records per drained batch, and puts in flight while draining
+#define DRAIN_BATCH 1024
+#define DRAIN_DEPTH 64
+
+// How long the drainer thread waits after a failure
+#define RETRY_MS 1000
+
+// How long the drainer thread sleeps when the log is empty, unless woken by a put
+#define IDLE_MS 100
+
+// The checkpoint: segment number, offset and the CRC32C of both
+#define CHECKPOINT_SIZE 20
+
+const size_t Beanstalkpp::Outbox::RECORD_HEADER_SIZE;
+
+struct Beanstalkpp::Outbox::Segment {
+  Segment(): number(0), data(NULL), size(0) {}
+  
+  ~Segment() {
+    if(this->data) munmap(this->data, this->size);
+  }
+  
+  uint64_t number;
+  std::string path;
+  char *data;
+  size_t size;
+};
+
+static inline void writeLittleEndian(char *p, uint64_t v, int bytes) {
+  for(int i = 0; i < bytes; i++)
+    p[i] = (char)((v >> (8 * i)) & 0xff);
+}
+
+static inline uint64_t readLittleEndian(const char *p, int bytes) {
+  uint64_t v = 0;
+  for(int i = 0; i < bytes; i++)
+    v |= (uint64_t)(uint8_t)p[i] << (8 * i);
+  
+  return v;
+}
+
+/**
+ * Checks @p tube against the rules of the protocol: 1 to 200 bytes of letters, digits and
+ * "-+/;.$_()", not starting with a hyphen
+ */
+static bool isValidTube(const std::string &tube) {
+  if(tube.empty() || tube.size() > 200 || tube[0] == '-') return false;
+  
+  for(size_t i = 0; i < tube.size(); i++) {
+    char c = tube[i];
+    if(!isalnum((unsigned char)c) && !strchr("-+/;.$_()", c)) return false;
+  }
+  
+  return true;
+}
+
+/**
+ * Returns true for the errors the server replies with to a job it will never accept, which are
+ * skipped instead of retried
+ */
+static bool isPermanent(Beanstalkpp::ServerException::Reason reason) {
+  return reason == Beanstalkpp::ServerException::BAD_FORMAT ||
+    reason == Beanstalkpp::ServerException::EXPECTED_CRLF ||
+    reason == Beanstalkpp::ServerException::JOB_TOO_BIG;
+}
+
+Beanstalkpp::Outbox::Outbox(const std::string& host, int port):
+  host(host), port(port), segmentSize(DEFAULT_SEGMENT_SIZE), sync(false), checkpointFd(-1),
+  running(false), pending(0), drained(0), rejected(0) {
+  this->tail.segment = this->head.segment = 0;
+  this->tail.offset = this->head.offset = 0;
+}
+
+Beanstalkpp::Outbox::~Outbox() {
+  this->stop();
+  
+  if(this->checkpointFd >= 0) close(this->checkpointFd);
+}
+
+void Beanstalkpp::Outbox::setSegmentSize(size_t bytes) {
+  this->segmentSize = bytes;
+}
+
+void Beanstalkpp::Outbox::setSync(bool sync) {
+  this->sync = sync;
+}
+
+Beanstalkpp::Outbox::segment_p Beanstalkpp::Outbox::mapSegment(uint64_t number, bool create) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.seg", (unsigned long long)number);
+  
+  segment_p s(new Segment());
+  s->number = number;
+  s->path = this->directory + name;
+  
+  int fd = ::open(s->path.c_str(), O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+  if(fd < 0) return segment_p();
+  
+  // The blocks are reserved up front, as writing to a hole in the mapping on a full disk raises
+  // SIGBUS instead of failing
+  struct stat st;
+  if(create ? posix_fallocate(fd, 0, this->segmentSize) != 0 : fstat(fd, &st) != 0) {
+    ::close(fd);
+    if(create) unlink(s->path.c_str());
+    return segment_p();
+  }
+  
+  s->size = create ? this->segmentSize : st.st_size;
+  void *data = MAP_FAILED;
+  if(s->size > 0) data = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  
+  if(data == MAP_FAILED) return segment_p();
+  
+  s->data = (char *)data;
+  return s;
+}
+
+bool Beanstalkpp::Outbox::readRecord(const Segment& s, size_t offset, Record& r) {
+  if(offset + RECORD_HEADER_SIZE > s.size) return false;
+  
+  const char *p = s.data + offset;
+  r.tubeLength = readLittleEndian(p + 20, 2);
+  if(r.tubeLength == 0) return false;
+  
+  r.size = readLittleEndian(p + 4, 4);
+  r.length = RECORD_HEADER_SIZE + r.tubeLength + r.size;
+  if(r.length > s.size - offset) return false;
+  
+  if(readLittleEndian(p, 4) != crc32c(p + 4, r.length - 4)) return false;
+  
+  r.priority = readLittleEndian(p + 8, 4);
+  r.delay = readLittleEndian(p + 12, 4);
+  r.ttr = readLittleEndian(p + 16, 4);
+  r.tube = p + RECORD_HEADER_SIZE;
+  r.data = r.tube + r.tubeLength;
+  return true;
+}
+
+bool Beanstalkpp::Outbox::open(const std::string& directory) {
+  this->directory = directory;
+  if(mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) return false;
+  
+  this->checkpointFd = ::open((directory + "/checkpoint").c_str(), O_RDWR | O_CREAT, 0644);
+  if(this->checkpointFd < 0) return false;
+  
+  // A missing or torn checkpoint means starting from the oldest segment
+  char cp[CHECKPOINT_SIZE];
+  Position start = {0, 0};
+  if(
+    pread(this->checkpointFd, cp, sizeof(cp), 0) == (ssize_t)sizeof(cp) &&
+    readLittleEndian(cp + 16, 4) == crc32c(cp, 16)
+  ) {
+    start.segment = readLittleEndian(cp, 8);
+    start.offset = readLittleEndian(cp + 8, 8);
+  }
+  
+  vector<uint64_t> numbers;
+  DIR *dir = opendir(directory.c_str());
+  if(!dir) return false;
+  
+  for(struct dirent *e = readdir(dir); e; e = readdir(dir)) {
+    char *end;
+    uint64_t number = strtoull(e->d_name, &end, 16);
+    if(end == e->d_name + 16 && strcmp(end, ".seg") == 0) numbers.push_back(number);
+  }
+  closedir(dir);
+  sort(numbers.begin(), numbers.end());
+  
+  for(size_t i = 0; i < numbers.size(); i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.seg", (unsigned long long)numbers[i]);
+    
+    if(numbers[i] < start.segment) {
+      unlink((directory + name).c_str());
+      continue;
+    }
+    
+    segment_p s = this->mapSegment(numbers[i], false);
+    if(!s) return false;
+    this->segments[numbers[i]] = s;
+  }
+  
+  if(this->segments.empty()) {
+    segment_p s = this->mapSegment(start.segment + 1, true);
+    if(!s) return false;
+    this->segments[s->number] = s;
+  }
+  
+  // The checkpoint only counts if its segment is still there
+  this->head.segment = this->segments.begin()->first;
+  this->head.offset = this->head.segment == start.segment ? start.offset : 0;
+  
+  // Count the records to drain, and find the end of the last segment
+  uint64_t records = 0;
+  Position p = this->head;
+  map<uint64_t, segment_p>::const_iterator i;
+  for(i = this->segments.begin(); i != this->segments.end(); i++) {
+    p.segment = i->first;
+    if(p.segment != this->head.segment) p.offset = 0;
+    
+    Record r;
+    while(readRecord(*i->second, p.offset, r)) {
+      p.offset += r.length;
+      records++;
+    }
+  }
+  
+  // Clear a record torn by a crash, so it can't be mistaken for the end of a later one
+  Segment &last = *this->segments.rbegin()->second;
+  if(p.offset + RECORD_HEADER_SIZE <= last.size) {
+    const char *h = last.data + p.offset;
+    size_t torn = RECORD_HEADER_SIZE + readLittleEndian(h + 20, 2) + readLittleEndian(h + 4, 4);
+    memset(last.data + p.offset, 0, min(torn, last.size - p.offset));
+  } else {
+    memset(last.data + p.offset, 0, last.size - p.offset);
+  }
+  
+  this->tail = p;
+  this->pending = records;
+  return true;
+}
+
+void Beanstalkpp::Outbox::put(const std::string& tube, const std::string& data) {
+  this->tryPut(tube, data).get("put");
+}
+
+Beanstalkpp::Status Beanstalkpp::Outbox::tryPut(const std::string& tube, const std::string& data) {
+  return this->tryPut(
+    tube, data.data(), data.size(), DEFAULT_PRIORITY, DEFAULT_DELAY, DEFAULT_TTR
+  );
+}
+
+Beanstalkpp::Status Beanstalkpp::Outbox::tryPut(
+  const std::string& tube, const char* data, size_t size, unsigned int priority,
+  unsigned int delay, unsigned int ttr
+) {
+  // The drainer couldn't use an invalid tube, so it's refused before it gets into the log
+  if(!isValidTube(tube) || size > 0xffffffff) return Failure(ServerException::BAD_FORMAT);
+  
+  size_t length = RECORD_HEADER_SIZE + tube.size() + size;
+  
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if(this->segments.empty()) return Failure(ServerException::INTERNAL_ERROR);
+    
+    segment_p s = this->segments.rbegin()->second;
+    if(length > s->size - this->tail.offset) {
+      if(length > this->segmentSize) return Failure(ServerException::JOB_TOO_BIG);
+      
+      // The zeroes after the last record mark the end of the full segment
+      s = this->mapSegment(this->tail.segment + 1, true);
+      if(!s) return Failure(ServerException::INTERNAL_ERROR);
+      
+      this->segments[s->number] = s;
+      this->tail.segment = s->number;
+      this->tail.offset = 0;
+    }
+    
+    char *p = s->data + this->tail.offset;
+    writeLittleEndian(p + 4, size, 4);
+    writeLittleEndian(p + 8, priority, 4);
+    writeLittleEndian(p + 12, delay, 4);
+    writeLittleEndian(p + 16, ttr, 4);
+    writeLittleEndian(p + 20, tube.size(), 2);
+    writeLittleEndian(p + 22, 0, 2);
+    memcpy(p + RECORD_HEADER_SIZE, tube.data(), tube.size());
+    memcpy(p + RECORD_HEADER_SIZE + tube.size(), data, size);
+    writeLittleEndian(p, crc32c(p + 4, length - 4), 4);
+    
+    if(this->sync) {
+      size_t page = sysconf(_SC_PAGESIZE);
+      size_t start = this->tail.offset / page * page;
+      if(msync(s->data + start, this->tail.offset + length - start, MS_SYNC) != 0)
+        return Failure(ServerException::INTERNAL_ERROR);
+    }
+    
+    this->tail.offset += length;
+    this->pending++;
+  }
+  
+  this->appended.notify_one();
+  return Status();
+}
+
+Beanstalkpp::Result<uint64_t> Beanstalkpp::Outbox::tryDrain() {
+  uint64_t total = 0;
+  vector<Record> batch;
+  batch.reserve(DRAIN_BATCH);
+  
+  for(;;) {
+    Position end;
+    segment_p s;
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      end = this->tail;
+      
+      map<uint64_t, segment_p>::const_iterator i = this->segments.find(this->head.segment);
+      if(i != this->segments.end()) s = i->second;
+    }
+    
+    if(!s || (this->head.segment == end.segment && this->head.offset >= end.offset)) break;
+    
+    // Records are only read below the tail, which the writer doesn't touch again
+    size_t limit = this->head.segment == end.segment ? end.offset : s->size;
+    Position next = this->head;
+    
+    batch.clear();
+    Record r;
+    while(batch.size() < DRAIN_BATCH && next.offset < limit && readRecord(*s, next.offset, r)) {
+      batch.push_back(r);
+      next.offset += r.length;
+    }
+    
+    // The rest of a full segment is zeroes
+    if(batch.empty()) {
+      next.segment++;
+      next.offset = 0;
+    }
+    
+    Status st = this->sendBatch(batch.data(), batch.size());
+    if(!st) {
+      this->client.reset();
+      return st.failure();
+    }
+    
+    this->checkpoint(next);
+    
+    total += batch.size();
+    this->pending -= batch.size();
+    this->drained += batch.size();
+  }
+  
+  return total;
+}
+
+Beanstalkpp::Status Beanstalkpp::Outbox::sendBatch(const Record* records, size_t count) {
+  if(count == 0) return Status();
+  
+  if(!this->client) {
+    this->client.reset(new Client(this->host, this->port));
+    
+    Status s = this->client->tryConnect();
+    if(!s) return s;
+  }
+  
+  Client &c = *this->client;
+  size_t sent = 0, read = 0;
+  
+  while(read < count) {
+    // A tube change waits for the puts in flight, as use can't be pipelined behind them
+    bool sameTube = sent < count && c.getUsedTube().compare(
+      0, string::npos, records[sent].tube, records[sent].tubeLength
+    ) == 0;
+    
+    if(sent < count && sent - read < DRAIN_DEPTH && (sameTube || sent == read)) {
+      const Record &r = records[sent];
+      
+      Status s = c.tryUse(string(r.tube, r.tubeLength));
+      if(!s) {
+        if(!isPermanent(s.error())) return s;
+        
+        // Nothing is in flight, so the record is skipped right away
+        this->rejected++;
+        sent++;
+        read++;
+        continue;
+      }
+      
+      s = c.trySendPut(r.data, r.size, r.priority, r.delay, r.ttr);
+      if(!s) return s;
+      
+      sent++;
+      continue;
+    }
+    
+    Result<job_id_t> id = c.tryReadPutReply();
+    if(!id) {
+      if(!isPermanent(id.error())) return id.failure();
+      this->rejected++;
+    }
+    
+    read++;
+  }
+  
+  return Status();
+}
+
+void Beanstalkpp::Outbox::checkpoint(const Position& p) {
+  char cp[CHECKPOINT_SIZE];
+  writeLittleEndian(cp, p.segment, 8);
+  writeLittleEndian(cp + 8, p.offset, 8);
+  writeLittleEndian(cp + 16, crc32c(cp, 16), 4);
+  
+  // A torn write fails the CRC, and the log is then drained again from the oldest segment
+  if(pwrite(this->checkpointFd, cp, sizeof(cp), 0) == (ssize_t)sizeof(cp) && this->sync)
+    fdatasync(this->checkpointFd);
+  
+  this->head = p;
+  
+  std::lock_guard<std::mutex> lock(this->mutex);
+  while(!this->segments.empty() && this->segments.begin()->first < p.segment) {
+    unlink(this->segments.begin()->second->path.c_str());
+    this->segments.erase(this->segments.begin());
+  }
+}
+
+void Beanstalkpp::Outbox::start() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  if(this->running) return;
+  
+  this->running = true;
+  this->thread = std::thread(&Outbox::run, this);
+}
+
+void Beanstalkpp::Outbox::stop() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->running = false;
+  }
+  this->appended.notify_all();
+  
+  if(this->thread.joinable()) this->thread.join();
+}
+
+void Beanstalkpp::Outbox::run() {
+  for(;;) {
+    Result<uint64_t> r = this->tryDrain();
+    
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if(!this->running) break;
+    
+    if(!r) {
+      this->appended.wait_for(lock, std::chrono::milliseconds(RETRY_MS), [this] {
+        return !this->running;
+      });
+    } else if(this->head.segment == this->tail.segment && this->head.offset == this->tail.offset) {
+      this->appended.wait_for(lock, std::chrono::milliseconds(IDLE_MS));
+    }
+  }
+}
+
+uint64_t Beanstalkpp::Outbox::getPending() const {
+  return this->pending;
+}
+
+uint64_t Beanstalkpp::Outbox::getDrained() const {
+  return this->drained;
+}
+
+uint64_t Beanstalkpp::Outbox::getRejected() const {
+  return this->rejected;
+}
@@ -0,0 +1,237 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_OUTBOX_H
+#define _BEANSTALK_OUTBOX_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "result.h"
+
+namespace Beanstalkpp {
+
+class Client;
+
+/**
+ * A local spool for puts, so producers don't wait for, or fail with, a slow or unreachable server.
+ * 
+ * @c put appends the job to a log of memory mapped segment files in a local directory and returns.
+ * A drainer, either a background thread started with @c start or calls to @c tryDrain, replays
+ * the log to the server with pipelined puts, and records how far it got in a checkpoint file.
+ * Drained segments are deleted.
+ * 
+ * @c open recovers the log after a crash: the jobs after the checkpoint are put again, and a
+ * record torn by the crash is discarded. Jobs put before a crash but after the last checkpoint
+ * may be put twice, so delivery is at least once. Without @c setSync, the log survives the
+ * process crashing, but not the machine.
+ * 
+ * Segments are named by their sequence number in hex, e.g. 0000000000000001.seg. A segment is a
+ * series of records, followed by zeroes. All integers are little endian:
+ * 
+ *   uint32         CRC32C of the rest of the record
+ *   uint32         payload length
+ *   uint32         priority
+ *   uint32         delay
+ *   uint32         ttr
+ *   uint16         tube name length
+ *   uint16         zero
+ *   tube           the tube name
+ *   payload        the job
+ */
+class Outbox {
+public:
+  static const size_t RECORD_HEADER_SIZE = 24;
+  
+  /**
+   * @param host The server to drain the log to
+   * @param port Its port
+   */
+  Outbox(const std::string &host, int port);
+  
+  /**
+   * Stops the drainer
+   */
+  ~Outbox();
+  
+  /**
+   * Sets the size of new segments, which bounds the size of a job. Defaults to 64 MiB.
+   */
+  void setSegmentSize(size_t bytes);
+  
+  /**
+   * Makes @c put wait for the job to reach the disk, and the checkpoint sync too, so the log
+   * survives power loss. Defaults to false.
+   */
+  void setSync(bool sync);
+  
+  /**
+   * Opens the log in @p directory, creating the directory if needed, and recovers what it holds
+   * 
+   * @return False if the directory or its files couldn't be created or mapped
+   */
+  bool open(const std::string &directory);
+  
+  /**
+   * Appends a job to the log, with the default priority, delay and ttr of @c Client::put
+   * 
+   * @throws ServerException With reason BAD_FORMAT if @p tube isn't a valid tube name
+   * @throws ServerException With reason JOB_TOO_BIG if the job doesn't fit in a segment
+   * @throws ServerException With reason INTERNAL_ERROR if a new segment couldn't be created or the
+   *         disk is full
+   */
+  void put(const std::string &tube, const std::string &data);
+  
+  /**
+   * Non-throwing version of @c put
+   */
+  Status tryPut(const std::string &tube, const std::string &data);
+  
+  /**
+   * Appends a job with the given attributes to the log
+   */
+  Status tryPut(
+    const std::string &tube, const char *data, size_t size, unsigned int priority,
+    unsigned int delay, unsigned int ttr
+  );
+  
+  /**
+   * Puts the jobs appended so far to the server, connecting first if needed. Must not be called
+   * while the drainer thread runs.
+   * 
+   * @return The number of jobs drained, or the error which stopped the drain. The jobs drained
+   *         before an error stay drained.
+   */
+  Result<uint64_t> tryDrain();
+  
+  /**
+   * Starts draining in a background thread. After a failure, the thread reconnects and retries
+   * every second.
+   */
+  void start();
+  
+  /**
+   * Stops the drainer thread, waiting for the batch in progress
+   */
+  void stop();
+  
+  /**
+   * Returns the number of jobs in the log not yet drained. May be called from any thread.
+   */
+  uint64_t getPending() const;
+  
+  /**
+   * Returns the number of jobs drained, and of those the server rejected for good (JOB_TOO_BIG,
+   * BAD_FORMAT or EXPECTED_CRLF) and that were skipped. May be called from any thread.
+   */
+  uint64_t getDrained() const;
+  uint64_t getRejected() const;
+private:
+  struct Segment;
+  typedef boost::shared_ptr<Segment> segment_p;
+  
+  struct Position {
+    uint64_t segment;
+    size_t offset;
+  };
+  
+  /**
+   * A record read from a segment, pointing into its mapping
+   */
+  struct Record {
+    const char *tube;
+    size_t tubeLength;
+    const char *data;
+    size_t size;
+    unsigned int priority;
+    unsigned int delay;
+    unsigned int ttr;
+    size_t length;
+  };
+  
+  /**
+   * Reads the record at @p offset of @p s into @p r
+   * 
+   * @return False at the end of the records, or if the record is corrupt
+   */
+  static bool readRecord(const Segment &s, size_t offset, Record &r);
+  
+  /**
+   * Creates the segment @p number, with all its blocks allocated, or maps it if @p create is false
+   */
+  segment_p mapSegment(uint64_t number, bool create);
+  
+  /**
+   * Puts @p records to the server in one pipelined batch
+   */
+  Status sendBatch(const Record *records, size_t count);
+  
+  /**
+   * Records that everything before @p p is drained, and deletes the segments before it
+   */
+  void checkpoint(const Position &p);
+  
+  void run();
+  
+  std::string host;
+  int port;
+  std::string directory;
+  size_t segmentSize;
+  bool sync;
+  
+  int checkpointFd;
+  
+  /**
+   * Guards segments, tail and running
+   */
+  std::mutex mutex;
+  std::condition_variable appended;
+  
+  /**
+   * The segments not yet drained, by number
+   */
+  std::map<uint64_t, segment_p> segments;
+  
+  /**
+   * Where the next record is appended, and where the drainer continues
+   */
+  Position tail;
+  Position head;
+  
+  boost::scoped_ptr<Client> client;
+  
+  std::thread thread;
+  bool running;
+  
+  std::atomic<uint64_t> pending;
+  std::atomic<uint64_t> drained;
+  std::atomic<uint64_t> rejected;
+};
+
+}
+
+#endif
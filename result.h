@@ -0,0 +1,124 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_RESULT_H
+#define _BEANSTALK_RESULT_H
+
+#include <string>
+
+#include "serverexception.h"
+
+namespace Beanstalkpp {
+
+/**
+ * A failed outcome of a non-throwing call. Converts implicitly to any @c Result, so functions can
+ * simply return Failure(reason).
+ */
+struct Failure {
+  explicit Failure(ServerException::Reason r): reason(r) {}
+  
+  ServerException::Reason reason;
+};
+
+/**
+ * The outcome of a non-throwing call: either a value, or the reason the call failed.
+ * 
+ * Neither constructing nor inspecting a failed result throws or allocates memory. T must be
+ * default constructible and copyable.
+ */
+template<class T>
+class Result {
+public:
+  Result(const T &value): val(value), failed(false), reason(ServerException::UNKNOWN_ERROR) {}
+  Result(const Failure &f): val(), failed(true), reason(f.reason) {}
+  
+  /**
+   * Returns true if the call succeeded
+   */
+  bool ok() const { return !this->failed; }
+  explicit operator bool() const { return !this->failed; }
+  
+  /**
+   * Returns the value of a successful call. The value is default constructed for failed calls.
+   */
+  const T &value() const { return this->val; }
+  T &value() { return this->val; }
+  
+  /**
+   * Returns the reason a failed call failed. Only meaningful if ok() is false.
+   */
+  ServerException::Reason error() const { return this->reason; }
+  
+  /**
+   * Returns the failure of this result, to pass it on to a result of another type
+   */
+  Failure failure() const { return Failure(this->reason); }
+  
+  /**
+   * Returns the value, or throws if the call failed.
+   * 
+   * @param context Describes the call, and is used as the prefix of the exception message
+   * 
+   * @throws ServerException With the reason of the failure
+   */
+  const T &get(const char *context) const {
+    if(this->failed) ServerException::raise(this->reason, context);
+    return this->val;
+  }
+private:
+  T val;
+  bool failed;
+  ServerException::Reason reason;
+};
+
+/**
+ * The outcome of a non-throwing call that has no value to return.
+ */
+template<>
+class Result<void> {
+public:
+  Result(): failed(false), reason(ServerException::UNKNOWN_ERROR) {}
+  Result(const Failure &f): failed(true), reason(f.reason) {}
+  
+  bool ok() const { return !this->failed; }
+  explicit operator bool() const { return !this->failed; }
+  ServerException::Reason error() const { return this->reason; }
+  Failure failure() const { return Failure(this->reason); }
+  
+  /**
+   * Throws if the call failed.
+   * 
+   * @param context Describes the call, and is used as the prefix of the exception message
+   * 
+   * @throws ServerException With the reason of the failure
+   */
+  void get(const char *context) const {
+    if(this->failed) ServerException::raise(this->reason, context);
+  }
+private:
+  bool failed;
+  ServerException::Reason reason;
+};
+
+typedef Result<void> Status;
+
+}
+
+#endif
@@ -20,6 +20,22 @@
 
 #include "serverexception.h"
 
+static const char *reasonNames[] = {
+  "OUT_OF_MEMORY", "INTERNAL_ERROR", "DRAINING", "BAD_FORMAT", "UNKNOWN_COMMAND", "EXPECTED_CRLF",
+  "JOB_TOO_BIG", "NOT_FOUND", "UNKNOWN_ERROR", "NETWORK_ERROR", "TIMED_OUT", "DEADLINE_SOON",
+  "NOT_IGNORED", "CLIENT_TIMEOUT", "SOURCE_ERROR"
+};
+
+// Replies which the server sends as errors. The rest of the reasons are generated client side.
+static const Beanstalkpp::ServerException::Reason replyReasons[] = {
+  Beanstalkpp::ServerException::OUT_OF_MEMORY, Beanstalkpp::ServerException::INTERNAL_ERROR,
+  Beanstalkpp::ServerException::DRAINING, Beanstalkpp::ServerException::BAD_FORMAT,
+  Beanstalkpp::ServerException::UNKNOWN_COMMAND, Beanstalkpp::ServerException::EXPECTED_CRLF,
+  Beanstalkpp::ServerException::JOB_TOO_BIG, Beanstalkpp::ServerException::NOT_FOUND,
+  Beanstalkpp::ServerException::TIMED_OUT, Beanstalkpp::ServerException::DEADLINE_SOON,
+  Beanstalkpp::ServerException::NOT_IGNORED
+};
+
 Beanstalkpp::ServerException::ServerException(ServerException::Reason r, const std::string& error):
 Exception(error) {
   this->reason = r;
@@ -28,3 +44,33 @@ Exception(error) {
 Beanstalkpp::ServerException::Reason Beanstalkpp::ServerException::getReason() {
   return this->reason;
 }
+
+const char* Beanstalkpp::ServerException::reasonName(Beanstalkpp::ServerException::Reason r) {
+  if(r < 0 || (size_t)r >= sizeof(reasonNames) / sizeof(reasonNames[0]))
+    return "UNKNOWN_ERROR";
+  
+  return reasonNames[r];
+}
+
+Beanstalkpp::ServerException::Reason Beanstalkpp::ServerException::fromReply(
+  const std::string& reply
+) {
+  for(size_t i = 0; i < sizeof(replyReasons) / sizeof(replyReasons[0]); i++) {
+    if(reply.compare(reasonNames[replyReasons[i]]) == 0)
+      return replyReasons[i];
+  }
+  
+  return BAD_FORMAT;
+}
+
+void Beanstalkpp::ServerException::raise(Beanstalkpp::ServerException::Reason r, const char* context) {
+  if(r == CLIENT_TIMEOUT)
+    throw TimeoutException(std::string(context) + ": " + reasonName(r));
+  
+  throw ServerException(r, std::string(context) + ": " + reasonName(r));
+}
+
+Beanstalkpp::TimeoutException::TimeoutException(const std::string& error):
+ServerException(CLIENT_TIMEOUT, error) {
+
+}
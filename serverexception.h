@@ -32,15 +32,50 @@ class ServerException: public Exception {
 public:
   enum Reason { 
     OUT_OF_MEMORY, INTERNAL_ERROR, DRAINING, BAD_FORMAT, UNKNOWN_COMMAND, EXPECTED_CRLF,
-    JOB_TOO_BIG, NOT_FOUND, UNKNOWN_ERROR
+    JOB_TOO_BIG, NOT_FOUND, UNKNOWN_ERROR, NETWORK_ERROR, TIMED_OUT, DEADLINE_SOON,
+    NOT_IGNORED, CLIENT_TIMEOUT,
+    
+    // A streamed payload couldn't be read from its source, which isn't the connection's fault
+    SOURCE_ERROR,
+    
+    // The number of reasons, not a reason itself
+    REASON_COUNT
   };
   
   ServerException(Reason r, const std::string &error);
   Reason getReason();
+  
+  /**
+   * Returns the protocol name of @p r, e.g. "NOT_FOUND"
+   */
+  static const char *reasonName(Reason r);
+  
+  /**
+   * Maps a reply token from the server to a reason. Replies which aren't protocol errors map to
+   * BAD_FORMAT, as they are unexpected at the point where this is used.
+   * 
+   * @param reply The first token of a server reply
+   */
+  static Reason fromReply(const std::string &reply);
+  
+  /**
+   * Throws a ServerException with reason @p r, and a message prefixed by @p context. Timeouts
+   * throw a TimeoutException.
+   */
+  static void raise(Reason r, const char *context);
 private:
   Reason reason;
 };
 
+/**
+ * Thrown when the server didn't answer within the client's timeout or deadline, with reason
+ * CLIENT_TIMEOUT. Unlike TIMED_OUT, it doesn't come from the server.
+ */
+class TimeoutException: public ServerException {
+public:
+  TimeoutException(const std::string &error);
+};
+
 }
 
 #endif
@@ -0,0 +1,437 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#include "shardruntime.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <set>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "sink.h"
+
+// The timeout of the reserves kept in flight, in seconds
+#define RESERVE_TIMEOUT 1
+
+// The longest wait for a reply, so stop() takes effect quickly
+#define POLL_MS 100
+
+// Connection attempts, and their delays, when a connection fails
+#define RECONNECT_ATTEMPTS 3
+#define RECONNECT_MIN_DELAY_MS 10
+#define RECONNECT_MAX_DELAY_MS 200
+
+// The reply expected on a connection before the reply to its reserve
+#define ACK_NONE 0
+#define ACK_DELETE 1
+#define ACK_BURY 2
+
+// The priority rejected jobs are buried with when theirs can't be read, the default of Client::put
+#define DEFAULT_PRIORITY 1024
+
+/**
+ * Collects payloads into a buffer which only ever grows, so jobs are received without allocating
+ */
+class PayloadBuffer: public Beanstalkpp::PayloadSink {
+public:
+  PayloadBuffer(): size(0) {}
+  
+  virtual void begin(Beanstalkpp::job_id_t, size_t size) {
+    if(this->buffer.size() < size) this->buffer.resize(size);
+    this->size = 0;
+  }
+  
+  virtual bool write(const char *data, size_t length) {
+    memcpy(&this->buffer[this->size], data, length);
+    this->size += length;
+    return true;
+  }
+  
+  std::vector<char> buffer;
+  size_t size;
+};
+
+struct Beanstalkpp::ShardRuntime::Shard {
+  Shard():
+    cpu(-1), node(-1), reserved(0), deleted(0), buried(0), idle(0), errors(0), payloadBytes(0) {}
+  
+  int cpu;
+  int node;
+  
+  std::vector<boost::shared_ptr<Client> > owned;
+  
+  /**
+   * The connections, rotated after every wait so none is starved by the others
+   */
+  std::vector<Client *> clients;
+  
+  /**
+   * Per connection: whether a reserve is in flight, and the ACK_* reply expected before it
+   */
+  std::vector<bool> reserving;
+  std::vector<int> acks;
+  
+  boost::shared_ptr<ShardHandler> handler;
+  PayloadBuffer payload;
+  
+  std::atomic<uint64_t> reserved;
+  std::atomic<uint64_t> deleted;
+  std::atomic<uint64_t> buried;
+  std::atomic<uint64_t> idle;
+  std::atomic<uint64_t> errors;
+  std::atomic<uint64_t> payloadBytes;
+  LatencyHistogram handlerLatency;
+};
+
+/**
+ * Returns the CPUs this process may run on
+ */
+static std::vector<int> allowedCpus() {
+  std::vector<int> ret;
+  
+#ifdef __linux__
+  cpu_set_t set;
+  if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for(int i = 0; i < CPU_SETSIZE; i++)
+      if(CPU_ISSET(i, &set)) ret.push_back(i);
+  }
+#endif
+  
+  if(ret.empty()) {
+    for(unsigned int i = 0; i < std::max(1u, std::thread::hardware_concurrency()); i++)
+      ret.push_back(i);
+  }
+  
+  return ret;
+}
+
+/**
+ * Pins the calling thread to @p cpu
+ */
+static bool pinToCpu(int cpu) {
+#ifdef __linux__
+  if(cpu < 0 || cpu >= CPU_SETSIZE) return false;
+  
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+/**
+ * Returns the NUMA node of the CPU the calling thread runs on, or -1 if unknown
+ */
+static int currentNode() {
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned int cpu, node;
+  if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0) return node;
+#endif
+  
+  return -1;
+}
+
+/**
+ * Makes the memory the calling thread touches first come from @p node where possible
+ */
+static void preferNode(int node) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+  const int bits = 8 * sizeof(unsigned long);
+  unsigned long mask[1024 / bits];
+  if(node < 0 || node >= 1024) return;
+  
+  memset(mask, 0, sizeof(mask));
+  mask[node / bits] |= 1UL << (node % bits);
+  syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, 1024 + 1);
+#else
+  (void)node;
+#endif
+}
+
+Beanstalkpp::ShardRuntime::ShardRuntime(
+  const std::string& host, int port, const std::string& tube,
+  Beanstalkpp::shard_handler_factory_t factory
+): host(host), port(port), tube(tube), factory(factory), shardCount(0), cpus(allowedCpus()),
+  connections(1), numa(false), started(0), failed(false), running(false) {
+}
+
+Beanstalkpp::ShardRuntime::~ShardRuntime() {
+  this->stop();
+}
+
+void Beanstalkpp::ShardRuntime::setShards(size_t shards) {
+  this->shardCount = shards;
+}
+
+void Beanstalkpp::ShardRuntime::setCpus(const std::vector<int>& cpus) {
+  this->cpus = cpus;
+}
+
+void Beanstalkpp::ShardRuntime::setConnections(size_t connections) {
+  this->connections = std::max((size_t)1, connections);
+}
+
+void Beanstalkpp::ShardRuntime::setNuma(bool numa) {
+  this->numa = numa;
+}
+
+void Beanstalkpp::ShardRuntime::setOptions(const Beanstalkpp::ClientOptions& options) {
+  this->options = options;
+}
+
+void Beanstalkpp::ShardRuntime::start() {
+  this->tryStart().get("start");
+}
+
+Beanstalkpp::Status Beanstalkpp::ShardRuntime::tryStart() {
+  this->stop();
+  
+  size_t count = this->shardCount > 0 ? this->shardCount : std::max((size_t)1, this->cpus.size());
+  
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->shards.assign(count, boost::shared_ptr<Shard>());
+  this->started = 0;
+  this->failed = false;
+  this->running = true;
+  
+  for(size_t i = 0; i < count; i++)
+    this->threads.push_back(std::thread(&ShardRuntime::runShard, this, i));
+  
+  this->ready.wait(lock, [this, count] { return this->started == count; });
+  bool failed = this->failed;
+  lock.unlock();
+  
+  if(failed) {
+    this->stop();
+    return Failure(ServerException::NETWORK_ERROR);
+  }
+  
+  return Status();
+}
+
+void Beanstalkpp::ShardRuntime::stop() {
+  this->running = false;
+  
+  for(size_t i = 0; i < this->threads.size(); i++)
+    this->threads[i].join();
+  this->threads.clear();
+}
+
+size_t Beanstalkpp::ShardRuntime::getShards() const {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->shards.size();
+}
+
+void Beanstalkpp::ShardRuntime::snapshot(size_t shard, Beanstalkpp::ShardSnapshot& s) const {
+  boost::shared_ptr<Shard> p;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if(shard < this->shards.size()) p = this->shards[shard];
+  }
+  
+  if(!p) {
+    s = ShardSnapshot();
+    s.cpu = s.node = -1;
+    LatencyHistogram().snapshot(s.handler);
+    return;
+  }
+  
+  s.cpu = p->cpu;
+  s.node = p->node;
+  s.reserved = p->reserved.load(std::memory_order_relaxed);
+  s.deleted = p->deleted.load(std::memory_order_relaxed);
+  s.buried = p->buried.load(std::memory_order_relaxed);
+  s.idle = p->idle.load(std::memory_order_relaxed);
+  s.errors = p->errors.load(std::memory_order_relaxed);
+  s.payloadBytes = p->payloadBytes.load(std::memory_order_relaxed);
+  p->handlerLatency.snapshot(s.handler);
+}
+
+uint64_t Beanstalkpp::ShardRuntime::getHandled() const {
+  uint64_t ret = 0;
+  
+  std::lock_guard<std::mutex> lock(this->mutex);
+  for(size_t i = 0; i < this->shards.size(); i++) {
+    if(!this->shards[i]) continue;
+    ret += this->shards[i]->deleted.load(std::memory_order_relaxed);
+    ret += this->shards[i]->buried.load(std::memory_order_relaxed);
+  }
+  
+  return ret;
+}
+
+void Beanstalkpp::ShardRuntime::runShard(size_t index) {
+  // Pin and pick the memory policy first, so everything the shard allocates is local
+  int cpu = this->cpus.empty() ? -1 : this->cpus[index % this->cpus.size()];
+  bool pinned = pinToCpu(cpu);
+  int node = pinned ? currentNode() : -1;
+  if(this->numa && node >= 0) preferNode(node);
+  
+  boost::shared_ptr<Shard> shard(new Shard());
+  shard->cpu = pinned ? cpu : -1;
+  shard->node = node;
+  
+  std::set<std::string> watched;
+  watched.insert(this->tube);
+  
+  Status s;
+  for(size_t i = 0; s && i < this->connections; i++) {
+    boost::shared_ptr<Client> c(new Client(this->host, this->port));
+    c->setOptions(this->options);
+    c->setReconnect(RECONNECT_ATTEMPTS, RECONNECT_MIN_DELAY_MS, RECONNECT_MAX_DELAY_MS);
+    
+    s = c->tryConnect();
+    if(s) {
+      Result<size_t> w = c->trySetWatchList(watched);
+      if(!w) s = w.failure();
+    }
+    
+    shard->owned.push_back(c);
+    shard->clients.push_back(c.get());
+  }
+  shard->reserving.assign(shard->clients.size(), false);
+  shard->acks.assign(shard->clients.size(), ACK_NONE);
+  
+  if(s) shard->handler.reset(this->factory(index));
+  
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->shards[index] = shard;
+    this->started++;
+    if(!s) this->failed = true;
+  }
+  this->ready.notify_all();
+  
+  while(s && this->running) {
+    for(size_t i = 0; i < shard->clients.size(); i++) {
+      if(shard->reserving[i]) continue;
+      
+      if(shard->clients[i]->trySendReserve(RESERVE_TIMEOUT)) {
+        shard->reserving[i] = true;
+      } else {
+        LatencyHistogram::bump(shard->errors, 1);
+        shard->clients[i]->tryReconnect();
+      }
+    }
+    
+    Result<int> replied = Client::tryWaitReply(shard->clients, POLL_MS);
+    if(!replied) break;
+    if(replied.value() < 0) continue;
+    
+    this->handleReply(*shard, replied.value());
+    
+    // Serve the connections round robin, as the wait prefers the first with a reply
+    std::rotate(shard->clients.begin(), shard->clients.begin() + 1, shard->clients.end());
+    std::rotate(shard->reserving.begin(), shard->reserving.begin() + 1, shard->reserving.end());
+    std::rotate(shard->acks.begin(), shard->acks.begin() + 1, shard->acks.end());
+  }
+  
+  // Closing the connections makes the server release whatever they reserved
+  shard->clients.clear();
+  shard->owned.clear();
+}
+
+void Beanstalkpp::ShardRuntime::handleReply(Beanstalkpp::ShardRuntime::Shard& shard, size_t i) {
+  Client &c = *shard.clients[i];
+  Status s;
+  
+  if(shard.acks[i] != ACK_NONE) {
+    // The delete or bury of the last job comes first, the reply to the reserve follows it
+    bool deleted = shard.acks[i] == ACK_DELETE;
+    shard.acks[i] = ACK_NONE;
+    
+    s = deleted ? c.tryReadDelete() : c.tryReadBury();
+    if(s) {
+      LatencyHistogram::bump(deleted ? shard.deleted : shard.buried, 1);
+      return;
+    }
+  } else {
+    shard.reserving[i] = false;
+    
+    Result<job_id_t> id = c.tryReadReserve(shard.payload);
+    if(!id) {
+      if(
+        id.error() == ServerException::TIMED_OUT || id.error() == ServerException::DEADLINE_SOON
+      ) {
+        LatencyHistogram::bump(shard.idle, 1);
+        return;
+      }
+      
+      s = id.failure();
+    } else {
+      LatencyHistogram::bump(shard.reserved, 1);
+      LatencyHistogram::bump(shard.payloadBytes, shard.payload.size);
+      
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      bool keep = false;
+      try {
+        keep = shard.handler->handle(id.value(), shard.payload.buffer.data(), shard.payload.size);
+      } catch(std::exception &) {
+        // Buried, like a job the handler rejected
+      }
+      shard.handlerLatency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start
+      ).count());
+      
+      // Rejections are rare, so the priority to bury with is read when needed, rather than
+      // pipelining a stats-job with every reserve
+      unsigned int priority = DEFAULT_PRIORITY;
+      if(!keep) {
+        Result<JobStats> stats = c.tryStatsJob(id.value());
+        if(stats) priority = stats.value().pri;
+      }
+      
+      // Pipeline the delete or bury with the next reserve
+      s = keep ? c.trySendDelete(id.value()) : c.trySendBury(id.value(), priority);
+      if(s) {
+        shard.acks[i] = keep ? ACK_DELETE : ACK_BURY;
+        s = c.trySendReserve(RESERVE_TIMEOUT);
+      }
+      if(s) {
+        shard.reserving[i] = true;
+        return;
+      }
+    }
+  }
+  
+  LatencyHistogram::bump(shard.errors, 1);
+  
+  // Replies like NOT_FOUND, for a job whose TTR ran out, leave the connection usable
+  if(
+    s.error() != ServerException::NETWORK_ERROR && s.error() != ServerException::CLIENT_TIMEOUT &&
+    s.error() != ServerException::BAD_FORMAT
+  ) {
+    return;
+  }
+  
+  shard.reserving[i] = false;
+  shard.acks[i] = ACK_NONE;
+  c.tryReconnect();
+}
@@ -0,0 +1,225 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#ifndef _BEANSTALK_SHARDRUNTIME_H
+#define _BEANSTALK_SHARDRUNTIME_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include "client.h"
+#include "metrics.h"
+#include "result.h"
+
+namespace Beanstalkpp {
+
+/**
+ * Handles the jobs of one shard of a @c ShardRuntime. Each shard creates its own handler on its own
+ * thread, so the handler's state is never shared, and is allocated near the shard's CPU.
+ */
+class ShardHandler {
+public:
+  virtual ~ShardHandler() {}
+  
+  /**
+   * Handles a reserved job. @p data belongs to the shard's payload buffer, and is only valid until
+   * the call returns.
+   * 
+   * @return True to delete the job, false to bury it with its priority
+   */
+  virtual bool handle(job_id_t jobId, const char *data, size_t size) = 0;
+};
+
+/**
+ * Creates the handler of shard @p shard, on the shard's thread
+ */
+typedef std::function<ShardHandler *(size_t shard)> shard_handler_factory_t;
+
+/**
+ * A point-in-time copy of the counters of one shard
+ */
+struct ShardSnapshot {
+  /**
+   * The CPU the shard is pinned to, or -1 if pinning failed, and its NUMA node, or -1 if unknown
+   */
+  int cpu;
+  int node;
+  
+  uint64_t reserved;
+  uint64_t deleted;
+  uint64_t buried;
+  
+  /**
+   * Reserves that timed out without a job
+   */
+  uint64_t idle;
+  
+  /**
+   * Failed commands. The connection is reconnected after each.
+   */
+  uint64_t errors;
+  
+  uint64_t payloadBytes;
+  
+  /**
+   * The time spent in the handler per job, in nanoseconds
+   */
+  HistogramSnapshot handler;
+};
+
+/**
+ * Consumes a tube with one thread per CPU, each pinned to its CPU and sharing nothing with the
+ * others: every shard owns its connections, a payload buffer reused for all its jobs, its handler
+ * and its counters. Jobs thus never cross cores, and the steady state allocates nothing.
+ * 
+ * A shard keeps a reserve-with-timeout in flight on each of its connections, and waits for
+ * whichever replies first. The delete or bury of a handled job is pipelined with the next reserve
+ * on the same connection. Burying a rejected job takes a stats-job first, to keep its priority.
+ * Failed connections are reconnected.
+ * 
+ * Delivery is at least once: jobs reserved when the runtime stops, or when a connection drops,
+ * are released by the server and reserved again.
+ */
+class ShardRuntime {
+public:
+  /**
+   * @param host    The server to consume from
+   * @param port    Its port
+   * @param tube    The tube to consume
+   * @param factory Creates the handler of each shard
+   */
+  ShardRuntime(
+    const std::string &host, int port, const std::string &tube, shard_handler_factory_t factory
+  );
+  
+  /**
+   * Stops the shards
+   */
+  ~ShardRuntime();
+  
+  /**
+   * Sets the number of shards. Defaults to one per CPU the process may run on.
+   */
+  void setShards(size_t shards);
+  
+  /**
+   * Sets the CPUs to pin the shards to, shard i to @p cpus[i % cpus.size()]. Defaults to the CPUs
+   * the process may run on, in order.
+   */
+  void setCpus(const std::vector<int> &cpus);
+  
+  /**
+   * Sets the connections per shard. More connections keep more reserves in flight, which helps
+   * when the server is far away. Defaults to 1.
+   */
+  void setConnections(size_t connections);
+  
+  /**
+   * Makes each shard prefer memory on the NUMA node of its CPU, for its connections, payload
+   * buffer and handler state. Defaults to off, leaving the placement to the kernel's first touch
+   * policy.
+   */
+  void setNuma(bool numa);
+  
+  /**
+   * Sets the socket options of the connections
+   */
+  void setOptions(const ClientOptions &options);
+  
+  /**
+   * Starts the shards, and waits until they have all connected and watch the tube
+   * 
+   * @throws ServerException If a shard couldn't connect
+   */
+  void start();
+  
+  /**
+   * Non-throwing version of @c start
+   * 
+   * @return NETWORK_ERROR if a shard couldn't connect, in which case none are left running
+   */
+  Status tryStart();
+  
+  /**
+   * Stops the shards, after the jobs they are handling. May be called from any thread but the
+   * shards'.
+   */
+  void stop();
+  
+  /**
+   * Returns the number of shards of the last start
+   */
+  size_t getShards() const;
+  
+  /**
+   * Copies the counters of shard @p shard, as of the last start. May be called from any thread at
+   * any time.
+   */
+  void snapshot(size_t shard, ShardSnapshot &s) const;
+  
+  /**
+   * Returns the number of jobs handled by all shards since the last start
+   */
+  uint64_t getHandled() const;
+private:
+  /**
+   * The state of one shard. Allocated by the shard's own thread, after pinning it.
+   */
+  struct Shard;
+  
+  void runShard(size_t index);
+  
+  /**
+   * Handles the reply that arrived on connection @p i of @p shard
+   */
+  void handleReply(Shard &shard, size_t i);
+  
+  std::string host;
+  int port;
+  std::string tube;
+  shard_handler_factory_t factory;
+  size_t shardCount;
+  std::vector<int> cpus;
+  size_t connections;
+  bool numa;
+  ClientOptions options;
+  
+  /**
+   * Guards shards and started
+   */
+  mutable std::mutex mutex;
+  std::condition_variable ready;
+  std::vector<boost::shared_ptr<Shard> > shards;
+  size_t started;
+  bool failed;
+  
+  std::vector<std::thread> threads;
+  std::atomic<bool> running;
+};
+
+}
+
+#endif
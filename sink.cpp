@@ -0,0 +1,48 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "sink.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+Beanstalkpp::FileSink::FileSink(int fd): fd(fd), error(false) {
+
+}
+
+bool Beanstalkpp::FileSink::write(const char* data, size_t length) {
+  while(length > 0) {
+    ssize_t written = ::write(this->fd, data, length);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      this->error = true;
+      return false;
+    }
+    
+    data += written;
+    length -= written;
+  }
+  
+  return true;
+}
+
+bool Beanstalkpp::FileSink::failed() const {
+  return this->error;
+}
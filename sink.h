@@ -0,0 +1,78 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_SINK_H
+#define _BEANSTALK_SINK_H
+
+#include <cstddef>
+
+#include "job.h"
+
+namespace Beanstalkpp {
+
+/**
+ * Receives the payload of a job in chunks, as it arrives from the server. Used with
+ * @c Client::reserveInto to process jobs without holding the whole payload in memory.
+ */
+class PayloadSink {
+public:
+  virtual ~PayloadSink() {}
+  
+  /**
+   * Called once before the first chunk of each job.
+   * 
+   * @param jobId The id of the job
+   * @param size  The total size of the payload
+   */
+  virtual void begin(job_id_t /* jobId */, size_t /* size */) {}
+  
+  /**
+   * Called for each chunk of the payload. Must not throw, as that would leave the rest of the
+   * payload unread on the connection.
+   * 
+   * @return False to stop receiving chunks. The rest of the payload is then read and discarded.
+   */
+  virtual bool write(const char *data, size_t length) = 0;
+};
+
+/**
+ * A sink writing payloads to a file descriptor
+ */
+class FileSink: public PayloadSink {
+public:
+  /**
+   * @param fd The file descriptor to write to. It is not closed by the sink.
+   */
+  FileSink(int fd);
+  
+  virtual bool write(const char *data, size_t length);
+  
+  /**
+   * Returns true if a write to the file descriptor has failed
+   */
+  bool failed() const;
+private:
+  int fd;
+  bool error;
+};
+
+}
+
+#endif
@@ -0,0 +1,175 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "stats.h"
+
+#include <cstring>
+
+#include "yaml.h"
+
+using namespace Beanstalkpp;
+
+namespace {
+
+/**
+ * Maps a YAML key to a numeric field of T
+ */
+template<class T>
+struct Field {
+  const char *key;
+  uint64_t T::*member;
+};
+
+/**
+ * Parses a decimal number, stopping at the first non-digit
+ */
+uint64_t parseNumber(const char *value, size_t length) {
+  uint64_t ret = 0;
+  for(size_t i = 0; i < length && value[i] >= '0' && value[i] <= '9'; i++)
+    ret = ret * 10 + (value[i] - '0');
+  
+  return ret;
+}
+
+/**
+ * Assigns numeric fields of @p target from the YAML dictionary in @p data, using the N entries of
+ * @p fields. Keys not in the table are handed to @p other.
+ * 
+ * The server sends the keys in the order of our tables, so the search for each key starts after
+ * the previous match, and usually succeeds at once.
+ */
+template<class T, size_t N, class F>
+void parseFields(T &target, const Field<T> (&fields)[N], const char *data, size_t size, F other) {
+  size_t next = 0;
+  
+  forEachYamlField(data, size, [&](const char *key, size_t keyLength, const char *value,
+    size_t valueLength) {
+    for(size_t i = 0; i < N; i++) {
+      const Field<T> &f = fields[(next + i) % N];
+      if(strncmp(f.key, key, keyLength) == 0 && f.key[keyLength] == 0) {
+        target.*f.member = parseNumber(value, valueLength);
+        next = (next + i + 1) % N;
+        return;
+      }
+    }
+    
+    other(key, keyLength, value, valueLength);
+  });
+}
+
+bool keyIs(const char *key, size_t keyLength, const char *expected) {
+  return strncmp(key, expected, keyLength) == 0 && expected[keyLength] == 0;
+}
+
+const Field<ServerStats> serverFields[] = {
+  { "current-jobs-urgent", &ServerStats::currentJobsUrgent },
+  { "current-jobs-ready", &ServerStats::currentJobsReady },
+  { "current-jobs-reserved", &ServerStats::currentJobsReserved },
+  { "current-jobs-delayed", &ServerStats::currentJobsDelayed },
+  { "current-jobs-buried", &ServerStats::currentJobsBuried },
+  { "cmd-put", &ServerStats::cmdPut },
+  { "cmd-reserve", &ServerStats::cmdReserve },
+  { "cmd-delete", &ServerStats::cmdDelete },
+  { "cmd-release", &ServerStats::cmdRelease },
+  { "cmd-bury", &ServerStats::cmdBury },
+  { "cmd-kick", &ServerStats::cmdKick },
+  { "job-timeouts", &ServerStats::jobTimeouts },
+  { "total-jobs", &ServerStats::totalJobs },
+  { "max-job-size", &ServerStats::maxJobSize },
+  { "current-tubes", &ServerStats::currentTubes },
+  { "current-connections", &ServerStats::currentConnections },
+  { "current-producers", &ServerStats::currentProducers },
+  { "current-workers", &ServerStats::currentWorkers },
+  { "current-waiting", &ServerStats::currentWaiting },
+  { "total-connections", &ServerStats::totalConnections },
+  { "pid", &ServerStats::pid },
+  { "uptime", &ServerStats::uptime }
+};
+
+const Field<TubeStats> tubeFields[] = {
+  { "current-jobs-urgent", &TubeStats::currentJobsUrgent },
+  { "current-jobs-ready", &TubeStats::currentJobsReady },
+  { "current-jobs-reserved", &TubeStats::currentJobsReserved },
+  { "current-jobs-delayed", &TubeStats::currentJobsDelayed },
+  { "current-jobs-buried", &TubeStats::currentJobsBuried },
+  { "total-jobs", &TubeStats::totalJobs },
+  { "current-using", &TubeStats::currentUsing },
+  { "current-waiting", &TubeStats::currentWaiting },
+  { "current-watching", &TubeStats::currentWatching },
+  { "pause", &TubeStats::pause },
+  { "cmd-delete", &TubeStats::cmdDelete },
+  { "cmd-pause-tube", &TubeStats::cmdPauseTube },
+  { "pause-time-left", &TubeStats::pauseTimeLeft }
+};
+
+const Field<JobStats> jobFields[] = {
+  { "id", &JobStats::id },
+  { "pri", &JobStats::pri },
+  { "age", &JobStats::age },
+  { "delay", &JobStats::delay },
+  { "ttr", &JobStats::ttr },
+  { "time-left", &JobStats::timeLeft },
+  { "file", &JobStats::file },
+  { "reserves", &JobStats::reserves },
+  { "timeouts", &JobStats::timeouts },
+  { "releases", &JobStats::releases },
+  { "buries", &JobStats::buries },
+  { "kicks", &JobStats::kicks }
+};
+
+}
+
+Beanstalkpp::ServerStats::ServerStats() {
+  for(size_t i = 0; i < sizeof(serverFields) / sizeof(serverFields[0]); i++)
+    this->*serverFields[i].member = 0;
+}
+
+void Beanstalkpp::ServerStats::parse(const char* data, size_t size) {
+  parseFields(*this, serverFields, data, size, [this](const char *key, size_t keyLength,
+    const char *value, size_t valueLength) {
+    if(keyIs(key, keyLength, "version")) this->version.assign(value, valueLength);
+    else if(keyIs(key, keyLength, "hostname")) this->hostname.assign(value, valueLength);
+  });
+}
+
+Beanstalkpp::TubeStats::TubeStats() {
+  for(size_t i = 0; i < sizeof(tubeFields) / sizeof(tubeFields[0]); i++)
+    this->*tubeFields[i].member = 0;
+}
+
+void Beanstalkpp::TubeStats::parse(const char* data, size_t size) {
+  parseFields(*this, tubeFields, data, size, [this](const char *key, size_t keyLength,
+    const char *value, size_t valueLength) {
+    if(keyIs(key, keyLength, "name")) this->name.assign(value, valueLength);
+  });
+}
+
+Beanstalkpp::JobStats::JobStats() {
+  for(size_t i = 0; i < sizeof(jobFields) / sizeof(jobFields[0]); i++)
+    this->*jobFields[i].member = 0;
+}
+
+void Beanstalkpp::JobStats::parse(const char* data, size_t size) {
+  parseFields(*this, jobFields, data, size, [this](const char *key, size_t keyLength,
+    const char *value, size_t valueLength) {
+    if(keyIs(key, keyLength, "tube")) this->tube.assign(value, valueLength);
+    else if(keyIs(key, keyLength, "state")) this->state.assign(value, valueLength);
+  });
+}
@@ -0,0 +1,128 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_STATS_H
+#define _BEANSTALK_STATS_H
+
+#include <cstdint>
+#include <string>
+
+#include "job.h"
+
+namespace Beanstalkpp {
+
+/**
+ * The reply to the "stats" command: server wide counters. Fields the server doesn't send are 0.
+ */
+struct ServerStats {
+  ServerStats();
+  
+  uint64_t currentJobsUrgent;
+  uint64_t currentJobsReady;
+  uint64_t currentJobsReserved;
+  uint64_t currentJobsDelayed;
+  uint64_t currentJobsBuried;
+  uint64_t cmdPut;
+  uint64_t cmdReserve;
+  uint64_t cmdDelete;
+  uint64_t cmdRelease;
+  uint64_t cmdBury;
+  uint64_t cmdKick;
+  uint64_t jobTimeouts;
+  uint64_t totalJobs;
+  uint64_t maxJobSize;
+  uint64_t currentTubes;
+  uint64_t currentConnections;
+  uint64_t currentProducers;
+  uint64_t currentWorkers;
+  uint64_t currentWaiting;
+  uint64_t totalConnections;
+  uint64_t pid;
+  uint64_t uptime;
+  std::string version;
+  std::string hostname;
+  
+  /**
+   * Parses the YAML payload of the reply
+   */
+  void parse(const char *data, size_t size);
+};
+
+/**
+ * The reply to the "stats-tube" command
+ */
+struct TubeStats {
+  TubeStats();
+  
+  std::string name;
+  uint64_t currentJobsUrgent;
+  uint64_t currentJobsReady;
+  uint64_t currentJobsReserved;
+  uint64_t currentJobsDelayed;
+  uint64_t currentJobsBuried;
+  uint64_t totalJobs;
+  uint64_t currentUsing;
+  uint64_t currentWaiting;
+  uint64_t currentWatching;
+  uint64_t pause;
+  uint64_t cmdDelete;
+  uint64_t cmdPauseTube;
+  uint64_t pauseTimeLeft;
+  
+  /**
+   * Parses the YAML payload of the reply
+   */
+  void parse(const char *data, size_t size);
+};
+
+/**
+ * The reply to the "stats-job" command
+ */
+struct JobStats {
+  JobStats();
+  
+  job_id_t id;
+  std::string tube;
+  
+  /**
+   * "ready", "delayed", "reserved" or "buried"
+   */
+  std::string state;
+  uint64_t pri;
+  uint64_t age;
+  uint64_t delay;
+  uint64_t ttr;
+  uint64_t timeLeft;
+  uint64_t file;
+  uint64_t reserves;
+  uint64_t timeouts;
+  uint64_t releases;
+  uint64_t buries;
+  uint64_t kicks;
+  
+  /**
+   * Parses the YAML payload of the reply
+   */
+  void parse(const char *data, size_t size);
+};
+
+}
+
+#endif
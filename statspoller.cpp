@@ -0,0 +1,255 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "statspoller.h"
+
+#include <algorithm>
+
+#include "client.h"
+
+using namespace std;
+
+namespace {
+
+/**
+ * Returns the per second rate of a counter going from @p before to @p after in @p seconds. A
+ * counter going backwards, because a server restarted or failed, gives 0.
+ */
+double rate(uint64_t before, uint64_t after, double seconds) {
+  if(after < before || seconds <= 0) return 0;
+  
+  return (after - before) / seconds;
+}
+
+/**
+ * Sets the rates of @p current, the sample of one server, from its @p previous sample
+ */
+void computeRates(const Beanstalkpp::ClusterSample &previous, Beanstalkpp::ClusterSample &current) {
+  double seconds = std::chrono::duration<double>(current.time - previous.time).count();
+  
+  current.reserveRate = rate(previous.reserves, current.reserves, seconds);
+  
+  // Both lists are sorted by name, so the previous sample of each tube is found by a merge
+  size_t p = 0;
+  for(size_t i = 0; i < current.tubes.size(); i++) {
+    Beanstalkpp::TubeSample &t = current.tubes[i];
+    
+    while(p < previous.tubes.size() && previous.tubes[p].name < t.name)
+      p++;
+    
+    if(p < previous.tubes.size() && previous.tubes[p].name == t.name) {
+      t.putRate = rate(previous.tubes[p].totalJobs, t.totalJobs, seconds);
+      t.deleteRate = rate(previous.tubes[p].deletes, t.deletes, seconds);
+      if(seconds > 0) t.backlogRate = ((double)t.ready - previous.tubes[p].ready) / seconds;
+    }
+  }
+}
+
+bool byName(const Beanstalkpp::TubeSample &a, const Beanstalkpp::TubeSample &b) {
+  return a.name < b.name;
+}
+
+void add(Beanstalkpp::TubeSample &sum, const Beanstalkpp::TubeSample &t) {
+  sum.urgent += t.urgent;
+  sum.ready += t.ready;
+  sum.reserved += t.reserved;
+  sum.delayed += t.delayed;
+  sum.buried += t.buried;
+  sum.totalJobs += t.totalJobs;
+  sum.deletes += t.deletes;
+  sum.users += t.users;
+  sum.watchers += t.watchers;
+  sum.waiters += t.waiters;
+  sum.putRate += t.putRate;
+  sum.deleteRate += t.deleteRate;
+  sum.backlogRate += t.backlogRate;
+}
+
+}
+
+Beanstalkpp::TubeSample::TubeSample():
+  urgent(0), ready(0), reserved(0), delayed(0), buried(0), totalJobs(0), deletes(0), users(0),
+  watchers(0), waiters(0), putRate(0), deleteRate(0), backlogRate(0) {
+}
+
+Beanstalkpp::ClusterSample::ClusterSample():
+  connections(0), producers(0), workers(0), reserves(0), reserveRate(0), serversFailed(0) {
+}
+
+Beanstalkpp::StatsPoller::StatsPoller(const std::vector<server_t>& servers): running(false) {
+  this->servers.resize(servers.size());
+  for(size_t i = 0; i < servers.size(); i++)
+    this->servers[i].address = servers[i];
+}
+
+Beanstalkpp::StatsPoller::~StatsPoller() {
+  this->stop();
+}
+
+boost::shared_ptr<const Beanstalkpp::ClusterSample> Beanstalkpp::StatsPoller::poll() {
+  boost::shared_ptr<ClusterSample> ret(new ClusterSample());
+  map<string, TubeSample> tubes;
+  
+  for(size_t i = 0; i < this->servers.size(); i++) {
+    Server &server = this->servers[i];
+    
+    // A server failing midway is left out, with the tubes it had already reported
+    boost::shared_ptr<ClusterSample> s(new ClusterSample());
+    if(!this->pollServer(server, *s)) {
+      server.previous.reset();
+      ret->serversFailed++;
+      continue;
+    }
+    
+    if(server.previous) computeRates(*server.previous, *s);
+    server.previous = s;
+    
+    ret->connections += s->connections;
+    ret->producers += s->producers;
+    ret->workers += s->workers;
+    ret->reserves += s->reserves;
+    ret->reserveRate += s->reserveRate;
+    
+    for(size_t j = 0; j < s->tubes.size(); j++)
+      add(tubes[s->tubes[j].name], s->tubes[j]);
+  }
+  
+  ret->time = std::chrono::steady_clock::now();
+  
+  ret->tubes.reserve(tubes.size());
+  for(map<string, TubeSample>::iterator i = tubes.begin(); i != tubes.end(); i++) {
+    TubeSample &t = i->second;
+    t.name = i->first;
+    
+    add(ret->total, t);
+    ret->tubes.push_back(t);
+  }
+  
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->sample = ret;
+  return ret;
+}
+
+bool Beanstalkpp::StatsPoller::pollServer(
+  Beanstalkpp::StatsPoller::Server& server, Beanstalkpp::ClusterSample& sample
+) {
+  if(!server.client) {
+    server.client.reset(new Client(server.address.first, server.address.second));
+    if(!server.client->tryConnect()) {
+      server.client.reset();
+      return false;
+    }
+  }
+  
+  Client &client = *server.client;
+  
+  Result<vector<string> > names = client.tryListTubes();
+  if(!names) {
+    server.client.reset();
+    return false;
+  }
+  
+  bool sent = client.trySendStats().ok();
+  for(size_t i = 0; sent && i < names.value().size(); i++)
+    sent = client.trySendStatsTube(names.value()[i]).ok();
+  
+  if(!sent) {
+    server.client.reset();
+    return false;
+  }
+  
+  Result<ServerStats> stats = client.tryReadStats();
+  if(!stats) {
+    server.client.reset();
+    return false;
+  }
+  
+  sample.connections = stats.value().currentConnections;
+  sample.producers = stats.value().currentProducers;
+  sample.workers = stats.value().currentWorkers;
+  sample.reserves = stats.value().cmdReserve;
+  
+  sample.tubes.reserve(names.value().size());
+  for(size_t i = 0; i < names.value().size(); i++) {
+    Result<TubeStats> tube = client.tryReadStatsTube();
+    
+    if(!tube) {
+      // The tube went away since list-tubes, which doesn't break the connection
+      if(tube.error() == ServerException::NOT_FOUND) continue;
+      
+      server.client.reset();
+      return false;
+    }
+    
+    TubeSample t;
+    t.name = names.value()[i];
+    t.urgent = tube.value().currentJobsUrgent;
+    t.ready = tube.value().currentJobsReady;
+    t.reserved = tube.value().currentJobsReserved;
+    t.delayed = tube.value().currentJobsDelayed;
+    t.buried = tube.value().currentJobsBuried;
+    t.totalJobs = tube.value().totalJobs;
+    t.deletes = tube.value().cmdDelete;
+    t.users = tube.value().currentUsing;
+    t.watchers = tube.value().currentWatching;
+    t.waiters = tube.value().currentWaiting;
+    sample.tubes.push_back(t);
+  }
+  
+  std::sort(sample.tubes.begin(), sample.tubes.end(), byName);
+  sample.time = std::chrono::steady_clock::now();
+  return true;
+}
+
+boost::shared_ptr<const Beanstalkpp::ClusterSample> Beanstalkpp::StatsPoller::latest() const {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->sample;
+}
+
+void Beanstalkpp::StatsPoller::start(unsigned int intervalMs) {
+  this->stop();
+  
+  this->running = true;
+  this->thread = std::thread(&StatsPoller::run, this, intervalMs);
+}
+
+void Beanstalkpp::StatsPoller::stop() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->running = false;
+  }
+  this->wakeup.notify_all();
+  
+  if(this->thread.joinable()) this->thread.join();
+}
+
+void Beanstalkpp::StatsPoller::run(unsigned int intervalMs) {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  
+  while(this->running) {
+    lock.unlock();
+    this->poll();
+    lock.lock();
+    
+    this->wakeup.wait_for(lock, std::chrono::milliseconds(intervalMs), [this] {
+      return !this->running;
+    });
+  }
+}
@@ -0,0 +1,187 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_STATSPOLLER_H
+#define _BEANSTALK_STATSPOLLER_H
+
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace Beanstalkpp {
+
+class Client;
+
+/**
+ * The queue depth of one tube, summed over all polled servers
+ */
+struct TubeSample {
+  TubeSample();
+  
+  std::string name;
+  uint64_t urgent;
+  uint64_t ready;
+  uint64_t reserved;
+  uint64_t delayed;
+  uint64_t buried;
+  uint64_t totalJobs;
+  uint64_t deletes;
+  
+  /**
+   * Connections using, watching and waiting for a job in the tube
+   */
+  uint64_t users;
+  uint64_t watchers;
+  uint64_t waiters;
+  
+  /**
+   * Jobs put and deleted per second since the previous sample, or 0 for the first one. Rates are
+   * computed per server and then summed, and a server contributes none until it has been polled
+   * twice in a row.
+   */
+  double putRate;
+  double deleteRate;
+  
+  /**
+   * How fast the ready jobs grow, in jobs per second. Negative while the backlog shrinks.
+   */
+  double backlogRate;
+};
+
+/**
+ * One poll of all servers
+ */
+struct ClusterSample {
+  ClusterSample();
+  
+  std::chrono::steady_clock::time_point time;
+  
+  /**
+   * The tubes of all servers, sorted by name
+   */
+  std::vector<TubeSample> tubes;
+  
+  /**
+   * The sum of all tubes. Its name is empty.
+   */
+  TubeSample total;
+  
+  /**
+   * Server wide counters, summed over the servers
+   */
+  uint64_t connections;
+  uint64_t producers;
+  uint64_t workers;
+  uint64_t reserves;
+  
+  /**
+   * Reserves per second since the previous sample. Beanstalkd only counts them per server, so
+   * there is no per tube rate.
+   */
+  double reserveRate;
+  
+  /**
+   * Servers which couldn't be reached or failed during the poll, and are left out of the sums
+   * entirely
+   */
+  size_t serversFailed;
+};
+
+/**
+ * Samples the queue depths of every tube on a set of servers.
+ * 
+ * Each poll costs two round trips per server: list-tubes, followed by a stats and a stats-tube for
+ * every tube, all pipelined on one connection. Servers that fail are reconnected on the next poll.
+ * 
+ * Polls can be made directly, or by a background thread started with @c start. Either way the
+ * newest sample is published through @c latest, which may be called from any thread.
+ */
+class StatsPoller {
+public:
+  typedef std::pair<std::string, int> server_t;
+  
+  StatsPoller(const std::vector<server_t> &servers);
+  
+  /**
+   * Stops the background thread, if any
+   */
+  ~StatsPoller();
+  
+  /**
+   * Polls all servers, publishes the sample and returns it
+   */
+  boost::shared_ptr<const ClusterSample> poll();
+  
+  /**
+   * Returns the newest sample, or an empty pointer before the first poll
+   */
+  boost::shared_ptr<const ClusterSample> latest() const;
+  
+  /**
+   * Starts polling every @p intervalMs milliseconds in a background thread
+   */
+  void start(unsigned int intervalMs);
+  
+  /**
+   * Stops the background thread, waiting for the poll in progress
+   */
+  void stop();
+  
+private:
+  struct Server {
+    server_t address;
+    boost::shared_ptr<Client> client;
+    
+    /**
+     * The last sample of this server alone, which its rates are computed from. Empty after a
+     * failure, so a server coming back doesn't count all it did in the meantime as one spike.
+     */
+    boost::shared_ptr<const ClusterSample> previous;
+  };
+  
+  /**
+   * Puts the counters and tubes of @p server alone in @p sample. Returns false if the server
+   * failed, in which case @p sample is only partly filled.
+   */
+  bool pollServer(Server &server, ClusterSample &sample);
+  
+  void run(unsigned int intervalMs);
+  
+  std::vector<Server> servers;
+  
+  mutable std::mutex mutex;
+  boost::shared_ptr<const ClusterSample> sample;
+  
+  std::thread thread;
+  std::condition_variable wakeup;
+  bool running;
+};
+
+}
+
+#endif
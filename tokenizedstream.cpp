@@ -22,49 +22,40 @@
 
 #include <boost/regex.h>
 #include <iostream>
+#include <climits>
+#include <algorithm>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 
 #include "exception.h"
 #include "serverexception.h"
+#include "sink.h"
+#include "metrics.h"
+#include "observer.h"
+#include "capture.h"
 
 using namespace std;
 
-typedef boost::asio::buffers_iterator<
-    boost::asio::streambuf::const_buffers_type> boost_iterator;
-
-std::pair<boost_iterator, bool> match_token_delimiter(boost_iterator begin, boost_iterator end) {
-  boost_iterator i = begin;
-  while (i != end) {
-    switch(*i++) {
-      case ' ':
-      case '\r':
-      case '\n':
-        return std::make_pair(i, true);
-      default:
-        continue;
-    }
-  }
-  return std::make_pair(i, false);
+// How much we ask the socket for at a time
+#define READ_SIZE 65536
+
+static inline bool isTokenDelimiter(char c) {
+  return c == ' ' || c == '\r' || c == '\n';
 }
 
 Beanstalkpp::TokenizedStream::TokenizedStream(boost::asio::ip::tcp::socket &s): 
-  socket(s) {
+  socket(s), metrics(NULL), capture(NULL), captureConnection(0), observer(NULL), event(NULL),
+  replyStarted(false), timeoutMs(0), deadline(std::chrono::steady_clock::time_point::max()),
+  serverWaitMs(0), quickAck(false) {
 
 }
 
 std::string Beanstalkpp::TokenizedStream::nextString() {
-  boost::system::error_code error;
-  string line;
-  
-  boost::asio::read_until(
-    this->socket, this->socketBuffer, match_token_delimiter, error
-  ); 
-  if(error && error != boost::asio::error::eof)
+  if(!this->tryNextString(this->token))
     throw ServerException(ServerException::BAD_FORMAT, "Unable to read from socket");
   
-  istream strResponse(&this->socketBuffer);
-  strResponse >> line;
-  
-  return line;
+  return this->token;
 }
 
 void Beanstalkpp::TokenizedStream::expectString(const std::string& expected) {
@@ -75,10 +66,9 @@ void Beanstalkpp::TokenizedStream::expectString(const std::string& expected) {
 
 unsigned int Beanstalkpp::TokenizedStream::expectInt() {
   string s = this->nextString();
-  unsigned int ret;
+  uint64_t ret;
   
-  istringstream stream(s);
-  if(!(stream >> ret)) 
+  if(!parseUnsigned(s, UINT_MAX, ret)) 
     throw ServerException(ServerException::BAD_FORMAT, "Expected integer but got: " + s);
   
   return ret;
@@ -88,46 +78,326 @@ uint64_t Beanstalkpp::TokenizedStream::expectULL() {
   string s = this->nextString();
   uint64_t ret;
   
-  istringstream stream(s);
-  if(!(stream >> ret)) 
+  if(!parseUnsigned(s, UINT64_MAX, ret)) 
     throw ServerException(ServerException::BAD_FORMAT, "Expected unsigned long long but got: " + s);
   
   return ret;
 }
 
 void Beanstalkpp::TokenizedStream::expectEol() {
-  char *buf = this->readChunk(2);
+  char buf[2];
   
-  try {
-    if(buf[0] != '\r') throw ServerException(ServerException::BAD_FORMAT, "Expected \\r\\n");
-    if(buf[1] != '\n') throw ServerException(ServerException::BAD_FORMAT, "Expected \\r\\n");
-    delete[] buf;
-  } catch(...) {
-    delete[] buf;
-    throw;
-  }
+  if(!this->tryReadChunk(buf, 2))
+    throw ServerException(ServerException::BAD_FORMAT, "Unable to read from socket");
+  
+  if(buf[0] != '\r') throw ServerException(ServerException::BAD_FORMAT, "Expected \\r\\n");
+  if(buf[1] != '\n') throw ServerException(ServerException::BAD_FORMAT, "Expected \\r\\n");
 }
 
 char* Beanstalkpp::TokenizedStream::readChunk ( size_t bytes ) {
   char *buf = new char[bytes];
-  char *bufp = buf;
-  size_t read = 0, totalRead = 0;
-  
-  while(totalRead < bytes) {
-    size_t avail = this->socketBuffer.in_avail();
-    if(avail == 0) {
-      boost::asio::read(
-        this->socket, this->socketBuffer, boost::asio::transfer_at_least(bytes - totalRead)
-      ); 
+  
+  if(!this->tryReadChunk(buf, bytes)) {
+    delete[] buf;
+    throw ServerException(ServerException::BAD_FORMAT, "Got 0 bytes from the server");
+  }
+  
+  return buf;
+}
+
+Beanstalkpp::Status Beanstalkpp::TokenizedStream::tryNextString(std::string& token) {
+  for(;;) {
+    const char *data = boost::asio::buffer_cast<const char *>(this->socketBuffer.data());
+    size_t size = this->socketBuffer.size();
+    size_t start = 0;
+    
+    // Skip the spaces separating this token from the previous one
+    while(start < size && data[start] == ' ')
+      start++;
+    
+    size_t end = start;
+    while(end < size && !isTokenDelimiter(data[end]))
+      end++;
+    
+    if(end < size) {
+      // The delimiter is left in the buffer, so \r\n can be checked with expectEol
+      token.assign(data + start, end - start);
+      this->socketBuffer.consume(end);
+      return Status();
     }
-    read = this->socketBuffer.sgetn(bufp, bytes - read);
+    
+    this->socketBuffer.consume(start);
+    
+    Status s = this->fill();
+    if(!s) return s;
+  }
+}
+
+Beanstalkpp::Status Beanstalkpp::TokenizedStream::tryNextToken() {
+  return this->tryNextString(this->token);
+}
 
-    if(read == 0) 
-      throw ServerException(ServerException::BAD_FORMAT, "Got 0 bytes from the server");
+Beanstalkpp::Status Beanstalkpp::TokenizedStream::tryExpectString(const char* expected) {
+  Status s = this->tryNextString(this->token);
+  if(!s) return s;
+  
+  if(this->token.compare(expected) != 0)
+    return Failure(ServerException::fromReply(this->token));
+  
+  return Status();
+}
+
+Beanstalkpp::Result<unsigned int> Beanstalkpp::TokenizedStream::tryExpectInt() {
+  uint64_t ret;
+  
+  Status s = this->tryNextString(this->token);
+  if(!s) return s.failure();
+  
+  if(!parseUnsigned(this->token, UINT_MAX, ret))
+    return this->fail(ServerException::BAD_FORMAT);
+  
+  return (unsigned int)ret;
+}
+
+Beanstalkpp::Result<uint64_t> Beanstalkpp::TokenizedStream::tryExpectULL() {
+  uint64_t ret;
+  
+  Status s = this->tryNextString(this->token);
+  if(!s) return s.failure();
+  
+  if(!parseUnsigned(this->token, UINT64_MAX, ret))
+    return this->fail(ServerException::BAD_FORMAT);
+  
+  return ret;
+}
+
+Beanstalkpp::Status Beanstalkpp::TokenizedStream::tryExpectEol() {
+  char buf[2];
+  
+  Status s = this->tryReadChunk(buf, 2);
+  if(!s) return s;
+  
+  if(buf[0] != '\r' || buf[1] != '\n')
+    return this->fail(ServerException::BAD_FORMAT);
+  
+  return Status();
+}
+
+Beanstalkpp::Status Beanstalkpp::TokenizedStream::tryReadChunk(char* buf, size_t bytes) {
+  while(bytes > 0) {
+    size_t read;
     
-    bufp += read;
-    totalRead += read;
+    if(this->socketBuffer.size() > 0) {
+      read = this->socketBuffer.sgetn(buf, bytes);
+    } else if(bytes >= READ_SIZE) {
+      // Large payloads are read straight into the caller's memory instead of through our buffer
+      Status s = this->readSome(boost::asio::buffer(buf, bytes), read);
+      if(!s) return s;
+      this->received(buf, read);
+    } else {
+      Status s = this->fill();
+      if(!s) return s;
+      continue;
+    }
+    
+    buf += read;
+    bytes -= read;
   }
   
-  return buf;
+  return Status();
+}
+
+Beanstalkpp::Status Beanstalkpp::TokenizedStream::tryReadChunk(
+  Beanstalkpp::PayloadSink& sink, size_t bytes
+) {
+  bool wanted = true;
+  
+  while(bytes > 0) {
+    if(this->socketBuffer.size() == 0) {
+      Status s = this->fill();
+      if(!s) return s;
+    }
+    
+    // Hand out the data straight from our buffer, so each chunk is copied only once
+    const char *data = boost::asio::buffer_cast<const char *>(this->socketBuffer.data());
+    size_t chunk = std::min(bytes, this->socketBuffer.size());
+    
+    if(wanted) wanted = sink.write(data, chunk);
+    
+    this->socketBuffer.consume(chunk);
+    bytes -= chunk;
+  }
+  
+  return Status();
+}
+
+const std::string& Beanstalkpp::TokenizedStream::lastToken() const {
+  return this->token;
+}
+
+size_t Beanstalkpp::TokenizedStream::buffered() const {
+  return this->socketBuffer.size();
+}
+
+void Beanstalkpp::TokenizedStream::reset() {
+  this->socketBuffer.consume(this->socketBuffer.size());
+}
+
+void Beanstalkpp::TokenizedStream::setDeadline(
+  unsigned int timeoutMs, std::chrono::steady_clock::time_point deadline
+) {
+  this->timeoutMs = timeoutMs;
+  this->deadline = deadline;
+}
+
+void Beanstalkpp::TokenizedStream::setServerWait(int ms) {
+  this->serverWaitMs = ms;
+}
+
+Beanstalkpp::Status Beanstalkpp::TokenizedStream::wait(short events) {
+  using std::chrono::steady_clock;
+  
+  steady_clock::time_point until = this->deadline;
+  if(this->timeoutMs > 0 && this->serverWaitMs >= 0) {
+    until = std::min(until, steady_clock::now() + std::chrono::milliseconds(
+      (int64_t)this->timeoutMs + this->serverWaitMs
+    ));
+  }
+  
+  struct pollfd fd;
+  fd.fd = this->socket.native_handle();
+  fd.events = events;
+  
+  for(;;) {
+    int ms = -1;
+    
+    if(until != steady_clock::time_point::max()) {
+      int64_t left = std::chrono::duration_cast<std::chrono::microseconds>(
+        until - steady_clock::now()
+      ).count();
+      if(left <= 0) break;
+      ms = (int)std::min((left + 999) / 1000, (int64_t)INT_MAX);
+    }
+    
+    int ready = poll(&fd, 1, ms);
+    if(ready > 0) return Status();
+    if(ready < 0 && errno != EINTR) return this->fail(ServerException::NETWORK_ERROR);
+  }
+  
+  boost::system::error_code ignored;
+  this->socket.close(ignored);
+  this->reset();
+  return this->fail(ServerException::CLIENT_TIMEOUT);
+}
+
+void Beanstalkpp::TokenizedStream::setQuickAck(bool on) {
+  this->quickAck = on;
+}
+
+Beanstalkpp::Status Beanstalkpp::TokenizedStream::readSome(
+  const boost::asio::mutable_buffers_1 &buffer, size_t &read
+) {
+  boost::system::error_code error;
+  
+  read = this->socket.read_some(buffer, error);
+  while(error == boost::asio::error::would_block) {
+    // Only sockets with a timeout or deadline are non-blocking
+    Status s = this->wait(POLLIN);
+    if(!s) return s;
+    read = this->socket.read_some(buffer, error);
+  }
+  
+  if(error || read == 0)
+    return this->fail(ServerException::NETWORK_ERROR);
+  
+#ifdef TCP_QUICKACK
+  if(this->quickAck) {
+    int on = 1;
+    setsockopt(this->socket.native_handle(), IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+  }
+#endif
+  
+  return Status();
+}
+
+Beanstalkpp::Status Beanstalkpp::TokenizedStream::fill() {
+  boost::asio::streambuf::mutable_buffers_type space = this->socketBuffer.prepare(READ_SIZE);
+  size_t read;
+  Status s = this->readSome(space, read);
+  if(!s) return s;
+  
+  this->socketBuffer.commit(read);
+  this->received(boost::asio::buffer_cast<const char *>(space), read);
+  return Status();
+}
+
+bool Beanstalkpp::TokenizedStream::parseUnsigned(
+  const std::string& token, uint64_t max, uint64_t& value
+) {
+  if(token.empty()) return false;
+  
+  value = 0;
+  for(size_t i = 0; i < token.size(); i++) {
+    char c = token[i];
+    if(c < '0' || c > '9') return false;
+    
+    uint64_t digit = c - '0';
+    if(value > (max - digit) / 10) return false;
+    value = value * 10 + digit;
+  }
+  
+  return true;
+}
+
+void Beanstalkpp::TokenizedStream::feed(const char *data, size_t size) {
+  size_t copied = boost::asio::buffer_copy(
+    this->socketBuffer.prepare(size), boost::asio::buffer(data, size)
+  );
+  this->socketBuffer.commit(copied);
+}
+
+void Beanstalkpp::TokenizedStream::setMetrics(Beanstalkpp::Metrics* m) {
+  this->metrics = m;
+}
+
+void Beanstalkpp::TokenizedStream::setTrace(
+  Beanstalkpp::CommandObserver* o, Beanstalkpp::CommandEvent* e
+) {
+  this->observer = o;
+  this->event = e;
+  this->replyStarted = false;
+}
+
+Beanstalkpp::Failure Beanstalkpp::TokenizedStream::fail(Beanstalkpp::ServerException::Reason r) {
+#ifndef BEANSTALKPP_NO_METRICS
+  if(this->metrics) this->metrics->recordError(r);
+#endif
+  
+  if(this->observer) {
+    this->event->failed = true;
+    this->event->time = CommandEvent::now();
+    this->observer->commandFailed(*this->event, r);
+  }
+  
+  return Failure(r);
+}
+
+void Beanstalkpp::TokenizedStream::setCapture(Beanstalkpp::WireCapture* c, uint32_t connection) {
+  this->capture = c;
+  this->captureConnection = connection;
+}
+
+void Beanstalkpp::TokenizedStream::received(const char *data, size_t size) {
+#ifndef BEANSTALKPP_NO_METRICS
+  if(this->metrics) this->metrics->recordReceived(size);
+#endif
+  
+  if(this->capture)
+    this->capture->record(WireCapture::RECEIVED, this->captureConnection, data, size);
+  
+  if(this->observer && !this->replyStarted) {
+    this->replyStarted = true;
+    this->event->time = CommandEvent::now();
+    this->observer->firstReplyByte(*this->event);
+  }
 }
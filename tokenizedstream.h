@@ -22,9 +22,20 @@
 #define TOKENIZEDSTREAM_H
 
 #include <boost/asio.hpp>
+#include <chrono>
 #include <string>
 #include <cstdint>
 
+#include "result.h"
+
+namespace Beanstalkpp {
+class PayloadSink;
+class Metrics;
+class CommandObserver;
+class WireCapture;
+struct CommandEvent;
+}
+
 namespace Beanstalkpp {
 
 /**
@@ -91,13 +102,196 @@ public:
    * @throws ServerException On other network errors
    */
   char *readChunk(size_t bytes);
+  
+  /**
+   * Non-throwing version of @c nextString.
+   * 
+   * @param token Receives the token. Its memory is reused, so short tokens don't allocate.
+   * 
+   * @return NETWORK_ERROR if the socket couldn't be read
+   */
+  Status tryNextString(std::string &token);
+  
+  /**
+   * Reads the next token into the stream's own scratch space, where it is available through
+   * @c lastToken
+   * 
+   * @return NETWORK_ERROR if the socket couldn't be read
+   */
+  Status tryNextToken();
+  
+  /**
+   * Non-throwing version of @c expectString. 
+   * 
+   * @return The reason the server sent instead of @p expected (see ServerException::fromReply),
+   *         or NETWORK_ERROR
+   */
+  Status tryExpectString(const char *expected);
+  
+  /**
+   * Non-throwing version of @c expectInt
+   * 
+   * @return BAD_FORMAT if the next token isn't an integer, or NETWORK_ERROR
+   */
+  Result<unsigned int> tryExpectInt();
+  
+  /**
+   * Non-throwing version of @c expectULL
+   * 
+   * @return BAD_FORMAT if the next token isn't an unsigned long long, or NETWORK_ERROR
+   */
+  Result<uint64_t> tryExpectULL();
+  
+  /**
+   * Non-throwing version of @c expectEol
+   * 
+   * @return BAD_FORMAT if the next token isn't \r\n, or NETWORK_ERROR
+   */
+  Status tryExpectEol();
+  
+  /**
+   * Non-throwing version of @c readChunk, which reads into memory owned by the caller.
+   * 
+   * @param buf   Buffer of at least @p bytes bytes
+   * @param bytes Read this many bytes. The call will block until the number of bytes are read.
+   * 
+   * @return NETWORK_ERROR if the socket couldn't be read
+   */
+  Status tryReadChunk(char *buf, size_t bytes);
+  
+  /**
+   * Reads @p bytes from the stream and hands them to @p sink in chunks, without buffering more
+   * than one chunk at a time.
+   * 
+   * @param sink  Receives the data
+   * @param bytes Read this many bytes. The call will block until the number of bytes are read.
+   * 
+   * @return NETWORK_ERROR if the socket couldn't be read
+   */
+  Status tryReadChunk(PayloadSink &sink, size_t bytes);
+  
+  /**
+   * The most recently read token. Valid until the next token is read.
+   */
+  const std::string &lastToken() const;
+  
+  /**
+   * Returns the number of bytes read from the socket but not yet parsed
+   */
+  size_t buffered() const;
+  
+  /**
+   * Discards the buffered bytes, e.g. the rest of a reply cut short by a closed connection
+   */
+  void reset();
+  
+  /**
+   * Bounds how long @c wait may wait
+   * 
+   * @param timeoutMs The longest any one wait may take, or 0 for no limit
+   * @param deadline  The point in time no wait may pass
+   */
+  void setDeadline(unsigned int timeoutMs, std::chrono::steady_clock::time_point deadline);
+  
+  /**
+   * Lets the server hold back the next reply for @p ms on top of the timeout, as reserve with a
+   * timeout may, or for as long as it likes if @p ms is negative. The deadline still applies.
+   */
+  void setServerWait(int ms);
+  
+  /**
+   * Waits until the socket is ready for @p events, POLLIN or POLLOUT. Fails with CLIENT_TIMEOUT if
+   * the timeout or the deadline passes first, and closes the connection, since whatever was cut
+   * short can't be resumed.
+   */
+  Status wait(short events);
+  
+  /**
+   * Sets TCP_QUICKACK after every read when @p on, since the kernel clears it by itself
+   */
+  void setQuickAck(bool on);
+  
+  /**
+   * Appends @p size bytes to the read buffer, as if they had arrived on the socket. Lets replies
+   * be parsed straight from memory, e.g. by the benchmarks in bench.cpp.
+   */
+  void feed(const char *data, size_t size);
+  
+  /**
+   * Makes the stream count received bytes and parse errors in @p m, or in nothing if NULL
+   */
+  void setMetrics(Metrics *m);
+  
+  /**
+   * Makes the stream report the first reply byte and parse errors of the command described by
+   * @p e to @p o. Pass NULLs when the command is done.
+   */
+  void setTrace(CommandObserver *o, CommandEvent *e);
+  
+  /**
+   * Records all bytes read from the socket to @p c as connection @p connection, or stops recording
+   * if NULL
+   */
+  void setCapture(WireCapture *c, uint32_t connection = 0);
 private:
+  /**
+   * Reads whatever is available from the socket into socketBuffer, blocking until at least one
+   * byte has arrived
+   */
+  Status fill();
+  
+  /**
+   * Reads at least one byte from the socket into @p buffer, waiting for it if the socket is
+   * non-blocking
+   */
+  Status readSome(const boost::asio::mutable_buffers_1 &buffer, size_t &read);
+  
+  /**
+   * Parses @p token as an unsigned decimal number
+   * 
+   * @return False if @p token isn't a number, or is larger than @p max
+   */
+  static bool parseUnsigned(const std::string &token, uint64_t max, uint64_t &value);
+  
+  /**
+   * Records an error with reason @p r in the metrics, and returns it
+   */
+  Failure fail(ServerException::Reason r);
+  
+  /**
+   * Records @p size bytes received into @p data in the metrics and the capture
+   */
+  void received(const char *data, size_t size);
+  
+  /**
+   * Scratch space for tokens read by the try* functions
+   */
+  std::string token;
+  
   /**
    * Our current buffer we store the data in
    */
   boost::asio::streambuf socketBuffer;
   
   boost::asio::ip::tcp::socket &socket;
+  
+  Metrics *metrics;
+  
+  WireCapture *capture;
+  uint32_t captureConnection;
+  
+  CommandObserver *observer;
+  CommandEvent *event;
+  
+  /**
+   * Whether data has been read since the traced command started
+   */
+  bool replyStarted;
+  
+  unsigned int timeoutMs;
+  std::chrono::steady_clock::time_point deadline;
+  int serverWaitMs;
+  bool quickAck;
 };
 
 }
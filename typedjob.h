@@ -0,0 +1,70 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_TYPEDJOB_H
+#define _BEANSTALK_TYPEDJOB_H
+
+#include "job.h"
+#include "jobtraits.h"
+#include "exception.h"
+
+namespace Beanstalkpp {
+
+/**
+ * A job carrying a value of type T, as put with @c Client::put<T>. The value is decoded with
+ * @c JobTraits<T> straight from the payload buffer.
+ * 
+ * To receive typed jobs, use Client::reserve<TypedJob<T> >
+ */
+template<class T>
+class TypedJob: public Job {
+public:
+  static_assert(JobTraits<T>::serializable, "T needs a JobTraits specialization");
+  
+  TypedJob() {}
+  
+  TypedJob(Client &c, job_id_t jobId, size_t payloadSize, char *payload):
+    Job(c, jobId, payloadSize, payload) {}
+  
+  /**
+   * Decodes the payload into @p value
+   * 
+   * @return False if the payload isn't a valid T
+   */
+  bool getValue(T &value) const {
+    return JobTraits<T>::decode(this->data(), this->size(), value);
+  }
+  
+  /**
+   * Decodes and returns the payload
+   * 
+   * @throws Exception If the payload isn't a valid T
+   */
+  T value() const {
+    T value;
+    if(!this->getValue(value)) throw Exception("Payload is not a valid value of the job type");
+    
+    return value;
+  }
+};
+
+}
+
+#endif
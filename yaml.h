@@ -0,0 +1,102 @@
+// Copyright (C) 2011 Mostphotos AB
+// 
+// Author(s):
+// Andreas Andersen <andreas@mostphotos.com>
+//
+// This library is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or (at
+// your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License (COPYING.txt) for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this library; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef _BEANSTALK_YAML_H
+#define _BEANSTALK_YAML_H
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace Beanstalkpp {
+
+/**
+ * Calls @p onItem(const char *item, size_t length) for each item of a YAML list as sent by
+ * beanstalkd in reply to list-tubes and list-tubes-watched:
+ * 
+ *   ---
+ *   - default
+ *   - emails
+ * 
+ * Lines which aren't list items are ignored. Nothing is allocated.
+ */
+template<class F>
+void forEachYamlItem(const char *data, size_t size, F onItem) {
+  const char *end = data + size;
+  
+  while(data < end) {
+    const char *eol = (const char *)memchr(data, '\n', end - data);
+    if(!eol) eol = end;
+    
+    if(eol - data >= 2 && data[0] == '-' && data[1] == ' ')
+      onItem(data + 2, (size_t)(eol - data - 2));
+    
+    data = eol + 1;
+  }
+}
+
+/**
+ * Calls @p onField(const char *key, size_t keyLength, const char *value, size_t valueLength) for
+ * each entry of a YAML dictionary as sent by beanstalkd in reply to the stats commands:
+ * 
+ *   ---
+ *   name: default
+ *   current-jobs-ready: 3
+ *   version: "1.12"
+ * 
+ * Quotes around values are stripped, and lines which aren't entries are ignored. Nothing is
+ * allocated.
+ */
+template<class F>
+void forEachYamlField(const char *data, size_t size, F onField) {
+  const char *end = data + size;
+  
+  while(data < end) {
+    const char *eol = (const char *)memchr(data, '\n', end - data);
+    if(!eol) eol = end;
+    
+    const char *colon = (const char *)memchr(data, ':', eol - data);
+    if(colon && colon > data && colon + 1 < eol && colon[1] == ' ') {
+      const char *value = colon + 2;
+      const char *valueEnd = eol;
+      if(valueEnd - value >= 2 && *value == '"' && valueEnd[-1] == '"') {
+        value++;
+        valueEnd--;
+      }
+      
+      onField(data, (size_t)(colon - data), value, (size_t)(valueEnd - value));
+    }
+    
+    data = eol + 1;
+  }
+}
+
+/**
+ * Parses a YAML list, see @c forEachYamlItem
+ * 
+ * @param data The payload of the reply
+ * @param size The length of @p data
+ * 
+ * @return The items of the list
+ */
+std::vector<std::string> parseYamlList(const char *data, size_t size);
+}
+
+#endif